@@ -200,7 +200,7 @@ parse_actor_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode )
 	xmlXPathFreeContext( XPath );    
 }
 
-parse_event_slot_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode, guint slotIndex )
+parse_event_slot_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode, gint slotIndex )
 {
     xmlXPathContextPtr XPath;       
     xmlChar           *idStr;
@@ -238,6 +238,7 @@ parse_event_slot_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode, guin
             xmlChar           *topLabel    = NULL;
             xmlChar           *bottomLabel = NULL;
             xmlChar           *classStr    = NULL;
+            xmlChar           *timeStr     = NULL;
 
 		    // Get a pointer to the current node.
 		    FNode = nodeset->nodeTab[NodeIndx];
@@ -321,6 +322,11 @@ parse_event_slot_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode, guin
                 sqd_layout_add_external_event(SL, idStr, classStr, slotIndex, startActor, topLabel, TRUE);
             }
 
+            // Optional trace timestamp for the time axis.
+            timeStr = xmlGetProp(FNode,"time");
+            if(timeStr)
+                sqd_layout_set_event_time(SL, idStr, g_ascii_strtod(timeStr, NULL));
+
             // Check for storage that needs to be freed.
             if(idStr)       xmlFree(idStr);
             if(startActor)  xmlFree(startActor);
@@ -328,6 +334,7 @@ parse_event_slot_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode, guin
             if(topLabel)    xmlFree(topLabel);
             if(bottomLabel) xmlFree(bottomLabel);
             if(classStr)    xmlFree(classStr);
+            if(timeStr)     xmlFree(timeStr);
 
 		}
 
@@ -380,6 +387,22 @@ parse_event_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode )
         xmlFree(xpathlist);
     }
 
+    // Events placed directly in the event list, rather than in a slot, are 
+    // treated as a time ordered stream and packed into slots automatically.
+	xpathlist = xmlXPathEvalExpression("sqd:event-list", XPath);
+
+	if( xpathlist && !xmlXPathNodeSetIsEmpty(xpathlist->nodesetval) )
+	{
+   		nodeset = xpathlist->nodesetval; 
+
+		for (NodeIndx = 0; NodeIndx < nodeset->nodeNr; NodeIndx++)    
+		{
+            parse_event_slot_list( SL, DocPtr, nodeset->nodeTab[NodeIndx], SQD_LAYOUT_AUTO_SLOT );
+		}
+
+        xmlFree(xpathlist);
+    }
+
 	// Free up the libxml structures.
 	xmlXPathFreeContext( XPath );    
 }
@@ -510,6 +533,7 @@ parse_box_region_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode )
             xmlChar           *StartEvent;
             xmlChar           *EndEvent;
             xmlChar           *classStr;
+            xmlChar           *labelStr;
 
 		    // Get a pointer to the current node.
 		    FNode = nodeset->nodeTab[NodeIndx];
@@ -547,14 +571,20 @@ parse_box_region_list( SQDLayout *SL, xmlDocPtr DocPtr, xmlNodePtr SeqNode )
 
             classStr = xmlGetProp(FNode,"class");
 
+            labelStr = xmlGetProp(FNode,"label");
+
             sqd_layout_add_box_region(SL, idStr, classStr, StartActor, EndActor, StartEvent, EndEvent);
 
+            if( labelStr )
+                sqd_layout_set_box_region_label(SL, idStr, labelStr);
+
             if(idStr)      xmlFree(idStr);
             if(StartActor) xmlFree(StartActor);
             if(EndActor)   xmlFree(EndActor);
             if(StartEvent) xmlFree(StartEvent);
             if(EndEvent)   xmlFree(EndEvent);
             if(classStr)   xmlFree(classStr);
+            if(labelStr)   xmlFree(labelStr);
 		}
 
         xmlFree(xpathlist);
@@ -825,7 +855,33 @@ main (int argc, char *argv[])
 	gchar *input_path  = NULL;
 	gchar *output_pdf  = NULL;
 	gchar *output_png  = NULL;
+	gchar *output_ppm  = NULL;
+	gchar *output_qoi  = NULL;
 	gchar *output_svg  = NULL;
+	gint   thread_cnt  = 0;
+	gboolean fit_content = FALSE;
+	gboolean align_notes = FALSE;
+	gboolean route_notes = FALSE;
+	gint   left_note_columns  = 0;
+	gint   right_note_columns = 1;
+	gboolean variable_columns = FALSE;
+	gboolean reorder_actors = FALSE;
+	gboolean fold_repeats = FALSE;
+	gboolean native_svg = FALSE;
+	gboolean native_pdf = FALSE;
+	gchar *viewport = NULL;
+	gint   png_level = -1;
+	gchar *png_filter = NULL;
+	gint   png_filter_type = RASTER_FILTER_ADAPTIVE;
+	gboolean parallel_deflate = FALSE;
+	gdouble raster_scale = 0;
+	gdouble raster_dpi   = 0;
+	gchar **viewport_parts;
+	gint   max_events  = 0;
+	gdouble time_scale = 0;
+	gdouble max_idle_gap = 72;
+	gchar **collapse_classes = NULL;
+	gchar **collapse;
 
 	GOptionContext *context;
 
@@ -833,13 +889,40 @@ main (int argc, char *argv[])
 	  { "input-xml", 'i', 0, G_OPTION_ARG_STRING, &input_path, "The xml formatted sequence diagram description file.", "<filename>"},
 	  { "output-pdf", 'p', 0, G_OPTION_ARG_STRING, &output_pdf, "The pdf formatted sequence diagram.", "<filename>"},
 	  { "output-png", 'g', 0, G_OPTION_ARG_STRING, &output_png, "The png formatted sequence diagram.", "<filename>"},
+	  { "output-ppm", 'q', 0, G_OPTION_ARG_STRING, &output_ppm, "Uncompressed ppm images of the sequence diagram, for pipelines that encode them again.", "<filename>"},
+	  { "output-qoi", 'd', 0, G_OPTION_ARG_STRING, &output_qoi, "The qoi formatted sequence diagram.", "<filename>"},
+	  { "png-level", 'z', 0, G_OPTION_ARG_INT, &png_level, "Zlib compression level for png output, 0 to 9.", "<level>"},
+	  { "png-filter", 'k', 0, G_OPTION_ARG_STRING, &png_filter, "Png row filter: none, sub, up, average, paeth or adaptive (the default).", "<filter>"},
+	  { "parallel-deflate", 'j', 0, G_OPTION_ARG_NONE, &parallel_deflate, "Compress png output on the render threads.", NULL},
+	  { "scale", 0, 0, G_OPTION_ARG_DOUBLE, &raster_scale, "Pixels per point for png, ppm and qoi output, defaults to 1.", "<factor>"},
+	  { "dpi", 0, 0, G_OPTION_ARG_DOUBLE, &raster_dpi, "Resolution of png, ppm and qoi output, the same as a scale of dpi/72.", "<dpi>"},
 	  { "output-svg", 's', 0, G_OPTION_ARG_STRING, &output_svg, "The svg formatted sequence diagram.", "<filename>"},
+	  { "native-svg", 'v', 0, G_OPTION_ARG_NONE, &native_svg, "Write svg directly instead of through cairo, smaller files for large diagrams.", NULL},
+	  { "native-pdf", 'e', 0, G_OPTION_ARG_NONE, &native_pdf, "Write pdf directly instead of through cairo, using the standard pdf fonts.", NULL},
+	  { "threads", 't', 0, G_OPTION_ARG_INT, &thread_cnt, "Worker threads used for layout, defaults to one per processor.", "<count>"},
+	  { "fit-content", 'f', 0, G_OPTION_ARG_NONE, &fit_content, "Size the output to the diagram instead of a fixed page.", NULL},
+	  { "align-notes", 'a', 0, G_OPTION_ARG_NONE, &align_notes, "Place notes next to what they reference instead of stacking them.", NULL},
+	  { "note-columns", 'n', 0, G_OPTION_ARG_INT, &right_note_columns, "Note columns on the right of the actors, defaults to one.", "<count>"},
+	  { "left-note-columns", 'l', 0, G_OPTION_ARG_INT, &left_note_columns, "Note columns on the left of the actors.", "<count>"},
+	  { "route-notes", 'o', 0, G_OPTION_ARG_NONE, &route_notes, "Route note reference lines around the events.", NULL},
+	  { "variable-columns", 'w', 0, G_OPTION_ARG_NONE, &variable_columns, "Size each actor column to fit its name and event labels.", NULL},
+	  { "reorder-actors", 'r', 0, G_OPTION_ARG_NONE, &reorder_actors, "Reorder the actors to shorten the event arrows.", NULL},
+	  { "max-events", 'm', 0, G_OPTION_ARG_INT, &max_events, "Sample the events down to at most this many, keeping the ones notes and regions use.", "<count>"},
+	  { "collapse", 'c', 0, G_OPTION_ARG_STRING_ARRAY, &collapse_classes, "Draw the box regions of a class as a single summary band, 'all' for every region. May be repeated.", "class=<name>"},
+	  { "time-scale", 'y', 0, G_OPTION_ARG_DOUBLE, &time_scale, "Place events by their time attribute at this many points per unit of time.", "<points>"},
+	  { "max-idle-gap", 'b', 0, G_OPTION_ARG_DOUBLE, &max_idle_gap, "Cut idle gaps longer than this many points down to a marked break, defaults to 72.", "<points>"},
+	  { "viewport", 'u', 0, G_OPTION_ARG_STRING, &viewport, "Only draw this rectangle of each page, the output is sized to it.", "x,y,w,h"},
+	  { "fold-repeats", 'x', 0, G_OPTION_ARG_NONE, &fold_repeats, "Fold repeated runs of events into one copy with a repeat count.", NULL},
 //	  { "symbol", 's', 0, G_OPTION_ARG_STRING, &symbol_path, "The symbol table file. (xml-format)", "<filename>"},
 //	  { "format", 'f', 0, G_OPTION_ARG_STRING, &format_path, "The trace formatting file. (xml-format)", "<filename>"},
 	  { NULL }
 	};
 
     // Initialize threading.
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if( !g_thread_supported() )
+        g_thread_init(NULL);
+#endif
     g_type_init();
 
 	context = g_option_context_new ("- sequence diagram generation");
@@ -855,6 +938,58 @@ main (int argc, char *argv[])
     // Allocate a layout object to build the sequence diagram into.
     SL = sqd_layout_new();
 
+    sqd_layout_set_thread_count( SL, thread_cnt );
+    sqd_layout_set_fit_content( SL, fit_content );
+    sqd_layout_set_note_placement( SL, align_notes ? NOTE_PLACEMENT_ALIGNED : NOTE_PLACEMENT_STACKED );
+    sqd_layout_set_note_columns( SL, left_note_columns, right_note_columns );
+    sqd_layout_set_note_routing( SL, route_notes ? NOTE_ROUTING_ORTHOGONAL : NOTE_ROUTING_DIRECT );
+    sqd_layout_set_variable_columns( SL, variable_columns );
+    sqd_layout_set_reorder_actors( SL, reorder_actors );
+    sqd_layout_set_fold_repeats( SL, fold_repeats );
+    sqd_layout_set_max_events( SL, max_events );
+    sqd_layout_set_time_axis( SL, time_scale, max_idle_gap );
+    sqd_layout_set_native_svg( SL, native_svg );
+    sqd_layout_set_native_pdf( SL, native_pdf );
+
+    if( png_filter )
+    {
+        if( g_strcmp0(png_filter, "none") == 0 )
+            png_filter_type = RASTER_FILTER_NONE;
+        else if( g_strcmp0(png_filter, "sub") == 0 )
+            png_filter_type = RASTER_FILTER_SUB;
+        else if( g_strcmp0(png_filter, "up") == 0 )
+            png_filter_type = RASTER_FILTER_UP;
+        else if( g_strcmp0(png_filter, "average") == 0 )
+            png_filter_type = RASTER_FILTER_AVERAGE;
+        else if( g_strcmp0(png_filter, "paeth") == 0 )
+            png_filter_type = RASTER_FILTER_PAETH;
+        else if( g_strcmp0(png_filter, "adaptive") != 0 )
+            g_error("Unknown png filter '%s'.\n", png_filter);
+    }
+
+    sqd_layout_set_png_encoding( SL, png_level, png_filter_type, parallel_deflate );
+
+    if( (raster_scale > 0) && (raster_dpi > 0) )
+        g_error("Give either --scale or --dpi, not both.\n");
+
+    if( raster_dpi > 0 )
+        sqd_layout_set_raster_scale( SL, raster_dpi / 72.0 );
+    else if( raster_scale > 0 )
+        sqd_layout_set_raster_scale( SL, raster_scale );
+
+    if( viewport )
+    {
+        viewport_parts = g_strsplit(viewport, ",", 0);
+
+        if( g_strv_length(viewport_parts) != 4 )
+            g_error("The viewport should be given as x,y,w,h.\n");
+
+        sqd_layout_set_viewport( SL, g_ascii_strtod(viewport_parts[0], NULL), g_ascii_strtod(viewport_parts[1], NULL),
+                                     g_ascii_strtod(viewport_parts[2], NULL), g_ascii_strtod(viewport_parts[3], NULL) );
+
+        g_strfreev(viewport_parts);
+    }
+
     // Parse the input file.
     // Try to open the policy file.
     SeqDoc = xmlParseFile( input_path );    
@@ -974,6 +1109,17 @@ main (int argc, char *argv[])
     // Cleanup
     xmlFreeDoc( SeqDoc );
 
+    // Collapse requests from the command line override the document's presentation.
+    for( collapse = collapse_classes; collapse && *collapse; collapse++ )
+    {
+        if( g_str_has_prefix(*collapse, "class=") )
+            sqd_layout_set_presentation_parameter( SL, "box-region.collapsed", "true", *collapse + (sizeof("class=") - 1) );
+        else if( g_strcmp0(*collapse, "all") == 0 )
+            sqd_layout_set_presentation_parameter( SL, "box-region.collapsed", "true", NULL );
+        else
+            g_error("Collapse requests take the form class=<name> or all.\n");
+    }
+
     // Check if pdf should be generated.
     if( output_pdf )
     {
@@ -986,6 +1132,18 @@ main (int argc, char *argv[])
         sqd_layout_generate_png( SL, output_png );
     }
 
+    // Check if ppm should be generated.
+    if( output_ppm )
+    {
+        sqd_layout_generate_ppm( SL, output_ppm );
+    }
+
+    // Check if qoi should be generated.
+    if( output_qoi )
+    {
+        sqd_layout_generate_qoi( SL, output_qoi );
+    }
+
     // Check if pdf should be generated.
     if( output_svg )
     {
@@ -43,6 +43,9 @@
 
 #include <math.h>
 #include <pango/pangocairo.h>
+#include <stdarg.h>
+#include <zlib.h>
+#include <png.h>
 
 typedef struct SDPresentationParameter
 {
@@ -67,6 +70,15 @@ typedef struct SeqDrawBox
     double End;
 }SQD_BOX;
 
+// Compact box for per event geometry that is kept relative to its layer.
+typedef struct SeqDrawFloatBox
+{
+    float Top;
+    float Bottom;
+    float Start;
+    float End;
+}SQD_FBOX;
+
 typedef struct SeqTxtRecord
 {
     char   *Str;
@@ -86,7 +98,8 @@ enum SeqDrawObjectTypeEnum
 typedef struct SeqDrawObjectHdr
 {
     guint8  Type;
-    guint8  Index;
+    guint8  Dirty;      // The object changed since it was last arranged.
+    guint32 Index;
     gchar  *IdStr; 
     gchar  *ClassStr;
 }SQD_OBJ;
@@ -125,21 +138,35 @@ typedef struct SeqDrawEventRecord
 
     guint8  ArrowDir;
 
-    double  Height;
+    guint8  Hidden;         // Inside a collapsed box region, takes no room and isn't drawn.
+    guint8  HasTime;        // Time was given for this event.
+
+    // Geometry used by arrange and draw.  Vertical positions are relative to 
+    // the top of the event's layer, so moving a layer never touches its events 
+    // and floats keep enough precision.
+    float    Height;
 
+    SQD_FBOX EventBox;
+    SQD_FBOX UpperTextBox;
+    SQD_FBOX StemBox;
+    SQD_FBOX LowerTextBox;
+
+    // Only needed when the labels are measured or drawn, or for the time axis.
     SQD_TXT UpperText;
     SQD_TXT LowerText;
 
-    SQD_BOX EventBox;
-
-    SQD_BOX UpperTextBox;
-    SQD_BOX StemBox;
-    SQD_BOX LowerTextBox;
+    double  Time;           // Trace timestamp, in whatever units the trace uses.
 }SQD_EVENT;
 
+// One column per possible actor index.
+#define SQD_PACK_COLUMNS  256
+
+// Words in a layer's column mask, one bit per actor column.
+#define SQD_MASK_WORDS  (SQD_PACK_COLUMNS / 32)
+
 typedef struct SeqDrawEventRecordLayer
 {
-    guint32  UsedMask;
+    guint32  UsedMask[SQD_MASK_WORDS];
 
     gboolean RegularLayer;   // This layer is occupied by regular events.
     gboolean StepLayer;      // This layer is occupied by step events.  
@@ -149,7 +176,22 @@ typedef struct SeqDrawEventRecordLayer
 
     SQD_BOX  LayerBox;
 
-    guint8   EventCnt;
+    guint    Page;           // The page this layer was placed on.
+
+    gboolean Dirty;          // The layer needs to be arranged again.
+
+    guint    DroppedCnt;     // Events sampled away just before this layer.
+    SQD_TXT  DroppedText;    // Marker drawn above the layer when some were.
+
+    GList   *Summaries;      // Collapsed regions whose bands start here, top band first.
+
+    double   TimePad;        // Space above the layer that puts it at its time.
+    gboolean TimeBreak;      // An idle gap before this layer was cut short.
+    SQD_TXT  BreakText;      // Marker drawn in the cut gap.
+
+    guint    SkipTo;         // Events of the other kind can start looking again here, 0 for the next layer.
+
+    guint    EventCnt;
     GList   *Events;
 }SQD_EVENT_LAYER;
 
@@ -174,8 +216,29 @@ typedef struct SeqDrawBoxRegionRecord
     SQD_EVENT *EEventRef;
 
     SQD_BOX BoundsBox;
+
+    SQD_TXT Label;          // Drawn in the bottom corner, the repeat count for folded slots.
+
+    gboolean Collapsed;     // Drawn as a single summary band instead of its events.
+    SQD_TXT  SummaryText;
+    double   SummaryOffset; // From the first band in its slot to its own.
 }SQD_BOX_REGION;
 
+// A run of slots that was folded down to one copy.
+typedef struct SeqDrawFoldRecord
+{
+    guint FirstLayer;
+    guint LastLayer;
+    guint RepeatCnt;
+}SQD_FOLD;
+
+// An event waiting in the sampling reservoir.
+typedef struct SeqDrawSampleRecord
+{
+    double     Key;
+    SQD_EVENT *Event;
+}SQD_SAMPLE;
+
 typedef struct SeqDrawNoteRecord
 {
     SQD_OBJ hdr;
@@ -195,30 +258,361 @@ typedef struct SeqDrawNoteRecord
     double  RefLastTop;
     double  RefLastStart;
 
+    guint    Page;           // The page this note was placed on, G_MAXUINT until it is. 
+    guint    Column;         // The notes column it went in.
+    gboolean RefOffPage;     // The reference is on an earlier page than the note.
+
+    double   RefChannelStart; // Gutter track and lane height of a routed reference line.
+    double   RefLaneTop;
+
 }SQD_NOTE;
 
+// A note waiting to be placed in the aligned notes column.
+typedef struct SeqDrawNotePlacement
+{
+    SQD_NOTE *Note;
+
+    guint     Page;         // Page the note's reference is drawn on.
+    double    Top;          // Desired top of the note on that page.
+    double    Start;        // Horizontal position of the reference.
+}SQD_NOTE_PLACEMENT;
+
+// A note reference line waiting for a track in the gutter beside the notes column.
+typedef struct SeqDrawNoteRoute
+{
+    SQD_NOTE *Note;
+
+    gint      Side;         // -1 when the line leaves the left of the note, 1 for the right.
+    double    Top;          // Extent of the vertical run along the track.
+    double    Bottom;
+}SQD_NOTE_ROUTE;
+
+typedef struct SeqDrawRouteTrack
+{
+    guint     Index;        // Track position counting out from the note.
+    double    Bottom;       // Where the last run on the track ends.
+}SQD_ROUTE_TRACK;
+
+// A minimum distance between two stem positions when solving variable columns.
+typedef struct SeqDrawColumnSpan
+{
+    guint   Left;
+    guint   Right;
+    double  Dist;
+}SQD_COLUMN_SPAN;
+
+typedef struct SeqDrawPageRecord
+{
+    guint   FirstLayer;     // First event layer on the page.
+    guint   LastLayer;      // One past the last event layer on the page.
+
+    double  LayerShift;     // Subtract from arranged event positions to get page positions.
+    double  HeaderShift;    // Subtract from arranged actor header positions to get page positions.
+
+    SQD_BOX SeqBox;         // Space for events on the page, in page coordinates.
+}SQD_PAGE;
+
+// Repeated slot folding.
+#define SQD_FOLD_MAX_PERIOD   32                      // Longest run of slots that is checked for repeats.
+#define SQD_FOLD_MIN_REPEATS  3                       // Shorter repeats are left as they are.
+#define SQD_FOLD_HASH_BASE    0x100000001b3ULL        // Multiplier for the rolling hash over slots.
+#define SQD_FOLD_FNV_OFFSET   0xcbf29ce484222325ULL
+#define SQD_FOLD_FNV_PRIME    0x100000001b3ULL
+
+// Event sampling for --max-events.
+#define SQD_SAMPLE_TIME_BUCKETS  16               // Stretches of the trace sampled separately.
+#define SQD_SAMPLE_SEED          20120521
+
+// Orthogonal note reference routing.
+#define SQD_NOTE_ROUTE_MAX_STEPS      64      // Limit on how many layers a reference line's lane climbs past.
+#define SQD_NOTE_ROUTE_TRACKS         4       // Tracks in the gutter beside each notes column.
+#define SQD_NOTE_ROUTE_TRACK_SPACING  3.0     // Least distance between tracks, in line widths.
+
+// Barycentric sweeps and neighbour swap passes used when reordering actors.
+#define SQD_REORDER_SWEEPS       32
+#define SQD_REORDER_SWAP_PASSES  64
+
+// Pull of an actor's current column during a sweep, relative to one event.
+#define SQD_REORDER_INERTIA      1.0
+
+// Children per node in the spatial index.
+#define SQD_INDEX_NODE_SIZE  16
+
+// Grid resolution along each axis for ordering boxes on the hilbert curve.
+#define SQD_INDEX_HILBERT_BITS  16
+
+typedef struct SeqDrawIndexEntry
+{
+    SQD_BOX  Box;           // Bounds in page coordinates.
+    SQD_OBJ *Obj;
+    guint32  Hilbert;       // Position of the box center along the hilbert curve.
+}SQD_INDEX_ENTRY;
+
+// Packed hilbert R-tree over the objects drawn on one page.  The entries are 
+// sorted along the curve and the node boxes are stored level by level, leaves
+// first, so a node's children are found from its position alone.
+typedef struct SeqDrawSpatialIndex
+{
+    GArray  *Entries;       // SQD_INDEX_ENTRY
+    GArray  *Nodes;         // SQD_BOX, every level including the leaves.
+    GArray  *LevelEnds;     // guint, one past the last node of each level.
+}SQD_SPATIAL_INDEX;
+
+// Display list ops recorded by the draw stage and replayed by the backends.
+enum DisplayOpTypes
+{
+    DLOP_RECT,          // Filled rectangle between two corner points.
+    DLOP_ROUND_RECT,    // Filled rectangle, the third point holds the corner radius.
+    DLOP_LINE,          // Stroked line between two points.
+    DLOP_POLYLINE,      // Stroked line through Count points.
+    DLOP_CURVE,         // Stroked cubic bezier, start, two controls and end.
+    DLOP_ARROWHEAD,     // Stroked open arrowhead, back, tip and back.
+    DLOP_DOT,           // Filled circle, the second point holds the radius.
+    DLOP_TEXT,          // Text run at a point, Count is the index of the run.
+    DLOP_CLIP,          // Clip the ops that follow to a rectangle.
+    DLOP_UNCLIP,        // End the last clip.
+};
+
+// Ops in the sorted band don't overlap each other, so a backend may replay
+// a run of them in any order.
+enum DisplayBandTypes
+{
+    DLBAND_ORDERED,     // Replay in list order.
+    DLBAND_SORTED,      // Free to group by style.
+};
+
+enum DisplayPaintTypes
+{
+    DLPAINT_NONE,
+    DLPAINT_FILL,
+    DLPAINT_STROKE,
+};
+
+enum DisplayDashTypes
+{
+    DLDASH_NONE,        // Solid line.
+    DLDASH_MARKER,      // Even dashes across a marker band.
+    DLDASH_NOTEREF,     // Dash-dot with round caps for note references.
+};
+
+typedef struct SeqDrawDisplayPoint
+{
+    double X;
+    double Y;
+}SQD_DL_POINT;
+
+typedef struct SeqDrawDisplayStyle
+{
+    SQD_COLOR Color;
+    double    LineWidth;
+    guint8    Dash;
+    gchar    *FontStr;      // Only set for text.
+    PangoFontDescription *FontDesc;
+    const gchar *Kind;      // What was drawn: "event", "note", ...
+    gchar       *ClassStr;  // Presentation class of the object, not owned.
+}SQD_DL_STYLE;
+
+typedef struct SeqDrawDisplayText
+{
+    gchar  *Str;            // Markup owned by the layout object.
+    double  Width;          // Wrap width, zero for none.
+}SQD_DL_TEXT;
+
+typedef struct SeqDrawDisplayOp
+{
+    guint8   Type;
+    guint8   Band;
+    guint16  Style;         // Index into the styles.
+    guint32  First;         // First point of the op.
+    guint32  Count;
+    SQD_FBOX Bounds;        // Page coordinates, for culling.
+}SQD_DL_OP;
+
+// Flat list of drawing ops for every page, in page coordinates.
+typedef struct SeqDrawDisplayList
+{
+    GArray  *Ops;           // SQD_DL_OP
+    GArray  *Points;        // SQD_DL_POINT
+    GArray  *Texts;         // SQD_DL_TEXT
+    GArray  *Styles;        // SQD_DL_STYLE
+    GArray  *PageEnds;      // guint, one past the last op of each page.
+
+    guint    LastStyle;     // Style matched last, checked first.
+    double   Shift;         // Added to y while the draw stage emits ops.
+    guint8   Band;          // Band given to the ops being emitted.
+    const gchar *Kind;      // Kind and class of the object being emitted,
+    gchar       *ClassStr;  // set by the presentation being used.
+}SQD_DISPLAY_LIST;
+
+// Room for one number written by the native backends.
+#define SQD_NUM_BUF_SIZE  G_ASCII_DTOSTR_BUF_SIZE
+
+typedef struct SeqDrawDisplaySortKey
+{
+    guint32 Key;
+    guint32 Index;
+}SQD_DL_SORT_KEY;
+
+// Path the cairo backend is building and the style it was started with.
+typedef struct SeqDrawCairoBatch
+{
+    guint  Style;
+    guint8 Paint;
+}SQD_CAIRO_BATCH;
+
+// Rows of a page image each png render thread is given at the least.
+#define SQD_RASTER_MIN_ROWS_PER_WORKER  128
+
+// Rows each png render thread draws per strip.  A strip is one band per
+// worker, and only one strip of a page is held in memory at a time.
+#define SQD_RASTER_BAND_ROWS  256
+
+// Slack around a band for strokes and glyphs that spill past their bounds.
+#define SQD_RASTER_BAND_PAD  4.0
+
+// Widest image surface cairo will create.
+#define SQD_RASTER_MAX_WIDTH  32767
+
+// A horizontal band of a page image rendered by one worker.  Its surface
+// shares rows of the strip buffer, so nothing needs copying afterwards.
+typedef struct SeqDrawRasterBand
+{
+    cairo_surface_t *Surface;
+    guint   PageIndex;
+    guint   Top;        // First row of the band in the page image.
+    SQD_BOX View;       // Page area whose ops can touch the band.
+    SQD_DL_POINT Origin;    // Page position of the band's top left pixel.
+    guint   Rows;       // Rows of the band that fall on the page.
+    guint   Channels;   // Bytes per pixel written out.
+
+    // Parallel png deflate: the band's rows as one finished IDAT chunk.
+    guchar     *Above;  // Rendered row above the band, NULL at the top of a page.
+    GByteArray *Chunk;
+    guint32     Adler;  // Checksum and length of the uncompressed rows.
+    gsize       RawLen;
+}SQD_RASTER_BAND;
+
+enum RasterFormatTypes
+{
+    RASTER_FORMAT_PNG,
+    RASTER_FORMAT_PPM,
+    RASTER_FORMAT_QOI
+};
+
+typedef struct SeqDrawQoiState
+{
+    guchar  Index[64][4];   // Recently seen pixels by hash.
+    guchar  Prev[4];
+    guint   Run;
+}SQD_QOI_STATE;
+
+// A raster page being streamed out strip by strip.
+typedef struct SeqDrawRasterPage
+{
+    guint8  Format;
+    guint   Index;          // Page being written.
+    guint   Width;
+    guint   Height;
+    guint   Channels;       // Bytes per pixel written out.
+    gdouble Scale;          // Pixels per point.
+    cairo_format_t SurfaceFormat;
+
+    cairo_surface_t *Strip; // Rows being rendered, shared by the bands.
+    guchar  *Pixels;
+    guint    Stride;
+    SQD_RASTER_BAND *Bands;
+    guint    BandCnt;
+
+    guchar  *Row;           // One converted row.
+    guchar  *LastRow;       // Last rendered row of the strip before.
+    GByteArray *Encoded;
+
+    FILE       *File;
+    png_structp Png;
+    png_infop   Info;
+    guint32     Adler;      // Running checksum of a parallel deflate stream.
+    SQD_QOI_STATE Qoi;
+}SQD_RASTER_PAGE;
+
+#define SQD_PDF_FONT_CNT  12
+#define SQD_AFM_CHAR_CNT  95        // Printable ASCII, from the space up.
+
+// Content stream the native pdf backend is building for the current page.
+typedef struct SeqDrawPdfState
+{
+    GString *Out;
+    guint    Style;
+    guint8   Paint;
+    gboolean Translucent;
+}SQD_PDF_STATE;
+
+// State for assigning slots to events that were added without one.
+typedef struct SeqDrawSlotPacker
+{
+    // Max segment tree over the actor columns, holding the top occupied layer.
+    gint  TopLayer[2 * SQD_PACK_COLUMNS];
+    gint  Pending[2 * SQD_PACK_COLUMNS];
+}SQD_SLOT_PACKER;
+
+// Open page height used while arranging a content sized diagram.
+#define SQD_FIT_CONTENT_MAX_HEIGHT  1.0e9
+
+// Don't split the arrange work across threads unless each one gets at least this many layers.
+#define SQD_ARRANGE_MIN_LAYERS_PER_WORKER  256
+
+typedef struct SeqDrawArrangeChunk
+{
+    PangoContext *Context;
+
+    guint   FirstLayer;
+    guint   LastLayer;
+
+    double  Height;     // Sum of the layer heights in this chunk.
+    double  Offset;     // Absolute top of the first layer in this chunk.
+}SQD_ARRANGE_CHUNK;
+
 // Prototypes
 static void draw_text (cairo_t *cr);
 static gchar* sqd_layout_get_pparam( SQDLayout *sb, gchar *IdStr, gchar *ClassStr );
-static void sqd_layout_draw_actor ( SQDLayout *sb, int ActorIndex, char *ActorTitle);
+static void sqd_layout_draw_actor( SQDLayout *sb, SQD_ACTOR *Actor, double StemBottom );
 static void sqd_layout_draw_arrow ( SQDLayout *sb, int EventIndex, int StartActorIndex, int EndActorIndex, char *TopText, char *BottomText);
 static void debug_box_print(char *BoxName, SQD_BOX *Box);
 static int sqd_layout_measure_text( SQDLayout *sb, SQD_TXT *Text, double Width);
+static void sqd_layout_measure_text_in_context( PangoContext *Context, gchar *FontStr, SQD_TXT *Text, double Width, gboolean PdfMetrics );
+static double sqd_layout_pdf_layout_width( PangoLayout *Layout );
 static double sqd_layout_arrange_actors( SQDLayout *sb );
 static void sqd_layout_get_actor_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start );
-static double sqd_layout_arrange_notes( SQDLayout *sb );
+static void sqd_layout_add_note_page( SQDLayout *sb );
+static void sqd_layout_paginate( SQDLayout *sb, guint FirstPage );
+static guint sqd_layout_get_object_page( SQDLayout *sb, SQD_OBJ *RefObj );
+static void sqd_layout_get_aregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start );
+static void sqd_layout_get_bregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start );
+static void sqd_layout_get_note_reference_point( SQDLayout *sb, SQD_NOTE *Note, double *Top, double *Start );
+static double sqd_layout_arrange_notes( SQDLayout *sb, guint FirstPage );
+static void sqd_layout_arrange_layer( SQDLayout *sb, SQD_EVENT_LAYER *Layer, PangoContext *Context );
+static void sqd_layout_offset_layer_events( SQD_EVENT_LAYER *Layer, double Offset );
+static void sqd_layout_shift_layer( SQDLayout *sb, SQD_EVENT_LAYER *Layer, double Offset );
 static int sqd_layout_arrange_events( SQDLayout *sb );
 static void sqd_layout_get_event_point( SQDLayout *sb, SQD_OBJ *RefObj, int RefType, double *Top, double *Start );
-static double sqd_layout_arrange_notes_references( SQDLayout *sb );
+static double sqd_layout_arrange_notes_references( SQDLayout *sb, guint FirstPage );
+static void sqd_layout_build_spatial_index( SQDLayout *sb );
+static void sqd_layout_search_spatial_index( SQD_SPATIAL_INDEX *Index, SQD_BOX *QueryBox, GPtrArray *Results );
+static void sqd_layout_reorder_actors( SQDLayout *sb );
+static void sqd_layout_repack_events( SQDLayout *sb );
+static void sqd_layout_fold_repeats( SQDLayout *sb );
+static void sqd_layout_sample_events( SQDLayout *sb );
+static void sqd_layout_apply_collapsed_regions( SQDLayout *sb );
 static int sqd_layout_arrange_diagram( SQDLayout *sb );
-static void sqd_layout_draw_text( SQDLayout *sb, SQD_TXT *Text, double Width );
-static void sqd_layout_draw_actors( SQDLayout *sb );
-static void sqd_layout_draw_events( SQDLayout *sb );
-static void sqd_layout_draw_notes( SQDLayout *sb );
-static void sqd_layout_draw_note_references( SQDLayout *sb );
-static void sqd_layout_draw_aregions( SQDLayout *sb );
-static void sqd_layout_draw_bregions( SQDLayout *sb );
-static int sqd_layout_draw_diagram( SQDLayout *sb );
+static void sqd_layout_draw_actors( SQDLayout *sb, double StemBottom );
+static void sqd_layout_draw_events( SQDLayout *sb, guint FirstLayer, guint LastLayer );
+static void sqd_layout_draw_notes( SQDLayout *sb, guint PageIndex );
+static void sqd_layout_draw_note_references( SQDLayout *sb, guint PageIndex );
+static void sqd_layout_draw_aregions( SQDLayout *sb, double Top, double Bottom );
+static void sqd_layout_draw_bregions( SQDLayout *sb, double Top, double Bottom );
+static int sqd_layout_draw_page( SQDLayout *sb, guint PageIndex );
+static int sqd_layout_draw_viewport( SQDLayout *sb, guint PageIndex );
+static void sqd_layout_build_display_list( SQDLayout *sb );
+static void sqd_layout_replay_cairo( SQDLayout *sb, cairo_t *cr, PangoContext *Context, guint PageIndex, SQD_BOX *View );
 
 // Object start
 #define SQD_LAYOUT_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), G_TYPE_SQD_LAYOUT, SQDLayoutPrivate))
@@ -243,6 +637,9 @@ struct _SQDLayoutPrivate
     gdouble  ArrowLength;
 
     gdouble  NoteBoxWidth;
+    gint     NoteColumnsLeft;       // Number of note columns on each side of the actors.
+    gint     NoteColumnsRight;
+    GArray  *NoteColumns;           // Column boxes, the left side first.
 
     SQD_TXT Title;
     SQD_BOX TitleBar;
@@ -260,6 +657,32 @@ struct _SQDLayoutPrivate
     gint    MaxActorIndex;
     gdouble MaxActorHeight;
     gdouble ActorWidth;
+    gdouble ActorTextWidth;     // Wrap width the actor names were measured with.
+
+    // Reorder the actors to shorten the event arrows.
+    gboolean ReorderActors;
+    gboolean ActorsReordered;
+
+    // Fold repeated runs of slots into one copy with a repeat count.
+    gboolean   FoldRepeats;
+    gboolean   RepeatsFolded;
+    GPtrArray *FoldedEvents;    // Events of the folded away repeats, still in the IdTable.
+
+    // Sample the events down to this many, zero keeps them all.
+    guint    MaxEvents;
+    gboolean EventsSampled;
+
+    // Place the layers by event time, zero leaves them stacked.
+    gdouble  TimeScale;         // Points per unit of time.
+    gdouble  MaxTimeGap;        // Longest idle stretch drawn to scale.
+
+    // Size actor columns from their contents instead of evenly.
+    gboolean VariableColumns;
+    gdouble  ColumnTextLimit;   // Wrap names and labels wider than this.
+    gdouble  MinColumnWidth;
+    gboolean ColumnsSolved;
+    gdouble  ColumnExtent;      // Natural width of the solved columns.
+    GArray  *ColumnCenters;     // Solved stem positions from the actor box start.
 
     // Event Stats
     gint MaxEventIndex;
@@ -267,12 +690,61 @@ struct _SQDLayoutPrivate
     // Note Stats
     gint MaxNoteIndex;
 
+    // How notes are placed in the notes column.
+    gint NotePlacement;
+
+    // How note reference lines are drawn.
+    gint NoteRouting;
+
+    // Size the page to the arranged content instead of a fixed page.
+    gboolean FitContent;
+    gdouble  FitActorWidth;
+
+    // Worker threads to use for layout, zero picks one per processor.
+    gint ThreadCnt;
+
+    // Change tracking so that edits only redo the affected part of the layout.
+    gboolean LayoutDirty;           // Everything needs to be arranged again.
+    gboolean NotesDirty;            // A note was added or its text changed.
+    gboolean RegionsDirty;          // A region was added.
+    guint    DirtyFirstLayer;       // Range of layers that need arranging,
+    guint    DirtyLastLayer;        // G_MAXUINT for the first when there are none.
+    cairo_surface_type_t ArrangedSurfaceType;
+
+    // Per page spatial index for hit testing, built on the first query after an arrange.
+    GArray  *SpatialIndex;
+    gboolean SpatialIndexValid;
+
+    // What the draw stage produced for the output backends.
+    SQD_DISPLAY_LIST DisplayList;
+
+    // Write svg and pdf with the native writers instead of cairo's surfaces.
+    gboolean NativeSvg;
+    gboolean NativePdf;
+    gboolean PdfMetrics;    // Text was measured in the standard pdf fonts.
+
+    // Raster encoder settings.
+    gint     PngLevel;
+    guint8   PngFilter;
+    gboolean ParallelDeflate;
+
+    // Pixels per point for raster output, 1.0 is 72 dpi.
+    gdouble  RasterScale;
+
+    // Only draw this rectangle of each page, in page coordinates.
+    gboolean HasViewport;
+    SQD_BOX  Viewport;
+
+    // Slot assignment for events without an explicit slot.
+    SQD_SLOT_PACKER Packer;
+
     // Actor, Event, Note Lists
     GPtrArray *Notes;
     GPtrArray *Actors;
     GPtrArray *ActorRegions;
     GPtrArray *BoxRegions;
     GArray    *EventLayers;
+    GArray    *Pages;
 
     //GList  *Events;
     cairo_surface_t *surface;
@@ -383,6 +855,7 @@ static void
 sqd_layout_init (SQDLayout *sb)
 {
 	SQDLayoutPrivate *priv;
+    int i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
@@ -405,12 +878,33 @@ sqd_layout_init (SQDLayout *sb)
     priv->ArrowLength  = 6;
 
     priv->NoteBoxWidth   = 2*72;
+    priv->NoteColumnsLeft  = 0;
+    priv->NoteColumnsRight = 1;
+    priv->NoteColumns      = g_array_new(FALSE, TRUE, sizeof (SQD_BOX));
 
     //priv->EventHeight  = (priv->Height / (72 * 0.33333));
 
     priv->MaxActorIndex  = 0;
     priv->MaxActorHeight = 0;
     priv->ActorWidth     = 0;
+    priv->ActorTextWidth = 0;
+
+    priv->ReorderActors   = FALSE;
+    priv->ActorsReordered = FALSE;
+    priv->FoldRepeats     = FALSE;
+    priv->RepeatsFolded   = FALSE;
+    priv->MaxEvents       = 0;
+    priv->EventsSampled   = FALSE;
+
+    priv->TimeScale       = 0;
+    priv->MaxTimeGap      = 1*72;
+
+    priv->VariableColumns = FALSE;
+    priv->ColumnTextLimit = 2*72;
+    priv->MinColumnWidth  = 0.5*72;
+    priv->ColumnsSolved   = FALSE;
+    priv->ColumnExtent    = 0;
+    priv->ColumnCenters   = g_array_new(FALSE, TRUE, sizeof (double));
 
     priv->Actors = g_ptr_array_new();
 
@@ -418,11 +912,55 @@ sqd_layout_init (SQDLayout *sb)
 
     priv->EventLayers = g_array_new(FALSE, TRUE, sizeof (SQD_EVENT_LAYER));
 
+    priv->Pages = g_array_new(FALSE, TRUE, sizeof (SQD_PAGE));
+
     priv->MaxNoteIndex   = 0;
     priv->Notes = g_ptr_array_new();
 
+    priv->ThreadCnt      = 0;
+
+    priv->NotePlacement  = NOTE_PLACEMENT_STACKED;
+    priv->NoteRouting    = NOTE_ROUTING_DIRECT;
+
+    priv->FitContent     = FALSE;
+    priv->FitActorWidth  = 1.5*72;
+
+    priv->LayoutDirty     = TRUE;
+    priv->NotesDirty      = TRUE;
+    priv->RegionsDirty    = TRUE;
+    priv->DirtyFirstLayer = G_MAXUINT;
+    priv->DirtyLastLayer  = 0;
+
+    priv->SpatialIndex      = g_array_new(FALSE, TRUE, sizeof (SQD_SPATIAL_INDEX));
+    priv->SpatialIndexValid = FALSE;
+
+    priv->DisplayList.Ops      = g_array_new(FALSE, FALSE, sizeof (SQD_DL_OP));
+    priv->DisplayList.Points   = g_array_new(FALSE, FALSE, sizeof (SQD_DL_POINT));
+    priv->DisplayList.Texts    = g_array_new(FALSE, FALSE, sizeof (SQD_DL_TEXT));
+    priv->DisplayList.Styles   = g_array_new(FALSE, FALSE, sizeof (SQD_DL_STYLE));
+    priv->DisplayList.PageEnds = g_array_new(FALSE, FALSE, sizeof (guint));
+
+    priv->NativeSvg = FALSE;
+    priv->NativePdf  = FALSE;
+    priv->PdfMetrics = FALSE;
+
+    priv->HasViewport = FALSE;
+
+    priv->PngLevel        = Z_DEFAULT_COMPRESSION;
+    priv->PngFilter       = RASTER_FILTER_ADAPTIVE;
+    priv->ParallelDeflate = FALSE;
+
+    priv->RasterScale = 1.0;
+
+    for (i = 0; i < (2 * SQD_PACK_COLUMNS); i++)
+    {
+        priv->Packer.TopLayer[i] = -1;
+        priv->Packer.Pending[i]  = -1;
+    }
+
     priv->ActorRegions = g_ptr_array_new();
     priv->BoxRegions   = g_ptr_array_new();
+    priv->FoldedEvents = g_ptr_array_new();
 
     priv->Title.Str       = NULL;
     priv->Description.Str = NULL;
@@ -565,6 +1103,9 @@ sqd_layout_use_default_presentation( SQDLayout *sb )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "page";
+    priv->DisplayList.ClassStr = NULL;
+
     // Use the default font
     priv->FontStr = sqd_layout_get_pparam( sb, "font", NULL );
 
@@ -592,6 +1133,9 @@ sqd_layout_use_title_presentation( SQDLayout *sb )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "title";
+    priv->DisplayList.ClassStr = NULL;
+
     // First look for a specific font for the title block
     priv->FontStr = sqd_layout_get_pparam( sb, "title.font", NULL );
     if( priv->FontStr == NULL )
@@ -613,6 +1157,9 @@ sqd_layout_use_description_presentation( SQDLayout *sb )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "description";
+    priv->DisplayList.ClassStr = NULL;
+
     // First look for a specific font for the description block
     priv->FontStr = sqd_layout_get_pparam( sb, "description.font", NULL );
 
@@ -630,6 +1177,9 @@ sqd_layout_use_actor_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "actor";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // First look for a specific font for the actor block, in decreasing specificity.
     priv->FontStr = sqd_layout_get_pparam( sb, "actor.font", ClassStr );
     if( priv->FontStr == NULL )
@@ -663,6 +1213,25 @@ sqd_layout_use_actor_presentation( SQDLayout *sb, gchar *ClassStr )
 
 }
 
+// Resolve the event font without touching the shared presentation state, 
+// so that it can be used from the arrange worker threads.
+static gchar*
+sqd_layout_get_event_font( SQDLayout *sb, gchar *ClassStr )
+{
+    gchar *FontStr;
+
+    // Look for a specific font for the event, in decreasing specificity.
+    FontStr = sqd_layout_get_pparam( sb, "event.font", ClassStr );
+    if( FontStr == NULL )
+        FontStr = sqd_layout_get_pparam( sb, "font", ClassStr );
+    if( FontStr == NULL )
+        FontStr = sqd_layout_get_pparam( sb, "event.font", NULL );
+    if( FontStr == NULL )
+        FontStr = sqd_layout_get_pparam( sb, "font", NULL );
+
+    return FontStr;
+}
+
 static void
 sqd_layout_use_event_presentation( SQDLayout *sb, gchar *ClassStr )
 {
@@ -671,14 +1240,11 @@ sqd_layout_use_event_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "event";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // First look for a specific font for the actor block, in decreasing specificity.
-    priv->FontStr = sqd_layout_get_pparam( sb, "event.font", ClassStr );
-    if( priv->FontStr == NULL )
-        priv->FontStr = sqd_layout_get_pparam( sb, "font", ClassStr );
-    if( priv->FontStr == NULL )
-        priv->FontStr = sqd_layout_get_pparam( sb, "event.font", NULL );
-    if( priv->FontStr == NULL )
-        priv->FontStr = sqd_layout_get_pparam( sb, "font", NULL );
+    priv->FontStr = sqd_layout_get_event_font( sb, ClassStr );
 
     // Look for a specfic stem color. 
     TmpStr = sqd_layout_get_pparam(sb, "event.stem.color", ClassStr);
@@ -701,6 +1267,9 @@ sqd_layout_use_note_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "note";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // First look for a specific font for the actor block, in decreasing specificity.
     priv->FontStr = sqd_layout_get_pparam( sb, "note.font", ClassStr );
     if( priv->FontStr == NULL )
@@ -731,6 +1300,9 @@ sqd_layout_use_noteref_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "noteref";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // Look for a specfic stem color. 
     TmpStr = sqd_layout_get_pparam(sb, "noteref.stem.color", ClassStr);
     if( TmpStr == NULL )
@@ -752,6 +1324,9 @@ sqd_layout_use_aregion_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "actor-region";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // Look for a specfic fill color. 
     TmpStr = sqd_layout_get_pparam(sb, "actor-region.fill.color", ClassStr);
     if( TmpStr == NULL )
@@ -773,6 +1348,9 @@ sqd_layout_use_bregion_presentation( SQDLayout *sb, gchar *ClassStr )
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    priv->DisplayList.Kind     = "box-region";
+    priv->DisplayList.ClassStr = ClassStr;
+
     // Look for a specfic fill color. 
     TmpStr = sqd_layout_get_pparam(sb, "box-region.fill.color", ClassStr);
     if( TmpStr == NULL )
@@ -787,30 +1365,6 @@ sqd_layout_use_bregion_presentation( SQDLayout *sb, gchar *ClassStr )
 
 
 
-static void
-sqd_layout_draw_rounded_rec( SQDLayout *sb, gdouble x, gdouble y, gdouble w, gdouble h, gdouble r)
-{
-	SQDLayoutPrivate *priv;
-
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
-
-    // "Draw a rounded rectangle"
-    //   A****BQ
-    //  H      C
-    //  *      *
-    //  G      D
-    //   F****E
-    cairo_move_to(priv->cr, x+r,y);                     // Move to A
-    cairo_line_to(priv->cr,x+w-r,y);                    // Straight line to B
-    cairo_curve_to(priv->cr,x+w,y,x+w,y,x+w,y+r);       // Curve to C, Control points are both at Q
-    cairo_line_to(priv->cr,x+w,y+h-r);                  // Move to D
-    cairo_curve_to(priv->cr,x+w,y+h,x+w,y+h,x+w-r,y+h); // Curve to E
-    cairo_line_to(priv->cr,x+r,y+h);                    // Line to F
-    cairo_curve_to(priv->cr,x,y+h,x,y+h,x,y+h-r);       // Curve to G
-    cairo_line_to(priv->cr,x,y+r);                      // Line to H
-    cairo_curve_to(priv->cr,x,y,x,y,x+r,y);             // Curve to A
-}
-
 static void
 debug_box_print(char *BoxName, SQD_BOX *Box)
 {
@@ -825,12 +1379,21 @@ sqd_layout_measure_text( SQDLayout *sb, SQD_TXT *Text, double Width)
 	SQDLayoutPrivate *priv;
     PangoLayout *layout;
     PangoFontDescription *desc;
+    cairo_font_options_t *Options;
     int pwidth, pheight;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
     // Create a PangoLayout, set the font and text 
     layout = pango_cairo_create_layout (priv->cr);
+
+    // Measure with the font options set on cr, raster output sets them to
+    // match what the bands render with.
+    Options = cairo_font_options_create();
+    cairo_get_font_options(priv->cr, Options);
+    pango_cairo_context_set_font_options(pango_layout_get_context(layout), Options);
+    pango_layout_context_changed(layout);
+    cairo_font_options_destroy(Options);
   
     if( Width )
     {
@@ -849,2070 +1412,9177 @@ sqd_layout_measure_text( SQDLayout *sb, SQD_TXT *Text, double Width)
     Text->Width  = ((double)pwidth  / PANGO_SCALE); 
     Text->Height = ((double)pheight / PANGO_SCALE); 
 
+    // The native pdf writer shows the text in a standard font.
+    if( priv->PdfMetrics )
+        Text->Width = sqd_layout_pdf_layout_width(layout);
+
     // free the layout object 
     g_object_unref (layout);
 
 }
 
-// sqd_layout_get_pparam( sb, "font", NULL)
-
-static double
-sqd_layout_arrange_actors( SQDLayout *sb )
+// Measure text with an explicit pango context and font rather than the 
+// shared cairo context and presentation state.
+static void
+sqd_layout_measure_text_in_context( PangoContext *Context, gchar *FontStr, SQD_TXT *Text, double Width, gboolean PdfMetrics )
 {
-	SQDLayoutPrivate *priv;
-    GList *Element;
-    SQD_ACTOR *Actor;
-    int i;
-    double ActorTop;
-    double ActorTextWidth;
-    double ActorMaxTextWidth;
-    double EventTop;
-
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
-
-    // Top of the event box.
-    EventTop = 0;
-
-    // The Actor Box should now contain the space allocated for actor columns. 
-    ActorTop   = priv->ActorBox.Top + priv->ElementPad;
-    priv->ActorWidth = (priv->ActorBox.End - priv->ActorBox.Start) / (priv->MaxActorIndex + 1.0);
+    PangoLayout *layout;
+    PangoFontDescription *desc;
+    int pwidth, pheight;
 
-    // Have the Actor Text take up the middle two thirds of the width.
-    ActorTextWidth = (priv->ActorWidth * 2.0)/3.0;
+    layout = pango_layout_new (Context);
+  
+    if( Width )
+    {
+        pango_layout_set_width (layout, (Width * PANGO_SCALE));
+        pango_layout_set_wrap (layout, PANGO_WRAP_WORD);
+    }
 
-    printf("Actor Widths: %d %g %g\n", priv->MaxActorIndex+1, priv->ActorWidth, ActorTextWidth); 
+    desc = pango_font_description_from_string( FontStr );
+    pango_layout_set_font_description (layout, desc);
+    pango_font_description_free (desc);
 
-    ActorMaxTextWidth = 0;
+    pango_layout_set_markup (layout, Text->Str, -1);
 
-    // Determine the width and height of the actors text.
-    for (i = 0; i <= priv->MaxActorIndex; i++)
-    {
-        Actor = g_ptr_array_index(priv->Actors, i);
+    pango_layout_get_size (layout, &pwidth, &pheight);
 
-        // Setup the parameters for the title bar
-        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
+    Text->Width  = ((double)pwidth  / PANGO_SCALE); 
+    Text->Height = ((double)pheight / PANGO_SCALE); 
 
-        sqd_layout_measure_text(sb, &Actor->Name, ActorTextWidth);
+    if( PdfMetrics )
+        Text->Width = sqd_layout_pdf_layout_width(layout);
 
-        printf("Pango Actor Extents: %g %g\n", Actor->Name.Width, Actor->Name.Height); 
+    // free the layout object 
+    g_object_unref (layout);
+}
 
-        if( Actor->Name.Height > priv->MaxActorHeight )
-            priv->MaxActorHeight = Actor->Name.Height;   
+// sqd_layout_get_pparam( sb, "font", NULL)
 
-        if( Actor->Name.Width > ActorMaxTextWidth )
-            ActorMaxTextWidth = Actor->Name.Width;       
+// Add a minimum distance between two stem positions to the column constraints.
+static void
+sqd_layout_add_column_span( GArray *Spans, double *MinGap, guint Left, guint Right, double Dist )
+{
+    SQD_COLUMN_SPAN Span;
 
-        // Restore default presentation
-        sqd_layout_use_default_presentation(sb); 
-    
+    // Neighbours just widen the gap between them.
+    if( Right == (Left + 1) )
+    {
+        if( Dist > MinGap[Right] )
+            MinGap[Right] = Dist;
+        return;
     }
 
-    printf("Pango Actor Maxs: %g %g\n", priv->MaxActorHeight, ActorMaxTextWidth); 
+    Span.Left  = Left;
+    Span.Right = Right;
+    Span.Dist  = Dist;
 
-    // Layout the Actors
-    for (i = 0; i <= priv->MaxActorIndex; i++)
-    {
-        Actor = g_ptr_array_index(priv->Actors, i);
+    g_array_append_val(Spans, Span);
+}
 
-        // Setup the parameters for the title bar
-        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
+// Work out the narrowest set of actor columns that fits the actor names and
+// the event labels between them.  Stem positions are solved relative to the
+// left edge of the actor box, with position 0 and ActorCnt+1 standing in for
+// the box edges.  Every constraint points forward, so one pass in position
+// order gives the tightest positions.
+static void
+sqd_layout_solve_actor_columns( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR        *Actor;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    SQD_COLUMN_SPAN  *Span;
+    GList            *Element;
+    GArray           *Spans;
+    SQD_TXT           Label;
+    double *MinGap;
+    double *Half;
+    double *Pos;
+    double  LabelWidth;
+    guint  *SpanStart;
+    guint  *SpanOrder;
+    guint   ActorCnt, PosCnt;
+    guint   Left, Right;
+    guint   i, k;
 
-        Actor->BoundsBox.Top    = ActorTop;
-        Actor->BoundsBox.Bottom = priv->ActorBox.Bottom;
-        Actor->BoundsBox.Start  = priv->ActorBox.Start + (i * priv->ActorWidth);
-        Actor->BoundsBox.End    = Actor->BoundsBox.Start + priv->ActorWidth;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-        debug_box_print("Bounds Box", &Actor->BoundsBox);
+    ActorCnt = priv->MaxActorIndex + 1;
+    PosCnt   = ActorCnt + 2;
 
-        Actor->NameBox.Top     = ActorTop;
-        Actor->NameBox.Bottom  = ActorTop + priv->MaxActorHeight + (2 * priv->TextPad);
-        Actor->NameBox.Start   = Actor->BoundsBox.Start + (priv->ActorWidth / 2.0) - (ActorMaxTextWidth / 2.0) - priv->TextPad;
-        Actor->NameBox.End     = Actor->NameBox.Start + ActorMaxTextWidth + (2 * priv->TextPad);
+    MinGap = g_new0(double, PosCnt);
+    Half   = g_new0(double, PosCnt);
+    Pos    = g_new0(double, PosCnt);
+    Spans  = g_array_new(FALSE, FALSE, sizeof (SQD_COLUMN_SPAN));
 
-        debug_box_print("Name Box", &Actor->NameBox);
+    // Each name needs half its width on either side of the stem.
+    for (i = 0; i < ActorCnt; i++)
+    {
+        Actor = g_ptr_array_index(priv->Actors, i);
 
-        Actor->BaselineBox.Top     = Actor->NameBox.Bottom;
-        Actor->BaselineBox.Bottom  = Actor->BaselineBox.Top + priv->LineWidth;
-        Actor->BaselineBox.Start   = Actor->NameBox.Start;
-        Actor->BaselineBox.End     = Actor->NameBox.End;
+        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
 
-        Actor->StemBox.Top         = Actor->BaselineBox.Top;
-        Actor->StemBox.Bottom      = priv->ActorBox.Bottom - priv->ElementPad;
-        Actor->StemBox.Start       = Actor->NameBox.Start + ((Actor->NameBox.End - Actor->NameBox.Start)/ 2.0) - priv->LineWidth;
-        Actor->StemBox.End         = Actor->StemBox.Start + (2 * priv->LineWidth);
+        sqd_layout_measure_text(sb, &Actor->Name, priv->ColumnTextLimit);
 
-        if( (Actor->StemBox.Top + priv->ElementPad) > EventTop )
-            EventTop = (Actor->StemBox.Top + priv->ElementPad);
+        Half[i + 1] = MAX( ((Actor->Name.Width / 2.0) + priv->TextPad + (priv->ElementPad / 2.0)), (priv->MinColumnWidth / 2.0) );
 
-        // Restore default presentation
         sqd_layout_use_default_presentation(sb);
     }
 
-    return EventTop;
+    for (k = 1; k < PosCnt; k++)
+        MinGap[k] = Half[k - 1] + Half[k];
 
-}
+    // Event labels need room between the stems they run across.
+    for (i = 0; i < priv->MaxEventIndex; i++)
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
-static void 
-sqd_layout_get_actor_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
-{
-	SQDLayoutPrivate *priv;
-    GList *Element;
-    SQD_ACTOR *Actor;
+        Element = g_list_first(Layer->Events);
+        while( Element )
+        {
+            Event = Element->data;
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+            if( Event->Hidden )
+            {
+                Element = g_list_next(Element);
+                continue;
+            }
 
-    // default the point
-    *Top   = 0;
-    *Start = 0;
+            sqd_layout_use_event_presentation(sb, Event->hdr.ClassStr);
 
-    // Look up the actor element
-    Actor = (SQD_ACTOR *)RefObj;
+            LabelWidth = 0;
 
-    if( (Actor == NULL) || (Actor->hdr.Type != SDOBJ_ACTOR) )
-        return;
+            if( Event->UpperText.Str )
+            {
+                Label = Event->UpperText;
+                sqd_layout_measure_text(sb, &Label, priv->ColumnTextLimit);
+                LabelWidth = Label.Width;
+            }
 
-    // Get a point at the baseline and stem intersection.
-    *Top   = Actor->BaselineBox.Top - (2.0*priv->LineWidth);
-    *Start = Actor->BaselineBox.End - (2.0*priv->LineWidth);
-}
+            if( Event->LowerText.Str )
+            {
+                Label = Event->LowerText;
+                sqd_layout_measure_text(sb, &Label, priv->ColumnTextLimit);
+                LabelWidth = MAX(LabelWidth, Label.Width);
+            }
 
+            switch ( Event->ArrowDir )
+            {
+                case ARROWDIR_LEFT_TO_RIGHT:
+                case ARROWDIR_RIGHT_TO_LEFT:
+                    Left  = MIN(Event->StartActorIndx, Event->EndActorIndx) + 1;
+                    Right = MAX(Event->StartActorIndx, Event->EndActorIndx) + 1;
 
-static double
-sqd_layout_arrange_notes( SQDLayout *sb )
-{
-	SQDLayoutPrivate *priv;
-    SQD_NOTE *Note;
-    int i;
-    double NoteTop;
-    double NoteTextWidth;
+                    sqd_layout_add_column_span(Spans, MinGap, Left, Right, LabelWidth + (2 * priv->TextPad) + (2 * priv->ArrowLength));
+                break;
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+                // External events run in from the left edge of the actor box.
+                case ARROWDIR_EXTERNAL_TO:
+                case ARROWDIR_EXTERNAL_FROM:
+                    Right = Event->StartActorIndx + 1;
 
-    // The Note Box should now contain the space allocated for Note columns. 
-    NoteTop   = priv->NoteBox.Top + priv->ElementPad;
-    NoteTextWidth = priv->NoteBoxWidth - (2 * priv->TextPad);
+                    sqd_layout_add_column_span(Spans, MinGap, 0, Right, LabelWidth + (2 * priv->TextPad) + (2 * priv->ArrowLength));
+                break;
 
-    // Determine the height of the Note text.
-    for (i = 0; i < priv->MaxNoteIndex; i++)
-    {
-        Note = g_ptr_array_index(priv->Notes, i);
+                // Step text sits in the right three quarters of the column.  The column
+                // reaches half way to the next stem, or all the way to the box edge.
+                case ARROWDIR_STEP:
+                    Left  = Event->StartActorIndx + 1;
+                    Right = Left + 1;
 
-        // Setup the parameters
-        sqd_layout_use_note_presentation(sb, Note->hdr.ClassStr);
-        
-        sqd_layout_measure_text(sb, &Note->Text, NoteTextWidth);
+                    if( Right == (PosCnt - 1) )
+                        sqd_layout_add_column_span(Spans, MinGap, Left, Right, (LabelWidth + (2 * priv->TextPad)) * (2.0 / 3.0));
+                    else
+                        sqd_layout_add_column_span(Spans, MinGap, Left, Right, (LabelWidth + (2 * priv->TextPad)) * (4.0 / 3.0));
+                break;
+            }
+
+            sqd_layout_use_default_presentation(sb);
 
-        printf("Pango Note Extents: %g %g\n", Note->Text.Width, Note->Text.Height);      
+            Element = g_list_next(Element);
+        }
+    }
 
-        Note->BoundsBox.Top    = NoteTop;
-        Note->BoundsBox.Bottom = NoteTop + Note->Text.Height + (2 * priv->TextPad);
-        Note->BoundsBox.Start  = priv->NoteBox.Start;
-        Note->BoundsBox.End    = priv->NoteBox.End;
+    // Bucket the longer spans by their right hand position.
+    SpanStart = g_new0(guint, PosCnt + 1);
+    SpanOrder = g_new0(guint, Spans->len + 1);
 
-        debug_box_print("Note Box", &Note->BoundsBox);
+    for (i = 0; i < Spans->len; i++)
+        SpanStart[ g_array_index(Spans, SQD_COLUMN_SPAN, i).Right + 1 ] += 1;
 
-        NoteTop = (Note->BoundsBox.Bottom + priv->ElementPad);
+    for (k = 1; k <= PosCnt; k++)
+        SpanStart[k] += SpanStart[k - 1];
 
-        // Restore default presentation
-        sqd_layout_use_default_presentation(sb);
+    for (i = 0; i < Spans->len; i++)
+    {
+        Right = g_array_index(Spans, SQD_COLUMN_SPAN, i).Right;
 
+        SpanOrder[ SpanStart[Right] ] = i;
+        SpanStart[Right] += 1;
     }
 
-    return 0;
-}
+    // The fill left each bucket start at the next bucket; walk them back.
+    for (k = PosCnt; k > 0; k--)
+        SpanStart[k] = SpanStart[k - 1];
+    SpanStart[0] = 0;
 
+    // Longest path from the left edge.
+    Pos[0] = 0;
+    for (k = 1; k < PosCnt; k++)
+    {
+        Pos[k] = Pos[k - 1] + MinGap[k];
 
+        for (i = SpanStart[k]; i < SpanStart[k + 1]; i++)
+        {
+            Span = &g_array_index(Spans, SQD_COLUMN_SPAN, SpanOrder[i]);
 
-static int
-sqd_layout_arrange_events( SQDLayout *sb )
+            if( (Pos[Span->Left] + Span->Dist) > Pos[k] )
+                Pos[k] = Pos[Span->Left] + Span->Dist;
+        }
+    }
+
+    g_array_set_size(priv->ColumnCenters, ActorCnt);
+    for (i = 0; i < ActorCnt; i++)
+        g_array_index(priv->ColumnCenters, double, i) = Pos[i + 1];
+
+    priv->ColumnExtent  = Pos[PosCnt - 1];
+    priv->ColumnsSolved = TRUE;
+
+    g_free(SpanOrder);
+    g_free(SpanStart);
+    g_array_free(Spans, TRUE);
+    g_free(Pos);
+    g_free(Half);
+    g_free(MinGap);
+}
+
+static double
+sqd_layout_arrange_actors( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    GList           *Element;
-    SQD_EVENT_LAYER *Layer;
-    SQD_EVENT       *Event;
-    SQD_ACTOR       *StartActor, *EndActor;
+    GList *Element;
+    SQD_ACTOR *Actor;
     int i;
+    double ActorTop;
+    double ActorTextWidth;
+    double ActorMaxTextWidth;
     double EventTop;
-    double EventWidth;
-//    double ActorTextWidth;
-    double EventMaxTextWidth;
+    double ActorAvail;
+    double Slack, Scale;
+    double *StemPos;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // The Event Box should now contain the space allotted for laying out events. 
-    EventTop   = priv->SeqBox.Top;
+    // Top of the event box.
+    EventTop = 0;
 
-    // Cycle through the event layers in sequencial order to layout each one.
-    for (i = 0; i < priv->MaxEventIndex; i++)
+    // The Actor Box should now contain the space allocated for actor columns. 
+    ActorTop   = priv->ActorBox.Top + priv->ElementPad;
+    ActorAvail = priv->ActorBox.End - priv->ActorBox.Start;
+    priv->ActorWidth = ActorAvail / (priv->MaxActorIndex + 1.0);
+
+    if( priv->VariableColumns )
     {
-        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        // Names were measured while solving the columns.
+        if( priv->ColumnsSolved == FALSE )
+            sqd_layout_solve_actor_columns(sb);
 
-        // Layout each seperate event in this layer
-        Element = g_list_first(Layer->Events);
-        while( Element )
-        {
-            Event = Element->data;
+        ActorTextWidth = priv->ColumnTextLimit;
+    }
+    else
+    {
+        // Have the Actor Text take up the middle two thirds of the width.
+        ActorTextWidth = (priv->ActorWidth * 2.0)/3.0;
+    }
 
-            // Setup the parameters
-            sqd_layout_use_event_presentation(sb, Event->hdr.ClassStr);
+    priv->ActorTextWidth = ActorTextWidth;
 
-            // Calculate the arrow length so that available space for text layout can be calculated.
-            switch ( Event->ArrowDir )
-            {
-                case ARROWDIR_EXTERNAL_TO:
-                case ARROWDIR_EXTERNAL_FROM:
+    printf("Actor Widths: %d %g %g\n", priv->MaxActorIndex+1, priv->ActorWidth, ActorTextWidth); 
 
-                    StartActor = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
+    ActorMaxTextWidth = 0;
 
-                    if( Event->ArrowDir == ARROWDIR_EXTERNAL_FROM )
-                    {
-                        Event->StemBox.Start   = priv->ActorBox.Start;
-                        Event->StemBox.End     = StartActor->StemBox.Start; // - (priv->LineWidth/2.0);
-                    }
-                    else
-                    {
-                        Event->StemBox.End   = StartActor->StemBox.Start - (priv->LineWidth/2.0);
-                        Event->StemBox.Start = priv->ActorBox.Start;
-                    }
+    // Determine the width and height of the actors text.
+    for (i = 0; i <= priv->MaxActorIndex; i++)
+    {
+        Actor = g_ptr_array_index(priv->Actors, i);
 
-                    Event->EventBox.Top    = EventTop;
-                    Event->EventBox.Start  = Event->StemBox.Start;
-                    Event->EventBox.End    = Event->StemBox.End;
+        // Setup the parameters for the title bar
+        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
 
-                    EventMaxTextWidth = ((Event->StemBox.End - Event->StemBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
-                    Event->Height = 0;
+        if( priv->VariableColumns == FALSE )
+        {
+            sqd_layout_measure_text(sb, &Actor->Name, ActorTextWidth);
 
-                    if( Event->UpperText.Str )
-                    {
-                        sqd_layout_measure_text(sb, &Event->UpperText, EventMaxTextWidth);
+            printf("Pango Actor Extents: %g %g\n", Actor->Name.Width, Actor->Name.Height); 
+        }
 
-                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+        if( Actor->Name.Height > priv->MaxActorHeight )
+            priv->MaxActorHeight = Actor->Name.Height;   
 
-                        if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
-                            Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
-                        else
-                            Event->Height += priv->MinEventPad;
+        if( Actor->Name.Width > ActorMaxTextWidth )
+            ActorMaxTextWidth = Actor->Name.Width;       
 
-                        Event->UpperTextBox.Top     = (Event->EventBox.Top + Event->Height) - priv->TextPad - Event->UpperText.Height;
-                        Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
-                        Event->UpperTextBox.Start   = priv->ActorBox.Start; // Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->UpperText.Width/2.0);
-                        Event->UpperTextBox.End     = Event->UpperTextBox.Start + Event->UpperText.Width;
-                    }
-                    else
-                    {
-                        Event->Height += priv->MinEventPad;
-                    }
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb); 
+    
+    }
 
-                    // Layout the rest of the boxes for the event.
-                    Event->StemBox.Top     = Event->EventBox.Top + Event->Height;
-                    Event->StemBox.Bottom  = Event->StemBox.Top + priv->LineWidth;
+    printf("Pango Actor Maxs: %g %g\n", priv->MaxActorHeight, ActorMaxTextWidth); 
 
-                    Event->Height += priv->LineWidth;
-                    Event->Height += priv->MinEventPad;
+    // Stem positions, either evenly spaced or from the solved columns.
+    StemPos = g_new(double, priv->MaxActorIndex + 1);
 
-                    // Update the EventBox Bottom
-                    Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
+    for (i = 0; i <= priv->MaxActorIndex; i++)
+        StemPos[i] = priv->ActorBox.Start + ((i + 0.5) * priv->ActorWidth);
 
-                    // The layer height is the maximum height of any event.
-                    if( Layer->Height < Event->Height )
-                        Layer->Height = Event->Height;
+    if( priv->VariableColumns && (priv->ColumnExtent > 0) )
+    {
+        // Share out any spare width evenly, or squeeze the columns to fit.
+        Slack = ActorAvail - priv->ColumnExtent;
+        Scale = (Slack < 0) ? (ActorAvail / priv->ColumnExtent) : 1.0;
 
-                break;
+        if( Slack < 0 )
+            Slack = 0;
 
-                case ARROWDIR_STEP:
+        for (i = 0; i <= priv->MaxActorIndex; i++)
+            StemPos[i] = priv->ActorBox.Start + (g_array_index(priv->ColumnCenters, double, i) * Scale) + ((i + 0.5) * Slack / (priv->MaxActorIndex + 1.0));
+    }
 
-                    EventMaxTextWidth =  (3.0*(priv->ActorWidth/4.0)) - (2 * priv->TextPad);
+    // Layout the Actors
+    for (i = 0; i <= priv->MaxActorIndex; i++)
+    {
+        Actor = g_ptr_array_index(priv->Actors, i);
 
-                    if( Event->UpperText.Str )
-                    {
-                        sqd_layout_measure_text(sb, &Event->UpperText, EventMaxTextWidth);
+        // Setup the parameters for the title bar
+        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
 
-                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+        // Columns meet half way between neighbouring stems.
+        Actor->BoundsBox.Top    = ActorTop;
+        Actor->BoundsBox.Bottom = priv->ActorBox.Bottom;
+        Actor->BoundsBox.Start  = (i == 0) ? priv->ActorBox.Start : ((StemPos[i - 1] + StemPos[i]) / 2.0);
+        Actor->BoundsBox.End    = (i == priv->MaxActorIndex) ? priv->ActorBox.End : ((StemPos[i] + StemPos[i + 1]) / 2.0);
 
-                        if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
-                            Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
-                        else
-                            Event->Height += priv->MinEventPad;
-                    }
-                    else
-                    {
-                        Event->Height += priv->MinEventPad + 20;
-                    }
+        debug_box_print("Bounds Box", &Actor->BoundsBox);
 
-                    Event->Height += priv->LineWidth;
+        // Equal columns share one name box width, variable ones fit their own name.
+        if( priv->VariableColumns )
+            ActorTextWidth = Actor->Name.Width;
+        else
+            ActorTextWidth = ActorMaxTextWidth;
 
-                    StartActor = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
-                    
-                    Event->StemBox.Start   = StartActor->StemBox.Start + (priv->LineWidth*2);
-                    Event->StemBox.End     = StartActor->StemBox.Start + priv->ActorWidth/4.0;
-                    
-                    Event->EventBox.Top    = EventTop;
-                    Event->EventBox.Start  = Event->StemBox.Start;
-                    Event->EventBox.End    = Event->StemBox.End + Event->UpperText.Width + (2*priv->TextPad);
+        Actor->NameBox.Top     = ActorTop;
+        Actor->NameBox.Bottom  = ActorTop + priv->MaxActorHeight + (2 * priv->TextPad);
+        Actor->NameBox.Start   = StemPos[i] - (ActorTextWidth / 2.0) - priv->TextPad;
+        Actor->NameBox.End     = Actor->NameBox.Start + ActorTextWidth + (2 * priv->TextPad);
 
-                    EventMaxTextWidth = ((Event->EventBox.End - Event->EventBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
+        debug_box_print("Name Box", &Actor->NameBox);
 
-                    // Layout the rest of the boxes for the event.
-                    Event->StemBox.Top     = Event->EventBox.Top + priv->LineWidth;
-                    Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
-                    Event->StemBox.Bottom  = Event->EventBox.Bottom - priv->LineWidth;
+        Actor->BaselineBox.Top     = Actor->NameBox.Bottom;
+        Actor->BaselineBox.Bottom  = Actor->BaselineBox.Top + priv->LineWidth;
+        Actor->BaselineBox.Start   = Actor->NameBox.Start;
+        Actor->BaselineBox.End     = Actor->NameBox.End;
 
-                    if( Event->UpperText.Str )
-                    {
-                        Event->UpperTextBox.Top     = (Event->EventBox.Top + (Event->Height/2.0)) - (Event->UpperText.Height/2.0);
-                        Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
-                        Event->UpperTextBox.Start   = Event->StemBox.End + priv->TextPad;
-                        Event->UpperTextBox.End     = Event->EventBox.End;
-                    }
- 
-                    // The layer height is the maximum height of any event.
-                    if( Layer->Height < Event->Height )
-                        Layer->Height = Event->Height;
+        Actor->StemBox.Top         = Actor->BaselineBox.Top;
+        Actor->StemBox.Bottom      = priv->ActorBox.Bottom - priv->ElementPad;
+        Actor->StemBox.Start       = Actor->NameBox.Start + ((Actor->NameBox.End - Actor->NameBox.Start)/ 2.0) - priv->LineWidth;
+        Actor->StemBox.End         = Actor->StemBox.Start + (2 * priv->LineWidth);
 
-                break;
+        if( (Actor->StemBox.Top + priv->ElementPad) > EventTop )
+            EventTop = (Actor->StemBox.Top + priv->ElementPad);
 
-                case ARROWDIR_LEFT_TO_RIGHT:
-                case ARROWDIR_RIGHT_TO_LEFT:
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb);
+    }
 
-                    StartActor = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
-                    EndActor   = g_ptr_array_index(priv->Actors, Event->EndActorIndx);
+    g_free(StemPos);
 
-                    if( Event->ArrowDir == ARROWDIR_LEFT_TO_RIGHT )
-                    {
-                        Event->StemBox.Start   = StartActor->StemBox.Start + (priv->LineWidth/2.0);
-                        Event->StemBox.End     = EndActor->StemBox.Start - (priv->LineWidth/2.0);
-                    }
-                    else
-                    {
-                        Event->StemBox.Start   = EndActor->StemBox.Start + (priv->LineWidth*3.0/2.0);
-                        Event->StemBox.End     = StartActor->StemBox.Start;
-                    }
+    return EventTop;
 
-                    Event->EventBox.Top    = EventTop;
-                    Event->EventBox.Start  = Event->StemBox.Start;
-                    Event->EventBox.End    = Event->StemBox.End;
+}
 
-                    EventMaxTextWidth = ((Event->StemBox.End - Event->StemBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
-                    Event->Height = 0;
+static void 
+sqd_layout_get_actor_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
+{
+	SQDLayoutPrivate *priv;
+    GList *Element;
+    SQD_ACTOR *Actor;
 
-                    if( Event->UpperText.Str )
-                    {
-                        sqd_layout_measure_text(sb, &Event->UpperText, EventMaxTextWidth);
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+    // default the point
+    *Top   = 0;
+    *Start = 0;
 
-                        if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
-                            Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
-                        else
-                            Event->Height += priv->MinEventPad;
+    // Look up the actor element
+    Actor = (SQD_ACTOR *)RefObj;
 
-                        Event->UpperTextBox.Top     = (Event->EventBox.Top + Event->Height) - priv->TextPad - Event->UpperText.Height;
-                        Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
-                        Event->UpperTextBox.Start   = Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->UpperText.Width/2.0);
-                        Event->UpperTextBox.End     = Event->UpperTextBox.Start + Event->UpperText.Width;
-                    }
-                    else
-                    {
-                        Event->Height += priv->MinEventPad;
-                    }
+    if( (Actor == NULL) || (Actor->hdr.Type != SDOBJ_ACTOR) )
+        return;
 
-                    // Layout the rest of the boxes for the event.
-                    Event->StemBox.Top     = Event->EventBox.Top + Event->Height;
-                    Event->StemBox.Bottom  = Event->StemBox.Top + priv->LineWidth;
+    // Get a point at the baseline and stem intersection.
+    *Top   = Actor->BaselineBox.Top - (2.0*priv->LineWidth);
+    *Start = Actor->BaselineBox.End - (2.0*priv->LineWidth);
+}
 
-                    Event->Height += priv->LineWidth;
 
-                    if( Event->LowerText.Str )
-                    {
-                        sqd_layout_measure_text(sb, &Event->LowerText, EventMaxTextWidth);
+// Start a new page, continuing the event layers from FirstLayer.
+static SQD_PAGE *
+sqd_layout_add_page( SQDLayout *sb, guint FirstLayer, double LayerTop )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE *Page;
+    double    HeaderShift;
 
-                        printf("Pango Event Lower Extents: %g %g\n", Event->LowerText.Width, Event->LowerText.Height); 
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-                        if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
-                            Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
-                        else
-                            Event->Height += priv->MinEventPad;
+    g_array_set_size(priv->Pages, priv->Pages->len + 1);
+    Page = &g_array_index(priv->Pages, SQD_PAGE, priv->Pages->len - 1);
 
-                        Event->LowerTextBox.Top     = Event->StemBox.Bottom + priv->TextPad;  
-                        Event->LowerTextBox.Bottom  = Event->LowerTextBox.Top + Event->LowerText.Height;
-                        Event->LowerTextBox.Start   = Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->LowerText.Width/2.0);
-                        Event->LowerTextBox.End     = Event->LowerTextBox.Start + Event->LowerText.Width;
-                    }
-                    else
-                    {
-                        Event->Height += priv->MinEventPad;
-                    }
+    // Continuation pages drop the title and description and repeat 
+    // the actor header at the top margin.
+    HeaderShift = (priv->Pages->len == 1) ? 0 : (priv->ActorBox.Top - priv->Margin);
 
-                    // Update the EventBox Bottom
-                    Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
+    Page->HeaderShift   = HeaderShift;
 
-                    // The layer height is the maximum height of any event.
-                    if( Layer->Height < Event->Height )
-                        Layer->Height = Event->Height;
+    Page->SeqBox.Start  = priv->SeqBox.Start;
+    Page->SeqBox.End    = priv->SeqBox.End;
+    Page->SeqBox.Top    = priv->SeqBox.Top - HeaderShift;
+    Page->SeqBox.Bottom = priv->SeqBox.Bottom;
 
-                break;
+    Page->FirstLayer    = FirstLayer;
+    Page->LastLayer     = FirstLayer;
+    Page->LayerShift    = LayerTop - Page->SeqBox.Top;
 
-            }
-            
-            // Restore default presentation
-            sqd_layout_use_default_presentation(sb);
+    return Page;
+}
 
-            Element = g_list_next(Element);
-        } // Event Layout Loop
+// Add a page that only continues the notes column.
+static void
+sqd_layout_add_note_page( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE *Page;
 
-        // Get the new event height
-        EventTop += Layer->Height;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Page = &g_array_index(priv->Pages, SQD_PAGE, priv->Pages->len - 1);
 
-    } // Event Layer Loop 
+    sqd_layout_add_page(sb, Page->LastLayer, 0);
 }
 
-static void 
-sqd_layout_get_event_point( SQDLayout *sb, SQD_OBJ *RefObj, int RefType, double *Top, double *Start )
+// The page a layer went on in the last pagination.  Layers added since 
+// then belong with the last page that holds events.
+static guint
+sqd_layout_get_layer_page( SQDLayout *sb, guint LayerIndex )
 {
 	SQDLayoutPrivate *priv;
-    GList           *Element;
-    SQD_EVENT_LAYER *Layer;
-    SQD_EVENT       *Event;
-    int i;
+    SQD_PAGE *Page;
+    guint     Last;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // default the point
-    *Top   = 0;
-    *Start = 0;
+    if( priv->Pages->len == 0 )
+        return 0;
 
-    // Validate the event
-    Event = (SQD_EVENT *)RefObj; 
+    // Skip the pages that only continue the notes column.
+    Last = priv->Pages->len - 1;
+    while( (Last > 0) && (g_array_index(priv->Pages, SQD_PAGE, Last).FirstLayer == g_array_index(priv->Pages, SQD_PAGE, Last).LastLayer) )
+        Last -= 1;
 
-    // Make sure we found it.
-    if( (Event == NULL) || (Event->hdr.Type != SDOBJ_EVENT) )
-        return;
+    Page = &g_array_index(priv->Pages, SQD_PAGE, Last);
 
-    switch( RefType )
-    {
-            // Reference a specific event.
-            case NOTE_REFTYPE_EVENT_START: 
-                switch ( Event->ArrowDir )
-                {
-                    case ARROWDIR_STEP:
-                        *Top   = Event->StemBox.Top;
-                        *Start = Event->StemBox.Start;
-                    break;
+    if( LayerIndex >= Page->FirstLayer )
+        return Last;
 
-                    case ARROWDIR_EXTERNAL_TO:
-                    case ARROWDIR_LEFT_TO_RIGHT:
-                        *Top   = Event->StemBox.Top;
-                        *Start = Event->StemBox.Start;
-                    break;
+    return g_array_index(priv->EventLayers, SQD_EVENT_LAYER, LayerIndex).Page;
+}
 
-                    case ARROWDIR_EXTERNAL_FROM:
-                    case ARROWDIR_RIGHT_TO_LEFT:
-                        *Top   = Event->StemBox.Top;
-                        *Start = Event->StemBox.End;
-                    break;
-                }
-            break;
-  
-            case NOTE_REFTYPE_EVENT_MIDDLE:  
-                if( Event->ArrowDir == ARROWDIR_STEP )
-                {
-                    // Point to the end of the text in this case, and the center vertically
-                    *Top   = (Event->EventBox.Top + Event->EventBox.Bottom)/2.0;
-                    *Start = Event->EventBox.End + (2.0*priv->LineWidth);                    
-                }
-                else
-                {
-                    // Find the center point of the arrow
-                    *Top   = Event->StemBox.Top;
-                    *Start = ((Event->StemBox.End - Event->StemBox.Start)/2.0) + Event->StemBox.Start;
-                }
-            break;
+// Break the arranged event layers into pages.  Breaks only happen at slot 
+// boundaries, a layer taller than a whole page gets a page to itself.  Pages
+// before FirstPage are kept as they are; the layers on them must not have moved.
+static void
+sqd_layout_paginate( SQDLayout *sb, guint FirstPage )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_PAGE         *Page;
+    guint i;
 
-            case NOTE_REFTYPE_EVENT_END: 
-                switch ( Event->ArrowDir )
-                {
-                    case ARROWDIR_STEP:
-                        *Top   = Event->StemBox.Bottom;
-                        *Start = Event->StemBox.Start;
-                    break;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-                    case ARROWDIR_EXTERNAL_TO:
-                    case ARROWDIR_LEFT_TO_RIGHT:
-                        // Get a point at the baseline and stem intersection.
-                        *Top   = Event->StemBox.Top;
-                        *Start = Event->StemBox.End;
-                    break;
+    if( (FirstPage == 0) || (FirstPage >= priv->Pages->len) )
+    {
+        g_array_set_size(priv->Pages, 0);
 
-                    case ARROWDIR_EXTERNAL_FROM:
-                    case ARROWDIR_RIGHT_TO_LEFT:
-                        // Get a point at the baseline and stem intersection.
-                        *Top   = Event->StemBox.Top;
-                        *Start = Event->StemBox.Start;
-                    break;
-                }
-            break;
-    } // Ref Type switch
+        Page = sqd_layout_add_page(sb, 0, priv->SeqBox.Top);
+        i    = 0;
+    }
+    else
+    {
+        // Start the page over from its first layer, which stays where it was.
+        i = g_array_index(priv->Pages, SQD_PAGE, FirstPage).FirstLayer;
+        g_array_set_size(priv->Pages, FirstPage);
+
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        Page  = sqd_layout_add_page(sb, i, Layer->LayerBox.Top);
+    }
 
+    for ( ; i < priv->MaxEventIndex; i++)
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
+        if( ((Layer->LayerBox.Bottom - Page->LayerShift) > Page->SeqBox.Bottom) && (Page->LastLayer > Page->FirstLayer) )
+            Page = sqd_layout_add_page(sb, i, Layer->LayerBox.Top);
+
+        Layer->Page     = priv->Pages->len - 1;
+        Page->LastLayer = i + 1;
+    }
 }
 
-static gboolean
-sqd_layout_arrange_aregions( SQDLayout *sb )
+// The page an object is drawn on, for objects that sit in the event area.
+static guint
+sqd_layout_get_object_page( SQDLayout *sb, SQD_OBJ *RefObj )
 {
 	SQDLayoutPrivate *priv;
-    SQD_ACTOR_REGION *AReg;
+    SQD_EVENT        *Event;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( RefObj == NULL )
+        return 0;
+
+    switch( RefObj->Type )
+    {
+        case SDOBJ_EVENT:
+            Event = (SQD_EVENT *)RefObj;
+        break;
+
+        // Regions are referenced at their starting event.
+        case SDOBJ_AREGION:
+            Event = ((SQD_ACTOR_REGION *)RefObj)->SEventRef;
+        break;
 
+        case SDOBJ_BREGION:
+            Event = ((SQD_BOX_REGION *)RefObj)->SEventRef;
+        break;
+
+        // Actors are repeated on every page.
+        default:
+            return 0;
+    }
+
+    return g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Event->hdr.Index).Page;
+}
+
+
+// Measure the text of each note and work out how tall it will be.
+static void
+sqd_layout_measure_notes( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
     int i;
+    double NoteTextWidth;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Determine the bounding boxes for each actor region.
-    for (i = 0; i < priv->ActorRegions->len; i++)
+    NoteTextWidth = priv->NoteBoxWidth - (2 * priv->TextPad);
+
+    for (i = 0; i < priv->MaxNoteIndex; i++)
     {
-        AReg = g_ptr_array_index(priv->ActorRegions, i);
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        // Only text that changed needs to be measured again.
+        if( (priv->LayoutDirty == FALSE) && (Note->hdr.Dirty == FALSE) )
+            continue;
 
         // Setup the parameters
-        sqd_layout_use_aregion_presentation(sb, AReg->hdr.ClassStr);
+        sqd_layout_use_note_presentation(sb, Note->hdr.ClassStr);
 
-        if( AReg->SEventRef->StemBox.Top >= AReg->EEventRef->StemBox.Bottom )
-        {
-            g_error("The start event must proceed the end event in an actor region. (failing id '%s'", AReg->hdr.IdStr);
-            return TRUE;
-        }
+        sqd_layout_measure_text(sb, &Note->Text, NoteTextWidth);
 
-        AReg->BoundsBox.Top    = (AReg->SEventRef->StemBox.Top + AReg->SEventRef->StemBox.Bottom)/2.0;
-        AReg->BoundsBox.Bottom = (AReg->EEventRef->StemBox.Top + AReg->EEventRef->StemBox.Bottom)/2.0;
+        printf("Pango Note Extents: %g %g\n", Note->Text.Width, Note->Text.Height);
 
-        AReg->BoundsBox.Start  = AReg->ActorRef->StemBox.Start + (priv->LineWidth/2.0) - (2.0*priv->LineWidth);
-        AReg->BoundsBox.End    = AReg->ActorRef->StemBox.Start + (priv->LineWidth/2.0) + (2.0*priv->LineWidth);
+        Note->hdr.Dirty = FALSE;
 
-        debug_box_print("ARegion Box", &AReg->BoundsBox);
+        Note->Height = Note->Text.Height + (2 * priv->TextPad);
 
         // Restore default presentation
         sqd_layout_use_default_presentation(sb);
-
     }
-
-    return FALSE;
 }
 
-static void 
-sqd_layout_get_aregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
+// Pick the column for a note on the current page.  A column that is free down 
+// to WantTop can take the note where it wants to be, the one nearest the 
+// reference wins.  Otherwise the note goes in the least filled column.
+static guint
+sqd_layout_pick_note_column( SQDLayout *sb, double *ColumnTops, double WantTop, double RefStart )
 {
 	SQDLayoutPrivate *priv;
-    SQD_ACTOR_REGION *AReg;
+    SQD_BOX *Column;
+    guint  Best, Least;
+    double Dist, BestDist;
+    guint  i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // default the point
-    *Top   = 0;
-    *Start = 0;
+    Best     = G_MAXUINT;
+    BestDist = 0;
+    Least    = 0;
 
-    // Look up the actor element
-    AReg = (SQD_ACTOR_REGION *)RefObj;
+    for( i = 0; i < priv->NoteColumns->len; i++ )
+    {
+        if( ColumnTops[i] < ColumnTops[Least] )
+            Least = i;
 
-    if( (AReg == NULL) || (AReg->hdr.Type != SDOBJ_AREGION) )
-        return;
+        if( ColumnTops[i] > WantTop )
+            continue;
 
-    // Get a point at the baseline and stem intersection.
-    *Top   = AReg->BoundsBox.Top + (5.0*priv->LineWidth);
-    *Start = AReg->BoundsBox.End;
+        Column = &g_array_index(priv->NoteColumns, SQD_BOX, i);
+        Dist   = MIN( fabs(Column->Start - RefStart), fabs(Column->End - RefStart) );
+
+        if( (Best == G_MAXUINT) || (Dist < BestDist) )
+        {
+            Best     = i;
+            BestDist = Dist;
+        }
+    }
+
+    return (Best == G_MAXUINT) ? Least : Best;
 }
 
-static gboolean
-sqd_layout_arrange_bregions( SQDLayout *sb )
+// Start every column at the top of a page.
+static void
+sqd_layout_reset_note_columns( SQDLayout *sb, double *ColumnTops, guint PageIndex )
 {
 	SQDLayoutPrivate *priv;
-    SQD_BOX_REGION   *BReg;
-    int i;
+    SQD_PAGE *Page;
+    guint i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Determine the bounding boxes for each actor region.
-    for (i = 0; i < priv->BoxRegions->len; i++)
-    {
-        BReg = g_ptr_array_index(priv->BoxRegions, i);
+    Page = &g_array_index(priv->Pages, SQD_PAGE, PageIndex);
 
-        // Setup the parameters
-        sqd_layout_use_bregion_presentation(sb, BReg->hdr.ClassStr);
+    for( i = 0; i < priv->NoteColumns->len; i++ )
+        ColumnTops[i] = Page->SeqBox.Top + priv->ElementPad;
+}
 
-        if( BReg->SEventRef->EventBox.Top >= BReg->EEventRef->EventBox.Bottom )
-        {
-            g_error("The start event must proceed the end event in a box region. (failing id '%s'", BReg->hdr.IdStr);
-            return TRUE;
-        }
+// Put a note in a column on the current page, no higher than WantTop.  When 
+// it doesn't fit there the highest spot in another column is tried, and only
+// when no column has room does the note start the columns on the next page.
+static void
+sqd_layout_place_note( SQDLayout *sb, SQD_NOTE *Note, guint Column, guint *PageIndex, double *ColumnTops, double WantTop )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE *Page;
+    SQD_BOX  *ColumnBox;
+    double    NoteTop;
+    double    Top;
+    guint     i;
 
-        BReg->BoundsBox.Top    = BReg->SEventRef->EventBox.Top;
-        BReg->BoundsBox.Bottom = BReg->EEventRef->EventBox.Bottom;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Page    = &g_array_index(priv->Pages, SQD_PAGE, *PageIndex);
+    NoteTop = MAX(ColumnTops[Column], WantTop);
 
-        if( BReg->SActorRef->BoundsBox.Top >= BReg->EActorRef->BoundsBox.Bottom )
+    if( (NoteTop + Note->Height) > Page->SeqBox.Bottom )
+    {
+        for( i = 0; i < priv->NoteColumns->len; i++ )
         {
-            g_error("The start actor must be to the right of the end actor in a box region. (failing id '%s'", BReg->hdr.IdStr);
-            return TRUE;
+            Top = MAX(ColumnTops[i], WantTop);
+
+            if( ((Top + Note->Height) <= Page->SeqBox.Bottom) && ((Top < NoteTop) || ((NoteTop + Note->Height) > Page->SeqBox.Bottom)) )
+            {
+                Column  = i;
+                NoteTop = Top;
+            }
         }
+    }
 
-        BReg->BoundsBox.Start  = BReg->SActorRef->BoundsBox.Start;
-        BReg->BoundsBox.End    = BReg->EActorRef->BoundsBox.End;
+    // Continue the columns on the next page when this one is full.
+    if( ((NoteTop + Note->Height) > Page->SeqBox.Bottom) && (NoteTop > (Page->SeqBox.Top + priv->ElementPad)) )
+    {
+        *PageIndex += 1;
+        if( *PageIndex >= priv->Pages->len )
+            sqd_layout_add_note_page(sb);
 
-        debug_box_print("BRegion Box", &BReg->BoundsBox);
+        sqd_layout_reset_note_columns(sb, ColumnTops, *PageIndex);
+        NoteTop = ColumnTops[Column];
+    }
 
-        // Restore default presentation
-        sqd_layout_use_default_presentation(sb);
+    ColumnBox = &g_array_index(priv->NoteColumns, SQD_BOX, Column);
 
-    }
+    Note->Page             = *PageIndex;
+    Note->Column           = Column;
 
-    return 0;
+    Note->BoundsBox.Top    = NoteTop;
+    Note->BoundsBox.Bottom = NoteTop + Note->Height;
+    Note->BoundsBox.Start  = ColumnBox->Start;
+    Note->BoundsBox.End    = ColumnBox->End;
+
+    debug_box_print("Note Box", &Note->BoundsBox);
+
+    ColumnTops[Column] = Note->BoundsBox.Bottom + priv->ElementPad;
 }
 
-static void 
-sqd_layout_get_bregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
+// Width kept free beside each notes column for routed reference lines.
+static double
+sqd_layout_get_route_gutter( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    SQD_BOX_REGION   *BReg;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // default the point
-    *Top   = 0;
-    *Start = 0;
+    if( priv->NoteRouting != NOTE_ROUTING_ORTHOGONAL )
+        return 0;
 
-    // Look up the actor element
-    BReg = (SQD_BOX_REGION *)RefObj;
+    return (SQD_NOTE_ROUTE_TRACKS + 1) * SQD_NOTE_ROUTE_TRACK_SPACING * MAX(priv->LineWidth, 1.0);
+}
 
-    if( (BReg == NULL) || (BReg->hdr.Type != SDOBJ_BREGION) )
-        return;
+// Width taken up by Columns notes columns and the space beside them.
+static double
+sqd_layout_get_note_columns_width( SQDLayout *sb, gint Columns )
+{
+	SQDLayoutPrivate *priv;
 
-    // Get a point at the baseline and stem intersection.
-    *Top   = BReg->BoundsBox.Top + (3.0 * priv->LineWidth);
-    *Start = BReg->BoundsBox.End - (3.0 * priv->LineWidth);
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    return Columns * (priv->NoteBoxWidth + priv->ElementPad + sqd_layout_get_route_gutter(sb));
 }
 
-static double
-sqd_layout_arrange_notes_references( SQDLayout *sb )
+// Lay out the note columns, the left ones from the margin in and the right 
+// ones from the far margin in.  The actor box gets the space between them.
+static void
+sqd_layout_arrange_note_columns( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    SQD_NOTE *Note;
-    int i;
-    double NoteTop;
-    double NoteTextWidth;
+    SQD_BOX Column;
+    double  Start, End;
+    double  Gutter;
+    gint    i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // The Note Box should now contain the space allocated for Note columns. 
-    NoteTop   = priv->NoteBox.Top + priv->ElementPad;
-    NoteTextWidth = priv->NoteBoxWidth - (2 * priv->TextPad);
+    g_array_set_size(priv->NoteColumns, 0);
 
-    // Determine the height of the Note text.
-    for (i = 0; i < priv->MaxNoteIndex; i++)
-    {
-        Note = g_ptr_array_index(priv->Notes, i);
+    // Notes carry their own heights, the columns only set the sides.
+    Column.Top    = 0;
+    Column.Bottom = 0;
 
-        // Setup the parameters
-        sqd_layout_use_noteref_presentation(sb, Note->hdr.ClassStr);
+    // Routed reference lines leave each column on the side facing the 
+    // actors, so leave them a gutter there.
+    Gutter = sqd_layout_get_route_gutter(sb);
 
-        // Start the arrow at the note.
-        Note->RefFirstTop   = Note->BoundsBox.Top;
-        Note->RefFirstStart = Note->BoundsBox.Start;
+    Start = priv->Margin;
+    for (i = 0; i < priv->NoteColumnsLeft; i++)
+    {
+        Column.Start = Start;
+        Column.End   = Start + priv->NoteBoxWidth;
+        g_array_append_val(priv->NoteColumns, Column);
 
-        switch( Note->ReferenceType )
-        {
-            // Just a general note that doesn't reference a specific diagram feature.
-            case NOTE_REFTYPE_NONE:          
-            break;
+        Start = Column.End + priv->ElementPad + Gutter;
+    }
 
-            // References the a specific Actor.
-            case NOTE_REFTYPE_ACTOR: 
-                sqd_layout_get_actor_point( sb, Note->RefObj, &Note->RefLastTop, &Note->RefLastStart );
-            break;
+    End = priv->Width - priv->Margin;
+    for (i = 0; i < priv->NoteColumnsRight; i++)
+    {
+        Column.End   = End;
+        Column.Start = End - priv->NoteBoxWidth;
+        g_array_append_val(priv->NoteColumns, Column);
 
-            // Reference a specific event.
-            case NOTE_REFTYPE_EVENT_START:   
-            case NOTE_REFTYPE_EVENT_MIDDLE:  
-            case NOTE_REFTYPE_EVENT_END:     
-                sqd_layout_get_event_point( sb, Note->RefObj, Note->ReferenceType, &Note->RefLastTop, &Note->RefLastStart );
-            break;
-           
-            // Reference to a Vertical Span of events.
-            case NOTE_REFTYPE_VSPAN:         
-                sqd_layout_get_aregion_point( sb, Note->RefObj, &Note->RefLastTop, &Note->RefLastStart );
-            break;
+        End = Column.Start - priv->ElementPad - Gutter;
+    }
 
-            // Group events into a box. Reference to the box.
-            case NOTE_REFTYPE_BOXSPAN:       
-                sqd_layout_get_bregion_point( sb, Note->RefObj, &Note->RefLastTop, &Note->RefLastStart );
-            break;
-        } // Ref Type switch
+    // The note box spans all of the columns.
+    priv->NoteBox.Start = priv->Margin;
+    priv->NoteBox.End   = priv->Width - priv->Margin;
 
-        // Restore default presentation
-        sqd_layout_use_default_presentation(sb);
+    // The page size or routing may have changed since the columns were set.
+    if( End <= Start )
+        g_error("The note columns don't leave the actors any room on the page.\n");
 
-    } // Note Loop
+    priv->ActorBox.Start = Start;
+    priv->ActorBox.End   = End;
+
+    debug_box_print("NoteBox", &priv->NoteBox);
 }
 
-static int
-sqd_layout_arrange_diagram( SQDLayout *sb )
+// Pick the note sweep up after Kept notes that are staying where they are, 
+// the first Kept of Notes in sweep order.  The sweep was on the page of the 
+// last of them, with the columns filled down to the notes placed there.
+static void
+sqd_layout_resume_note_columns( SQDLayout *sb, SQD_NOTE **Notes, guint Kept, double *ColumnTops, guint *PageIndex )
 {
 	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
+    guint i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Start with the default presentation.
-    sqd_layout_use_default_presentation(sb);
-
-    // Start as if there isn't a title.
-    priv->TitleBox.Start   = priv->Margin;
-    priv->TitleBox.End     = priv->Width - priv->Margin;
-    priv->TitleBox.Top     = priv->Margin;
-    priv->TitleBox.Bottom  = priv->Margin;
+    *PageIndex = (Kept > 0) ? Notes[Kept - 1]->Page : 0;
+    sqd_layout_reset_note_columns(sb, ColumnTops, *PageIndex);
 
-    // Determine the amount of space needed for the title
-    if( priv->Title.Str )
+    for( i = Kept; (i > 0) && (Notes[i - 1]->Page == *PageIndex); i-- )
     {
-        // Setup the parameters for the title bar
-        sqd_layout_use_title_presentation(sb);
-
-        priv->TitleBar.Start   = priv->TitleBox.Start;
-        priv->TitleBar.End     = priv->TitleBox.End;
-        priv->TitleBar.Top     = priv->TitleBox.Top + priv->ElementPad;
-
-        sqd_layout_measure_text(sb, &priv->Title, (priv->TitleBar.End - priv->TitleBar.Start - (2 * priv->TextPad)));
+        Note = Notes[i - 1];
+        ColumnTops[Note->Column] = MAX(ColumnTops[Note->Column], Note->BoundsBox.Bottom + priv->ElementPad);
+    }
+}
 
+// Stack the notes in document order, filling the columns evenly.  Notes that
+// come before anything on FirstPage or later keep their places.
+static void
+sqd_layout_stack_notes( SQDLayout *sb, guint FirstPage )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
+    SQD_PAGE *Page;
+    int i;
+    guint PageIndex;
+    guint RefPage;
+    guint Column;
+    double *ColumnTops;
+    double PageTop;
+    double RefTop, RefStart;
 
-        priv->TitleBar.Bottom  = priv->TitleBar.Top + priv->Title.Height + (2 * priv->TextPad);
-        priv->TitleBox.Bottom  = priv->TitleBar.Bottom + priv->ElementPad;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-        printf("Pango Title Extents: %g %g\n", priv->Title.Width, priv->Title.Height); 
-        debug_box_print("TitleBar", &priv->TitleBar);
-        debug_box_print("TitleBox", &priv->TitleBox);
+    ColumnTops = g_new(double, priv->NoteColumns->len);
 
-        // Restore defaults
-        sqd_layout_use_default_presentation(sb);
+    // Keep the notes up to the first one that was placed on, or refers to, 
+    // FirstPage or later.  New notes haven't got a page yet.
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
 
+        if( (Note->Page >= FirstPage) || (sqd_layout_get_object_page(sb, Note->RefObj) >= FirstPage) )
+            break;
     }
 
-    // Default to not having a Description
-    priv->DescriptionBox.Start   = priv->Margin;
-    priv->DescriptionBox.End     = priv->Width - priv->Margin;
-    priv->DescriptionBox.Top     = priv->TitleBox.Bottom;
-    priv->DescriptionBox.Bottom  = priv->TitleBox.Bottom;
+    // The Note Box should now contain the space allocated for Note columns.
+    sqd_layout_resume_note_columns(sb, (SQD_NOTE **)priv->Notes->pdata, i, ColumnTops, &PageIndex);
 
-    // Determine the amount of space needed for the description block
-    if( priv->Description.Str )
+    for ( ; i < priv->MaxNoteIndex; i++)
     {
-        // Setup the parameters for the title bar
-        sqd_layout_use_description_presentation(sb);
+        Note = g_ptr_array_index(priv->Notes, i);
 
-        sqd_layout_measure_text(sb, &priv->Description, (priv->DescriptionBox.End - priv->DescriptionBox.Start - (2 * priv->TextPad)));
+        // Don't start a note before the page its reference is on.
+        RefPage = sqd_layout_get_object_page(sb, Note->RefObj);
+        if( RefPage > PageIndex )
+        {
+            PageIndex = RefPage;
+            sqd_layout_reset_note_columns(sb, ColumnTops, PageIndex);
+        }
 
-        priv->DescriptionBox.Bottom  = priv->TitleBox.Bottom + priv->Description.Height + (2 * priv->ElementPad) + (2 * priv->TextPad);
+        // Empty columns near the reference go first, then the shortest.
+        sqd_layout_get_note_reference_point(sb, Note, &RefTop, &RefStart);
 
-        printf("Pango Description Extents: %g %g\n", priv->Description.Width,priv->Description.Height);  
-        debug_box_print("DescriptionBox", &priv->DescriptionBox);
+        Page    = &g_array_index(priv->Pages, SQD_PAGE, PageIndex);
+        PageTop = Page->SeqBox.Top + priv->ElementPad;
+        Column  = sqd_layout_pick_note_column(sb, ColumnTops, PageTop, RefStart);
 
-        // Restore default presentation
-        sqd_layout_use_default_presentation(sb);
+        sqd_layout_place_note(sb, Note, Column, &PageIndex, ColumnTops, PageTop);
     }
 
-    // Determine if a notes column is needed.
-    if( priv->Notes->len )
-    {
-        // Add a box for notes on the right hand side of the page.
-        priv->NoteBox.End    = priv->Width - priv->Margin;
-        priv->NoteBox.Start  = priv->NoteBox.End - priv->NoteBoxWidth;
+    g_free(ColumnTops);
+}
 
-        // Figure out where the Actors should be located.
-        priv->ActorBox.Start  = priv->Margin;
-        priv->ActorBox.End    = priv->NoteBox.Start - priv->ElementPad;
-        priv->ActorBox.Top    = priv->DescriptionBox.Bottom;
-        priv->ActorBox.Bottom = priv->Height - priv->Margin;
+static gint
+sqd_layout_compare_note_placements( gconstpointer a, gconstpointer b )
+{
+    const SQD_NOTE_PLACEMENT *PlaceA = a;
+    const SQD_NOTE_PLACEMENT *PlaceB = b;
 
-        // Call a subroutine to layout the Actors.
-        priv->SeqBox.Top = sqd_layout_arrange_actors(sb);
+    if( PlaceA->Page != PlaceB->Page )
+        return (PlaceA->Page < PlaceB->Page) ? -1 : 1;
 
-        // Finish laying out the notes
-        priv->NoteBox.Top    = priv->SeqBox.Top;
-        priv->NoteBox.Bottom = priv->Height - priv->Margin;
+    if( PlaceA->Top != PlaceB->Top )
+        return (PlaceA->Top < PlaceB->Top) ? -1 : 1;
 
-        sqd_layout_arrange_notes(sb);
+    // Keep document order for notes that want the same spot.
+    return (gint)PlaceA->Note->hdr.Index - (gint)PlaceB->Note->hdr.Index;
+}
 
-        // Init the rest of the event box.
-        priv->SeqBox.Start  = priv->ActorBox.Start;
-        priv->SeqBox.End    = priv->ActorBox.End;
-        priv->SeqBox.Bottom = priv->ActorBox.Bottom;
+// Place each note level with the feature it references.  The notes are sorted
+// by where they want to be and then swept top to bottom.  Each goes in the 
+// column nearest its reference that is free at that height, or else the 
+// least filled column, pushed down just far enough to clear the note above.
+// Notes sorted ahead of FirstPage that were placed there keep their places.
+static void
+sqd_layout_align_notes( SQDLayout *sb, guint FirstPage )
+{
+	SQDLayoutPrivate   *priv;
+    SQD_NOTE_PLACEMENT *Placements;
+    SQD_NOTE_PLACEMENT *Place;
+    SQD_NOTE **Sorted;
+    SQD_NOTE *Note;
+    SQD_PAGE *Page;
+    int i;
+    guint Kept;
+    guint PageIndex;
+    guint Column;
+    double *ColumnTops;
+    double NoteTop;
+    double RefTop, RefStart;
 
-        // Layout the events
-        sqd_layout_arrange_events(sb);
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-        // Layout the actor regions
-        sqd_layout_arrange_aregions(sb);
+    Placements = g_new(SQD_NOTE_PLACEMENT, priv->MaxNoteIndex);
+    ColumnTops = g_new(double, priv->NoteColumns->len);
 
-        // Layout the box regions
-        sqd_layout_arrange_bregions(sb);
+    Page    = &g_array_index(priv->Pages, SQD_PAGE, 0);
+    NoteTop = Page->SeqBox.Top + priv->ElementPad;
 
-        // Layout the reference lines for notes.
-        sqd_layout_arrange_notes_references(sb);
+    // Work out where each note would like to be on its reference's page.
+    PageIndex = 0;
+    RefStart  = 0;
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note  = g_ptr_array_index(priv->Notes, i);
+        Place = &Placements[i];
+
+        Place->Note = Note;
+
+        switch( Note->ReferenceType )
+        {
+            // General notes just follow the note before them.
+            case NOTE_REFTYPE_NONE:
+                Place->Page  = PageIndex;
+                Place->Top   = NoteTop;
+                Place->Start = RefStart;
+            break;
+
+            // Actors sit in the header, so aim for the top of the first page.
+            case NOTE_REFTYPE_ACTOR:
+                sqd_layout_get_note_reference_point(sb, Note, &RefTop, &RefStart);
+
+                Place->Page  = 0;
+                Place->Top   = g_array_index(priv->Pages, SQD_PAGE, 0).SeqBox.Top + priv->ElementPad;
+                Place->Start = RefStart;
+            break;
+
+            // Center the note on the reference point.
+            default:
+                sqd_layout_get_note_reference_point(sb, Note, &RefTop, &RefStart);
+
+                Place->Page  = sqd_layout_get_object_page(sb, Note->RefObj);
+                Page         = &g_array_index(priv->Pages, SQD_PAGE, Place->Page);
+                Place->Top   = RefTop - Page->LayerShift - (Note->Height / 2.0);
+                Place->Start = RefStart;
+            break;
+        }
+
+        PageIndex = Place->Page;
+        NoteTop   = Place->Top;
     }
-    else
+
+    qsort(Placements, priv->MaxNoteIndex, sizeof(SQD_NOTE_PLACEMENT), sqd_layout_compare_note_placements);
+
+    // Nothing before FirstPage moved, so the sweep up to the first note that
+    // wants, or went to, FirstPage or later would come out the same.
+    Sorted = g_new(SQD_NOTE *, priv->MaxNoteIndex + 1);
+
+    for (Kept = 0; Kept < priv->MaxNoteIndex; Kept++)
     {
-        // Figure out where the Actors should be located.
-        // In the future the width will depend on if notes are present or not.
-        priv->ActorBox.Start  = priv->Margin;
-        priv->ActorBox.End    = priv->Width - priv->Margin;
-        priv->ActorBox.Top    = priv->DescriptionBox.Bottom;
-        priv->ActorBox.Bottom = priv->Height - priv->Margin;
+        Place = &Placements[Kept];
 
-        // Call a subroutine to layout the Actors.
-        priv->SeqBox.Top = sqd_layout_arrange_actors(sb);
+        if( (Place->Page >= FirstPage) || (Place->Note->Page >= FirstPage) )
+            break;
 
-        // Init the rest of the event box.
-        // In the future the width will depend on if notes are present or not.
-        priv->SeqBox.Start  = priv->Margin;
-        priv->SeqBox.End    = priv->Width - priv->Margin;
-        priv->SeqBox.Bottom = priv->ActorBox.Bottom;
+        Sorted[Kept] = Place->Note;
+    }
 
-        // Layout the events
-        sqd_layout_arrange_events(sb);
+    // Sweep down the sorted notes keeping track of the first free spot in each column.
+    sqd_layout_resume_note_columns(sb, Sorted, Kept, ColumnTops, &PageIndex);
 
-        // Layout the actor regions
-        sqd_layout_arrange_aregions(sb);
+    g_free(Sorted);
 
-        // Layout the box regions
-        sqd_layout_arrange_bregions(sb);
+    for (i = Kept; i < priv->MaxNoteIndex; i++)
+    {
+        Place = &Placements[i];
+
+        if( Place->Page > PageIndex )
+        {
+            PageIndex = Place->Page;
+            sqd_layout_reset_note_columns(sb, ColumnTops, PageIndex);
+        }
+
+        // Notes pushed off their own page just continue the columns, and
+        // general notes take the first free spot; their Top only sorted 
+        // them in behind the note before.
+        if( (Place->Page == PageIndex) && (Place->Note->ReferenceType != NOTE_REFTYPE_NONE) )
+            NoteTop = Place->Top;
+        else
+            NoteTop = 0;
+
+        Column = sqd_layout_pick_note_column(sb, ColumnTops, NoteTop, Place->Start);
+
+        sqd_layout_place_note(sb, Place->Note, Column, &PageIndex, ColumnTops, NoteTop);
     }
 
+    g_free(ColumnTops);
+    g_free(Placements);
 }
 
-static void
-sqd_layout_draw_text( SQDLayout *sb, SQD_TXT *Text, double Width )
+// Measure the notes and place the ones from FirstPage on, 0 places them all.
+static double
+sqd_layout_arrange_notes( SQDLayout *sb, guint FirstPage )
 {
 	SQDLayoutPrivate *priv;
-    PangoLayout *layout;
-    PangoFontDescription *desc;
-    int pwidth, pheight;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Create a PangoLayout, set the font and text 
-    layout = pango_cairo_create_layout (priv->cr);
-  
-    if( Width )
-    {
-        pango_layout_set_width (layout, (Width * PANGO_SCALE));
-        pango_layout_set_wrap (layout, PANGO_WRAP_WORD);
-    }
+    sqd_layout_measure_notes(sb);
 
-    desc = pango_font_description_from_string( priv->FontStr );
-    pango_layout_set_font_description (layout, desc);
-    pango_font_description_free (desc);
+    if( priv->NotePlacement == NOTE_PLACEMENT_ALIGNED )
+        sqd_layout_align_notes(sb, FirstPage);
+    else
+        sqd_layout_stack_notes(sb, FirstPage);
 
-    pango_layout_set_markup (layout, Text->Str, -1);
+    return 0;
+}
 
-    pango_cairo_show_layout (priv->cr, layout);
 
-    // free the layout object 
-    g_object_unref (layout);
-}
 
+// Lay out the events of a single layer relative to a layer top of zero.  
+// Only reads the shared layout state, so layers can be arranged concurrently
+// as long as each caller supplies its own pango context.
 static void
-sqd_layout_draw_actors( SQDLayout *sb )
+sqd_layout_arrange_layer( SQDLayout *sb, SQD_EVENT_LAYER *Layer, PangoContext *Context )
 {
 	SQDLayoutPrivate *priv;
-    SQD_ACTOR *Actor;
-    int i;
-    double ActorWidth;
-    double ActorTextWidth;
-    double dashes[] = {1.0,  /* ink */
-                       2.0,  /* skip */
-                      };
-    int    ndash  = sizeof (dashes)/sizeof(dashes[0]);
-    double offset = 2.0;
+    GList           *Element;
+    SQD_EVENT       *Event;
+    SQD_ACTOR       *StartActor, *EndActor;
+    SQD_BOX_REGION  *BReg;
+    gchar           *FontStr;
+    gboolean         Remeasure;
+    double EventTop;
+    double EventMaxTextWidth;
+    double ColumnWidth;
+    double SummaryHeight;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    ActorWidth = (priv->ActorBox.End - priv->ActorBox.Start) / (priv->MaxActorIndex + 1.0);
-    ActorTextWidth = (ActorWidth *2.0)/3.0;
+    // Events are positioned relative to the top of the layer.
+    EventTop = 0;
+
+    Layer->Height  = 0;
+    Layer->TimePad = 0;
 
-    // Draw each actor
-    for (i = 0; i <= priv->MaxActorIndex; i++)
+    // Layout each seperate event in this layer
+    Element = g_list_first(Layer->Events);
+    while( Element )
     {
-        Actor = g_ptr_array_index(priv->Actors, i);
+        Event = Element->data;
 
-        // Setup the actor presentation parameters
-        sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
+        // Collapsed events sit at the top of the layer and take no room.
+        if( Event->Hidden )
+        {
+            Event->Height = 0;
 
-        // Draw the Text bounding box.
-        cairo_set_source_rgba(priv->cr, priv->FillColor.Red, priv->FillColor.Green, priv->FillColor.Blue, priv->FillColor.Alpha);
+            Event->EventBox.Top    = Event->EventBox.Bottom = EventTop;
+            Event->StemBox.Top     = Event->StemBox.Bottom  = EventTop;
+            Event->UpperTextBox.Top = Event->UpperTextBox.Bottom = EventTop;
+            Event->LowerTextBox.Top = Event->LowerTextBox.Bottom = EventTop;
 
-        cairo_rectangle(priv->cr, Actor->NameBox.Start, Actor->NameBox.Top, 
-                            (Actor->NameBox.End - Actor->NameBox.Start),
-                            (Actor->NameBox.Bottom - Actor->NameBox.Top));
+            Element = g_list_next(Element);
+            continue;
+        }
 
-        cairo_fill (priv->cr);
+        // Setup the parameters
+        FontStr = sqd_layout_get_event_font(sb, Event->hdr.ClassStr);
 
+        // Only text that changed needs to be measured again.
+        Remeasure = (priv->LayoutDirty || Event->hdr.Dirty);
 
-        // Draw the Actor Title
-        // Center it over the Stem
-        cairo_set_source_rgba(priv->cr, priv->TextColor.Red, priv->TextColor.Green, priv->TextColor.Blue, priv->TextColor.Alpha);
+        Event->Height = 0;
 
-        cairo_move_to (priv->cr, 
-                       ((Actor->StemBox.Start + priv->LineWidth) - (Actor->Name.Width / 2.0)),
-                       (Actor->NameBox.Top + priv->TextPad));
+        // Calculate the arrow length so that available space for text layout can be calculated.
+        switch ( Event->ArrowDir )
+        {
+            case ARROWDIR_EXTERNAL_TO:
+            case ARROWDIR_EXTERNAL_FROM:
 
-        sqd_layout_draw_text( sb, &Actor->Name, ActorTextWidth );
+                StartActor = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
 
-    
-        // Draw the Baseline
-        cairo_set_source_rgba(priv->cr, priv->LineColor.Red, priv->LineColor.Green, priv->LineColor.Blue, priv->LineColor.Alpha);
+                if( Event->ArrowDir == ARROWDIR_EXTERNAL_FROM )
+                {
+                    Event->StemBox.Start   = priv->ActorBox.Start;
+                    Event->StemBox.End     = StartActor->StemBox.Start; // - (priv->LineWidth/2.0);
+                }
+                else
+                {
+                    Event->StemBox.End   = StartActor->StemBox.Start - (priv->LineWidth/2.0);
+                    Event->StemBox.Start = priv->ActorBox.Start;
+                }
 
-        cairo_move_to (priv->cr, Actor->BaselineBox.Start, Actor->BaselineBox.Top + (priv->LineWidth/2.0));
-        cairo_line_to (priv->cr, Actor->BaselineBox.End, Actor->BaselineBox.Top + (priv->LineWidth/2.0));
+                Event->EventBox.Top    = EventTop;
+                Event->EventBox.Start  = Event->StemBox.Start;
+                Event->EventBox.End    = Event->StemBox.End;
 
-        cairo_stroke (priv->cr);
+                EventMaxTextWidth = ((Event->StemBox.End - Event->StemBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
 
+                if( Event->UpperText.Str )
+                {
+                    if( Remeasure )
+                    {
+                        sqd_layout_measure_text_in_context(Context, FontStr, &Event->UpperText, EventMaxTextWidth, priv->PdfMetrics);
 
-        // Draw the Stem
-        cairo_set_source_rgba(priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
-        //cairo_set_dash (priv->cr, dashes, ndash, offset);
+                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+                    }
 
-        cairo_move_to (priv->cr, Actor->StemBox.Start + (priv->LineWidth/2.0), Actor->StemBox.Top);
-        cairo_line_to (priv->cr, Actor->StemBox.Start + (priv->LineWidth/2.0), Actor->StemBox.Bottom);
+                    if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
+                        Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
+                    else
+                        Event->Height += priv->MinEventPad;
 
-        cairo_stroke (priv->cr);
+                    Event->UpperTextBox.Top     = (Event->EventBox.Top + Event->Height) - priv->TextPad - Event->UpperText.Height;
+                    Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
+                    Event->UpperTextBox.Start   = priv->ActorBox.Start; // Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->UpperText.Width/2.0);
+                    Event->UpperTextBox.End     = Event->UpperTextBox.Start + Event->UpperText.Width;
+                }
+                else
+                {
+                    Event->Height += priv->MinEventPad;
+                }
 
-        // Back to default rendering settings
-        sqd_layout_use_default_presentation(sb);
-    }
+                // Layout the rest of the boxes for the event.
+                Event->StemBox.Top     = Event->EventBox.Top + Event->Height;
+                Event->StemBox.Bottom  = Event->StemBox.Top + priv->LineWidth;
 
-}
+                Event->Height += priv->LineWidth;
+                Event->Height += priv->MinEventPad;
 
-static void
-sqd_layout_draw_events( SQDLayout *sb )
-{
-	SQDLayoutPrivate *priv;
-    GList            *Element;
-    SQD_EVENT_LAYER  *Layer;
-    SQD_EVENT        *Event;
-    int i;
+                // Update the EventBox Bottom
+                Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+                // The layer height is the maximum height of any event.
+                if( Layer->Height < Event->Height )
+                    Layer->Height = Event->Height;
 
-    // Cycle through the event layers in sequencial order to layout each one.
-    for (i = 0; i < priv->MaxEventIndex; i++)
-    {
-        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+            break;
 
-        // Layout each seperate event in this layer
-        Element = g_list_first(Layer->Events);
-        while( Element )
-        {
-            Event = Element->data;
+            case ARROWDIR_STEP:
 
-            // Setup the parameters
-            sqd_layout_use_event_presentation(sb, Event->hdr.ClassStr);
+                // Step events live inside their actor's column.
+                StartActor  = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
+                ColumnWidth = StartActor->BoundsBox.End - StartActor->BoundsBox.Start;
 
-            // Calculate the arrow length so that available space for text layout can be calculated.
-            switch ( Event->ArrowDir )
-            {
-                case ARROWDIR_EXTERNAL_TO:
+                EventMaxTextWidth =  (3.0*(ColumnWidth/4.0)) - (2 * priv->TextPad);
 
-                    cairo_set_source_rgba( priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
+                if( Event->UpperText.Str )
+                {
+                    if( Remeasure )
+                    {
+                        sqd_layout_measure_text_in_context(Context, FontStr, &Event->UpperText, EventMaxTextWidth, priv->PdfMetrics);
 
-                    // Draw the Stem
-                    cairo_move_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
+                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+                    }
 
-                    cairo_stroke (priv->cr);
+                    if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
+                        Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
+                    else
+                        Event->Height += priv->MinEventPad;
+                }
+                else
+                {
+                    Event->Height += priv->MinEventPad + 20;
+                }
 
-                    cairo_move_to (priv->cr, Event->StemBox.End - priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) - (priv->ArrowWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End - priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) + (priv->ArrowWidth/2.0));
+                Event->Height += priv->LineWidth;
 
-                    cairo_stroke (priv->cr);
-                break;
+                Event->StemBox.Start   = StartActor->StemBox.Start + (priv->LineWidth*2);
+                Event->StemBox.End     = StartActor->StemBox.Start + ColumnWidth/4.0;
+                
+                Event->EventBox.Top    = EventTop;
+                Event->EventBox.Start  = Event->StemBox.Start;
+                Event->EventBox.End    = Event->StemBox.End + Event->UpperText.Width + (2*priv->TextPad);
 
-                case ARROWDIR_EXTERNAL_FROM:
+                EventMaxTextWidth = ((Event->EventBox.End - Event->EventBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
 
-                    cairo_set_source_rgba( priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
+                // Layout the rest of the boxes for the event.
+                Event->StemBox.Top     = Event->EventBox.Top + priv->LineWidth;
+                Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
+                Event->StemBox.Bottom  = Event->EventBox.Bottom - priv->LineWidth;
 
-                    // Draw the Stem
-                    cairo_move_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
+                if( Event->UpperText.Str )
+                {
+                    Event->UpperTextBox.Top     = (Event->EventBox.Top + (Event->Height/2.0)) - (Event->UpperText.Height/2.0);
+                    Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
+                    Event->UpperTextBox.Start   = Event->StemBox.End + priv->TextPad;
+                    Event->UpperTextBox.End     = Event->EventBox.End;
+                }
+ 
+                // The layer height is the maximum height of any event.
+                if( Layer->Height < Event->Height )
+                    Layer->Height = Event->Height;
 
-                    cairo_stroke (priv->cr);
+            break;
 
-                    cairo_move_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) - (priv->ArrowWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) + (priv->ArrowWidth/2.0));
+            case ARROWDIR_LEFT_TO_RIGHT:
+            case ARROWDIR_RIGHT_TO_LEFT:
 
-                    cairo_stroke (priv->cr);
-                break;
+                StartActor = g_ptr_array_index(priv->Actors, Event->StartActorIndx);
+                EndActor   = g_ptr_array_index(priv->Actors, Event->EndActorIndx);
 
-                case ARROWDIR_STEP:
+                if( Event->ArrowDir == ARROWDIR_LEFT_TO_RIGHT )
+                {
+                    Event->StemBox.Start   = StartActor->StemBox.Start + (priv->LineWidth/2.0);
+                    Event->StemBox.End     = EndActor->StemBox.Start - (priv->LineWidth/2.0);
+                }
+                else
+                {
+                    Event->StemBox.Start   = EndActor->StemBox.Start + (priv->LineWidth*3.0/2.0);
+                    Event->StemBox.End     = StartActor->StemBox.Start;
+                }
 
-                    cairo_set_source_rgba( priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
-                  
-                    // Draw the Stem
-                    cairo_move_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to(priv->cr, (Event->StemBox.Start + Event->StemBox.End)/2.0, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_curve_to(priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0), 
-                                             Event->StemBox.End, Event->StemBox.Bottom - (priv->LineWidth/2.0),
-                                             (Event->StemBox.Start + Event->StemBox.End)/2.0, Event->StemBox.Bottom - (priv->LineWidth/2.0));
-                    cairo_line_to(priv->cr, Event->StemBox.Start, Event->StemBox.Bottom - (priv->LineWidth/2.0));
+                Event->EventBox.Top    = EventTop;
+                Event->EventBox.Start  = Event->StemBox.Start;
+                Event->EventBox.End    = Event->StemBox.End;
 
-                    cairo_stroke (priv->cr);
+                EventMaxTextWidth = ((Event->StemBox.End - Event->StemBox.Start) - ((2 * priv->TextPad) - (2 * priv->ArrowLength)));
 
-                    cairo_move_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Bottom - (priv->LineWidth/2.0) - (priv->ArrowWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start, Event->StemBox.Bottom - (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Bottom - (priv->LineWidth/2.0) + (priv->ArrowWidth/2.0));
+                if( Event->UpperText.Str )
+                {
+                    if( Remeasure )
+                    {
+                        sqd_layout_measure_text_in_context(Context, FontStr, &Event->UpperText, EventMaxTextWidth, priv->PdfMetrics);
 
-                    cairo_stroke (priv->cr);
-                break;
+                        printf("Pango Event Upper Extents: %g %g\n", Event->UpperText.Width, Event->UpperText.Height); 
+                    }
 
-                case ARROWDIR_LEFT_TO_RIGHT:
+                    if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
+                        Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
+                    else
+                        Event->Height += priv->MinEventPad;
 
-                    cairo_set_source_rgba( priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
+                    Event->UpperTextBox.Top     = (Event->EventBox.Top + Event->Height) - priv->TextPad - Event->UpperText.Height;
+                    Event->UpperTextBox.Bottom  = Event->UpperTextBox.Top + Event->UpperText.Height;
+                    Event->UpperTextBox.Start   = Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->UpperText.Width/2.0);
+                    Event->UpperTextBox.End     = Event->UpperTextBox.Start + Event->UpperText.Width;
+                }
+                else
+                {
+                    Event->Height += priv->MinEventPad;
+                }
 
-                    // Draw the Stem
-                    cairo_move_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
+                // Layout the rest of the boxes for the event.
+                Event->StemBox.Top     = Event->EventBox.Top + Event->Height;
+                Event->StemBox.Bottom  = Event->StemBox.Top + priv->LineWidth;
 
-                    cairo_stroke (priv->cr);
+                Event->Height += priv->LineWidth;
 
-                    cairo_move_to (priv->cr, Event->StemBox.End - priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) - (priv->ArrowWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End - priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) + (priv->ArrowWidth/2.0));
+                if( Event->LowerText.Str )
+                {
+                    if( Remeasure )
+                    {
+                        sqd_layout_measure_text_in_context(Context, FontStr, &Event->LowerText, EventMaxTextWidth, priv->PdfMetrics);
 
-                    cairo_stroke (priv->cr);
+                        printf("Pango Event Lower Extents: %g %g\n", Event->LowerText.Width, Event->LowerText.Height); 
+                    }
 
-                break;
+                    if( ((2 * priv->TextPad) + Event->UpperText.Height) > priv->MinEventPad )
+                        Event->Height += (2 * priv->TextPad) + Event->UpperText.Height;
+                    else
+                        Event->Height += priv->MinEventPad;
 
-                case ARROWDIR_RIGHT_TO_LEFT:
+                    Event->LowerTextBox.Top     = Event->StemBox.Bottom + priv->TextPad;  
+                    Event->LowerTextBox.Bottom  = Event->LowerTextBox.Top + Event->LowerText.Height;
+                    Event->LowerTextBox.Start   = Event->StemBox.Start + ((Event->StemBox.End - Event->StemBox.Start)/2.0) - (Event->LowerText.Width/2.0);
+                    Event->LowerTextBox.End     = Event->LowerTextBox.Start + Event->LowerText.Width;
+                }
+                else
+                {
+                    Event->Height += priv->MinEventPad;
+                }
 
-                    cairo_set_source_rgba( priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
+                // Update the EventBox Bottom
+                Event->EventBox.Bottom = Event->EventBox.Top + Event->Height;
 
-                    // Draw the Stem
-                    cairo_move_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.End, Event->StemBox.Top + (priv->LineWidth/2.0));
+                // The layer height is the maximum height of any event.
+                if( Layer->Height < Event->Height )
+                    Layer->Height = Event->Height;
 
-                    cairo_stroke (priv->cr);
+            break;
 
-                    cairo_move_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) - (priv->ArrowWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start, Event->StemBox.Top + (priv->LineWidth/2.0));
-                    cairo_line_to (priv->cr, Event->StemBox.Start + priv->ArrowLength, Event->StemBox.Top + (priv->LineWidth/2.0) + (priv->ArrowWidth/2.0));
+        }
 
-                    cairo_stroke (priv->cr);
+        Event->hdr.Dirty = FALSE;
 
-                break;
+        Element = g_list_next(Element);
+    } // Event Layout Loop
 
-            }
- 
-            cairo_set_source_rgba( priv->cr, priv->TextColor.Red, priv->TextColor.Green, priv->TextColor.Blue, priv->TextColor.Alpha);
+    // Make room for the bands standing in for collapsed regions, stacked 
+    // one below another when more than one starts in this slot.
+    SummaryHeight = 0;
+    for( Element = g_list_first(Layer->Summaries); Element; Element = g_list_next(Element) )
+    {
+        BReg = Element->data;
 
-            if( Event->UpperText.Str )
-            {
-                cairo_move_to (priv->cr, Event->UpperTextBox.Start, Event->UpperTextBox.Top);
+        sqd_layout_measure_text_in_context(Context, priv->FontStr, &BReg->SummaryText, 0, priv->PdfMetrics);
 
-                sqd_layout_draw_text( sb, &Event->UpperText, Event->UpperText.Width );
-            }
-    
-            if( Event->LowerText.Str )
-            {
-                cairo_move_to (priv->cr, Event->LowerTextBox.Start, Event->LowerTextBox.Top);
+        BReg->SummaryOffset = SummaryHeight;
+        SummaryHeight += BReg->SummaryText.Height + (2 * priv->TextPad) + priv->ElementPad;
+    }
 
-                sqd_layout_draw_text( sb, &Event->LowerText, Event->LowerText.Width );
-            }
+    if( SummaryHeight )
+    {
+        sqd_layout_offset_layer_events(Layer, SummaryHeight);
+        Layer->Height += SummaryHeight;
+    }
 
-            // Switch back to the default presentation
-            sqd_layout_use_default_presentation(sb);
-           
-            Element = g_list_next(Element);
-        } // Event Layout Loop
-    } // Event Layer Loop 
+    // Leave a band above the events to mark where some were sampled away.
+    if( Layer->DroppedCnt )
+    {
+        if( Layer->DroppedText.Str == NULL )
+            Layer->DroppedText.Str = g_strdup_printf("\xe2\x8b\xaf %u events omitted \xe2\x8b\xaf", Layer->DroppedCnt);
 
+        sqd_layout_measure_text_in_context(Context, priv->FontStr, &Layer->DroppedText, 0, priv->PdfMetrics);
+
+        sqd_layout_offset_layer_events(Layer, Layer->DroppedText.Height + (2 * priv->TextPad));
+        Layer->Height += Layer->DroppedText.Height + (2 * priv->TextPad);
+    }
+
+    Layer->Dirty = FALSE;
 }
 
+// Move the events of a layer down by Offset within the layer.
 static void
-sqd_layout_draw_aregions( SQDLayout *sb )
+sqd_layout_offset_layer_events( SQD_EVENT_LAYER *Layer, double Offset )
 {
-	SQDLayoutPrivate *priv;
-    SQD_ACTOR_REGION *AReg;
-    int i;
-
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+    GList     *Element;
+    SQD_EVENT *Event;
 
-    // Draw each actor region box
-    for (i = 0; i < priv->ActorRegions->len; i++)
+    Element = g_list_first(Layer->Events);
+    while( Element )
     {
-        AReg = g_ptr_array_index(priv->ActorRegions, i);
+        Event = Element->data;
 
-        // Set the presentation
-        sqd_layout_use_aregion_presentation(sb, AReg->hdr.ClassStr);
+        Event->EventBox.Top    += Offset;
+        Event->EventBox.Bottom += Offset;
+        Event->StemBox.Top     += Offset;
+        Event->StemBox.Bottom  += Offset;
 
-        // Draw the Text bounding box.
-        cairo_set_source_rgba( priv->cr, priv->FillColor.Red, priv->FillColor.Green, priv->FillColor.Blue, priv->FillColor.Alpha );
+        if( Event->UpperText.Str )
+        {
+            Event->UpperTextBox.Top    += Offset;
+            Event->UpperTextBox.Bottom += Offset;
+        }
 
-//        sqd_layout_draw_rounded_rec(sb, AReg->BoundsBox.Start, AReg->BoundsBox.Top, 
-//                            (AReg->BoundsBox.End - AReg->BoundsBox.Start),
-//                            (AReg->BoundsBox.Bottom - AReg->BoundsBox.Top), 10);
+        if( Event->LowerText.Str )
+        {
+            Event->LowerTextBox.Top    += Offset;
+            Event->LowerTextBox.Bottom += Offset;
+        }
 
-        cairo_rectangle(priv->cr, AReg->BoundsBox.Start, AReg->BoundsBox.Top, 
-                            (AReg->BoundsBox.End - AReg->BoundsBox.Start),
-                            (AReg->BoundsBox.Bottom - AReg->BoundsBox.Top));
+        Element = g_list_next(Element);
+    }
+}
 
-        cairo_fill (priv->cr);
+// Move an arranged layer from its relative position to an absolute one.
+static void
+sqd_layout_shift_layer( SQDLayout *sb, SQD_EVENT_LAYER *Layer, double Offset )
+{
+	SQDLayoutPrivate *priv;
 
-        // Back to the defualt presentation
-        sqd_layout_use_default_presentation(sb);
-    }
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
+    Layer->LayerBox.Top    = Offset;
+    Layer->LayerBox.Bottom = Offset + Layer->Height;
+    Layer->LayerBox.Start  = priv->SeqBox.Start;
+    Layer->LayerBox.End    = priv->SeqBox.End;
 }
 
+// Move a layer that is already at an absolute position to a new top.  The 
+// events ride along since they are placed relative to the layer.
 static void
-sqd_layout_draw_bregions( SQDLayout *sb )
+sqd_layout_move_layer( SQDLayout *sb, SQD_EVENT_LAYER *Layer, double Top )
+{
+    Layer->LayerBox.Bottom = Top + (Layer->LayerBox.Bottom - Layer->LayerBox.Top);
+    Layer->LayerBox.Top    = Top;
+}
+
+// Absolute top of the layer an event sits in; add it to the event's boxes.
+static double
+sqd_layout_get_event_layer_top( SQDLayout *sb, SQD_EVENT *Event )
 {
 	SQDLayoutPrivate *priv;
-    SQD_BOX_REGION   *BReg;
-    int i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Draw each box region box
-    for (i = 0; i < priv->BoxRegions->len; i++)
+    return g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Event->hdr.Index).LayerBox.Top;
+}
+
+// Determine how many worker threads to split a job of WorkItems into.
+static guint
+sqd_layout_get_worker_count( SQDLayout *sb, guint WorkItems, guint MinItemsPerWorker )
+{
+	SQDLayoutPrivate *priv;
+    guint WorkerCnt;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->ThreadCnt > 0 )
+        WorkerCnt = priv->ThreadCnt;
+    else
     {
-        BReg = g_ptr_array_index(priv->BoxRegions, i);
+#if GLIB_CHECK_VERSION(2,36,0)
+        WorkerCnt = g_get_num_processors();
+#else
+        WorkerCnt = 1;
+#endif
+    }
 
-        // Set the presentation
-        sqd_layout_use_bregion_presentation(sb, BReg->hdr.ClassStr);
+    // Don't bother with threads for small jobs.
+    if( MinItemsPerWorker && (WorkerCnt > (WorkItems / MinItemsPerWorker)) )
+        WorkerCnt = WorkItems / MinItemsPerWorker;
 
-        // Draw the Text bounding box.
-        cairo_set_source_rgba( priv->cr, priv->FillColor.Red, priv->FillColor.Green, priv->FillColor.Blue, priv->FillColor.Alpha );
+    if( WorkerCnt < 1 )
+        WorkerCnt = 1;
 
-        sqd_layout_draw_rounded_rec(sb, BReg->BoundsBox.Start, BReg->BoundsBox.Top, 
-                            (BReg->BoundsBox.End - BReg->BoundsBox.Start),
-                            (BReg->BoundsBox.Bottom - BReg->BoundsBox.Top), 10);
+    return WorkerCnt;
+}
 
-        //cairo_rectangle(priv->cr, BReg->BoundsBox.Start, BReg->BoundsBox.Top, 
-        //                    (BReg->BoundsBox.End - BReg->BoundsBox.Start),
-        //                    (BReg->BoundsBox.Bottom - BReg->BoundsBox.Top));
+// Run WorkFunc over each of the task records, in parallel when there is more than one.
+// Returns after all of the tasks have completed.
+static void
+sqd_layout_run_workers( SQDLayout *sb, GFunc WorkFunc, gpointer Tasks, gsize TaskSize, guint TaskCnt )
+{
+    GThreadPool *Pool;
+    guint        i;
 
-        cairo_fill (priv->cr);
+    Pool = NULL;
+    if( TaskCnt > 1 )
+        Pool = g_thread_pool_new(WorkFunc, sb, TaskCnt, TRUE, NULL);
 
-        // Back to the defualt presentation
-        sqd_layout_use_default_presentation(sb);
+    // A single task, or no thread support, just runs in the calling thread.
+    if( Pool == NULL )
+    {
+        for( i = 0; i < TaskCnt; i++ )
+            WorkFunc( ((guint8 *)Tasks) + (i * TaskSize), sb );
+        return;
     }
 
-}
+    for( i = 0; i < TaskCnt; i++ )
+        g_thread_pool_push(Pool, ((guint8 *)Tasks) + (i * TaskSize), NULL);
 
+    // Wait for all of the queued tasks to finish.
+    g_thread_pool_free(Pool, FALSE, TRUE);
+}
 
+// Worker for the first arrange pass: lay out a contiguous run of layers
+// and total up their heights.
 static void
-sqd_layout_draw_notes( SQDLayout *sb )
+sqd_layout_arrange_chunk_layers( gpointer data, gpointer user_data )
 {
-	SQDLayoutPrivate *priv;
-    SQD_NOTE *Note;
-    int i;
-    double NoteTextWidth;
+	SQDLayoutPrivate  *priv;
+    SQD_ARRANGE_CHUNK *Chunk = data;
+    SQDLayout         *sb    = user_data;
+    SQD_EVENT_LAYER   *Layer;
+    guint i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    NoteTextWidth = priv->NoteBoxWidth - (2 * priv->TextPad);
+    Chunk->Height = 0;
 
-    // Draw each actor
-    for (i = 0; i < priv->MaxNoteIndex; i++)
+    for( i = Chunk->FirstLayer; i < Chunk->LastLayer; i++ )
     {
-        Note = g_ptr_array_index(priv->Notes, i);
-
-        // Setup the parameters
-        sqd_layout_use_note_presentation(sb, Note->hdr.ClassStr);
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
-        // Draw the Text bounding box.
-        cairo_set_source_rgba( priv->cr, priv->FillColor.Red, priv->FillColor.Green, priv->FillColor.Blue, priv->FillColor.Alpha);
+        sqd_layout_arrange_layer(sb, Layer, Chunk->Context);
 
-        cairo_rectangle(priv->cr, Note->BoundsBox.Start, Note->BoundsBox.Top, 
-                            (Note->BoundsBox.End - Note->BoundsBox.Start),
-                            (Note->BoundsBox.Bottom - Note->BoundsBox.Top));
+        Chunk->Height += Layer->Height;
+    }
+}
 
-        cairo_fill (priv->cr);
+// Worker for the second arrange pass: finish the prefix sum inside the 
+// chunk and move each layer to its absolute position.
+static void
+sqd_layout_shift_chunk_layers( gpointer data, gpointer user_data )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_ARRANGE_CHUNK *Chunk = data;
+    SQDLayout         *sb    = user_data;
+    SQD_EVENT_LAYER   *Layer;
+    double EventTop;
+    guint i;
 
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-        // Draw the Note Text
-        cairo_set_source_rgba( priv->cr, priv->TextColor.Red, priv->TextColor.Green, priv->TextColor.Blue, priv->TextColor.Alpha);
+    EventTop = Chunk->Offset;
 
-        cairo_move_to (priv->cr, (Note->BoundsBox.Start + priv->TextPad), (Note->BoundsBox.Top + priv->TextPad));
+    for( i = Chunk->FirstLayer; i < Chunk->LastLayer; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
-        sqd_layout_draw_text( sb, &Note->Text, NoteTextWidth );
+        sqd_layout_shift_layer(sb, Layer, EventTop);
 
-        // Back to the default parameters
-        sqd_layout_use_default_presentation(sb);     
+        EventTop += Layer->Height;
     }
-
 }
 
+// A pango context on a font map of its own, set up for cr's target and the
+// font options set on cr.  Event text is always measured through one of 
+// these, so a full arrange and an incremental update get the same widths.
+// The context keeps the font map.
+static PangoContext *
+sqd_layout_create_pango_context( cairo_t *cr )
+{
+    PangoFontMap *FontMap;
+    PangoContext *Context;
+    cairo_font_options_t *Options;
+
+    FontMap = pango_cairo_font_map_new();
+    Context = pango_font_map_create_context(FontMap);
+    g_object_unref(FontMap);
 
+    pango_cairo_update_context(cr, Context);
 
-static void
-sqd_layout_draw_note_references( SQDLayout *sb )
+    Options = cairo_font_options_create();
+    cairo_get_font_options(cr, Options);
+    pango_cairo_context_set_font_options(Context, Options);
+    cairo_font_options_destroy(Options);
+
+    return Context;
+}
+
+static int
+sqd_layout_arrange_events( SQDLayout *sb )
 {
-	SQDLayoutPrivate *priv;
-    SQD_NOTE *Note;
-    int i;
-    double dashes[] = {3.0,  /* ink */
-                       4.0,  /* skip */
-                       1.0,  /* ink */
-                       4.0   /* skip*/
-                      };
-    int    ndash  = sizeof (dashes)/sizeof(dashes[0]);
-    double offset = -50.0;
+	SQDLayoutPrivate  *priv;
+    SQD_ARRANGE_CHUNK *Chunks;
+    guint  ChunkCnt;
+    guint  LayersPerChunk;
+    guint  i;
+    double EventTop;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Draw each reference line
-    for (i = 0; i < priv->MaxNoteIndex; i++)
+    // Layers only depend on each other through their running top position, so
+    // split them into contiguous chunks that are laid out in parallel.
+    ChunkCnt = sqd_layout_get_worker_count(sb, priv->MaxEventIndex, SQD_ARRANGE_MIN_LAYERS_PER_WORKER);
+    LayersPerChunk = (priv->MaxEventIndex + ChunkCnt - 1) / ChunkCnt;
+
+    Chunks = g_new0(SQD_ARRANGE_CHUNK, ChunkCnt);
+
+    for( i = 0; i < ChunkCnt; i++ )
     {
-        Note = g_ptr_array_index(priv->Notes, i);
+        Chunks[i].FirstLayer = MIN( (i * LayersPerChunk), priv->MaxEventIndex );
+        Chunks[i].LastLayer  = MIN( ((i + 1) * LayersPerChunk), priv->MaxEventIndex );
 
-        // If this note doesn't have a reference then don't draw one.
-        if( Note->ReferenceType == NOTE_REFTYPE_NONE )
-            continue;
+        // Each worker needs a private font map and context; pango objects can't 
+        // be shared across threads.
+        Chunks[i].Context = sqd_layout_create_pango_context(priv->cr);
+    }
 
-        // Setup the parameters
-        sqd_layout_use_noteref_presentation(sb, Note->hdr.ClassStr);
+    // First pass: relative layout and the height of each chunk.
+    sqd_layout_run_workers(sb, sqd_layout_arrange_chunk_layers, Chunks, sizeof(SQD_ARRANGE_CHUNK), ChunkCnt);
 
-        // Setup to draw the reference line.
-        cairo_set_source_rgba (priv->cr, priv->StemColor.Red, priv->StemColor.Green, priv->StemColor.Blue, priv->StemColor.Alpha);
-        cairo_set_line_cap  (priv->cr, CAIRO_LINE_CAP_ROUND);
-        cairo_set_dash (priv->cr, dashes, ndash, offset);
+    // Prefix sum over the chunk heights to find where each chunk starts.
+    // The Event Box should now contain the space allotted for laying out events. 
+    EventTop = priv->SeqBox.Top;
+    for( i = 0; i < ChunkCnt; i++ )
+    {
+        Chunks[i].Offset = EventTop;
+        EventTop += Chunks[i].Height;
+    }
 
-        cairo_move_to (priv->cr, Note->BoundsBox.Start, Note->BoundsBox.Top);
-        cairo_line_to (priv->cr, Note->RefLastStart, Note->RefLastTop ); 
-        cairo_stroke (priv->cr);
+    // Second pass: shift every layer to its absolute position.
+    sqd_layout_run_workers(sb, sqd_layout_shift_chunk_layers, Chunks, sizeof(SQD_ARRANGE_CHUNK), ChunkCnt);
 
-        // Draw a small circle at the termination of the note reference.
-        cairo_arc(priv->cr, Note->RefLastStart, Note->RefLastTop, 2*priv->LineWidth, 0.0, 2*M_PI );
-        cairo_fill(priv->cr);
+    for( i = 0; i < ChunkCnt; i++ )
+        g_object_unref(Chunks[i].Context);
 
-        // Back to the default parameters
-        sqd_layout_use_default_presentation(sb);     
-    }
+    g_free(Chunks);
 
+    return 0;
 }
 
-static int
-sqd_layout_draw_diagram( SQDLayout *sb )
+// Space the layers out by their event timestamps.  Slots without a time get 
+// one interpolated from the timed slots either side.  One pass down the slots 
+// in order puts each layer at its time, or right below the layer above when 
+// its labels need the room; a gap longer than MaxTimeGap is cut down to a 
+// marked break.  The space a layer is pushed down by stays inside the layer 
+// so that pagination and the incremental path see ordinary layer heights.
+// Returns the first layer that moved, or G_MAXUINT if none did.
+static guint
+sqd_layout_apply_time_axis( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    GList            *Element;
+    double  *Times;
+    gboolean Timed;
+    double   AnchorTop, AnchorTime;
+    double   Cursor;
+    double   WantTop;
+    double   Pad;
+    double   Delta;
+    double   BreakHeight;
+    guint    Known;
+    guint    FirstMoved;
+    guint    i, j;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Start with the default presentation.
-    sqd_layout_use_default_presentation(sb);
+    if( priv->MaxEventIndex == 0 )
+        return G_MAXUINT;
 
-    // Bring line size into account.
-    cairo_set_line_width (priv->cr, priv->LineWidth);
+    Times = g_new(double, priv->MaxEventIndex);
+    Known = G_MAXUINT;
 
-    // Draw a background so that it isn't transparent.
-    cairo_set_source_rgba(priv->cr, priv->BGColor.Red, priv->BGColor.Green, priv->BGColor.Blue, priv->BGColor.Alpha);
+    // A layer happens at the earliest time of its events.  Slots between two 
+    // timed ones are spread evenly, ones before the first or after the last 
+    // take the nearest time so they just stack.
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        Timed = FALSE;
 
-    cairo_rectangle(priv->cr, 0, 0, priv->Width, priv->Height); 
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            Event = Element->data;
 
-    cairo_fill (priv->cr);
+            if( (Event->HasTime == FALSE) || Event->Hidden )
+                continue;
 
-    // Take care of any title bar.
-    if( priv->Title.Str )
-    {
-        // Setup the parameters for the title bar
-        sqd_layout_use_title_presentation(sb);
+            if( (Timed == FALSE) || (Event->Time < Times[i]) )
+                Times[i] = Event->Time;
 
-        priv->TitleBar.Start   = priv->TitleBox.Start;
+            Timed = TRUE;
+        }
 
-        cairo_set_source_rgba(priv->cr, priv->FillColor.Red, priv->FillColor.Green, priv->FillColor.Blue, priv->FillColor.Alpha);
+        if( Timed == FALSE )
+            continue;
 
-        cairo_rectangle(priv->cr, priv->TitleBar.Start, priv->TitleBar.Top, 
-                            (priv->TitleBar.End - priv->TitleBar.Start),
-                            (priv->TitleBar.Bottom - priv->TitleBar.Top));
+        // Time only moves forward down the slots.
+        if( (Known != G_MAXUINT) && (Times[i] < Times[Known]) )
+            Times[i] = Times[Known];
 
-        cairo_fill (priv->cr);
+        if( Known == G_MAXUINT )
+        {
+            for( j = 0; j < i; j++ )
+                Times[j] = Times[i];
+        }
+        else
+        {
+            for( j = Known + 1; j < i; j++ )
+                Times[j] = Times[Known] + ((Times[i] - Times[Known]) * (j - Known)) / (i - Known);
+        }
 
-        cairo_set_source_rgba(priv->cr, priv->TextColor.Red, priv->TextColor.Green, priv->TextColor.Blue, priv->TextColor.Alpha);
+        Known = i;
+    }
 
-        cairo_move_to (priv->cr, (priv->TitleBar.Start + priv->TextPad), (priv->TitleBar.Top + priv->TextPad));
+    if( Known == G_MAXUINT )
+    {
+        g_free(Times);
+        return G_MAXUINT;
+    }
 
-        sqd_layout_draw_text( sb, &priv->Title, (priv->TitleBar.End - priv->TitleBar.Start) );
+    for( j = Known + 1; j < priv->MaxEventIndex; j++ )
+        Times[j] = Times[Known];
 
-        // Back to the default presentation
-        sqd_layout_use_default_presentation(sb);
-    }
+    AnchorTop  = priv->SeqBox.Top;
+    AnchorTime = Times[0];
+    Cursor     = priv->SeqBox.Top;
+    FirstMoved = G_MAXUINT;
 
-    // Determine the amount of space needed for the description block
-    if( priv->Description.Str )
+    for( i = 0; i < priv->MaxEventIndex; i++ )
     {
-        // Setup the parameters for the description region
-        sqd_layout_use_description_presentation(sb);
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
-        cairo_set_source_rgba(priv->cr, priv->TextColor.Red, priv->TextColor.Green, priv->TextColor.Blue, priv->TextColor.Alpha);
+        WantTop = AnchorTop + ((Times[i] - AnchorTime) * priv->TimeScale);
 
-        cairo_move_to (priv->cr, 
-                        (priv->DescriptionBox.Start + priv->TextPad), 
-                        (priv->DescriptionBox.Top + priv->ElementPad + priv->TextPad));
+        Layer->TimeBreak = FALSE;
 
-        sqd_layout_draw_text( sb, &priv->Description, (priv->DescriptionBox.End - priv->DescriptionBox.Start) );
+        if( (WantTop - Cursor) > priv->MaxTimeGap )
+        {
+            // Cut the idle stretch down to a marked break and carry on the 
+            // scale from here.
+            if( Layer->BreakText.Str )
+                g_free(Layer->BreakText.Str);
 
-        // Back to the default presentation
-        sqd_layout_use_default_presentation(sb);
+            Layer->BreakText.Str = g_strdup_printf("\xe2\x8b\xaf %g idle \xe2\x8b\xaf", Times[i] - Times[(i > 0) ? (i - 1) : 0]);
+            sqd_layout_measure_text(sb, &Layer->BreakText, 0);
 
-    }
+            BreakHeight = Layer->BreakText.Height + (2 * priv->TextPad);
 
-    sqd_layout_draw_actors(sb);
+            Layer->TimeBreak = TRUE;
 
-    sqd_layout_draw_events(sb);
+            WantTop    = Cursor + BreakHeight;
+            AnchorTop  = WantTop;
+            AnchorTime = Times[i];
+        }
 
-    sqd_layout_draw_notes(sb);
+        Pad = MAX(WantTop - Cursor, 0);
 
-    sqd_layout_draw_aregions(sb);
+        // Take the old padding out and put the new one in.
+        Delta = Pad - Layer->TimePad;
 
-    sqd_layout_draw_bregions(sb);
+        if( (Delta != 0) || (Layer->LayerBox.Top != Cursor) )
+        {
+            if( FirstMoved == G_MAXUINT )
+                FirstMoved = i;
 
-    sqd_layout_draw_note_references(sb);
+            sqd_layout_offset_layer_events(Layer, Delta);
+        }
 
-}
+        Layer->Height          = (Layer->Height - Layer->TimePad) + Pad;
+        Layer->TimePad         = Pad;
+        Layer->LayerBox.Top    = Cursor;
+        Layer->LayerBox.Bottom = Cursor + Layer->Height;
 
-///////////////////////
-// Interface functions
-///////////////////////
-SQDLayout*
-sqd_layout_new (void)
-{
-	return g_object_new (G_TYPE_SQD_LAYOUT, NULL);
+        Cursor = Layer->LayerBox.Bottom;
+    }
+
+    g_free(Times);
+
+    return FirstMoved;
 }
 
-// Set the base URL for the Hudson instance.
-gboolean
-sqd_layout_set_name( SQDLayout *sb, gchar *NameStr )
+// Arrange only the dirty layers and slide the layers below them by the change
+// in height.  Returns the first layer that moved, or G_MAXUINT if none did.
+static guint
+sqd_layout_update_events( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    PangoContext     *Context;
+    guint  FirstMoved;
+    guint  i;
+    double EventTop;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    if(priv->Title.Str)
-        g_free(priv->Title.Str);
+    if( priv->DirtyFirstLayer >= priv->MaxEventIndex )
+        return G_MAXUINT;
 
-    priv->Title.Str = g_strdup(NameStr);
+    FirstMoved = priv->DirtyFirstLayer;
 
-    return FALSE;
-}
+    Context = sqd_layout_create_pango_context(priv->cr);
 
-gboolean
-sqd_layout_set_description( SQDLayout *sb, gchar *DescStr )
-{
-	SQDLayoutPrivate *priv;
+    if( FirstMoved == 0 )
+        EventTop = priv->SeqBox.Top;
+    else
+        EventTop = g_array_index(priv->EventLayers, SQD_EVENT_LAYER, FirstMoved - 1).LayerBox.Bottom;
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+    for( i = FirstMoved; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
 
-    if(priv->Description.Str)
-        g_free(priv->Description.Str);
+        if( Layer->Dirty )
+        {
+            sqd_layout_arrange_layer(sb, Layer, Context);
+            sqd_layout_shift_layer(sb, Layer, EventTop);
+        }
+        else if( Layer->LayerBox.Top != EventTop )
+        {
+            sqd_layout_move_layer(sb, Layer, EventTop);
+        }
+        else if( i > priv->DirtyLastLayer )
+        {
+            // Past the last edit and back in place, the rest of the layers are unchanged.
+            break;
+        }
 
-    priv->Description.Str = g_strdup(DescStr);
+        EventTop += Layer->Height;
+    }
 
-    return FALSE;
+    g_object_unref(Context);
+
+    return FirstMoved;
 }
 
-static gboolean
-sqd_layout_add_event_common( SQDLayout *sb, SQD_EVENT *Event)
+static void 
+sqd_layout_get_event_point( SQDLayout *sb, SQD_OBJ *RefObj, int RefType, double *Top, double *Start )
 {
 	SQDLayoutPrivate *priv;
-    SQD_EVENT_LAYER  *Layer;
-    guint32          TmpMask, i;
+    GList           *Element;
+    SQD_EVENT_LAYER *Layer;
+    SQD_EVENT       *Event;
+    int i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    printf("Event Common: %d, %s\n", Event->hdr.Index, Event->hdr.IdStr);
-
-    // Add this object to the ID hash table.
-    g_hash_table_insert( priv->IdTable, Event->hdr.IdStr, Event );
+    // default the point
+    *Top   = 0;
+    *Start = 0;
 
-    if( priv->EventLayers->len < (Event->hdr.Index + 1) )
-    {
-        g_array_set_size(priv->EventLayers, (Event->hdr.Index + 1));
-    }
-    Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Event->hdr.Index);
+    // Validate the event
+    Event = (SQD_EVENT *)RefObj; 
 
-    Layer->EventCnt += 1;
+    // Make sure we found it.
+    if( (Event == NULL) || (Event->hdr.Type != SDOBJ_EVENT) )
+        return;
 
-    switch ( Event->ArrowDir )
+    switch( RefType )
     {
-        // External events need to be in a layer by themselves.
-        case ARROWDIR_EXTERNAL_TO:
-            if( Layer->EventCnt > 1 )
-            {
-                g_error("External events must be in there own slot.");
-                return TRUE;
-            }
-            Layer->ExternalLayer = TRUE;
-        break;
-
-        // External events need to be in a layer by themselves.
-        case ARROWDIR_EXTERNAL_FROM:
-            if( Layer->EventCnt > 1 )
-            {
-                g_error("External events must be in there own slot.");
-                return TRUE;
-            }
-            Layer->ExternalLayer = TRUE;
-        break;
+            // Reference a specific event.
+            case NOTE_REFTYPE_EVENT_START: 
+                switch ( Event->ArrowDir )
+                {
+                    case ARROWDIR_STEP:
+                        *Top   = Event->StemBox.Top;
+                        *Start = Event->StemBox.Start;
+                    break;
 
-        case ARROWDIR_STEP:
-            if( (Layer->EventCnt > 1) && (Layer->StepLayer == FALSE) )
-            {
-                g_error("Step events can only share a slot with other step events.");
-                return TRUE;
-            }
-            Layer->StepLayer = TRUE;
-            TmpMask = 0x1 << (Event->StartActorIndx + 1);
-        break;
+                    case ARROWDIR_EXTERNAL_TO:
+                    case ARROWDIR_LEFT_TO_RIGHT:
+                        *Top   = Event->StemBox.Top;
+                        *Start = Event->StemBox.Start;
+                    break;
 
-        case ARROWDIR_LEFT_TO_RIGHT:
-            if( (Layer->EventCnt > 1) && (Layer->RegularLayer == FALSE) )
-            {
-                g_error("Regular events can only share a slot with other regular events.");
-                return TRUE;
-            }
-            Layer->RegularLayer = TRUE;
+                    case ARROWDIR_EXTERNAL_FROM:
+                    case ARROWDIR_RIGHT_TO_LEFT:
+                        *Top   = Event->StemBox.Top;
+                        *Start = Event->StemBox.End;
+                    break;
+                }
+            break;
+  
+            case NOTE_REFTYPE_EVENT_MIDDLE:  
+                if( Event->ArrowDir == ARROWDIR_STEP )
+                {
+                    // Point to the end of the text in this case, and the center vertically
+                    *Top   = (Event->EventBox.Top + Event->EventBox.Bottom)/2.0;
+                    *Start = Event->EventBox.End + (2.0*priv->LineWidth);                    
+                }
+                else
+                {
+                    // Find the center point of the arrow
+                    *Top   = Event->StemBox.Top;
+                    *Start = ((Event->StemBox.End - Event->StemBox.Start)/2.0) + Event->StemBox.Start;
+                }
+            break;
 
-            TmpMask = 0;
-            for(i = Event->StartActorIndx; i <= Event->EndActorIndx; i++)
-                TmpMask |= 0x1 << (i + 1);
-        break;
+            case NOTE_REFTYPE_EVENT_END: 
+                switch ( Event->ArrowDir )
+                {
+                    case ARROWDIR_STEP:
+                        *Top   = Event->StemBox.Bottom;
+                        *Start = Event->StemBox.Start;
+                    break;
 
-        case ARROWDIR_RIGHT_TO_LEFT:
-            if( (Layer->EventCnt > 1) && (Layer->RegularLayer == FALSE) )
-            {
-                g_error("Regular events can only share a slot with other regular events.");
-                return TRUE;
-            }
-            Layer->RegularLayer = TRUE;
-            TmpMask = 0;
-            for(i = Event->EndActorIndx; i <= Event->StartActorIndx; i++)
-                TmpMask |= 0x1 << (i + 1);
-        break;
-    }
+                    case ARROWDIR_EXTERNAL_TO:
+                    case ARROWDIR_LEFT_TO_RIGHT:
+                        // Get a point at the baseline and stem intersection.
+                        *Top   = Event->StemBox.Top;
+                        *Start = Event->StemBox.End;
+                    break;
 
-    printf("Event Layer Masks: %d, 0x%x 0x%x\n", Event->hdr.Index, Layer->UsedMask, TmpMask);
+                    case ARROWDIR_EXTERNAL_FROM:
+                    case ARROWDIR_RIGHT_TO_LEFT:
+                        // Get a point at the baseline and stem intersection.
+                        *Top   = Event->StemBox.Top;
+                        *Start = Event->StemBox.Start;
+                    break;
+                }
+            break;
+    } // Ref Type switch
+
+    *Top += sqd_layout_get_event_layer_top(sb, Event);
+}
+
+static gboolean
+sqd_layout_arrange_aregion( SQDLayout *sb, SQD_ACTOR_REGION *AReg )
+{
+	SQDLayoutPrivate *priv;
+    double STop, ETop;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    STop = sqd_layout_get_event_layer_top(sb, AReg->SEventRef);
+    ETop = sqd_layout_get_event_layer_top(sb, AReg->EEventRef);
 
-    if( Layer->UsedMask & TmpMask )
+    if( (STop + AReg->SEventRef->StemBox.Top) >= (ETop + AReg->EEventRef->StemBox.Bottom) )
     {
-        printf("ERROR: Event Collision\n");
-        exit(-1);
+        g_error("The start event must proceed the end event in an actor region. (failing id '%s'", AReg->hdr.IdStr);
+        return TRUE;
     }
 
-    Layer->UsedMask |= TmpMask;
+    AReg->BoundsBox.Top    = STop + (AReg->SEventRef->StemBox.Top + AReg->SEventRef->StemBox.Bottom)/2.0;
+    AReg->BoundsBox.Bottom = ETop + (AReg->EEventRef->StemBox.Top + AReg->EEventRef->StemBox.Bottom)/2.0;
 
-    printf("0x%x\n", Layer->Events);
+    AReg->BoundsBox.Start  = AReg->ActorRef->StemBox.Start + (priv->LineWidth/2.0) - (2.0*priv->LineWidth);
+    AReg->BoundsBox.End    = AReg->ActorRef->StemBox.Start + (priv->LineWidth/2.0) + (2.0*priv->LineWidth);
 
-    Layer->Events = g_list_append(Layer->Events, Event);
+    debug_box_print("ARegion Box", &AReg->BoundsBox);
+
+    AReg->hdr.Dirty = FALSE;
 
+    return FALSE;
 }
 
-gboolean
-sqd_layout_add_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *StartActorId, gchar *EndActorId, char *TopLabel, char *BottomLabel)
+static gboolean
+sqd_layout_arrange_aregions( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    SQD_EVENT        *TmpEvent;
-    SQD_EVENT_LAYER  *Layer;
-    guint32          TmpMask, i;
-    SQD_ACTOR        *SAPtr;
-    SQD_ACTOR        *EAPtr;
+    SQD_ACTOR_REGION *AReg;
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+    int i;
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
-    {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
-    }
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Lookup the start actor
-    SAPtr = g_hash_table_lookup(priv->IdTable, StartActorId);
-    g_print("Start Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
-    if( SAPtr == NULL )
-    {
-        g_error("Couldn't find start actor with id \"%s\".\n", StartActorId);
-        return TRUE;
-    }
-    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+    // Determine the bounding boxes for each actor region.
+    for (i = 0; i < priv->ActorRegions->len; i++)
     {
-        g_error("Object with id \"%s\" is not of the required actor type.\n", StartActorId);
-        return TRUE;
-    }
+        AReg = g_ptr_array_index(priv->ActorRegions, i);
 
-    // Lookup the end actor
-    EAPtr = g_hash_table_lookup(priv->IdTable, EndActorId);
-    g_print("End Actor Lookup: 0x%x, %d, %d, %s\n", EAPtr, EAPtr->hdr.Index, EAPtr->hdr.Type, EAPtr->hdr.IdStr); 
-    if( EAPtr == NULL )
-    {
-        g_error("Couldn't find end actor with id \"%s\".\n", EndActorId);
-        return TRUE;
-    }
-    if( EAPtr->hdr.Type != SDOBJ_ACTOR )
-    {
-        g_error("Object with id \"%s\" is not of the required actor type.\n", EndActorId);
-        return TRUE;
-    }
+        // Setup the parameters
+        sqd_layout_use_aregion_presentation(sb, AReg->hdr.ClassStr);
 
-    TmpEvent = malloc( sizeof(SQD_EVENT) );
+        if( sqd_layout_arrange_aregion(sb, AReg) )
+            return TRUE;
 
-    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb);
 
-    TmpEvent->hdr.Index         = SlotIndex;
-    TmpEvent->hdr.Type          = SDOBJ_EVENT;
-    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
-    TmpEvent->hdr.ClassStr      = ClassStr ? g_strdup(ClassStr):NULL;
+    }
 
-    if( TmpEvent->hdr.Index >= priv->MaxEventIndex )
-        priv->MaxEventIndex = TmpEvent->hdr.Index+1;
+    return FALSE;
+}
 
-    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
-    TmpEvent->EndActorIndx      = EAPtr->hdr.Index;
+static void 
+sqd_layout_get_aregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR_REGION *AReg;
 
-    if( TmpEvent->StartActorIndx < TmpEvent->EndActorIndx )
-        TmpEvent->ArrowDir = ARROWDIR_LEFT_TO_RIGHT;
-    else 
-        TmpEvent->ArrowDir = ARROWDIR_RIGHT_TO_LEFT;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    if( TopLabel )
-        TmpEvent->UpperText.Str  = strdup(TopLabel);
+    // default the point
+    *Top   = 0;
+    *Start = 0;
 
-    if( BottomLabel )
-        TmpEvent->LowerText.Str  = strdup(BottomLabel);
+    // Look up the actor element
+    AReg = (SQD_ACTOR_REGION *)RefObj;
 
-    sqd_layout_add_event_common( sb, TmpEvent);
+    if( (AReg == NULL) || (AReg->hdr.Type != SDOBJ_AREGION) )
+        return;
 
+    // Get a point at the baseline and stem intersection.
+    *Top   = AReg->BoundsBox.Top + (5.0*priv->LineWidth);
+    *Start = AReg->BoundsBox.End;
 }
 
-gboolean
-sqd_layout_add_step_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *ActorId, gchar *Label)
+static gboolean
+sqd_layout_arrange_bregion( SQDLayout *sb, SQD_BOX_REGION *BReg )
 {
 	SQDLayoutPrivate *priv;
-    SQD_EVENT        *TmpEvent;
     SQD_EVENT_LAYER  *Layer;
-    guint32          TmpMask, i;
-    SQD_ACTOR        *SAPtr;
-    SQD_ACTOR        *EAPtr;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    // A collapsed region is just its summary band at the top of its first slot, 
+    // below the bands of any collapsed regions listed ahead of it there.
+    if( BReg->Collapsed )
     {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, BReg->SEventRef->hdr.Index);
+
+        BReg->BoundsBox.Top = Layer->LayerBox.Top + Layer->TimePad;
+        if( Layer->DroppedCnt )
+            BReg->BoundsBox.Top += Layer->DroppedText.Height + (2 * priv->TextPad);
+        BReg->BoundsBox.Top += BReg->SummaryOffset;
+
+        BReg->BoundsBox.Bottom = BReg->BoundsBox.Top + BReg->SummaryText.Height + (2 * priv->TextPad);
+        BReg->BoundsBox.Start  = MIN(BReg->SActorRef->BoundsBox.Start, BReg->EActorRef->BoundsBox.Start);
+        BReg->BoundsBox.End    = MAX(BReg->SActorRef->BoundsBox.End, BReg->EActorRef->BoundsBox.End);
+
+        debug_box_print("BRegion Box", &BReg->BoundsBox);
+
+        BReg->hdr.Dirty = FALSE;
+
+        return FALSE;
     }
 
-    // Lookup the actor
-    SAPtr = g_hash_table_lookup(priv->IdTable, ActorId);
-    g_print("Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
-    if( SAPtr == NULL )
+    BReg->BoundsBox.Top    = sqd_layout_get_event_layer_top(sb, BReg->SEventRef) + BReg->SEventRef->EventBox.Top;
+    BReg->BoundsBox.Bottom = sqd_layout_get_event_layer_top(sb, BReg->EEventRef) + BReg->EEventRef->EventBox.Bottom;
+
+    if( BReg->BoundsBox.Top >= BReg->BoundsBox.Bottom )
     {
-        g_error("Couldn't find start actor with id \"%s\".\n", ActorId);
+        g_error("The start event must proceed the end event in a box region. (failing id '%s'", BReg->hdr.IdStr);
         return TRUE;
     }
-    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+
+    if( BReg->SActorRef->BoundsBox.Top >= BReg->EActorRef->BoundsBox.Bottom )
     {
-        g_error("Object with id \"%s\" is not of the required actor type.\n", ActorId);
+        g_error("The start actor must be to the right of the end actor in a box region. (failing id '%s'", BReg->hdr.IdStr);
         return TRUE;
     }
 
-    TmpEvent = malloc( sizeof(SQD_EVENT) );
+    BReg->BoundsBox.Start  = BReg->SActorRef->BoundsBox.Start;
+    BReg->BoundsBox.End    = BReg->EActorRef->BoundsBox.End;
 
-    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+    if( BReg->Label.Str )
+        sqd_layout_measure_text(sb, &BReg->Label, 0);
 
-    TmpEvent->hdr.Index         = SlotIndex;
-    TmpEvent->hdr.Type          = SDOBJ_EVENT;
-    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
-    TmpEvent->hdr.ClassStr      = ClassStr ? g_strdup(ClassStr):NULL;
+    debug_box_print("BRegion Box", &BReg->BoundsBox);
 
-    if( TmpEvent->hdr.Index >= priv->MaxEventIndex )
-        priv->MaxEventIndex = TmpEvent->hdr.Index+1;
+    BReg->hdr.Dirty = FALSE;
 
-    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
-    TmpEvent->EndActorIndx      = 0;
-    
-    TmpEvent->ArrowDir          = ARROWDIR_STEP;
+    return FALSE;
+}
 
-    if( Label )
-        TmpEvent->UpperText.Str  = strdup(Label);
+// Check whether a box region's class asks for it to be drawn collapsed.
+static gboolean
+sqd_layout_bregion_is_collapsed( SQDLayout *sb, SQD_BOX_REGION *BReg )
+{
+    gchar *TmpStr;
 
-    sqd_layout_add_event_common( sb, TmpEvent);
+    TmpStr = sqd_layout_get_pparam(sb, "box-region.collapsed", BReg->hdr.ClassStr);
+    if( TmpStr == NULL )
+        return FALSE;
 
+    return ( (g_ascii_strcasecmp(TmpStr, "true") == 0) || (g_ascii_strcasecmp(TmpStr, "yes") == 0) || (strcmp(TmpStr, "1") == 0) );
 }
 
-gboolean
-sqd_layout_add_external_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *ActorId, gchar *Label, gboolean FromFlag )
+// Hide the events inside collapsed box regions.  Hidden events take no room 
+// and aren't drawn; the first slot of each collapsed region carries a summary 
+// band in their place.  Only events between the region's actors are hidden, 
+// anything else in those slots is still drawn.
+static void
+sqd_layout_apply_collapsed_regions( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    SQD_EVENT        *TmpEvent;
     SQD_EVENT_LAYER  *Layer;
-    guint32          TmpMask, i;
-    SQD_ACTOR        *SAPtr;
-    SQD_ACTOR        *EAPtr;
+    SQD_EVENT        *Event;
+    SQD_BOX_REGION   *BReg;
+    GList            *Element;
+    guint  FirstActor, LastActor;
+    guint  HiddenCnt;
+    guint  i, j;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    // Start from everything shown.
+    for( i = 0; i < priv->MaxEventIndex; i++ )
     {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
-    }
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        g_list_free(Layer->Summaries);
+        Layer->Summaries = NULL;
 
-    // Lookup the actor
-    SAPtr = g_hash_table_lookup(priv->IdTable, ActorId);
-    g_print("Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
-    if( SAPtr == NULL )
-    {
-        g_error("Couldn't find start actor with id \"%s\".\n", ActorId);
-        return TRUE;
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            Event = Element->data;
+            Event->Hidden = FALSE;
+        }
     }
-    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+
+    for( i = 0; i < priv->BoxRegions->len; i++ )
     {
-        g_error("Object with id \"%s\" is not of the required actor type.\n", ActorId);
-        return TRUE;
-    }
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
 
-    TmpEvent = malloc( sizeof(SQD_EVENT) );
+        BReg->Collapsed = sqd_layout_bregion_is_collapsed(sb, BReg);
+        if( BReg->Collapsed == FALSE )
+            continue;
 
-    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+        FirstActor = MIN(BReg->SActorRef->hdr.Index, BReg->EActorRef->hdr.Index);
+        LastActor  = MAX(BReg->SActorRef->hdr.Index, BReg->EActorRef->hdr.Index);
+        HiddenCnt  = 0;
 
-    TmpEvent->hdr.Index         = SlotIndex;
-    TmpEvent->hdr.Type          = SDOBJ_EVENT;
-    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
-    TmpEvent->hdr.ClassStr      = ClassStr ? g_strdup(ClassStr):NULL;
+        for( j = BReg->SEventRef->hdr.Index; j <= BReg->EEventRef->hdr.Index; j++ )
+        {
+            Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, j);
 
-    if( TmpEvent->hdr.Index >= priv->MaxEventIndex )
-        priv->MaxEventIndex = TmpEvent->hdr.Index+1;
+            for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+            {
+                Event = Element->data;
 
-    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
-    TmpEvent->EndActorIndx      = 0;
-    
-    if( FromFlag )
-        TmpEvent->ArrowDir = ARROWDIR_EXTERNAL_FROM;
+                if( (Event->StartActorIndx < FirstActor) || (Event->StartActorIndx > LastActor) )
+                    continue;
+
+                if( ((Event->ArrowDir == ARROWDIR_LEFT_TO_RIGHT) || (Event->ArrowDir == ARROWDIR_RIGHT_TO_LEFT)) 
+                    && ((Event->EndActorIndx < FirstActor) || (Event->EndActorIndx > LastActor)) )
+                    continue;
+
+                Event->Hidden = TRUE;
+                HiddenCnt += 1;
+            }
+
+            Layer->Dirty = TRUE;
+        }
+
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, BReg->SEventRef->hdr.Index);
+        Layer->Summaries = g_list_append(Layer->Summaries, BReg);
+
+        if( BReg->SummaryText.Str )
+            g_free(BReg->SummaryText.Str);
+
+        BReg->SummaryText.Str = g_strdup_printf("%s \xc2\xb7 %u events", BReg->Label.Str ? BReg->Label.Str : BReg->hdr.IdStr, HiddenCnt);
+    }
+}
+
+static gboolean
+sqd_layout_arrange_bregions( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX_REGION   *BReg;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Determine the bounding boxes for each actor region.
+    for (i = 0; i < priv->BoxRegions->len; i++)
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+
+        // Setup the parameters
+        sqd_layout_use_bregion_presentation(sb, BReg->hdr.ClassStr);
+
+        if( sqd_layout_arrange_bregion(sb, BReg) )
+            return TRUE;
+
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb);
+
+    }
+
+    return 0;
+}
+
+static void 
+sqd_layout_get_bregion_point( SQDLayout *sb, SQD_OBJ *RefObj, double *Top, double *Start )
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX_REGION   *BReg;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // default the point
+    *Top   = 0;
+    *Start = 0;
+
+    // Look up the actor element
+    BReg = (SQD_BOX_REGION *)RefObj;
+
+    if( (BReg == NULL) || (BReg->hdr.Type != SDOBJ_BREGION) )
+        return;
+
+    // Get a point at the baseline and stem intersection.
+    *Top   = BReg->BoundsBox.Top + (3.0 * priv->LineWidth);
+    *Start = BReg->BoundsBox.End - (3.0 * priv->LineWidth);
+}
+
+// The point a note's reference line ends at, in arranged coordinates.
+static void
+sqd_layout_get_note_reference_point( SQDLayout *sb, SQD_NOTE *Note, double *Top, double *Start )
+{
+    // default the point
+    *Top   = 0;
+    *Start = 0;
+
+    switch( Note->ReferenceType )
+    {
+        // Just a general note that doesn't reference a specific diagram feature.
+        case NOTE_REFTYPE_NONE:          
+        break;
+
+        // References the a specific Actor.
+        case NOTE_REFTYPE_ACTOR: 
+            sqd_layout_get_actor_point( sb, Note->RefObj, Top, Start );
+        break;
+
+        // Reference a specific event.
+        case NOTE_REFTYPE_EVENT_START:   
+        case NOTE_REFTYPE_EVENT_MIDDLE:  
+        case NOTE_REFTYPE_EVENT_END:     
+            sqd_layout_get_event_point( sb, Note->RefObj, Note->ReferenceType, Top, Start );
+        break;
+       
+        // Reference to a Vertical Span of events.
+        case NOTE_REFTYPE_VSPAN:         
+            sqd_layout_get_aregion_point( sb, Note->RefObj, Top, Start );
+        break;
+
+        // Group events into a box. Reference to the box.
+        case NOTE_REFTYPE_BOXSPAN:       
+            sqd_layout_get_bregion_point( sb, Note->RefObj, Top, Start );
+        break;
+    } // Ref Type switch
+}
+
+// Push a channel track onto the heap of tracks ordered by where they come free.
+static void
+sqd_layout_push_route_track( GArray *Heap, SQD_ROUTE_TRACK *Track )
+{
+    SQD_ROUTE_TRACK *Tracks;
+    SQD_ROUTE_TRACK  Tmp;
+    guint i, Parent;
+
+    g_array_append_val(Heap, *Track);
+    Tracks = (SQD_ROUTE_TRACK *)Heap->data;
+
+    for( i = Heap->len - 1; i > 0; i = Parent )
+    {
+        Parent = (i - 1) / 2;
+
+        if( Tracks[Parent].Bottom <= Tracks[i].Bottom )
+            break;
+
+        Tmp            = Tracks[Parent];
+        Tracks[Parent] = Tracks[i];
+        Tracks[i]      = Tmp;
+    }
+}
+
+// Take the track that comes free first off the heap.
+static void
+sqd_layout_pop_route_track( GArray *Heap, SQD_ROUTE_TRACK *Track )
+{
+    SQD_ROUTE_TRACK *Tracks;
+    SQD_ROUTE_TRACK  Tmp;
+    guint i, Child;
+
+    Tracks = (SQD_ROUTE_TRACK *)Heap->data;
+
+    *Track    = Tracks[0];
+    Tracks[0] = Tracks[Heap->len - 1];
+    g_array_set_size(Heap, Heap->len - 1);
+
+    for( i = 0; (Child = (2 * i) + 1) < Heap->len; i = Child )
+    {
+        if( ((Child + 1) < Heap->len) && (Tracks[Child + 1].Bottom < Tracks[Child].Bottom) )
+            Child += 1;
+
+        if( Tracks[i].Bottom <= Tracks[Child].Bottom )
+            break;
+
+        Tmp           = Tracks[Child];
+        Tracks[Child] = Tracks[i];
+        Tracks[i]     = Tmp;
+    }
+}
+
+static gint
+sqd_layout_compare_note_routes( gconstpointer a, gconstpointer b )
+{
+    const SQD_NOTE_ROUTE *RouteA = a;
+    const SQD_NOTE_ROUTE *RouteB = b;
+
+    if( RouteA->Note->Page != RouteB->Note->Page )
+        return (RouteA->Note->Page < RouteB->Note->Page) ? -1 : 1;
+
+    if( RouteA->Note->Column != RouteB->Note->Column )
+        return (RouteA->Note->Column < RouteB->Note->Column) ? -1 : 1;
+
+    if( RouteA->Top != RouteB->Top )
+        return (RouteA->Top < RouteB->Top) ? -1 : 1;
+
+    return (gint)RouteA->Note->hdr.Index - (gint)RouteB->Note->hdr.Index;
+}
+
+// Find a height for the horizontal run of a reference line that doesn't pass 
+// through any event.  The run starts level with the reference point and moves 
+// up to the top of whatever is in the way, which is the gap above that layer.
+static double
+sqd_layout_find_route_lane( SQDLayout *sb, SQD_SPATIAL_INDEX *Index, SQD_NOTE *Note, double ChannelEdge, double LaneLimit, GPtrArray *Hits )
+{
+	SQDLayoutPrivate *priv;
+    SQD_INDEX_ENTRY  *Entry;
+    SQD_BOX           QueryBox;
+    double LaneTop, BlockTop;
+    guint  Step, i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    LaneTop = Note->RefLastTop;
+
+    for( Step = 0; Step < SQD_NOTE_ROUTE_MAX_STEPS; Step++ )
+    {
+        QueryBox.Start  = MIN(Note->RefLastStart, ChannelEdge);
+        QueryBox.End    = MAX(Note->RefLastStart, ChannelEdge);
+        QueryBox.Top    = LaneTop;
+        QueryBox.Bottom = LaneTop;
+
+        g_ptr_array_set_size(Hits, 0);
+        sqd_layout_search_spatial_index(Index, &QueryBox, Hits);
+
+        // Only events block the run, the stems and regions have to be crossed anyway.
+        BlockTop = LaneTop;
+        for( i = 0; i < Hits->len; i++ )
+        {
+            Entry = g_ptr_array_index(Hits, i);
+
+            if( Entry->Obj->Type != SDOBJ_EVENT )
+                continue;
+
+            // Running along the edge between two layers is fine.
+            if( (LaneTop <= (Entry->Box.Top + priv->LineWidth)) || (LaneTop >= (Entry->Box.Bottom - priv->LineWidth)) )
+                continue;
+
+            BlockTop = MIN(BlockTop, Entry->Box.Top);
+        }
+
+        if( BlockTop == LaneTop )
+            break;
+
+        LaneTop = BlockTop;
+    }
+
+    return MAX(LaneTop, LaneLimit);
+}
+
+// Route the note reference lines around the diagram with horizontal and 
+// vertical runs.  Each line leaves the note into the gutter between the 
+// notes column and the actors, runs along a channel track in the gutter, 
+// crosses to the reference in a gap between event layers and drops onto 
+// the reference point.  The gutter tracks are handed out by sweeping the 
+// vertical runs top to bottom and reusing the track that came free first.
+static void
+sqd_layout_route_note_references( SQDLayout *sb, guint FirstPage )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_SPATIAL_INDEX *Index;
+    SQD_NOTE_ROUTE    *Routes;
+    SQD_NOTE_ROUTE    *Route;
+    SQD_NOTE          *Note;
+    SQD_PAGE          *Page;
+    SQD_ROUTE_TRACK    Track;
+    GPtrArray *Hits;
+    GArray    *Heap;
+    double     LaneLimit;
+    double     TrackGap;
+    guint      RouteCnt;
+    gint       TrackCnt;
+    gint       MaxTracks;
+    double     Space;
+    guint      GroupPage;
+    guint      GroupColumn;
+    guint      i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->SpatialIndexValid == FALSE )
+        sqd_layout_build_spatial_index(sb);
+
+    Routes   = g_new(SQD_NOTE_ROUTE, priv->MaxNoteIndex + 1);
+    Hits     = g_ptr_array_new();
+    Heap     = g_array_new(FALSE, FALSE, sizeof (SQD_ROUTE_TRACK));
+    RouteCnt = 0;
+
+    // Pick the lane for each horizontal run.
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        // Tracks are shared per page, earlier pages are routed already.
+        if( (Note->ReferenceType == NOTE_REFTYPE_NONE) || (Note->Page < FirstPage) )
+            continue;
+
+        Route = &Routes[RouteCnt];
+        RouteCnt += 1;
+
+        Route->Note = Note;
+
+        // Leave the note from the side facing its reference.
+        if( Note->BoundsBox.Start >= Note->RefLastStart )
+        {
+            Route->Side         = -1;
+            Note->RefFirstStart = Note->BoundsBox.Start;
+        }
+        else
+        {
+            Route->Side         = 1;
+            Note->RefFirstStart = Note->BoundsBox.End;
+        }
+
+        Page  = &g_array_index(priv->Pages, SQD_PAGE, Note->Page);
+        Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, Note->Page);
+
+        // Actor references sit in the header, above any event.
+        if( (Note->ReferenceType == NOTE_REFTYPE_ACTOR) || Note->RefOffPage )
+            Note->RefLaneTop = Note->RefLastTop;
+        else
+        {
+            LaneLimit        = Page->SeqBox.Top;
+            Note->RefLaneTop = sqd_layout_find_route_lane(sb, Index, Note, Note->RefFirstStart, LaneLimit, Hits);
+        }
+
+        Route->Top    = MIN(Note->RefFirstTop, Note->RefLaneTop);
+        Route->Bottom = MAX(Note->RefFirstTop, Note->RefLaneTop);
+    }
+
+    qsort(Routes, RouteCnt, sizeof(SQD_NOTE_ROUTE), sqd_layout_compare_note_routes);
+
+    // Keep the tracks a few line widths apart in the space beside the column.
+    Space     = priv->ElementPad + sqd_layout_get_route_gutter(sb);
+    MaxTracks = (gint)floor(Space / (SQD_NOTE_ROUTE_TRACK_SPACING * MAX(priv->LineWidth, 1.0))) - 1;
+    MaxTracks = MAX( 1, MaxTracks );
+    TrackGap  = Space / (MaxTracks + 1);
+
+    // Sweep down each notes column on each page.
+    GroupPage   = G_MAXUINT;
+    GroupColumn = G_MAXUINT;
+    TrackCnt    = 0;
+
+    for (i = 0; i < RouteCnt; i++)
+    {
+        Route = &Routes[i];
+        Note  = Route->Note;
+
+        if( (Note->Page != GroupPage) || (Note->Column != GroupColumn) )
+        {
+            GroupPage   = Note->Page;
+            GroupColumn = Note->Column;
+            TrackCnt    = 0;
+            g_array_set_size(Heap, 0);
+        }
+
+        // Reuse the track that came free first, or open a new one.  When the 
+        // gutter is full the earliest free track gets shared.
+        if( Heap->len && ((g_array_index(Heap, SQD_ROUTE_TRACK, 0).Bottom + TrackGap) < Route->Top) )
+        {
+            sqd_layout_pop_route_track(Heap, &Track);
+        }
+        else if( TrackCnt < MaxTracks )
+        {
+            Track.Index  = TrackCnt;
+            Track.Bottom = Route->Bottom;
+            TrackCnt += 1;
+        }
+        else
+        {
+            sqd_layout_pop_route_track(Heap, &Track);
+        }
+
+        Track.Bottom = MAX(Track.Bottom, Route->Bottom);
+        sqd_layout_push_route_track(Heap, &Track);
+
+        Note->RefChannelStart = Note->RefFirstStart + (Route->Side * (double)(Track.Index + 1) * TrackGap);
+    }
+
+    g_array_free(Heap, TRUE);
+    g_ptr_array_free(Hits, TRUE);
+    g_free(Routes);
+}
+
+// Lay out the reference lines of the notes placed on FirstPage or later.
+static double
+sqd_layout_arrange_notes_references( SQDLayout *sb, guint FirstPage )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
+    SQD_PAGE *Page;
+    int i;
+    double NoteTop;
+    double NoteTextWidth;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // The Note Box should now contain the space allocated for Note columns. 
+    NoteTop   = priv->NoteBox.Top + priv->ElementPad;
+    NoteTextWidth = priv->NoteBoxWidth - (2 * priv->TextPad);
+
+    // Determine the height of the Note text.
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        if( Note->Page < FirstPage )
+            continue;
+
+        // Setup the parameters
+        sqd_layout_use_noteref_presentation(sb, Note->hdr.ClassStr);
+
+        // Start the arrow at the note, on the side facing the actors.
+        Note->RefFirstTop   = Note->BoundsBox.Top;
+        Note->RefFirstStart = Note->BoundsBox.Start;
+
+        if( Note->BoundsBox.End <= priv->ActorBox.Start )
+            Note->RefFirstStart = Note->BoundsBox.End;
+
+        sqd_layout_get_note_reference_point( sb, Note, &Note->RefLastTop, &Note->RefLastStart );
+
+        // Move the reference point onto the note's page.
+        Page = &g_array_index(priv->Pages, SQD_PAGE, Note->Page);
+        Note->RefOffPage = FALSE;
+
+        if( Note->ReferenceType == NOTE_REFTYPE_ACTOR )
+        {
+            Note->RefLastTop -= Page->HeaderShift;
+        }
+        else if( Note->ReferenceType != NOTE_REFTYPE_NONE )
+        {
+            if( sqd_layout_get_object_page(sb, Note->RefObj) == Note->Page )
+            {
+                Note->RefLastTop -= Page->LayerShift;
+            }
+            else
+            {
+                // The note overflowed onto a later page; point off the top of the event area.
+                Note->RefLastTop = Page->SeqBox.Top;
+                Note->RefOffPage = TRUE;
+            }
+        }
+
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb);
+
+    } // Note Loop
+
+    if( priv->NoteRouting == NOTE_ROUTING_ORTHOGONAL )
+        sqd_layout_route_note_references(sb, FirstPage);
+}
+
+// Size the page width from the actor count and leave the height open 
+// so that the whole diagram is arranged onto a single page.
+static void
+sqd_layout_begin_fit_content( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->VariableColumns )
+    {
+        sqd_layout_solve_actor_columns(sb);
+        priv->Width = (2 * priv->Margin) + priv->ColumnExtent;
+    }
     else
-        TmpEvent->ArrowDir = ARROWDIR_EXTERNAL_TO;
+        priv->Width = (2 * priv->Margin) + ((priv->MaxActorIndex + 1) * priv->FitActorWidth);
+
+    if( priv->Notes->len )
+        priv->Width += sqd_layout_get_note_columns_width(sb, priv->NoteColumnsLeft + priv->NoteColumnsRight);
+
+    priv->Height = SQD_FIT_CONTENT_MAX_HEIGHT;
+}
+
+// Pull a box in so it doesn't reach past Limit on any side.
+static void
+sqd_layout_clamp_box( SQD_BOX *Box, SQD_BOX *Limit )
+{
+    Box->Start  = CLAMP(Box->Start, Limit->Start, Limit->End);
+    Box->End    = CLAMP(Box->End, Limit->Start, Limit->End);
+    Box->Top    = CLAMP(Box->Top, Limit->Top, Limit->Bottom);
+    Box->Bottom = CLAMP(Box->Bottom, Limit->Top, Limit->Bottom);
+}
+
+// Shrink the page height down to the arranged content and pull in 
+// everything that was laid out against the bottom of the page.
+static void
+sqd_layout_end_fit_content( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_ACTOR        *Actor;
+    SQD_NOTE         *Note;
+    SQD_PAGE         *Page;
+    SQD_ACTOR_REGION *AReg;
+    SQD_BOX_REGION   *BReg;
+    double ContentBottom;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    ContentBottom = priv->SeqBox.Top;
+
+    if( priv->MaxEventIndex )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, priv->MaxEventIndex - 1);
+        ContentBottom = Layer->LayerBox.Bottom;
+    }
+
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        if( Note->BoundsBox.Bottom > ContentBottom )
+            ContentBottom = Note->BoundsBox.Bottom;
+    }
+
+    priv->Height = ceil(ContentBottom + priv->ElementPad + priv->Margin);
+
+    priv->ActorBox.Bottom = priv->Height - priv->Margin;
+    priv->SeqBox.Bottom   = priv->ActorBox.Bottom;
+    priv->NoteBox.Bottom  = priv->Height - priv->Margin;
+
+    for (i = 0; i <= priv->MaxActorIndex; i++)
+    {
+        Actor = g_ptr_array_index(priv->Actors, i);
+
+        Actor->BoundsBox.Bottom = priv->ActorBox.Bottom;
+        Actor->StemBox.Bottom   = priv->ActorBox.Bottom - priv->ElementPad;
+    }
+
+    // Keep the region boxes inside the trimmed content area.
+    for (i = 0; i < priv->ActorRegions->len; i++)
+    {
+        AReg = g_ptr_array_index(priv->ActorRegions, i);
+        sqd_layout_clamp_box(&AReg->BoundsBox, &priv->SeqBox);
+    }
+
+    for (i = 0; i < priv->BoxRegions->len; i++)
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+        sqd_layout_clamp_box(&BReg->BoundsBox, &priv->SeqBox);
+    }
+
+    // The open height means everything landed on one page.
+    for (i = 0; i < priv->Pages->len; i++)
+    {
+        Page = &g_array_index(priv->Pages, SQD_PAGE, i);
+        Page->SeqBox.Bottom = priv->SeqBox.Bottom;
+    }
+    // The stems got shorter, so any index built while routing is out of date.
+    priv->SpatialIndexValid = FALSE;
+}
+
+// Forget about any pending changes once the layout reflects them.
+static void
+sqd_layout_clear_dirty( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->LayoutDirty     = FALSE;
+    priv->NotesDirty      = FALSE;
+    priv->RegionsDirty    = FALSE;
+    priv->DirtyFirstLayer = G_MAXUINT;
+    priv->DirtyLastLayer  = 0;
+
+    priv->ArrangedSurfaceType = cairo_surface_get_type(priv->surface);
+}
+
+// The page a note would like to go on.  General notes follow the nearest 
+// note before them that has a reference.
+static guint
+sqd_layout_get_note_want_page( SQDLayout *sb, guint NoteIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    for( i = NoteIndex + 1; i > 0; i-- )
+    {
+        Note = g_ptr_array_index(priv->Notes, i - 1);
+
+        if( Note->ReferenceType != NOTE_REFTYPE_NONE )
+            return sqd_layout_get_object_page(sb, Note->RefObj);
+    }
+
+    return 0;
+}
+
+// Update an arranged diagram for edits to events, notes and regions.  The 
+// header, actors and page geometry are reused from the last full arrange.
+static int
+sqd_layout_rearrange_diagram( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR_REGION *AReg;
+    SQD_BOX_REGION   *BReg;
+    SQD_NOTE         *Note;
+    guint FirstMoved;
+    guint FirstPage;
+    guint DirtyPage;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Open the page back up so the content can grow.
+    if( priv->FitContent )
+    {
+        priv->Height = SQD_FIT_CONTENT_MAX_HEIGHT;
+
+        priv->ActorBox.Bottom = priv->Height - priv->Margin;
+        priv->SeqBox.Bottom   = priv->ActorBox.Bottom;
+        priv->NoteBox.Bottom  = priv->Height - priv->Margin;
+
+        for (i = 0; i < priv->Pages->len; i++)
+            g_array_index(priv->Pages, SQD_PAGE, i).SeqBox.Bottom = priv->SeqBox.Bottom;
+    }
+
+    FirstMoved = sqd_layout_update_events(sb);
+
+    // A changed layer can shift the times of the ones around it.
+    if( priv->TimeScale > 0 )
+        FirstMoved = MIN(FirstMoved, sqd_layout_apply_time_axis(sb));
+
+    // Page breaks depend on where the layers ended up.  Start again from the
+    // page the first moved layer was on, or the one before when the layer
+    // opened its page, as it might fit at the bottom of that one now.
+    FirstPage = G_MAXUINT;
+
+    if( FirstMoved != G_MAXUINT )
+    {
+        FirstPage = sqd_layout_get_layer_page(sb, FirstMoved);
+
+        if( (FirstPage > 0) && (g_array_index(priv->Pages, SQD_PAGE, FirstPage).FirstLayer >= FirstMoved) )
+            FirstPage -= 1;
+
+        sqd_layout_paginate(sb, FirstPage);
+    }
+
+    // Only regions that were added or that hang off a moved layer need updating.
+    if( (FirstMoved != G_MAXUINT) || priv->RegionsDirty )
+    {
+        for (i = 0; i < priv->ActorRegions->len; i++)
+        {
+            AReg = g_ptr_array_index(priv->ActorRegions, i);
+
+            if( AReg->hdr.Dirty || (AReg->SEventRef->hdr.Index >= FirstMoved) || (AReg->EEventRef->hdr.Index >= FirstMoved) )
+            {
+                if( sqd_layout_arrange_aregion(sb, AReg) )
+                    return TRUE;
+
+                // Notes on the region have to be placed again.
+                FirstPage = MIN(FirstPage, sqd_layout_get_object_page(sb, &AReg->hdr));
+            }
+        }
+
+        for (i = 0; i < priv->BoxRegions->len; i++)
+        {
+            BReg = g_ptr_array_index(priv->BoxRegions, i);
+
+            if( BReg->hdr.Dirty || (BReg->SEventRef->hdr.Index >= FirstMoved) || (BReg->EEventRef->hdr.Index >= FirstMoved) )
+            {
+                if( sqd_layout_arrange_bregion(sb, BReg) )
+                    return TRUE;
+
+                FirstPage = MIN(FirstPage, sqd_layout_get_object_page(sb, &BReg->hdr));
+            }
+        }
+    }
+
+    // A changed note frees up its old spot and wants the one by its reference.
+    // A change to the placement options moves every note.
+    if( priv->NotesDirty )
+    {
+        DirtyPage = G_MAXUINT;
+
+        for (i = 0; i < priv->MaxNoteIndex; i++)
+        {
+            Note = g_ptr_array_index(priv->Notes, i);
+
+            if( Note->hdr.Dirty == FALSE )
+                continue;
+
+            if( Note->Page != G_MAXUINT )
+                DirtyPage = MIN(DirtyPage, Note->Page);
+
+            DirtyPage = MIN(DirtyPage, sqd_layout_get_note_want_page(sb, i));
+        }
+
+        FirstPage = MIN(FirstPage, (DirtyPage == G_MAXUINT) ? 0 : DirtyPage);
+    }
+
+    // Notes follow their references across pages, so place them again from 
+    // the first page that changed; only changed note text gets measured.
+    if( priv->Notes->len && (FirstPage != G_MAXUINT) )
+    {
+        sqd_layout_arrange_notes(sb, FirstPage);
+        sqd_layout_arrange_notes_references(sb, FirstPage);
+    }
+
+    if( priv->FitContent )
+        sqd_layout_end_fit_content(sb);
+
+    sqd_layout_clear_dirty(sb);
+
+    return 0;
+}
+
+static int
+sqd_layout_arrange_diagram( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    gboolean PdfMetrics;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // The native pdf writer shows text in the standard fonts, so it has to 
+    // be measured in them; switching in or out of that needs a full arrange.
+    PdfMetrics = (priv->NativePdf && (cairo_surface_get_type(priv->surface) == CAIRO_SURFACE_TYPE_PDF));
+    if( PdfMetrics != priv->PdfMetrics )
+    {
+        priv->PdfMetrics  = PdfMetrics;
+        priv->LayoutDirty = TRUE;
+    }
+
+    // Nothing changed since the last arrange for this kind of surface, the
+    // arrangement and its spatial index can be reused as they are.
+    if( (priv->LayoutDirty == FALSE) && (priv->ArrangedSurfaceType == cairo_surface_get_type(priv->surface))
+        && (priv->DirtyFirstLayer == G_MAXUINT) && (priv->RegionsDirty == FALSE) && (priv->NotesDirty == FALSE) )
+        return 0;
+
+    // The boxes are about to move, the index gets rebuilt when it is next 
+    // needed; routing the note references may need it during the arrange.
+    priv->SpatialIndexValid = FALSE;
+
+    // Text metrics differ between surface types, so a new kind of 
+    // output needs a full arrange.
+    if( (priv->LayoutDirty == FALSE) && (priv->ArrangedSurfaceType == cairo_surface_get_type(priv->surface)) )
+        return sqd_layout_rearrange_diagram(sb);
+
+    // Fold repeated slots before anything is measured.
+    if( priv->FoldRepeats && (priv->RepeatsFolded == FALSE) )
+    {
+        sqd_layout_fold_repeats(sb);
+        priv->RepeatsFolded = TRUE;
+    }
+
+    // Cut over-sized traces down to the event budget.
+    if( priv->MaxEvents && (priv->EventsSampled == FALSE) )
+    {
+        sqd_layout_sample_events(sb);
+        priv->EventsSampled = TRUE;
+    }
+
+    // Pick the actor order before anything is placed.  The order holds 
+    // until another actor or event comes along.
+    if( priv->ReorderActors && (priv->ActorsReordered == FALSE) )
+    {
+        sqd_layout_reorder_actors(sb);
+        priv->ActorsReordered = TRUE;
+    }
+
+    // Work out which events collapsed regions leave out.
+    sqd_layout_apply_collapsed_regions(sb);
+
+    // Column widths depend on the current text, solve them again.
+    priv->ColumnsSolved = FALSE;
+
+    // Content sized pages get their dimensions from the layout itself.
+    if( priv->FitContent )
+        sqd_layout_begin_fit_content(sb);
+
+    // Start with the default presentation.
+    sqd_layout_use_default_presentation(sb);
+
+    // Start as if there isn't a title.
+    priv->TitleBox.Start   = priv->Margin;
+    priv->TitleBox.End     = priv->Width - priv->Margin;
+    priv->TitleBox.Top     = priv->Margin;
+    priv->TitleBox.Bottom  = priv->Margin;
+
+    // Determine the amount of space needed for the title
+    if( priv->Title.Str )
+    {
+        // Setup the parameters for the title bar
+        sqd_layout_use_title_presentation(sb);
+
+        priv->TitleBar.Start   = priv->TitleBox.Start;
+        priv->TitleBar.End     = priv->TitleBox.End;
+        priv->TitleBar.Top     = priv->TitleBox.Top + priv->ElementPad;
+
+        sqd_layout_measure_text(sb, &priv->Title, (priv->TitleBar.End - priv->TitleBar.Start - (2 * priv->TextPad)));
+
+
+        priv->TitleBar.Bottom  = priv->TitleBar.Top + priv->Title.Height + (2 * priv->TextPad);
+        priv->TitleBox.Bottom  = priv->TitleBar.Bottom + priv->ElementPad;
+
+        printf("Pango Title Extents: %g %g\n", priv->Title.Width, priv->Title.Height); 
+        debug_box_print("TitleBar", &priv->TitleBar);
+        debug_box_print("TitleBox", &priv->TitleBox);
+
+        // Restore defaults
+        sqd_layout_use_default_presentation(sb);
+
+    }
+
+    // Default to not having a Description
+    priv->DescriptionBox.Start   = priv->Margin;
+    priv->DescriptionBox.End     = priv->Width - priv->Margin;
+    priv->DescriptionBox.Top     = priv->TitleBox.Bottom;
+    priv->DescriptionBox.Bottom  = priv->TitleBox.Bottom;
+
+    // Determine the amount of space needed for the description block
+    if( priv->Description.Str )
+    {
+        // Setup the parameters for the title bar
+        sqd_layout_use_description_presentation(sb);
+
+        sqd_layout_measure_text(sb, &priv->Description, (priv->DescriptionBox.End - priv->DescriptionBox.Start - (2 * priv->TextPad)));
+
+        priv->DescriptionBox.Bottom  = priv->TitleBox.Bottom + priv->Description.Height + (2 * priv->ElementPad) + (2 * priv->TextPad);
+
+        printf("Pango Description Extents: %g %g\n", priv->Description.Width,priv->Description.Height);  
+        debug_box_print("DescriptionBox", &priv->DescriptionBox);
+
+        // Restore default presentation
+        sqd_layout_use_default_presentation(sb);
+    }
+
+    // Determine if a notes column is needed.
+    if( priv->Notes->len )
+    {
+        // Add the note columns down the sides of the page, the actors 
+        // get the space left between them.
+        sqd_layout_arrange_note_columns(sb);
+
+        // Figure out where the Actors should be located.
+        priv->ActorBox.Top    = priv->DescriptionBox.Bottom;
+        priv->ActorBox.Bottom = priv->Height - priv->Margin;
+
+        // Call a subroutine to layout the Actors.
+        priv->SeqBox.Top = sqd_layout_arrange_actors(sb);
+
+        // Init the rest of the event box.
+        priv->SeqBox.Start  = priv->ActorBox.Start;
+        priv->SeqBox.End    = priv->ActorBox.End;
+        priv->SeqBox.Bottom = priv->ActorBox.Bottom;
+
+        // Layout the events
+        sqd_layout_arrange_events(sb);
+
+        // Spread them out by time
+        if( priv->TimeScale > 0 )
+            sqd_layout_apply_time_axis(sb);
+
+        // Break the events into pages
+        sqd_layout_paginate(sb, 0);
+
+        // Layout the actor regions
+        sqd_layout_arrange_aregions(sb);
+
+        // Layout the box regions
+        sqd_layout_arrange_bregions(sb);
+
+        // Finish laying out the notes, they follow their references onto later pages.
+        priv->NoteBox.Top    = priv->SeqBox.Top;
+        priv->NoteBox.Bottom = priv->Height - priv->Margin;
+
+        sqd_layout_arrange_notes(sb, 0);
+
+        // Layout the reference lines for notes.
+        sqd_layout_arrange_notes_references(sb, 0);
+    }
+    else
+    {
+        // Figure out where the Actors should be located.
+        // In the future the width will depend on if notes are present or not.
+        priv->ActorBox.Start  = priv->Margin;
+        priv->ActorBox.End    = priv->Width - priv->Margin;
+        priv->ActorBox.Top    = priv->DescriptionBox.Bottom;
+        priv->ActorBox.Bottom = priv->Height - priv->Margin;
+
+        // Call a subroutine to layout the Actors.
+        priv->SeqBox.Top = sqd_layout_arrange_actors(sb);
+
+        // Init the rest of the event box.
+        // In the future the width will depend on if notes are present or not.
+        priv->SeqBox.Start  = priv->Margin;
+        priv->SeqBox.End    = priv->Width - priv->Margin;
+        priv->SeqBox.Bottom = priv->ActorBox.Bottom;
+
+        // Layout the events
+        sqd_layout_arrange_events(sb);
+
+        // Spread them out by time
+        if( priv->TimeScale > 0 )
+            sqd_layout_apply_time_axis(sb);
+
+        // Break the events into pages
+        sqd_layout_paginate(sb, 0);
+
+        // Layout the actor regions
+        sqd_layout_arrange_aregions(sb);
+
+        // Layout the box regions
+        sqd_layout_arrange_bregions(sb);
+    }
+
+    if( priv->FitContent )
+        sqd_layout_end_fit_content(sb);
+
+    sqd_layout_clear_dirty(sb);
+
+    return 0;
+}
+
+// Distance along a hilbert curve filling a grid of 2^SQD_INDEX_HILBERT_BITS
+// cells per side.
+static guint32
+sqd_layout_hilbert_index( guint32 X, guint32 Y )
+{
+    guint32 Rx, Ry, S, D, T;
+
+    D = 0;
+    for( S = (1 << (SQD_INDEX_HILBERT_BITS - 1)); S > 0; S >>= 1 )
+    {
+        Rx = (X & S) > 0;
+        Ry = (Y & S) > 0;
+        D += S * S * ((3 * Rx) ^ Ry);
+
+        // Rotate the quadrant so the curve stays continuous.
+        if( Ry == 0 )
+        {
+            if( Rx == 1 )
+            {
+                X = (S - 1) - X;
+                Y = (S - 1) - Y;
+            }
+
+            T = X;
+            X = Y;
+            Y = T;
+        }
+    }
+
+    return D;
+}
+
+static gint
+sqd_layout_compare_index_entries( gconstpointer a, gconstpointer b )
+{
+    const SQD_INDEX_ENTRY *EntryA = a;
+    const SQD_INDEX_ENTRY *EntryB = b;
+
+    if( EntryA->Hilbert < EntryB->Hilbert )
+        return -1;
+
+    return (EntryA->Hilbert > EntryB->Hilbert);
+}
+
+static void
+sqd_layout_extend_box( SQD_BOX *Box, SQD_BOX *Other )
+{
+    if( Other->Top    < Box->Top )    Box->Top    = Other->Top;
+    if( Other->Bottom > Box->Bottom ) Box->Bottom = Other->Bottom;
+    if( Other->Start  < Box->Start )  Box->Start  = Other->Start;
+    if( Other->End    > Box->End )    Box->End    = Other->End;
+}
+
+static gboolean
+sqd_layout_boxes_overlap( SQD_BOX *BoxA, SQD_BOX *BoxB )
+{
+    return ( (BoxA->Start <= BoxB->End) && (BoxB->Start <= BoxA->End)
+             && (BoxA->Top <= BoxB->Bottom) && (BoxB->Top <= BoxA->Bottom) );
+}
+
+// Queue an object's box, already in page coordinates, for a page's index.
+static void
+sqd_layout_index_object( SQDLayout *sb, guint PageIndex, SQD_OBJ *Obj, SQD_BOX *Box )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_SPATIAL_INDEX *Index;
+    SQD_INDEX_ENTRY    Entry;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, PageIndex);
+
+    Entry.Box     = *Box;
+    Entry.Obj     = Obj;
+    Entry.Hilbert = 0;
+
+    g_array_append_val(Index->Entries, Entry);
+}
+
+// Queue a region that may run across several pages, clipped to each page's event area.
+static void
+sqd_layout_index_region( SQDLayout *sb, SQD_OBJ *Obj, SQD_BOX *Bounds, SQD_EVENT *SEvent, SQD_EVENT *EEvent )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE         *Page;
+    SQD_BOX           Box;
+    guint FirstPage, LastPage, i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    FirstPage = sqd_layout_get_object_page(sb, &SEvent->hdr);
+    LastPage  = sqd_layout_get_object_page(sb, &EEvent->hdr);
+
+    for( i = FirstPage; i <= LastPage; i++ )
+    {
+        Page = &g_array_index(priv->Pages, SQD_PAGE, i);
+
+        Box         = *Bounds;
+        Box.Top    -= Page->LayerShift;
+        Box.Bottom -= Page->LayerShift;
+
+        if( Box.Top < Page->SeqBox.Top )
+            Box.Top = Page->SeqBox.Top;
+        if( Box.Bottom > Page->SeqBox.Bottom )
+            Box.Bottom = Page->SeqBox.Bottom;
+
+        sqd_layout_index_object(sb, i, Obj, &Box);
+    }
+}
+
+// Sort one page's entries along the hilbert curve and pack the node levels above them.
+static void
+sqd_layout_pack_spatial_index( SQDLayout *sb, SQD_SPATIAL_INDEX *Index )
+{
+	SQDLayoutPrivate *priv;
+    SQD_INDEX_ENTRY  *Entry;
+    SQD_BOX          *Node;
+    SQD_BOX           Box;
+    SQD_BOX           Bounds;
+    double XScale, YScale;
+    guint  MaxCell;
+    guint  LevelStart, LevelEnd;
+    guint  i, j;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( Index->Entries->len == 0 )
+        return;
+
+    // Scale the grid to what is on the page rather than the page size; a 
+    // content sized page is still at its maximum height while it is being
+    // arranged, which would squash every entry into the first row of cells.
+    Bounds = g_array_index(Index->Entries, SQD_INDEX_ENTRY, 0).Box;
+    for( i = 1; i < Index->Entries->len; i++ )
+        sqd_layout_extend_box(&Bounds, &g_array_index(Index->Entries, SQD_INDEX_ENTRY, i).Box);
+
+    // Order the entries by where their centers fall on the page.
+    MaxCell = (1 << SQD_INDEX_HILBERT_BITS) - 1;
+    XScale  = MaxCell / MAX(Bounds.End - Bounds.Start, 1.0);
+    YScale  = MaxCell / MAX(Bounds.Bottom - Bounds.Top, 1.0);
+
+    for( i = 0; i < Index->Entries->len; i++ )
+    {
+        Entry = &g_array_index(Index->Entries, SQD_INDEX_ENTRY, i);
+
+        Entry->Hilbert = sqd_layout_hilbert_index(
+                            (guint32) CLAMP( (((Entry->Box.Start + Entry->Box.End) / 2.0) - Bounds.Start) * XScale, 0, MaxCell ),
+                            (guint32) CLAMP( (((Entry->Box.Top + Entry->Box.Bottom) / 2.0) - Bounds.Top) * YScale, 0, MaxCell ) );
+    }
+
+    g_array_sort(Index->Entries, sqd_layout_compare_index_entries);
+
+    // The leaf level is the entry boxes themselves.
+    for( i = 0; i < Index->Entries->len; i++ )
+    {
+        Entry = &g_array_index(Index->Entries, SQD_INDEX_ENTRY, i);
+        g_array_append_val(Index->Nodes, Entry->Box);
+    }
+
+    LevelStart = 0;
+    LevelEnd   = Index->Nodes->len;
+    g_array_append_val(Index->LevelEnds, LevelEnd);
+
+    // Each level up bounds consecutive runs of the level below, until one root is left.
+    while( (LevelEnd - LevelStart) > 1 )
+    {
+        for( i = LevelStart; i < LevelEnd; i += SQD_INDEX_NODE_SIZE )
+        {
+            Box = g_array_index(Index->Nodes, SQD_BOX, i);
+
+            for( j = i + 1; (j < (i + SQD_INDEX_NODE_SIZE)) && (j < LevelEnd); j++ )
+            {
+                Node = &g_array_index(Index->Nodes, SQD_BOX, j);
+                sqd_layout_extend_box(&Box, Node);
+            }
+
+            g_array_append_val(Index->Nodes, Box);
+        }
+
+        LevelStart = LevelEnd;
+        LevelEnd   = Index->Nodes->len;
+        g_array_append_val(Index->LevelEnds, LevelEnd);
+    }
+}
+
+static void
+sqd_layout_free_spatial_index( SQDLayout *sb )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_SPATIAL_INDEX *Index;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    for( i = 0; i < priv->SpatialIndex->len; i++ )
+    {
+        Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, i);
+
+        g_array_free(Index->Entries, TRUE);
+        g_array_free(Index->Nodes, TRUE);
+        g_array_free(Index->LevelEnds, TRUE);
+    }
+
+    g_array_set_size(priv->SpatialIndex, 0);
+}
+
+// Index the page coordinate bounds of everything that was arranged.
+static void
+sqd_layout_build_spatial_index( SQDLayout *sb )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_SPATIAL_INDEX *Index;
+    SQD_PAGE          *Page;
+    SQD_EVENT_LAYER   *Layer;
+    SQD_EVENT         *Event;
+    SQD_ACTOR         *Actor;
+    SQD_NOTE          *Note;
+    SQD_ACTOR_REGION  *AReg;
+    SQD_BOX_REGION    *BReg;
+    GList             *Element;
+    SQD_BOX            Box;
+    guint i, j;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    sqd_layout_free_spatial_index(sb);
+
+    g_array_set_size(priv->SpatialIndex, priv->Pages->len);
+
+    for( i = 0; i < priv->Pages->len; i++ )
+    {
+        Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, i);
+
+        Index->Entries   = g_array_new(FALSE, FALSE, sizeof (SQD_INDEX_ENTRY));
+        Index->Nodes     = g_array_new(FALSE, FALSE, sizeof (SQD_BOX));
+        Index->LevelEnds = g_array_new(FALSE, FALSE, sizeof (guint));
+
+        Page = &g_array_index(priv->Pages, SQD_PAGE, i);
+
+        // The actor headers and stems are repeated on every page.
+        for( j = 0; j <= priv->MaxActorIndex; j++ )
+        {
+            Actor = g_ptr_array_index(priv->Actors, j);
+
+            Box         = Actor->BoundsBox;
+            Box.Top    -= Page->HeaderShift;
+            Box.Bottom  = Page->SeqBox.Bottom;
+
+            sqd_layout_index_object(sb, i, &Actor->hdr, &Box);
+        }
+
+        // Events on this page.
+        for( j = Page->FirstLayer; j < Page->LastLayer; j++ )
+        {
+            Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, j);
+
+            Element = g_list_first(Layer->Events);
+            while( Element )
+            {
+                Event = Element->data;
+
+                Box.Top     = (Layer->LayerBox.Top + Event->EventBox.Top) - Page->LayerShift;
+                Box.Bottom  = (Layer->LayerBox.Top + Event->EventBox.Bottom) - Page->LayerShift;
+                Box.Start   = Event->EventBox.Start;
+                Box.End     = Event->EventBox.End;
+
+                if( Event->Hidden == FALSE )
+                    sqd_layout_index_object(sb, i, &Event->hdr, &Box);
+
+                Element = g_list_next(Element);
+            }
+        }
+    }
+
+    for( i = 0; i < priv->ActorRegions->len; i++ )
+    {
+        AReg = g_ptr_array_index(priv->ActorRegions, i);
+        sqd_layout_index_region(sb, &AReg->hdr, &AReg->BoundsBox, AReg->SEventRef, AReg->EEventRef);
+    }
+
+    for( i = 0; i < priv->BoxRegions->len; i++ )
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+        sqd_layout_index_region(sb, &BReg->hdr, &BReg->BoundsBox, BReg->SEventRef, BReg->EEventRef);
+    }
+
+    // Notes are already placed in page coordinates.
+    for( i = 0; i < priv->MaxNoteIndex; i++ )
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+        sqd_layout_index_object(sb, Note->Page, &Note->hdr, &Note->BoundsBox);
+    }
+
+    for( i = 0; i < priv->SpatialIndex->len; i++ )
+    {
+        Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, i);
+        sqd_layout_pack_spatial_index(sb, Index);
+    }
+
+    priv->SpatialIndexValid = TRUE;
+}
+
+// Collect the index entries on a page whose bounds overlap QueryBox.
+static void
+sqd_layout_search_spatial_index( SQD_SPATIAL_INDEX *Index, SQD_BOX *QueryBox, GPtrArray *Results )
+{
+    SQD_INDEX_ENTRY *Entry;
+    GArray *Stack;
+    guint   Level, Node, Child;
+    guint   LevelStart, ChildStart, ChildEnd;
+
+    if( Index->Entries->len == 0 )
+        return;
+
+    // Pending nodes are pushed as (level, node) pairs, starting at the root.
+    Stack = g_array_new(FALSE, FALSE, sizeof (guint));
+
+    Level = Index->LevelEnds->len - 1;
+    Node  = Index->Nodes->len - 1;
+    g_array_append_val(Stack, Level);
+    g_array_append_val(Stack, Node);
+
+    while( Stack->len )
+    {
+        Node  = g_array_index(Stack, guint, Stack->len - 1);
+        Level = g_array_index(Stack, guint, Stack->len - 2);
+        g_array_set_size(Stack, Stack->len - 2);
+
+        if( sqd_layout_boxes_overlap(&g_array_index(Index->Nodes, SQD_BOX, Node), QueryBox) == FALSE )
+            continue;
+
+        if( Level == 0 )
+        {
+            Entry = &g_array_index(Index->Entries, SQD_INDEX_ENTRY, Node);
+            g_ptr_array_add(Results, Entry);
+            continue;
+        }
+
+        // The children are this node's run of the level below.
+        LevelStart  = g_array_index(Index->LevelEnds, guint, Level - 1);
+        ChildStart  = (Level > 1) ? g_array_index(Index->LevelEnds, guint, Level - 2) : 0;
+        ChildStart += (Node - LevelStart) * SQD_INDEX_NODE_SIZE;
+        ChildEnd    = MIN( (ChildStart + SQD_INDEX_NODE_SIZE), LevelStart );
+
+        Level -= 1;
+        for( Child = ChildStart; Child < ChildEnd; Child++ )
+        {
+            g_array_append_val(Stack, Level);
+            g_array_append_val(Stack, Child);
+        }
+    }
+
+    g_array_free(Stack, TRUE);
+}
+
+
+// Labels, fonts and classes are optional; the g_strcmp0 fallback for old glib 
+// doesn't take NULLs.
+static gboolean
+sqd_layout_str_match( gchar *StrA, gchar *StrB )
+{
+    if( (StrA == NULL) || (StrB == NULL) )
+        return (StrA == StrB);
+
+    return (strcmp(StrA, StrB) == 0);
+}
+
+// Find or add the display list style for a color, dash and font, drawn for
+// the current kind and class of object.  Runs of ops mostly share a style, 
+// so the last hit is checked before the table.
+static guint
+sqd_layout_dl_style( SQDLayout *sb, SQD_COLOR *Color, guint8 Dash, gchar *FontStr )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_STYLE     *Style;
+    SQD_DL_STYLE      NewStyle;
+    guint i;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    for( i = 0; i <= DList->Styles->len; i++ )
+    {
+        // Try the last hit first, then the whole table.
+        if( i == 0 )
+        {
+            if( DList->LastStyle >= DList->Styles->len )
+                continue;
+            Style = &g_array_index(DList->Styles, SQD_DL_STYLE, DList->LastStyle);
+        }
+        else
+            Style = &g_array_index(DList->Styles, SQD_DL_STYLE, i - 1);
+
+        if( (memcmp(&Style->Color, Color, sizeof (SQD_COLOR)) == 0)
+            && (Style->Dash == Dash) && (Style->LineWidth == priv->LineWidth)
+            && sqd_layout_str_match(Style->FontStr, FontStr)
+            && (Style->Kind == DList->Kind) && sqd_layout_str_match(Style->ClassStr, DList->ClassStr) )
+        {
+            DList->LastStyle = (i == 0) ? DList->LastStyle : (i - 1);
+            return DList->LastStyle;
+        }
+    }
+
+    NewStyle.Color     = *Color;
+    NewStyle.LineWidth = priv->LineWidth;
+    NewStyle.Dash      = Dash;
+    NewStyle.FontStr   = FontStr ? g_strdup(FontStr) : NULL;
+    NewStyle.FontDesc  = FontStr ? pango_font_description_from_string(FontStr) : NULL;
+    NewStyle.Kind      = DList->Kind;
+    NewStyle.ClassStr  = DList->ClassStr;
+
+    g_array_append_val(DList->Styles, NewStyle);
+
+    DList->LastStyle = DList->Styles->len - 1;
+
+    return DList->LastStyle;
+}
+
+// Append an op with Count points to the display list.  Returns the first
+// point for the caller to fill in; the emit shift is applied by the caller.
+static SQD_DL_POINT *
+sqd_layout_dl_add_op( SQDLayout *sb, guint8 Type, guint Style, guint Count )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP         Op;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    Op.Type  = Type;
+    Op.Band  = DList->Band;
+    Op.Style = Style;
+    Op.First = DList->Points->len;
+    Op.Count = Count;
+
+    Op.Bounds.Top    = 0;
+    Op.Bounds.Bottom = 0;
+    Op.Bounds.Start  = 0;
+    Op.Bounds.End    = 0;
+
+    g_array_append_val(DList->Ops, Op);
+    g_array_set_size(DList->Points, DList->Points->len + Count);
+
+    return &g_array_index(DList->Points, SQD_DL_POINT, Op.First);
+}
+
+// Set the bounds of the last op from its points, grown by Pad on each side.
+static void
+sqd_layout_dl_bound_op( SQDLayout *sb, guint PointCnt, double Pad )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP        *Op;
+    SQD_DL_POINT     *Point;
+    guint i;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    Op    = &g_array_index(DList->Ops, SQD_DL_OP, DList->Ops->len - 1);
+    Point = &g_array_index(DList->Points, SQD_DL_POINT, Op->First);
+
+    Op->Bounds.Top    = Op->Bounds.Bottom = Point[0].Y;
+    Op->Bounds.Start  = Op->Bounds.End    = Point[0].X;
+
+    for( i = 1; i < PointCnt; i++ )
+    {
+        Op->Bounds.Top    = MIN(Op->Bounds.Top, Point[i].Y);
+        Op->Bounds.Bottom = MAX(Op->Bounds.Bottom, Point[i].Y);
+        Op->Bounds.Start  = MIN(Op->Bounds.Start, Point[i].X);
+        Op->Bounds.End    = MAX(Op->Bounds.End, Point[i].X);
+    }
+
+    Op->Bounds.Top    -= Pad;
+    Op->Bounds.Bottom += Pad;
+    Op->Bounds.Start  -= Pad;
+    Op->Bounds.End    += Pad;
+}
+
+// Filled rectangle, with rounded corners when Radius isn't zero.
+static void
+sqd_layout_dl_rect( SQDLayout *sb, SQD_COLOR *Color, double x, double y, double w, double h, double Radius )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, Radius ? DLOP_ROUND_RECT : DLOP_RECT, sqd_layout_dl_style(sb, Color, DLDASH_NONE, NULL), Radius ? 3 : 2);
+
+    Point[0].X = x;
+    Point[0].Y = y + priv->DisplayList.Shift;
+    Point[1].X = x + w;
+    Point[1].Y = y + h + priv->DisplayList.Shift;
+
+    if( Radius )
+        Point[2].X = Point[2].Y = Radius;
+
+    sqd_layout_dl_bound_op(sb, 2, 0);
+}
+
+// Stroked line through Count points.
+static void
+sqd_layout_dl_polyline( SQDLayout *sb, SQD_COLOR *Color, guint8 Dash, SQD_DL_POINT *Points, guint Count )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, (Count == 2) ? DLOP_LINE : DLOP_POLYLINE, sqd_layout_dl_style(sb, Color, Dash, NULL), Count);
+
+    for( i = 0; i < Count; i++ )
+    {
+        Point[i].X = Points[i].X;
+        Point[i].Y = Points[i].Y + priv->DisplayList.Shift;
+    }
+
+    sqd_layout_dl_bound_op(sb, Count, priv->LineWidth);
+}
+
+static void
+sqd_layout_dl_line( SQDLayout *sb, SQD_COLOR *Color, guint8 Dash, double x0, double y0, double x1, double y1 )
+{
+    SQD_DL_POINT Points[2];
+
+    Points[0].X = x0;
+    Points[0].Y = y0;
+    Points[1].X = x1;
+    Points[1].Y = y1;
+
+    sqd_layout_dl_polyline(sb, Color, Dash, Points, 2);
+}
+
+// Stroked cubic bezier from (x0,y0) to (x3,y3).
+static void
+sqd_layout_dl_curve( SQDLayout *sb, SQD_COLOR *Color, double x0, double y0, double x1, double y1, double x2, double y2, double x3, double y3 )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, DLOP_CURVE, sqd_layout_dl_style(sb, Color, DLDASH_NONE, NULL), 4);
+
+    Point[0].X = x0;  Point[0].Y = y0 + priv->DisplayList.Shift;
+    Point[1].X = x1;  Point[1].Y = y1 + priv->DisplayList.Shift;
+    Point[2].X = x2;  Point[2].Y = y2 + priv->DisplayList.Shift;
+    Point[3].X = x3;  Point[3].Y = y3 + priv->DisplayList.Shift;
+
+    // The curve stays inside the hull of its control points.
+    sqd_layout_dl_bound_op(sb, 4, priv->LineWidth);
+}
+
+// Open arrowhead with its tip at (TipX, TipY) and its back at BackX.
+static void
+sqd_layout_dl_arrowhead( SQDLayout *sb, SQD_COLOR *Color, double TipX, double TipY, double BackX )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, DLOP_ARROWHEAD, sqd_layout_dl_style(sb, Color, DLDASH_NONE, NULL), 3);
+
+    Point[0].X = BackX;
+    Point[0].Y = TipY - (priv->ArrowWidth/2.0) + priv->DisplayList.Shift;
+    Point[1].X = TipX;
+    Point[1].Y = TipY + priv->DisplayList.Shift;
+    Point[2].X = BackX;
+    Point[2].Y = TipY + (priv->ArrowWidth/2.0) + priv->DisplayList.Shift;
+
+    sqd_layout_dl_bound_op(sb, 3, priv->LineWidth);
+}
+
+// Filled circle.
+static void
+sqd_layout_dl_dot( SQDLayout *sb, SQD_COLOR *Color, double x, double y, double Radius )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, DLOP_DOT, sqd_layout_dl_style(sb, Color, DLDASH_NONE, NULL), 2);
+
+    Point[0].X = x;
+    Point[0].Y = y + priv->DisplayList.Shift;
+    Point[1].X = Point[1].Y = Radius;
+
+    sqd_layout_dl_bound_op(sb, 1, Radius);
+}
+
+// Text run in the current font, its top left corner at (x,y).  The string
+// belongs to the layout, so the list has to be rebuilt when text changes.
+static void
+sqd_layout_dl_text( SQDLayout *sb, SQD_TXT *Text, double x, double y, double Width )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_POINT     *Point;
+    SQD_DL_TEXT       Run;
+    SQD_DL_OP        *Op;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    Run.Str   = Text->Str;
+    Run.Width = Width;
+
+    Point = sqd_layout_dl_add_op(sb, DLOP_TEXT, sqd_layout_dl_style(sb, &priv->TextColor, DLDASH_NONE, priv->FontStr), 1);
+
+    Point[0].X = x;
+    Point[0].Y = y + DList->Shift;
+
+    Op = &g_array_index(DList->Ops, SQD_DL_OP, DList->Ops->len - 1);
+
+    Op->Count = DList->Texts->len;
+    g_array_append_val(DList->Texts, Run);
+
+    Op->Bounds.Top    = Point[0].Y;
+    Op->Bounds.Bottom = Point[0].Y + Text->Height;
+    Op->Bounds.Start  = x;
+    Op->Bounds.End    = x + MAX(Width, Text->Width);
+}
+
+// Clip the following ops to a rectangle until the matching unclip.
+static void
+sqd_layout_dl_clip( SQDLayout *sb, double x, double y, double w, double h )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT     *Point;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Point = sqd_layout_dl_add_op(sb, DLOP_CLIP, 0, 2);
+
+    Point[0].X = x;
+    Point[0].Y = y + priv->DisplayList.Shift;
+    Point[1].X = x + w;
+    Point[1].Y = y + h + priv->DisplayList.Shift;
+
+    sqd_layout_dl_bound_op(sb, 2, 0);
+}
+
+static void
+sqd_layout_dl_unclip( SQDLayout *sb )
+{
+    sqd_layout_dl_add_op(sb, DLOP_UNCLIP, 0, 0);
+}
+
+static void
+sqd_layout_draw_actor( SQDLayout *sb, SQD_ACTOR *Actor, double StemBottom )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Setup the actor presentation parameters
+    sqd_layout_use_actor_presentation(sb, Actor->hdr.ClassStr);
+
+    // Draw the Text bounding box.
+    sqd_layout_dl_rect(sb, &priv->FillColor, Actor->NameBox.Start, Actor->NameBox.Top,
+                        (Actor->NameBox.End - Actor->NameBox.Start),
+                        (Actor->NameBox.Bottom - Actor->NameBox.Top), 0);
+
+    // Draw the Actor Title
+    // Center it over the Stem
+    sqd_layout_dl_text(sb, &Actor->Name,
+                       ((Actor->StemBox.Start + priv->LineWidth) - (Actor->Name.Width / 2.0)),
+                       (Actor->NameBox.Top + priv->TextPad), priv->ActorTextWidth);
+
+    // Draw the Baseline
+    sqd_layout_dl_line(sb, &priv->LineColor, DLDASH_NONE,
+                       Actor->BaselineBox.Start, Actor->BaselineBox.Top + (priv->LineWidth/2.0),
+                       Actor->BaselineBox.End, Actor->BaselineBox.Top + (priv->LineWidth/2.0));
+
+    // Draw the Stem
+    sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NONE,
+                       Actor->StemBox.Start + (priv->LineWidth/2.0), Actor->StemBox.Top,
+                       Actor->StemBox.Start + (priv->LineWidth/2.0), StemBottom);
+
+    // Back to default rendering settings
+    sqd_layout_use_default_presentation(sb);
+}
+
+static void
+sqd_layout_draw_actors( SQDLayout *sb, double StemBottom )
+{
+	SQDLayoutPrivate *priv;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Draw each actor
+    for (i = 0; i <= priv->MaxActorIndex; i++)
+        sqd_layout_draw_actor(sb, g_ptr_array_index(priv->Actors, i), StemBottom);
+
+}
+
+// Draw a dashed rule across the events with Text centred on it, for the
+// events sampled away before a layer or an idle gap cut short.
+static void
+sqd_layout_draw_layer_marker( SQDLayout *sb, SQD_TXT *Text, double Top )
+{
+	SQDLayoutPrivate *priv;
+    double MarkY, TextStart;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    MarkY     = Top + priv->TextPad + (Text->Height / 2.0);
+    TextStart = ((priv->SeqBox.Start + priv->SeqBox.End) / 2.0) - (Text->Width / 2.0);
+
+    sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_MARKER, priv->SeqBox.Start, MarkY, TextStart - priv->TextPad, MarkY);
+    sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_MARKER, TextStart + Text->Width + priv->TextPad, MarkY, priv->SeqBox.End, MarkY);
+
+    sqd_layout_dl_text(sb, Text, TextStart, Top + priv->TextPad, 0);
+}
+
+// Draw one event in the current presentation.  The display list shift has
+// to be at the top of the event's layer.
+static void
+sqd_layout_draw_event( SQDLayout *sb, SQD_EVENT *Event )
+{
+	SQDLayoutPrivate *priv;
+    double StemTop, StemBottom, StemMid;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    StemTop    = Event->StemBox.Top + (priv->LineWidth/2.0);
+    StemBottom = Event->StemBox.Bottom - (priv->LineWidth/2.0);
+
+    // Draw the stem and the arrow at its end.
+    switch ( Event->ArrowDir )
+    {
+        case ARROWDIR_EXTERNAL_TO:
+        case ARROWDIR_LEFT_TO_RIGHT:
+            sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NONE, Event->StemBox.Start, StemTop, Event->StemBox.End, StemTop);
+            sqd_layout_dl_arrowhead(sb, &priv->StemColor, Event->StemBox.End, StemTop, Event->StemBox.End - priv->ArrowLength);
+        break;
+
+        case ARROWDIR_EXTERNAL_FROM:
+        case ARROWDIR_RIGHT_TO_LEFT:
+            sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NONE, Event->StemBox.Start, StemTop, Event->StemBox.End, StemTop);
+            sqd_layout_dl_arrowhead(sb, &priv->StemColor, Event->StemBox.Start, StemTop, Event->StemBox.Start + priv->ArrowLength);
+        break;
+
+        case ARROWDIR_STEP:
+            StemMid = (Event->StemBox.Start + Event->StemBox.End)/2.0;
+
+            // Out along the top, loop back down the right and return along the bottom.
+            sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NONE, Event->StemBox.Start, StemTop, StemMid, StemTop);
+            sqd_layout_dl_curve(sb, &priv->StemColor, StemMid, StemTop,
+                                Event->StemBox.End, StemTop,
+                                Event->StemBox.End, StemBottom,
+                                StemMid, StemBottom);
+            sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NONE, StemMid, StemBottom, Event->StemBox.Start, StemBottom);
+
+            sqd_layout_dl_arrowhead(sb, &priv->StemColor, Event->StemBox.Start, StemBottom, Event->StemBox.Start + priv->ArrowLength);
+        break;
+    }
+
+    if( Event->UpperText.Str )
+        sqd_layout_dl_text(sb, &Event->UpperText, Event->UpperTextBox.Start, Event->UpperTextBox.Top, Event->UpperText.Width);
+
+    if( Event->LowerText.Str )
+        sqd_layout_dl_text(sb, &Event->LowerText, Event->LowerTextBox.Start, Event->LowerTextBox.Top, Event->LowerText.Width);
+}
+
+static void
+sqd_layout_draw_events( SQDLayout *sb, guint FirstLayer, guint LastLayer )
+{
+	SQDLayoutPrivate *priv;
+    GList            *Element;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    gchar   *CurClass;
+    gboolean ClassSet;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Events don't overlap each other, the backend can group their ops by style.
+    priv->DisplayList.Band = DLBAND_SORTED;
+
+    // Event presentations are only looked up when the class changes.  Class
+    // names are interned so the pointers can be compared.
+    CurClass = NULL;
+    ClassSet = FALSE;
+
+    // Cycle through the event layers in sequencial order to layout each one.
+    for (i = FirstLayer; i < LastLayer; i++)
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        // Markers use the default presentation.
+        if( (Layer->TimeBreak || Layer->DroppedCnt) && ClassSet )
+        {
+            sqd_layout_use_default_presentation(sb);
+            ClassSet = FALSE;
+        }
+
+        if( Layer->TimeBreak )
+            sqd_layout_draw_layer_marker(sb, &Layer->BreakText, Layer->LayerBox.Top);
+
+        if( Layer->DroppedCnt )
+            sqd_layout_draw_layer_marker(sb, &Layer->DroppedText, Layer->LayerBox.Top + Layer->TimePad);
+
+        // Event geometry is relative to the layer.
+        priv->DisplayList.Shift += Layer->LayerBox.Top;
+
+        // Layout each seperate event in this layer
+        Element = g_list_first(Layer->Events);
+        while( Element )
+        {
+            Event = Element->data;
+
+            if( Event->Hidden )
+            {
+                Element = g_list_next(Element);
+                continue;
+            }
+
+            // Setup the parameters
+            if( (ClassSet == FALSE) || (Event->hdr.ClassStr != CurClass) )
+            {
+                sqd_layout_use_event_presentation(sb, Event->hdr.ClassStr);
+
+                CurClass = Event->hdr.ClassStr;
+                ClassSet = TRUE;
+            }
+
+            sqd_layout_draw_event(sb, Event);
+
+            Element = g_list_next(Element);
+        } // Event Layout Loop
+
+        priv->DisplayList.Shift -= Layer->LayerBox.Top;
+    } // Event Layer Loop
+
+    // Switch back to the default presentation
+    if( ClassSet )
+        sqd_layout_use_default_presentation(sb);
+
+    priv->DisplayList.Band = DLBAND_ORDERED;
+
+}
+
+static void
+sqd_layout_draw_aregion( SQDLayout *sb, SQD_ACTOR_REGION *AReg )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Set the presentation
+    sqd_layout_use_aregion_presentation(sb, AReg->hdr.ClassStr);
+
+    // Draw the Text bounding box.
+    sqd_layout_dl_rect(sb, &priv->FillColor, AReg->BoundsBox.Start, AReg->BoundsBox.Top,
+                        (AReg->BoundsBox.End - AReg->BoundsBox.Start),
+                        (AReg->BoundsBox.Bottom - AReg->BoundsBox.Top), 0);
+
+    // Back to the defualt presentation
+    sqd_layout_use_default_presentation(sb);
+}
+
+static void
+sqd_layout_draw_aregions( SQDLayout *sb, double Top, double Bottom )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR_REGION *AReg;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Draw each actor region box that reaches into the Top to Bottom span.
+    for (i = 0; i < priv->ActorRegions->len; i++)
+    {
+        AReg = g_ptr_array_index(priv->ActorRegions, i);
+
+        if( (AReg->BoundsBox.Bottom < Top) || (AReg->BoundsBox.Top > Bottom) )
+            continue;
+
+        sqd_layout_draw_aregion(sb, AReg);
+    }
+
+}
+
+static void
+sqd_layout_draw_bregion( SQDLayout *sb, SQD_BOX_REGION *BReg )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Set the presentation
+    sqd_layout_use_bregion_presentation(sb, BReg->hdr.ClassStr);
+
+    // Draw the Text bounding box.
+    sqd_layout_dl_rect(sb, &priv->FillColor, BReg->BoundsBox.Start, BReg->BoundsBox.Top,
+                        (BReg->BoundsBox.End - BReg->BoundsBox.Start),
+                        (BReg->BoundsBox.Bottom - BReg->BoundsBox.Top), 10);
+
+    // A collapsed region shows its summary in the middle of the band.
+    if( BReg->Collapsed )
+    {
+        sqd_layout_dl_text(sb, &BReg->SummaryText,
+                           ((BReg->BoundsBox.Start + BReg->BoundsBox.End) / 2.0) - (BReg->SummaryText.Width / 2.0),
+                           (BReg->BoundsBox.Top + priv->TextPad), 0);
+    }
+    // The label sits in the padding below the last event.
+    else if( BReg->Label.Str )
+    {
+        sqd_layout_dl_text(sb, &BReg->Label,
+                           (BReg->BoundsBox.End - priv->TextPad - BReg->Label.Width),
+                           (BReg->BoundsBox.Bottom - priv->TextPad - BReg->Label.Height), 0);
+    }
+
+    // Back to the defualt presentation
+    sqd_layout_use_default_presentation(sb);
+}
+
+static void
+sqd_layout_draw_bregions( SQDLayout *sb, double Top, double Bottom )
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX_REGION   *BReg;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Draw each box region box that reaches into the Top to Bottom span.
+    for (i = 0; i < priv->BoxRegions->len; i++)
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+
+        if( (BReg->BoundsBox.Bottom < Top) || (BReg->BoundsBox.Top > Bottom) )
+            continue;
+
+        sqd_layout_draw_bregion(sb, BReg);
+    }
+
+}
+
+
+static void
+sqd_layout_draw_note( SQDLayout *sb, SQD_NOTE *Note )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Setup the parameters
+    sqd_layout_use_note_presentation(sb, Note->hdr.ClassStr);
+
+    // Draw the Text bounding box.
+    sqd_layout_dl_rect(sb, &priv->FillColor, Note->BoundsBox.Start, Note->BoundsBox.Top,
+                        (Note->BoundsBox.End - Note->BoundsBox.Start),
+                        (Note->BoundsBox.Bottom - Note->BoundsBox.Top), 0);
+
+    // Draw the Note Text
+    sqd_layout_dl_text(sb, &Note->Text, (Note->BoundsBox.Start + priv->TextPad), (Note->BoundsBox.Top + priv->TextPad),
+                       priv->NoteBoxWidth - (2 * priv->TextPad));
+
+    // Back to the default parameters
+    sqd_layout_use_default_presentation(sb);
+}
+
+static void
+sqd_layout_draw_notes( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *Note;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Draw each note on this page
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        if( Note->Page != PageIndex )
+            continue;
+
+        sqd_layout_draw_note(sb, Note);
+    }
+
+}
+
+
+static void
+sqd_layout_draw_note_reference( SQDLayout *sb, SQD_NOTE *Note )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_POINT  Points[5];
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Setup the parameters
+    sqd_layout_use_noteref_presentation(sb, Note->hdr.ClassStr);
+
+    if( priv->NoteRouting == NOTE_ROUTING_ORTHOGONAL )
+    {
+        Points[0].X = Note->RefFirstStart;    Points[0].Y = Note->RefFirstTop;
+        Points[1].X = Note->RefChannelStart;  Points[1].Y = Note->RefFirstTop;
+        Points[2].X = Note->RefChannelStart;  Points[2].Y = Note->RefLaneTop;
+        Points[3].X = Note->RefLastStart;     Points[3].Y = Note->RefLaneTop;
+        Points[4].X = Note->RefLastStart;     Points[4].Y = Note->RefLastTop;
+
+        sqd_layout_dl_polyline(sb, &priv->StemColor, DLDASH_NOTEREF, Points, 5);
+    }
+    else
+    {
+        sqd_layout_dl_line(sb, &priv->StemColor, DLDASH_NOTEREF, Note->RefFirstStart, Note->RefFirstTop, Note->RefLastStart, Note->RefLastTop);
+    }
+
+    // Draw a small circle at the termination of the note reference.
+    if( Note->RefOffPage == FALSE )
+        sqd_layout_dl_dot(sb, &priv->StemColor, Note->RefLastStart, Note->RefLastTop, 2*priv->LineWidth);
+
+    // Back to the default parameters
+    sqd_layout_use_default_presentation(sb);
+}
+
+static void
+sqd_layout_draw_note_references( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE     *Note;
+    int i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Draw each reference line
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        // If this note doesn't have a reference then don't draw one.
+        if( Note->ReferenceType == NOTE_REFTYPE_NONE )
+            continue;
+
+        if( Note->Page != PageIndex )
+            continue;
+
+        sqd_layout_draw_note_reference(sb, Note);
+    }
+
+}
+
+// The title bar and description block at the top of the first page.
+static void
+sqd_layout_draw_heading( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Take care of any title bar
+    if( priv->Title.Str )
+    {
+        // Setup the parameters for the title bar
+        sqd_layout_use_title_presentation(sb);
+
+        priv->TitleBar.Start   = priv->TitleBox.Start;
+
+        sqd_layout_dl_rect(sb, &priv->FillColor, priv->TitleBar.Start, priv->TitleBar.Top,
+                            (priv->TitleBar.End - priv->TitleBar.Start),
+                            (priv->TitleBar.Bottom - priv->TitleBar.Top), 0);
+
+        sqd_layout_dl_text(sb, &priv->Title, (priv->TitleBar.Start + priv->TextPad), (priv->TitleBar.Top + priv->TextPad), (priv->TitleBar.End - priv->TitleBar.Start));
+
+        // Back to the default presentation
+        sqd_layout_use_default_presentation(sb);
+    }
+
+    // Determine the amount of space needed for the description block
+    if( priv->Description.Str )
+    {
+        // Setup the parameters for the description region
+        sqd_layout_use_description_presentation(sb);
+
+        sqd_layout_dl_text(sb, &priv->Description,
+                           (priv->DescriptionBox.Start + priv->TextPad),
+                           (priv->DescriptionBox.Top + priv->ElementPad + priv->TextPad),
+                           (priv->DescriptionBox.End - priv->DescriptionBox.Start));
+
+        // Back to the default presentation
+        sqd_layout_use_default_presentation(sb);
+
+    }
+}
+
+// Emit one page into the display list.
+static int
+sqd_layout_draw_page( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE         *Page;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Page = &g_array_index(priv->Pages, SQD_PAGE, PageIndex);
+
+    priv->DisplayList.Shift = 0;
+
+    // Start with the default presentation.
+    sqd_layout_use_default_presentation(sb);
+
+    // Draw a background so that it isn't transparent.
+    sqd_layout_dl_rect(sb, &priv->BGColor, 0, 0, priv->Width, priv->Height, 0);
+
+    // The title and description only go on the first page.
+    if( PageIndex == 0 )
+        sqd_layout_draw_heading(sb);
+
+    // The actor header is repeated on each page.
+    priv->DisplayList.Shift = -Page->HeaderShift;
+
+    sqd_layout_draw_actors(sb, Page->SeqBox.Bottom - priv->ElementPad + Page->HeaderShift);
+
+    priv->DisplayList.Shift = 0;
+
+    // Draw this page's slice of the event area, regions that
+    // continue across the page break get clipped at the edge.
+    sqd_layout_dl_clip(sb, 0, Page->SeqBox.Top, priv->Width, (Page->SeqBox.Bottom - Page->SeqBox.Top));
+
+    priv->DisplayList.Shift = -Page->LayerShift;
+
+    sqd_layout_draw_events(sb, Page->FirstLayer, Page->LastLayer);
+
+    sqd_layout_draw_aregions(sb, Page->SeqBox.Top + Page->LayerShift, Page->SeqBox.Bottom + Page->LayerShift);
+
+    sqd_layout_draw_bregions(sb, Page->SeqBox.Top + Page->LayerShift, Page->SeqBox.Bottom + Page->LayerShift);
+
+    priv->DisplayList.Shift = 0;
+
+    sqd_layout_dl_unclip(sb);
+
+    sqd_layout_draw_notes(sb, PageIndex);
+
+    sqd_layout_draw_note_references(sb, PageIndex);
+
+    return 0;
+}
+
+// Object behind the i'th spatial index hit.
+#define SQD_HIT_OBJ(Hits, i)  (((SQD_INDEX_ENTRY *)g_ptr_array_index((Hits), (i)))->Obj)
+
+// Order spatial index hits the way a full page draws them: actors, events,
+// actor regions, box regions and then notes, each in list order.
+static gint
+sqd_layout_compare_draw_order( gconstpointer a, gconstpointer b )
+{
+    static const guint8 Rank[] = { 0, 1, 4, 2, 3 };  // By SDOBJ_ type.
+
+    const SQD_OBJ *ObjA = (*(SQD_INDEX_ENTRY **)a)->Obj;
+    const SQD_OBJ *ObjB = (*(SQD_INDEX_ENTRY **)b)->Obj;
+
+    if( ObjA->Type != ObjB->Type )
+        return (Rank[ObjA->Type] < Rank[ObjB->Type]) ? -1 : 1;
+
+    if( ObjA->Index != ObjB->Index )
+        return (ObjA->Index < ObjB->Index) ? -1 : 1;
+
+    return 0;
+}
+
+// First layer in [FirstLayer, LastLayer) that reaches down to Top, in page
+// coordinates.  The layers are stacked in order, so a binary search finds it.
+static guint
+sqd_layout_find_layer( SQDLayout *sb, SQD_PAGE *Page, double Top )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    guint Lower, Upper, Mid;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Lower = Page->FirstLayer;
+    Upper = Page->LastLayer;
+
+    while( Lower < Upper )
+    {
+        Mid   = Lower + ((Upper - Lower) / 2);
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Mid);
+
+        if( (Layer->LayerBox.Top + Layer->Height - Page->LayerShift) < Top )
+            Lower = Mid + 1;
+        else
+            Upper = Mid;
+    }
+
+    return Lower;
+}
+
+// Emit the part of a page inside the viewport.  Only the objects the page's
+// spatial index finds there are drawn, so the cost follows what is visible
+// rather than the size of the diagram.
+static int
+sqd_layout_draw_viewport( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_PAGE         *Page;
+    SQD_BOX          *View;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    SQD_NOTE         *Note;
+    GPtrArray        *Hits;
+    SQD_BOX  RefBox;
+    gchar   *CurClass;
+    gboolean ClassSet;
+    guint i, j;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->SpatialIndexValid == FALSE )
+        sqd_layout_build_spatial_index(sb);
+
+    Page = &g_array_index(priv->Pages, SQD_PAGE, PageIndex);
+    View = &priv->Viewport;
+
+    priv->DisplayList.Shift = 0;
+
+    sqd_layout_use_default_presentation(sb);
+
+    sqd_layout_dl_rect(sb, &priv->BGColor, View->Start, View->Top, (View->End - View->Start), (View->Bottom - View->Top), 0);
+
+    if( (PageIndex == 0) && (View->Top <= priv->DescriptionBox.Bottom) )
+        sqd_layout_draw_heading(sb);
+
+    Hits = g_ptr_array_new();
+
+    sqd_layout_search_spatial_index(&g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, PageIndex), View, Hits);
+
+    g_ptr_array_sort(Hits, sqd_layout_compare_draw_order);
+
+    // The hits come sorted actors first, then events and regions, then notes.
+    priv->DisplayList.Shift = -Page->HeaderShift;
+
+    for( i = 0; (i < Hits->len) && (SQD_HIT_OBJ(Hits, i)->Type == SDOBJ_ACTOR); i++ )
+        sqd_layout_draw_actor(sb, (SQD_ACTOR *)SQD_HIT_OBJ(Hits, i), Page->SeqBox.Bottom - priv->ElementPad + Page->HeaderShift);
+
+    priv->DisplayList.Shift = 0;
+
+    sqd_layout_dl_clip(sb, 0, Page->SeqBox.Top, priv->Width, (Page->SeqBox.Bottom - Page->SeqBox.Top));
+
+    // Markers aren't indexed, find the layers in view directly.
+    priv->DisplayList.Shift = -Page->LayerShift;
+
+    for( j = sqd_layout_find_layer(sb, Page, View->Top); j < Page->LastLayer; j++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, j);
+
+        if( (Layer->LayerBox.Top - Page->LayerShift) > View->Bottom )
+            break;
+
+        if( Layer->TimeBreak )
+            sqd_layout_draw_layer_marker(sb, &Layer->BreakText, Layer->LayerBox.Top);
+
+        if( Layer->DroppedCnt )
+            sqd_layout_draw_layer_marker(sb, &Layer->DroppedText, Layer->LayerBox.Top + Layer->TimePad);
+    }
+
+    CurClass = NULL;
+    ClassSet = FALSE;
+
+    for( ; (i < Hits->len) && (SQD_HIT_OBJ(Hits, i)->Type == SDOBJ_EVENT); i++ )
+    {
+        Event = (SQD_EVENT *)SQD_HIT_OBJ(Hits, i);
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Event->hdr.Index);
+
+        if( (ClassSet == FALSE) || (Event->hdr.ClassStr != CurClass) )
+        {
+            sqd_layout_use_event_presentation(sb, Event->hdr.ClassStr);
+
+            CurClass = Event->hdr.ClassStr;
+            ClassSet = TRUE;
+        }
+
+        priv->DisplayList.Band  = DLBAND_SORTED;
+        priv->DisplayList.Shift = Layer->LayerBox.Top - Page->LayerShift;
+
+        sqd_layout_draw_event(sb, Event);
+    }
+
+    if( ClassSet )
+        sqd_layout_use_default_presentation(sb);
+
+    priv->DisplayList.Band  = DLBAND_ORDERED;
+    priv->DisplayList.Shift = -Page->LayerShift;
+
+    for( ; (i < Hits->len) && (SQD_HIT_OBJ(Hits, i)->Type != SDOBJ_NOTE); i++ )
+    {
+        if( SQD_HIT_OBJ(Hits, i)->Type == SDOBJ_AREGION )
+            sqd_layout_draw_aregion(sb, (SQD_ACTOR_REGION *)SQD_HIT_OBJ(Hits, i));
+        else
+            sqd_layout_draw_bregion(sb, (SQD_BOX_REGION *)SQD_HIT_OBJ(Hits, i));
+    }
+
+    priv->DisplayList.Shift = 0;
+
+    sqd_layout_dl_unclip(sb);
+
+    for( ; i < Hits->len; i++ )
+        sqd_layout_draw_note(sb, (SQD_NOTE *)SQD_HIT_OBJ(Hits, i));
+
+    g_ptr_array_free(Hits, TRUE);
+
+    // Reference lines cross the page, so they aren't in the index.  Their
+    // corners bound them well enough to skip the ones out of view.
+    for (i = 0; i < priv->MaxNoteIndex; i++)
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+
+        if( (Note->ReferenceType == NOTE_REFTYPE_NONE) || (Note->Page != PageIndex) )
+            continue;
+
+        RefBox.Start  = MIN(Note->RefFirstStart, Note->RefLastStart) - (2 * priv->LineWidth);
+        RefBox.End    = MAX(Note->RefFirstStart, Note->RefLastStart) + (2 * priv->LineWidth);
+        RefBox.Top    = MIN(Note->RefFirstTop, Note->RefLastTop) - (2 * priv->LineWidth);
+        RefBox.Bottom = MAX(Note->RefFirstTop, Note->RefLastTop) + (2 * priv->LineWidth);
+
+        if( priv->NoteRouting == NOTE_ROUTING_ORTHOGONAL )
+        {
+            RefBox.Start  = MIN(RefBox.Start, Note->RefChannelStart);
+            RefBox.End    = MAX(RefBox.End, Note->RefChannelStart);
+            RefBox.Top    = MIN(RefBox.Top, Note->RefLaneTop);
+            RefBox.Bottom = MAX(RefBox.Bottom, Note->RefLaneTop);
+        }
+
+        if( sqd_layout_boxes_overlap(&RefBox, View) )
+            sqd_layout_draw_note_reference(sb, Note);
+    }
+
+    return 0;
+}
+
+// Drop the current display list, keeping the arrays for reuse.
+static void
+sqd_layout_clear_display_list( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_STYLE     *Style;
+    guint i;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    for( i = 0; i < DList->Styles->len; i++ )
+    {
+        Style = &g_array_index(DList->Styles, SQD_DL_STYLE, i);
+
+        if( Style->FontStr )
+            g_free(Style->FontStr);
+        if( Style->FontDesc )
+            pango_font_description_free(Style->FontDesc);
+    }
+
+    g_array_set_size(DList->Ops, 0);
+    g_array_set_size(DList->Points, 0);
+    g_array_set_size(DList->Texts, 0);
+    g_array_set_size(DList->Styles, 0);
+    g_array_set_size(DList->PageEnds, 0);
+
+    DList->LastStyle = 0;
+    DList->Shift     = 0;
+    DList->Band      = DLBAND_ORDERED;
+    DList->Kind      = "page";
+    DList->ClassStr  = NULL;
+}
+
+// Run the draw stage over one page, appending its ops to the display list.
+static void
+sqd_layout_record_page( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    guint PageEnd;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->HasViewport )
+        sqd_layout_draw_viewport(sb, PageIndex);
+    else
+        sqd_layout_draw_page(sb, PageIndex);
+
+    PageEnd = priv->DisplayList.Ops->len;
+    g_array_append_val(priv->DisplayList.PageEnds, PageEnd);
+}
+
+// Run the draw stage once over every page, recording the flat list of ops
+// that the output backends replay.  Needs an arranged layout.
+static void
+sqd_layout_build_display_list( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    sqd_layout_clear_display_list(sb);
+
+    for (i = 0; i < priv->Pages->len; i++)
+        sqd_layout_record_page(sb, i);
+}
+
+// Replace the display list with just one page, for writers that stream the 
+// pages out one at a time.  The pages before it are left empty.
+static void
+sqd_layout_build_page_display_list( SQDLayout *sb, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    guint PageEnd;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    sqd_layout_clear_display_list(sb);
+
+    PageEnd = 0;
+    for (i = 0; i < PageIndex; i++)
+        g_array_append_val(priv->DisplayList.PageEnds, PageEnd);
+
+    sqd_layout_record_page(sb, PageIndex);
+}
+
+// Range of ops that make up a page of the display list.
+static void
+sqd_layout_get_page_ops( SQDLayout *sb, guint PageIndex, guint *FirstOp, guint *LastOp )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    *FirstOp = (PageIndex == 0) ? 0 : g_array_index(priv->DisplayList.PageEnds, guint, PageIndex - 1);
+    *LastOp  = g_array_index(priv->DisplayList.PageEnds, guint, PageIndex);
+}
+
+// The area of each page that goes to the output: the viewport when one is
+// set, otherwise the whole page.
+static void
+sqd_layout_get_output_box( SQDLayout *sb, SQD_BOX *Box )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->HasViewport )
+    {
+        *Box = priv->Viewport;
+        return;
+    }
+
+    Box->Start  = 0;
+    Box->Top    = 0;
+    Box->End    = priv->Width;
+    Box->Bottom = priv->Height;
+}
+
+static void
+sqd_layout_cairo_rounded_rec( cairo_t *cr, gdouble x, gdouble y, gdouble w, gdouble h, gdouble r)
+{
+    // "Draw a rounded rectangle"
+    //   A****BQ
+    //  H      C
+    //  *      *
+    //  G      D
+    //   F****E
+    cairo_move_to(cr, x+r,y);                     // Move to A
+    cairo_line_to(cr,x+w-r,y);                    // Straight line to B
+    cairo_curve_to(cr,x+w,y,x+w,y,x+w,y+r);       // Curve to C, Control points are both at Q
+    cairo_line_to(cr,x+w,y+h-r);                  // Move to D
+    cairo_curve_to(cr,x+w,y+h,x+w,y+h,x+w-r,y+h); // Curve to E
+    cairo_line_to(cr,x+r,y+h);                    // Line to F
+    cairo_curve_to(cr,x,y+h,x,y+h,x,y+h-r);       // Curve to G
+    cairo_line_to(cr,x,y+r);                      // Line to H
+    cairo_curve_to(cr,x,y,x,y,x+r,y);             // Curve to A
+}
+
+// Switch the cairo context over to a display list style.
+static void
+sqd_layout_cairo_use_style( cairo_t *cr, SQD_DL_STYLE *Style )
+{
+    double MarkerDashes[]  = {4.0, 4.0};
+    double NoteRefDashes[] = {3.0,  /* ink */
+                              4.0,  /* skip */
+                              1.0,  /* ink */
+                              4.0   /* skip*/
+                             };
+
+    cairo_set_source_rgba(cr, Style->Color.Red, Style->Color.Green, Style->Color.Blue, Style->Color.Alpha);
+    cairo_set_line_width(cr, Style->LineWidth);
+
+    switch( Style->Dash )
+    {
+        case DLDASH_MARKER:
+            cairo_set_dash(cr, MarkerDashes, 2, 0);
+            cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
+        break;
+
+        case DLDASH_NOTEREF:
+            cairo_set_dash(cr, NoteRefDashes, 4, -50.0);
+            cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+        break;
+
+        default:
+            cairo_set_dash(cr, NULL, 0, 0);
+            cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
+        break;
+    }
+}
+
+// Finish the path the cairo backend has been batching up.
+static void
+sqd_layout_cairo_flush( cairo_t *cr, SQD_CAIRO_BATCH *Batch )
+{
+    switch( Batch->Paint )
+    {
+        case DLPAINT_FILL:
+            cairo_fill(cr);
+        break;
+
+        case DLPAINT_STROKE:
+            cairo_stroke(cr);
+        break;
+    }
+
+    Batch->Paint = DLPAINT_NONE;
+}
+
+// Replay a single op.  Fills and strokes that share a style with the op
+// before them are added to the same path and painted in one go, unless the
+// style is translucent and the overlaps would blend differently.
+static void
+sqd_layout_cairo_replay_op( SQDLayout *sb, cairo_t *cr, PangoLayout *Layout, guint OpIndex, SQD_BOX *View, SQD_CAIRO_BATCH *Batch )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP        *Op;
+    SQD_DL_POINT     *Point;
+    SQD_DL_STYLE     *Style;
+    SQD_DL_TEXT      *Run;
+    guint8 Paint;
+    guint  j;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    Op    = &g_array_index(DList->Ops, SQD_DL_OP, OpIndex);
+    Point = &g_array_index(DList->Points, SQD_DL_POINT, Op->First);
+
+    if( View && (Op->Type != DLOP_UNCLIP) && (Op->Type != DLOP_CLIP)
+        && ((Op->Bounds.Bottom < View->Top) || (Op->Bounds.Top > View->Bottom)
+            || (Op->Bounds.End < View->Start) || (Op->Bounds.Start > View->End)) )
+        return;
+
+    switch( Op->Type )
+    {
+        case DLOP_RECT:
+        case DLOP_ROUND_RECT:
+        case DLOP_DOT:
+            Paint = DLPAINT_FILL;
+        break;
+
+        case DLOP_LINE:
+        case DLOP_POLYLINE:
+        case DLOP_CURVE:
+        case DLOP_ARROWHEAD:
+            Paint = DLPAINT_STROKE;
+        break;
+
+        default:
+            Paint = DLPAINT_NONE;
+        break;
+    }
+
+    // Anything that can't join the current path ends it.
+    if( (Batch->Paint != DLPAINT_NONE) && ((Paint != Batch->Paint) || (Op->Style != Batch->Style)) )
+        sqd_layout_cairo_flush(cr, Batch);
+
+    if( (Paint != DLPAINT_NONE) || (Op->Type == DLOP_TEXT) )
+    {
+        if( Op->Style != Batch->Style )
+        {
+            Batch->Style = Op->Style;
+            sqd_layout_cairo_use_style(cr, &g_array_index(DList->Styles, SQD_DL_STYLE, Batch->Style));
+        }
+    }
+
+    switch( Op->Type )
+    {
+        case DLOP_RECT:
+            cairo_rectangle(cr, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y);
+        break;
+
+        case DLOP_ROUND_RECT:
+            sqd_layout_cairo_rounded_rec(cr, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y, Point[2].X);
+        break;
+
+        case DLOP_LINE:
+        case DLOP_POLYLINE:
+        case DLOP_ARROWHEAD:
+            cairo_move_to(cr, Point[0].X, Point[0].Y);
+            for( j = 1; j < Op->Count; j++ )
+                cairo_line_to(cr, Point[j].X, Point[j].Y);
+        break;
+
+        case DLOP_CURVE:
+            cairo_move_to(cr, Point[0].X, Point[0].Y);
+            cairo_curve_to(cr, Point[1].X, Point[1].Y, Point[2].X, Point[2].Y, Point[3].X, Point[3].Y);
+        break;
+
+        case DLOP_DOT:
+            cairo_new_sub_path(cr);
+            cairo_arc(cr, Point[0].X, Point[0].Y, Point[1].X, 0.0, 2*M_PI);
+        break;
+
+        case DLOP_TEXT:
+            Run   = &g_array_index(DList->Texts, SQD_DL_TEXT, Op->Count);
+            Style = &g_array_index(DList->Styles, SQD_DL_STYLE, Op->Style);
+
+            if( Run->Width )
+            {
+                pango_layout_set_width(Layout, (Run->Width * PANGO_SCALE));
+                pango_layout_set_wrap(Layout, PANGO_WRAP_WORD);
+            }
+            else
+                pango_layout_set_width(Layout, -1);
+
+            pango_layout_set_font_description(Layout, Style->FontDesc);
+            pango_layout_set_markup(Layout, Run->Str, -1);
+
+            cairo_move_to(cr, Point[0].X, Point[0].Y);
+            pango_cairo_show_layout(cr, Layout);
+        break;
+
+        case DLOP_CLIP:
+            cairo_save(cr);
+            cairo_rectangle(cr, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y);
+            cairo_clip(cr);
+        break;
+
+        case DLOP_UNCLIP:
+            // The restore takes the style back with it.
+            cairo_restore(cr);
+            Batch->Style = G_MAXUINT;
+        break;
+    }
+
+    if( Paint != DLPAINT_NONE )
+    {
+        Batch->Paint = Paint;
+
+        if( g_array_index(DList->Styles, SQD_DL_STYLE, Op->Style).Color.Alpha < 1.0 )
+            sqd_layout_cairo_flush(cr, Batch);
+    }
+}
+
+// Order a run of freely sortable ops: geometry before text, then by style.
+// Ties keep list order so the result is stable.
+static gint
+sqd_layout_compare_op_keys( gconstpointer a, gconstpointer b )
+{
+    const SQD_DL_SORT_KEY *KeyA = a;
+    const SQD_DL_SORT_KEY *KeyB = b;
+
+    if( KeyA->Key != KeyB->Key )
+        return (KeyA->Key < KeyB->Key) ? -1 : 1;
+
+    if( KeyA->Index != KeyB->Index )
+        return (KeyA->Index < KeyB->Index) ? -1 : 1;
+
+    return 0;
+}
+
+// Op indices of a page in the order the backends replay them.  Runs of
+// ops in the sortable band come out grouped by style, geometry before text.
+static void
+sqd_layout_get_replay_order( SQDLayout *sb, guint PageIndex, GArray *Order )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP        *Op;
+    SQD_DL_SORT_KEY   Key;
+    guint FirstOp, LastOp;
+    guint RunStart;
+    guint i;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    sqd_layout_get_page_ops(sb, PageIndex, &FirstOp, &LastOp);
+
+    g_array_set_size(Order, 0);
+    RunStart = G_MAXUINT;
+
+    for( i = FirstOp; i < LastOp; i++ )
+    {
+        Op = &g_array_index(DList->Ops, SQD_DL_OP, i);
+
+        if( Op->Band != DLBAND_SORTED )
+        {
+            Key.Key  = 0;
+            RunStart = G_MAXUINT;
+        }
+        else
+        {
+            Key.Key = ((Op->Type == DLOP_TEXT) ? 0x10000 : 0) | Op->Style;
+
+            if( RunStart == G_MAXUINT )
+                RunStart = Order->len;
+        }
+
+        Key.Index = i;
+        g_array_append_val(Order, Key);
+
+        // Sort each run once it is complete.
+        if( (RunStart != G_MAXUINT) && ((i + 1 == LastOp) || (g_array_index(DList->Ops, SQD_DL_OP, i + 1).Band != DLBAND_SORTED)) )
+            qsort(&g_array_index(Order, SQD_DL_SORT_KEY, RunStart), Order->len - RunStart, sizeof (SQD_DL_SORT_KEY), sqd_layout_compare_op_keys);
+    }
+}
+
+// Cairo backend: replay one page of the display list.  Ops entirely outside
+// View are skipped when it is given.  Runs of ops in the sortable band are
+// replayed grouped by style so each group becomes one path.  Text is laid 
+// out in Context when one is given, otherwise in one made for cr.
+static void
+sqd_layout_replay_cairo( SQDLayout *sb, cairo_t *cr, PangoContext *Context, guint PageIndex, SQD_BOX *View )
+{
+    SQD_CAIRO_BATCH   Batch;
+    PangoLayout      *Layout;
+    GArray           *Order;
+    guint i;
+
+    // Keep line styles from leaking into the next page.
+    cairo_save(cr);
+
+    // One pango layout is reused for every text run on the page.
+    if( Context )
+        Layout = pango_layout_new(Context);
+    else
+        Layout = pango_cairo_create_layout(cr);
+
+    Order  = g_array_new(FALSE, FALSE, sizeof (SQD_DL_SORT_KEY));
+
+    Batch.Style = G_MAXUINT;
+    Batch.Paint = DLPAINT_NONE;
+
+    sqd_layout_get_replay_order(sb, PageIndex, Order);
+
+    for( i = 0; i < Order->len; i++ )
+        sqd_layout_cairo_replay_op(sb, cr, Layout, g_array_index(Order, SQD_DL_SORT_KEY, i).Index, View, &Batch);
+
+    sqd_layout_cairo_flush(cr, &Batch);
+
+    g_array_free(Order, TRUE);
+    g_object_unref(Layout);
+
+    cairo_restore(cr);
+}
+
+// Format a coordinate for the native writers: two decimals at most, no
+// trailing zeros, and a '.' whatever the locale.
+static gchar *
+sqd_layout_format_num( gchar *Buf, double Value )
+{
+    gchar *End;
+
+    g_ascii_formatd(Buf, SQD_NUM_BUF_SIZE, "%.2f", Value);
+
+    End = Buf + strlen(Buf) - 1;
+    while( *End == '0' )
+        *End-- = '\0';
+    if( *End == '.' )
+        *End = '\0';
+
+    if( (Buf[0] == '-') && (Buf[1] == '0') && (Buf[2] == '\0') )
+    {
+        Buf[0] = '0';
+        Buf[1] = '\0';
+    }
+
+    return Buf;
+}
+
+// Name the CSS rules of each display list style after what it draws: the 
+// kind of object and its presentation class, e.g. "event-error".  Styles 
+// that would share a name get their index on the end.
+static gchar **
+sqd_layout_svg_style_names( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_STYLE     *Style;
+    gchar **Names;
+    gchar  *Name;
+    guint   i, j;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Names = g_new0(gchar *, priv->DisplayList.Styles->len + 1);
+
+    for( i = 0; i < priv->DisplayList.Styles->len; i++ )
+    {
+        Style = &g_array_index(priv->DisplayList.Styles, SQD_DL_STYLE, i);
+
+        if( Style->ClassStr )
+            Name = g_strdup_printf("%s-%s", Style->Kind, Style->ClassStr);
+        else
+            Name = g_strdup(Style->Kind);
+
+        // Classes come from the document, keep them to what css takes.
+        g_strcanon(Name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_", '_');
+
+        for( j = 0; j < i; j++ )
+        {
+            if( strcmp(Names[j], Name) == 0 )
+            {
+                Names[i] = g_strdup_printf("%s-%u", Name, i);
+                g_free(Name);
+                break;
+            }
+        }
+
+        if( Names[i] == NULL )
+            Names[i] = Name;
+    }
+
+    return Names;
+}
+
+// One set of CSS rules per display list style: NAME-line for strokes, 
+// NAME-fill for fills and NAME-text for text in the style's font.
+static void
+sqd_layout_svg_write_styles( SQDLayout *sb, FILE *File, gchar **Names )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DL_STYLE     *Style;
+    gchar  N[2][SQD_NUM_BUF_SIZE];
+    gchar *Rgb;
+    guint  i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    fprintf(File, "<style>\n");
+
+    for( i = 0; i < priv->DisplayList.Styles->len; i++ )
+    {
+        Style = &g_array_index(priv->DisplayList.Styles, SQD_DL_STYLE, i);
+
+        Rgb = g_strdup_printf("rgb(%d,%d,%d)", (int)(Style->Color.Red * 255.0 + 0.5), (int)(Style->Color.Green * 255.0 + 0.5), (int)(Style->Color.Blue * 255.0 + 0.5));
+
+        if( Style->FontDesc )
+        {
+            fprintf(File, ".%s-text{fill:%s;fill-opacity:%s;font-family:'%s';font-size:%spx;font-weight:%d;font-style:%s}\n",
+                    Names[i], Rgb, sqd_layout_format_num(N[0], Style->Color.Alpha),
+                    pango_font_description_get_family(Style->FontDesc) ? pango_font_description_get_family(Style->FontDesc) : "sans-serif",
+                    sqd_layout_format_num(N[1], (double)pango_font_description_get_size(Style->FontDesc) / PANGO_SCALE),
+                    (int)pango_font_description_get_weight(Style->FontDesc),
+                    (pango_font_description_get_style(Style->FontDesc) == PANGO_STYLE_NORMAL) ? "normal" : "italic");
+        }
+        else
+        {
+            fprintf(File, ".%s-fill{fill:%s;fill-opacity:%s}\n", Names[i], Rgb, sqd_layout_format_num(N[0], Style->Color.Alpha));
+
+            fprintf(File, ".%s-line{fill:none;stroke:%s;stroke-opacity:%s;stroke-width:%s", Names[i], Rgb,
+                    sqd_layout_format_num(N[0], Style->Color.Alpha), sqd_layout_format_num(N[1], Style->LineWidth));
+
+            switch( Style->Dash )
+            {
+                case DLDASH_MARKER:
+                    fprintf(File, ";stroke-dasharray:4 4");
+                break;
+
+                case DLDASH_NOTEREF:
+                    fprintf(File, ";stroke-dasharray:3 4 1 4;stroke-dashoffset:-50;stroke-linecap:round");
+                break;
+            }
+
+            fprintf(File, "}\n");
+        }
+
+        g_free(Rgb);
+    }
+
+    fprintf(File, "</style>\n");
+}
+
+// Write a text run as a <text> element with one <tspan> per line.  Pango
+// lays the run out again so the lines break where they were measured.
+static void
+sqd_layout_svg_write_text( FILE *File, PangoLayout *Layout, SQD_DL_STYLE *Style, SQD_DL_TEXT *Run, SQD_DL_POINT *Point, gchar *StyleName )
+{
+    PangoLayoutIter *Iter;
+    PangoLayoutLine *Line;
+    const gchar     *Text;
+    gchar           *Escaped;
+    gchar  N[2][SQD_NUM_BUF_SIZE];
+
+    if( Run->Width )
+    {
+        pango_layout_set_width(Layout, (Run->Width * PANGO_SCALE));
+        pango_layout_set_wrap(Layout, PANGO_WRAP_WORD);
+    }
+    else
+        pango_layout_set_width(Layout, -1);
+
+    pango_layout_set_font_description(Layout, Style->FontDesc);
+    pango_layout_set_markup(Layout, Run->Str, -1);
+
+    // The markup is gone from the layout text, only the plain string is written.
+    Text = pango_layout_get_text(Layout);
+
+    fprintf(File, "<text class=\"%s-text\">", StyleName);
+
+    Iter = pango_layout_get_iter(Layout);
+    do
+    {
+        Line = pango_layout_iter_get_line_readonly(Iter);
+
+        if( Line->length > 0 )
+        {
+            Escaped = g_markup_escape_text(Text + Line->start_index, Line->length);
+
+            fprintf(File, "<tspan x=\"%s\" y=\"%s\">%s</tspan>",
+                    sqd_layout_format_num(N[0], Point->X),
+                    sqd_layout_format_num(N[1], Point->Y + ((double)pango_layout_iter_get_baseline(Iter) / PANGO_SCALE)),
+                    Escaped);
+
+            g_free(Escaped);
+        }
+    }
+    while( pango_layout_iter_next_line(Iter) );
+
+    pango_layout_iter_free(Iter);
+
+    fprintf(File, "</text>\n");
+}
+
+// Native SVG backend: stream one page of the display list straight to File
+// as plain elements.  Only that page is in the display list.
+static void
+sqd_layout_svg_write_page( SQDLayout *sb, FILE *File, PangoLayout *Layout, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP        *Op;
+    SQD_DL_POINT     *Point;
+    SQD_BOX           Out;
+    gchar  N[8][SQD_NUM_BUF_SIZE];
+    gchar **Names;
+    guint  FirstOp, LastOp;
+    guint  ClipCnt;
+    guint  i, j;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    sqd_layout_get_page_ops(sb, PageIndex, &FirstOp, &LastOp);
+    sqd_layout_get_output_box(sb, &Out);
+
+    fprintf(File, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(File, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%spt\" height=\"%spt\" viewBox=\"%s %s %s %s\">\n",
+            sqd_layout_format_num(N[0], Out.End - Out.Start), sqd_layout_format_num(N[1], Out.Bottom - Out.Top),
+            sqd_layout_format_num(N[2], Out.Start), sqd_layout_format_num(N[3], Out.Top),
+            sqd_layout_format_num(N[4], Out.End - Out.Start), sqd_layout_format_num(N[5], Out.Bottom - Out.Top));
+
+    Names = sqd_layout_svg_style_names(sb);
+    sqd_layout_svg_write_styles(sb, File, Names);
+
+    ClipCnt = 0;
+
+    for( i = FirstOp; i < LastOp; i++ )
+    {
+        Op    = &g_array_index(DList->Ops, SQD_DL_OP, i);
+        Point = &g_array_index(DList->Points, SQD_DL_POINT, Op->First);
+
+        switch( Op->Type )
+        {
+            case DLOP_RECT:
+            case DLOP_ROUND_RECT:
+                fprintf(File, "<rect class=\"%s-fill\" x=\"%s\" y=\"%s\" width=\"%s\" height=\"%s\"", Names[Op->Style],
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y),
+                        sqd_layout_format_num(N[2], Point[1].X - Point[0].X), sqd_layout_format_num(N[3], Point[1].Y - Point[0].Y));
+
+                if( Op->Type == DLOP_ROUND_RECT )
+                    fprintf(File, " rx=\"%s\"", sqd_layout_format_num(N[4], Point[2].X));
+
+                fprintf(File, "/>\n");
+            break;
+
+            case DLOP_LINE:
+                fprintf(File, "<line class=\"%s-line\" x1=\"%s\" y1=\"%s\" x2=\"%s\" y2=\"%s\"/>\n", Names[Op->Style],
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y),
+                        sqd_layout_format_num(N[2], Point[1].X), sqd_layout_format_num(N[3], Point[1].Y));
+            break;
+
+            case DLOP_POLYLINE:
+            case DLOP_ARROWHEAD:
+                fprintf(File, "<path class=\"%s-line\" d=\"M%s %s", Names[Op->Style],
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y));
+
+                for( j = 1; j < Op->Count; j++ )
+                    fprintf(File, "L%s %s", sqd_layout_format_num(N[0], Point[j].X), sqd_layout_format_num(N[1], Point[j].Y));
+
+                fprintf(File, "\"/>\n");
+            break;
+
+            case DLOP_CURVE:
+                fprintf(File, "<path class=\"%s-line\" d=\"M%s %sC%s %s %s %s %s %s\"/>\n", Names[Op->Style],
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y),
+                        sqd_layout_format_num(N[2], Point[1].X), sqd_layout_format_num(N[3], Point[1].Y),
+                        sqd_layout_format_num(N[4], Point[2].X), sqd_layout_format_num(N[5], Point[2].Y),
+                        sqd_layout_format_num(N[6], Point[3].X), sqd_layout_format_num(N[7], Point[3].Y));
+            break;
+
+            case DLOP_DOT:
+                fprintf(File, "<circle class=\"%s-fill\" cx=\"%s\" cy=\"%s\" r=\"%s\"/>\n", Names[Op->Style],
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y),
+                        sqd_layout_format_num(N[2], Point[1].X));
+            break;
+
+            case DLOP_TEXT:
+                sqd_layout_svg_write_text(File, Layout, &g_array_index(DList->Styles, SQD_DL_STYLE, Op->Style),
+                                          &g_array_index(DList->Texts, SQD_DL_TEXT, Op->Count), Point, Names[Op->Style]);
+            break;
+
+            case DLOP_CLIP:
+                fprintf(File, "<clipPath id=\"c%u\"><rect x=\"%s\" y=\"%s\" width=\"%s\" height=\"%s\"/></clipPath>\n", i,
+                        sqd_layout_format_num(N[0], Point[0].X), sqd_layout_format_num(N[1], Point[0].Y),
+                        sqd_layout_format_num(N[2], Point[1].X - Point[0].X), sqd_layout_format_num(N[3], Point[1].Y - Point[0].Y));
+                fprintf(File, "<g clip-path=\"url(#c%u)\">\n", i);
+                ClipCnt++;
+            break;
+
+            case DLOP_UNCLIP:
+                if( ClipCnt )
+                {
+                    fprintf(File, "</g>\n");
+                    ClipCnt--;
+                }
+            break;
+        }
+    }
+
+    while( ClipCnt-- )
+        fprintf(File, "</g>\n");
+
+    fprintf(File, "</svg>\n");
+
+    g_strfreev(Names);
+}
+
+// Standard fonts the native pdf writer maps pango fonts onto, in
+// family * 4 + bold + 2 * italic order.  Readers carry these, nothing is embedded.
+static const gchar *sqd_pdf_base_fonts[SQD_PDF_FONT_CNT] =
+{
+    "Helvetica",   "Helvetica-Bold",   "Helvetica-Oblique",   "Helvetica-BoldOblique",
+    "Times-Roman", "Times-Bold",       "Times-Italic",        "Times-BoldItalic",
+    "Courier",     "Courier-Bold",     "Courier-Oblique",     "Courier-BoldOblique"
+};
+
+// Pick the standard font closest to a text style's pango font.
+static guint
+sqd_layout_pdf_font_index( PangoFontDescription *FontDesc )
+{
+    const gchar *Family;
+    gchar *Lower;
+    guint  Index;
+
+    Index  = 0;
+    Family = pango_font_description_get_family(FontDesc);
+
+    if( Family )
+    {
+        Lower = g_ascii_strdown(Family, -1);
+
+        if( strstr(Lower, "mono") || strstr(Lower, "courier") )
+            Index = 8;
+        else if( strstr(Lower, "times") || (strstr(Lower, "serif") && !strstr(Lower, "sans")) )
+            Index = 4;
+
+        g_free(Lower);
+    }
+
+    if( pango_font_description_get_weight(FontDesc) >= PANGO_WEIGHT_SEMIBOLD )
+        Index += 1;
+
+    if( pango_font_description_get_style(FontDesc) != PANGO_STYLE_NORMAL )
+        Index += 2;
+
+    return Index;
+}
+
+// Advance widths of the printable ASCII range in the standard fonts, in 
+// thousandths of the font size, from the Adobe core font metrics.  The 
+// oblique Helvetica faces share the upright widths; the other Times faces 
+// are close enough to the roman ones that the difference is fitted out 
+// when the text is shown.
+static const guint16 sqd_afm_helvetica[SQD_AFM_CHAR_CNT] =
+{
+     278,  278,  355,  556,  556,  889,  667,  191,  333,  333,  389,  584,  278,  333,  278,  278,
+     556,  556,  556,  556,  556,  556,  556,  556,  556,  556,  278,  278,  584,  584,  584,  556,
+    1015,  667,  667,  722,  722,  667,  611,  778,  722,  278,  500,  667,  556,  833,  722,  778,
+     667,  778,  722,  667,  611,  722,  667,  944,  667,  667,  611,  278,  278,  278,  469,  556,
+     333,  556,  556,  500,  556,  556,  278,  556,  556,  222,  222,  500,  222,  833,  556,  556,
+     556,  556,  333,  500,  278,  556,  500,  722,  500,  500,  500,  334,  260,  334,  584
+};
+
+static const guint16 sqd_afm_helvetica_bold[SQD_AFM_CHAR_CNT] =
+{
+     278,  333,  474,  556,  556,  889,  722,  238,  333,  333,  389,  584,  278,  333,  278,  278,
+     556,  556,  556,  556,  556,  556,  556,  556,  556,  556,  333,  333,  584,  584,  584,  611,
+     975,  722,  722,  722,  722,  667,  611,  778,  722,  278,  556,  722,  611,  833,  722,  778,
+     667,  778,  722,  667,  611,  722,  667,  944,  667,  667,  611,  333,  278,  333,  584,  556,
+     333,  556,  611,  556,  611,  556,  333,  611,  611,  278,  278,  556,  278,  889,  611,  611,
+     611,  611,  389,  556,  333,  611,  556,  778,  556,  556,  500,  389,  280,  389,  584
+};
+
+static const guint16 sqd_afm_times[SQD_AFM_CHAR_CNT] =
+{
+     250,  333,  408,  500,  500,  833,  778,  180,  333,  333,  500,  564,  250,  333,  250,  278,
+     500,  500,  500,  500,  500,  500,  500,  500,  500,  500,  278,  278,  564,  564,  564,  444,
+     921,  722,  667,  667,  722,  611,  556,  722,  722,  333,  389,  722,  611,  889,  722,  722,
+     556,  722,  667,  556,  611,  722,  722,  944,  722,  722,  611,  333,  278,  333,  469,  500,
+     333,  444,  500,  444,  500,  444,  333,  500,  500,  278,  278,  500,  278,  778,  500,  500,
+     500,  500,  333,  389,  278,  500,  500,  722,  500,  500,  444,  480,  200,  480,  541
+};
+
+// Width of a UTF-8 string shown in one of the standard fonts at Size.
+// Characters without an entry in the tables count as a digit.
+static double
+sqd_layout_pdf_text_width( guint FontIndex, const gchar *Str, gsize Len, double Size )
+{
+    const guint16 *Widths;
+    gchar  *Ansi;
+    gsize   AnsiLen;
+    guchar  Ch;
+    guint   Total;
+    gsize   i;
+
+    switch( FontIndex / 4 )
+    {
+        case 0:
+            Widths = (FontIndex & 1) ? sqd_afm_helvetica_bold : sqd_afm_helvetica;
+        break;
+
+        case 1:
+            Widths = sqd_afm_times;
+        break;
+
+        default:
+            Widths = NULL;
+        break;
+    }
+
+    Ansi = g_convert_with_fallback(Str, Len, "WINDOWS-1252", "UTF-8", "?", NULL, &AnsiLen, NULL);
+
+    if( Ansi == NULL )
+    {
+        Ansi    = g_strndup(Str, Len);
+        AnsiLen = strlen(Ansi);
+    }
+
+    Total = 0;
+    for( i = 0; i < AnsiLen; i++ )
+    {
+        Ch = Ansi[i];
+
+        // Courier is monospaced.
+        if( Widths == NULL )
+            Total += 600;
+        else if( (Ch >= 32) && (Ch < (32 + SQD_AFM_CHAR_CNT)) )
+            Total += Widths[Ch - 32];
+        else
+            Total += Widths['0' - 32];
+    }
+
+    g_free(Ansi);
+
+    return (Total * Size) / 1000.0;
+}
+
+// Widest line of a laid out pango layout once it is shown in the standard 
+// font the native pdf writer picks for it.  Pango still breaks the lines.
+static double
+sqd_layout_pdf_layout_width( PangoLayout *Layout )
+{
+    const PangoFontDescription *FontDesc;
+    PangoLayoutIter *Iter;
+    PangoLayoutLine *Line;
+    const gchar     *Text;
+    double  Size;
+    double  Width;
+    guint   FontIndex;
+
+    FontDesc = pango_layout_get_font_description(Layout);
+    if( FontDesc == NULL )
+        return 0;
+
+    FontIndex = sqd_layout_pdf_font_index((PangoFontDescription *)FontDesc);
+    Size      = (double)pango_font_description_get_size(FontDesc) / PANGO_SCALE;
+    Text      = pango_layout_get_text(Layout);
+    Width     = 0;
+
+    Iter = pango_layout_get_iter(Layout);
+    do
+    {
+        Line = pango_layout_iter_get_line_readonly(Iter);
+
+        if( Line->length > 0 )
+            Width = MAX(Width, sqd_layout_pdf_text_width(FontIndex, Text + Line->start_index, Line->length, Size));
+    }
+    while( pango_layout_iter_next_line(Iter) );
+
+    pango_layout_iter_free(Iter);
+
+    return Width;
+}
+
+// Append Count numbers followed by a content stream operator.
+static void
+sqd_layout_pdf_op( GString *Out, const gchar *Operator, guint Count, ... )
+{
+    va_list Args;
+    gchar   N[SQD_NUM_BUF_SIZE];
+
+    va_start(Args, Count);
+
+    while( Count-- )
+    {
+        g_string_append(Out, sqd_layout_format_num(N, va_arg(Args, double)));
+        g_string_append_c(Out, ' ');
+    }
+
+    va_end(Args);
+
+    g_string_append(Out, Operator);
+    g_string_append_c(Out, '\n');
+}
+
+// Append a pdf string literal.  The text is re-encoded to the WinAnsi set
+// the standard fonts use, anything outside it comes out as '?'.
+static void
+sqd_layout_pdf_string( GString *Out, const gchar *Str, gsize Len )
+{
+    gchar *Ansi;
+    gsize  AnsiLen;
+    guchar Ch;
+    gsize  i;
+
+    Ansi = g_convert_with_fallback(Str, Len, "WINDOWS-1252", "UTF-8", "?", NULL, &AnsiLen, NULL);
+
+    if( Ansi == NULL )
+    {
+        Ansi    = g_strndup(Str, Len);
+        AnsiLen = strlen(Ansi);
+    }
+
+    g_string_append_c(Out, '(');
+
+    for( i = 0; i < AnsiLen; i++ )
+    {
+        Ch = Ansi[i];
+
+        if( (Ch == '(') || (Ch == ')') || (Ch == '\\') )
+        {
+            g_string_append_c(Out, '\\');
+            g_string_append_c(Out, Ch);
+        }
+        else if( (Ch < 32) || (Ch > 126) )
+            g_string_append_printf(Out, "\\%03o", Ch);
+        else
+            g_string_append_c(Out, Ch);
+    }
+
+    g_string_append_c(Out, ')');
+
+    g_free(Ansi);
+}
+
+// Paint whatever path the pdf backend has been batching up.
+static void
+sqd_layout_pdf_flush( SQD_PDF_STATE *State )
+{
+    switch( State->Paint )
+    {
+        case DLPAINT_FILL:
+            g_string_append(State->Out, "f\n");
+        break;
+
+        case DLPAINT_STROKE:
+            g_string_append(State->Out, "S\n");
+        break;
+    }
+
+    State->Paint = DLPAINT_NONE;
+}
+
+// Set colour, line and opacity state for a display list style.
+static void
+sqd_layout_pdf_use_style( SQD_PDF_STATE *State, SQD_DL_STYLE *Style, guint StyleIndex )
+{
+    sqd_layout_pdf_op(State->Out, "rg", 3, Style->Color.Red, Style->Color.Green, Style->Color.Blue);
+    sqd_layout_pdf_op(State->Out, "RG", 3, Style->Color.Red, Style->Color.Green, Style->Color.Blue);
+
+    if( Style->FontDesc == NULL )
+    {
+        sqd_layout_pdf_op(State->Out, "w", 1, Style->LineWidth);
+
+        // Same patterns as the cairo backend, the note dash phase is -50 mod 12.
+        switch( Style->Dash )
+        {
+            case DLDASH_MARKER:
+                g_string_append(State->Out, "[4 4] 0 d 0 J\n");
+            break;
+
+            case DLDASH_NOTEREF:
+                g_string_append(State->Out, "[3 4 1 4] 10 d 1 J\n");
+            break;
+
+            default:
+                g_string_append(State->Out, "[] 0 d 0 J\n");
+            break;
+        }
+    }
+
+    if( Style->Color.Alpha < 1.0 )
+    {
+        g_string_append_printf(State->Out, "/G%u gs\n", StyleIndex);
+        State->Translucent = TRUE;
+    }
+    else if( State->Translucent )
+    {
+        g_string_append(State->Out, "/GA gs\n");
+        State->Translucent = FALSE;
+    }
+
+    State->Style = StyleIndex;
+}
+
+// Lay a text run out with pango again and show each line at its baseline.
+// The text was measured in the standard font, but pango broke the lines, so
+// a line that comes out wider than the wrap width is squeezed to fit it.
+static void
+sqd_layout_pdf_text( SQD_PDF_STATE *State, PangoLayout *Layout, SQD_DL_STYLE *Style, SQD_DL_TEXT *Run, SQD_DL_POINT *Point )
+{
+    PangoLayoutIter *Iter;
+    PangoLayoutLine *Line;
+    const gchar     *Text;
+    double  Size;
+    double  Width;
+    guint   FontIndex;
+
+    if( Run->Width )
+    {
+        pango_layout_set_width(Layout, (Run->Width * PANGO_SCALE));
+        pango_layout_set_wrap(Layout, PANGO_WRAP_WORD);
+    }
+    else
+        pango_layout_set_width(Layout, -1);
+
+    pango_layout_set_font_description(Layout, Style->FontDesc);
+    pango_layout_set_markup(Layout, Run->Str, -1);
+
+    Text      = pango_layout_get_text(Layout);
+    FontIndex = sqd_layout_pdf_font_index(Style->FontDesc);
+    Size      = (double)pango_font_description_get_size(Style->FontDesc) / PANGO_SCALE;
+
+    g_string_append_printf(State->Out, "BT\n/F%u ", FontIndex);
+    sqd_layout_pdf_op(State->Out, "Tf", 1, Size);
+
+    Iter = pango_layout_get_iter(Layout);
+    do
+    {
+        Line = pango_layout_iter_get_line_readonly(Iter);
+
+        if( Line->length > 0 )
+        {
+            // The page is flipped to y down, flip the glyphs back.
+            sqd_layout_pdf_op(State->Out, "Tm", 6, 1.0, 0.0, 0.0, -1.0, Point->X,
+                              Point->Y + ((double)pango_layout_iter_get_baseline(Iter) / PANGO_SCALE));
+
+            Width = sqd_layout_pdf_text_width(FontIndex, Text + Line->start_index, Line->length, Size);
+
+            if( Run->Width && (Width > Run->Width) )
+                sqd_layout_pdf_op(State->Out, "Tz", 1, (100.0 * Run->Width) / Width);
+
+            sqd_layout_pdf_string(State->Out, Text + Line->start_index, Line->length);
+            g_string_append(State->Out, " Tj\n");
+
+            if( Run->Width && (Width > Run->Width) )
+                g_string_append(State->Out, "100 Tz\n");
+        }
+    }
+    while( pango_layout_iter_next_line(Iter) );
+
+    pango_layout_iter_free(Iter);
+
+    g_string_append(State->Out, "ET\n");
+}
+
+// Append a closed path of four quarter ellipse curves plus straight sides,
+// shared by rounded rectangles and dots.
+static void
+sqd_layout_pdf_rounded_rec( GString *Out, double x, double y, double w, double h, double r )
+{
+    double k;
+
+    // Control point distance for a bezier quarter circle.
+    k = 0.5523 * r;
+
+    sqd_layout_pdf_op(Out, "m", 2, x + r, y);
+    sqd_layout_pdf_op(Out, "l", 2, x + w - r, y);
+    sqd_layout_pdf_op(Out, "c", 6, x + w - r + k, y, x + w, y + r - k, x + w, y + r);
+    sqd_layout_pdf_op(Out, "l", 2, x + w, y + h - r);
+    sqd_layout_pdf_op(Out, "c", 6, x + w, y + h - r + k, x + w - r + k, y + h, x + w - r, y + h);
+    sqd_layout_pdf_op(Out, "l", 2, x + r, y + h);
+    sqd_layout_pdf_op(Out, "c", 6, x + r - k, y + h, x, y + h - r + k, x, y + h - r);
+    sqd_layout_pdf_op(Out, "l", 2, x, y + r);
+    sqd_layout_pdf_op(Out, "c", 6, x, y + r - k, x + r - k, y, x + r, y);
+    g_string_append(Out, "h\n");
+}
+
+// Add one op to the page's content stream.  Fills and strokes that share
+// a style are batched into one path the same way the cairo backend does.
+static void
+sqd_layout_pdf_write_op( SQDLayout *sb, SQD_PDF_STATE *State, PangoLayout *Layout, guint OpIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_OP        *Op;
+    SQD_DL_POINT     *Point;
+    SQD_DL_STYLE     *Style;
+    guint8 Paint;
+    guint  j;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    Op    = &g_array_index(DList->Ops, SQD_DL_OP, OpIndex);
+    Point = &g_array_index(DList->Points, SQD_DL_POINT, Op->First);
+    Style = &g_array_index(DList->Styles, SQD_DL_STYLE, Op->Style);
+
+    switch( Op->Type )
+    {
+        case DLOP_RECT:
+        case DLOP_ROUND_RECT:
+        case DLOP_DOT:
+            Paint = DLPAINT_FILL;
+        break;
+
+        case DLOP_LINE:
+        case DLOP_POLYLINE:
+        case DLOP_CURVE:
+        case DLOP_ARROWHEAD:
+            Paint = DLPAINT_STROKE;
+        break;
+
+        default:
+            Paint = DLPAINT_NONE;
+        break;
+    }
+
+    if( (State->Paint != DLPAINT_NONE) && ((Paint != State->Paint) || (Op->Style != State->Style)) )
+        sqd_layout_pdf_flush(State);
+
+    if( ((Paint != DLPAINT_NONE) || (Op->Type == DLOP_TEXT)) && (Op->Style != State->Style) )
+        sqd_layout_pdf_use_style(State, Style, Op->Style);
+
+    switch( Op->Type )
+    {
+        case DLOP_RECT:
+            sqd_layout_pdf_op(State->Out, "re", 4, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y);
+        break;
+
+        case DLOP_ROUND_RECT:
+            sqd_layout_pdf_rounded_rec(State->Out, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y, Point[2].X);
+        break;
+
+        case DLOP_LINE:
+        case DLOP_POLYLINE:
+        case DLOP_ARROWHEAD:
+            sqd_layout_pdf_op(State->Out, "m", 2, Point[0].X, Point[0].Y);
+            for( j = 1; j < Op->Count; j++ )
+                sqd_layout_pdf_op(State->Out, "l", 2, Point[j].X, Point[j].Y);
+        break;
+
+        case DLOP_CURVE:
+            sqd_layout_pdf_op(State->Out, "m", 2, Point[0].X, Point[0].Y);
+            sqd_layout_pdf_op(State->Out, "c", 6, Point[1].X, Point[1].Y, Point[2].X, Point[2].Y, Point[3].X, Point[3].Y);
+        break;
+
+        case DLOP_DOT:
+            sqd_layout_pdf_rounded_rec(State->Out, Point[0].X - Point[1].X, Point[0].Y - Point[1].X, 2 * Point[1].X, 2 * Point[1].X, Point[1].X);
+        break;
+
+        case DLOP_TEXT:
+            sqd_layout_pdf_text(State, Layout, Style, &g_array_index(DList->Texts, SQD_DL_TEXT, Op->Count), Point);
+        break;
+
+        case DLOP_CLIP:
+            g_string_append(State->Out, "q\n");
+            sqd_layout_pdf_op(State->Out, "re W n", 4, Point[0].X, Point[0].Y, Point[1].X - Point[0].X, Point[1].Y - Point[0].Y);
+        break;
+
+        case DLOP_UNCLIP:
+            // The restore takes the style back with it, opacity included.
+            g_string_append(State->Out, "Q\n");
+            State->Style       = G_MAXUINT;
+            State->Translucent = TRUE;
+        break;
+    }
+
+    if( Paint != DLPAINT_NONE )
+    {
+        State->Paint = Paint;
+
+        if( Style->Color.Alpha < 1.0 )
+            sqd_layout_pdf_flush(State);
+    }
+}
+
+// Note where the next object starts and open it.
+static void
+sqd_layout_pdf_begin_object( FILE *File, GArray *Offsets, guint Object )
+{
+    g_array_index(Offsets, guint64, Object) = ftell(File);
+    fprintf(File, "%u 0 obj\n", Object);
+}
+
+// Native PDF backend: stream the pages straight to FilePath.  Each page is
+// drawn into the display list, deflated and written before the next one is
+// started, so only the object offsets for the xref are kept across pages.
+// The standard fonts are declared once up front and shared; each page has 
+// its own resources for the opacity states of its styles.
+static gboolean
+sqd_layout_pdf_write_document( SQDLayout *sb, gchar *FilePath, PangoLayout *Layout )
+{
+	SQDLayoutPrivate *priv;
+    SQD_DISPLAY_LIST *DList;
+    SQD_DL_STYLE     *Style;
+    SQD_PDF_STATE     State;
+    SQD_BOX           Out;
+    FILE    *File;
+    GArray  *Offsets;
+    GArray  *Order;
+    GString *Fonts;
+    Bytef   *Packed;
+    uLongf   PackedLen;
+    guint    PageObject;
+    guint    FirstPageObject;
+    guint    ObjectCnt;
+    guint64  XrefOffset;
+    gchar    N[2][SQD_NUM_BUF_SIZE];
+    guint    i, j;
+
+	priv  = SQD_LAYOUT_GET_PRIVATE (sb);
+    DList = &priv->DisplayList;
+
+    sqd_layout_get_output_box(sb, &Out);
+
+    File = fopen(FilePath, "wb");
+
+    if( File == NULL )
+    {
+        g_error("Couldn't open \"%s\" for writing.\n", FilePath);
+        return TRUE;
+    }
+
+    // Objects 1 and 2 are the catalog and page tree, then every standard 
+    // font, then a content/resources/page triple per page.  The fonts a 
+    // page uses aren't known until it is drawn, so all of them are there.
+    FirstPageObject = 3 + SQD_PDF_FONT_CNT;
+    ObjectCnt       = FirstPageObject + (3 * priv->Pages->len);
+
+    Offsets = g_array_sized_new(FALSE, TRUE, sizeof (guint64), ObjectCnt);
+    g_array_set_size(Offsets, ObjectCnt);
+
+    fprintf(File, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+
+    sqd_layout_pdf_begin_object(File, Offsets, 1);
+    fprintf(File, "<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+
+    Fonts = g_string_new("/Font <<");
+
+    for( i = 0; i < SQD_PDF_FONT_CNT; i++ )
+    {
+        sqd_layout_pdf_begin_object(File, Offsets, 3 + i);
+        fprintf(File, "<< /Type /Font /Subtype /Type1 /BaseFont /%s /Encoding /WinAnsiEncoding >>\nendobj\n", sqd_pdf_base_fonts[i]);
+
+        g_string_append_printf(Fonts, " /F%u %u 0 R", i, 3 + i);
+    }
+
+    g_string_append(Fonts, " >>");
+
+    State.Out = g_string_sized_new(64 * 1024);
+    Order     = g_array_new(FALSE, FALSE, sizeof (SQD_DL_SORT_KEY));
+    Packed    = NULL;
+
+    for( i = 0; i < priv->Pages->len; i++ )
+    {
+        sqd_layout_build_page_display_list(sb, i);
+
+        g_string_truncate(State.Out, 0);
+
+        State.Style       = G_MAXUINT;
+        State.Paint       = DLPAINT_NONE;
+        State.Translucent = FALSE;
+
+        // Draw y down like the other backends, from the output box's corner.
+        sqd_layout_pdf_op(State.Out, "cm", 6, 1.0, 0.0, 0.0, -1.0, -Out.Start, Out.Bottom);
+
+        sqd_layout_get_replay_order(sb, i, Order);
+
+        for( j = 0; j < Order->len; j++ )
+            sqd_layout_pdf_write_op(sb, &State, Layout, g_array_index(Order, SQD_DL_SORT_KEY, j).Index);
+
+        sqd_layout_pdf_flush(&State);
+
+        PackedLen = compressBound(State.Out->len);
+        Packed    = g_realloc(Packed, PackedLen);
+
+        if( compress2(Packed, &PackedLen, (Bytef *)State.Out->str, State.Out->len, Z_DEFAULT_COMPRESSION) != Z_OK )
+        {
+            g_error("Couldn't compress page %u of \"%s\".\n", i, FilePath);
+            break;
+        }
+
+        PageObject = FirstPageObject + (3 * i);
+
+        sqd_layout_pdf_begin_object(File, Offsets, PageObject);
+        fprintf(File, "<< /Length %lu /Filter /FlateDecode >>\nstream\n", (gulong)PackedLen);
+        fwrite(Packed, 1, PackedLen, File);
+        fprintf(File, "\nendstream\nendobj\n");
+
+        // The opacity states are named after this page's styles.
+        sqd_layout_pdf_begin_object(File, Offsets, PageObject + 1);
+        fprintf(File, "<< %s\n/ExtGState << /GA << /ca 1 /CA 1 >>", Fonts->str);
+
+        for( j = 0; j < DList->Styles->len; j++ )
+        {
+            Style = &g_array_index(DList->Styles, SQD_DL_STYLE, j);
+
+            if( Style->Color.Alpha < 1.0 )
+                fprintf(File, "\n/G%u << /ca %s /CA %s >>", j,
+                        sqd_layout_format_num(N[0], Style->Color.Alpha), sqd_layout_format_num(N[1], Style->Color.Alpha));
+        }
+
+        fprintf(File, " >> >>\nendobj\n");
+
+        sqd_layout_pdf_begin_object(File, Offsets, PageObject + 2);
+        fprintf(File, "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %s %s] /Resources %u 0 R /Contents %u 0 R >>\nendobj\n",
+                sqd_layout_format_num(N[0], Out.End - Out.Start), sqd_layout_format_num(N[1], Out.Bottom - Out.Top),
+                PageObject + 1, PageObject);
+    }
+
+    sqd_layout_clear_display_list(sb);
+
+    g_free(Packed);
+    g_array_free(Order, TRUE);
+    g_string_free(State.Out, TRUE);
+    g_string_free(Fonts, TRUE);
+
+    // The page objects are numbered in order, the tree can be written last.
+    sqd_layout_pdf_begin_object(File, Offsets, 2);
+    fprintf(File, "<< /Type /Pages /Count %u /Kids [", priv->Pages->len);
+
+    for( i = 0; i < priv->Pages->len; i++ )
+        fprintf(File, "%s%u 0 R", (i % 8) ? " " : "\n", FirstPageObject + (3 * i) + 2);
+
+    fprintf(File, "\n] >>\nendobj\n");
+
+    XrefOffset = ftell(File);
+
+    fprintf(File, "xref\n0 %u\n0000000000 65535 f \n", ObjectCnt);
+
+    for( i = 1; i < ObjectCnt; i++ )
+        fprintf(File, "%010lu 00000 n \n", (gulong)g_array_index(Offsets, guint64, i));
+
+    fprintf(File, "trailer\n<< /Size %u /Root 1 0 R >>\nstartxref\n%lu\n%%%%EOF\n", ObjectCnt, (gulong)XrefOffset);
+
+    fclose(File);
+
+    g_array_free(Offsets, TRUE);
+
+    return FALSE;
+}
+
+///////////////////////
+// Interface functions
+///////////////////////
+SQDLayout*
+sqd_layout_new (void)
+{
+	return g_object_new (G_TYPE_SQD_LAYOUT, NULL);
+}
+
+// Set the base URL for the Hudson instance.
+gboolean
+sqd_layout_set_name( SQDLayout *sb, gchar *NameStr )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if(priv->Title.Str)
+        g_free(priv->Title.Str);
+
+    priv->Title.Str = g_strdup(NameStr);
+
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_description( SQDLayout *sb, gchar *DescStr )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if(priv->Description.Str)
+        g_free(priv->Description.Str);
+
+    priv->Description.Str = g_strdup(DescStr);
+
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+// Actor column range touched by an event when packing it into a layer.
+static void
+sqd_layout_get_event_columns( SQD_EVENT *Event, guint *FirstColumn, guint *LastColumn )
+{
+    switch ( Event->ArrowDir )
+    {
+        // External events need to be in a layer by themselves, so claim every column.
+        case ARROWDIR_EXTERNAL_TO:
+        case ARROWDIR_EXTERNAL_FROM:
+            *FirstColumn = 0;
+            *LastColumn  = SQD_PACK_COLUMNS - 1;
+        break;
+
+        case ARROWDIR_STEP:
+            *FirstColumn = Event->StartActorIndx;
+            *LastColumn  = Event->StartActorIndx;
+        break;
+
+        case ARROWDIR_LEFT_TO_RIGHT:
+            *FirstColumn = Event->StartActorIndx;
+            *LastColumn  = Event->EndActorIndx;
+        break;
+
+        case ARROWDIR_RIGHT_TO_LEFT:
+            *FirstColumn = Event->EndActorIndx;
+            *LastColumn  = Event->StartActorIndx;
+        break;
+    }
+}
+
+// Raise the top occupied layer of every column in [Lo, Hi] to at least Value.
+// The tree is a max segment tree over the actor columns; since updates only 
+// ever raise values, the pending tags never need to be pushed down.
+static void
+sqd_layout_pack_tree_raise( SQD_SLOT_PACKER *Packer, guint Node, guint NodeLo, guint NodeHi, guint Lo, guint Hi, gint Value )
+{
+    guint Mid;
+
+    if( (Hi < NodeLo) || (Lo > NodeHi) )
+        return;
+
+    if( Packer->TopLayer[Node] < Value )
+        Packer->TopLayer[Node] = Value;
+
+    if( (Lo <= NodeLo) && (NodeHi <= Hi) )
+    {
+        if( Packer->Pending[Node] < Value )
+            Packer->Pending[Node] = Value;
+        return;
+    }
+
+    Mid = (NodeLo + NodeHi) / 2;
+
+    sqd_layout_pack_tree_raise( Packer, (2 * Node), NodeLo, Mid, Lo, Hi, Value );
+    sqd_layout_pack_tree_raise( Packer, (2 * Node) + 1, Mid + 1, NodeHi, Lo, Hi, Value );
+}
+
+// Find the top occupied layer across the columns in [Lo, Hi].
+static gint
+sqd_layout_pack_tree_query( SQD_SLOT_PACKER *Packer, guint Node, guint NodeLo, guint NodeHi, guint Lo, guint Hi )
+{
+    guint Mid;
+    gint  Result;
+
+    if( (Hi < NodeLo) || (Lo > NodeHi) )
+        return -1;
+
+    if( (Lo <= NodeLo) && (NodeHi <= Hi) )
+        return Packer->TopLayer[Node];
+
+    Mid = (NodeLo + NodeHi) / 2;
+
+    Result = MAX( sqd_layout_pack_tree_query( Packer, (2 * Node), NodeLo, Mid, Lo, Hi ),
+                  sqd_layout_pack_tree_query( Packer, (2 * Node) + 1, Mid + 1, NodeHi, Lo, Hi ) );
+
+    // A pending raise on this node covers the part of the range being queried.
+    return MAX( Result, Packer->Pending[Node] );
+}
+
+// Record that an event now occupies its columns at its slot.
+static void
+sqd_layout_pack_record_event( SQDLayout *sb, SQD_EVENT *Event )
+{
+	SQDLayoutPrivate *priv;
+    guint FirstColumn, LastColumn;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    sqd_layout_get_event_columns( Event, &FirstColumn, &LastColumn );
+
+    sqd_layout_pack_tree_raise( &priv->Packer, 1, 0, SQD_PACK_COLUMNS - 1, FirstColumn, LastColumn, Event->hdr.Index );
+}
+
+// Check whether an event can share an existing layer.
+static gboolean
+sqd_layout_pack_layer_accepts( SQDLayout *sb, guint LayerIndex, SQD_EVENT *Event )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Layers past the end are empty.
+    if( LayerIndex >= priv->EventLayers->len )
+        return TRUE;
+
+    Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, LayerIndex);
+
+    if( Layer->EventCnt == 0 )
+        return TRUE;
+
+    switch ( Event->ArrowDir )
+    {
+        case ARROWDIR_EXTERNAL_TO:
+        case ARROWDIR_EXTERNAL_FROM:
+            return FALSE;
+
+        case ARROWDIR_STEP:
+            return Layer->StepLayer;
+
+        case ARROWDIR_LEFT_TO_RIGHT:
+        case ARROWDIR_RIGHT_TO_LEFT:
+            return Layer->RegularLayer;
+    }
+
+    return FALSE;
+}
+
+// Next layer worth trying after one that turned an event away.
+static guint
+sqd_layout_pack_next_layer( SQDLayout *sb, guint LayerIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, LayerIndex);
+
+    return (Layer->SkipTo > LayerIndex) ? Layer->SkipTo : (LayerIndex + 1);
+}
+
+// Mark actor columns First to Last as used in a layer mask.
+static void
+sqd_layout_mask_set( guint32 *Mask, guint First, guint Last )
+{
+    guint i;
+
+    for( i = First; i <= Last; i++ )
+        Mask[i / 32] |= 0x1u << (i % 32);
+}
+
+// Check whether any of actor columns First to Last are used in a layer mask.
+static gboolean
+sqd_layout_mask_test( guint32 *Mask, guint First, guint Last )
+{
+    guint i;
+
+    for( i = First; i <= Last; i++ )
+    {
+        if( Mask[i / 32] & (0x1u << (i % 32)) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Pick a slot for an event that was added without one.  Events are expected 
+// in time order; the event goes in the first layer above everything already
+// placed in the actor columns it touches.  Since both end actors are in that 
+// range, an event never lands at or before an earlier event on the same actor,
+// which keeps causal order, while unrelated columns still pack into lower layers.
+static guint
+sqd_layout_pack_event_slot( SQDLayout *sb, SQD_EVENT *Event )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    guint FirstColumn, LastColumn;
+    guint First, Next;
+    guint Slot;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    sqd_layout_get_event_columns( Event, &FirstColumn, &LastColumn );
+
+    First = Slot = sqd_layout_pack_tree_query( &priv->Packer, 1, 0, SQD_PACK_COLUMNS - 1, FirstColumn, LastColumn ) + 1;
+
+    // The columns are free from here up, but the layer may hold a different 
+    // kind of event.  Runs of those are jumped with the layers' skip links.
+    while( sqd_layout_pack_layer_accepts( sb, Slot, Event ) == FALSE )
+        Slot = sqd_layout_pack_next_layer( sb, Slot );
+
+    // Point the layers just skipped past the whole run.  A step layer is only
+    // ever skipped by regular events and the other way round, so the link 
+    // stays good until the layers are rebuilt.  External layers turn both 
+    // kinds away and keep stepping one at a time.
+    while( First < Slot )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, First);
+        Next  = sqd_layout_pack_next_layer( sb, First );
+
+        if( Layer->ExternalLayer == FALSE )
+            Layer->SkipTo = Slot;
+
+        First = Next;
+    }
+
+    return Slot;
+}
+
+// Weighted arrow span of an actor ordering.  Position[a] is the column of actor a.
+static double
+sqd_layout_order_cost( double *Weight, double *EdgeWeight, guint *Position, guint ActorCnt )
+{
+    double Cost;
+    guint  a, b;
+
+    Cost = 0;
+
+    for( a = 0; a < ActorCnt; a++ )
+    {
+        // External events reach in from the left edge of the actor box.
+        Cost += EdgeWeight[a] * (Position[a] + 1);
+
+        for( b = a + 1; b < ActorCnt; b++ )
+        {
+            if( Weight[(a * ActorCnt) + b] )
+                Cost += Weight[(a * ActorCnt) + b] * ABS( (gint)Position[a] - (gint)Position[b] );
+        }
+    }
+
+    return Cost;
+}
+
+static gint
+sqd_layout_compare_barycenters( gconstpointer a, gconstpointer b, gpointer user_data )
+{
+    double *Barycenter = user_data;
+    guint   ActorA = *(const guint *)a;
+    guint   ActorB = *(const guint *)b;
+
+    if( Barycenter[ActorA] != Barycenter[ActorB] )
+        return (Barycenter[ActorA] < Barycenter[ActorB]) ? -1 : 1;
+
+    // Fall back to the original order so the sweeps are deterministic.
+    return (gint)ActorA - (gint)ActorB;
+}
+
+// Find an actor ordering with a small weighted arrow span.  Barycentric sweeps
+// pull each actor toward the mean column of the actors it exchanges events with,
+// then passes of adjacent swaps clean up whatever the sweeps left behind.
+// Position[a] receives the new column of actor a.
+static void
+sqd_layout_optimise_actor_order( double *Weight, double *EdgeWeight, guint ActorCnt, guint *Position )
+{
+    double  *Barycenter;
+    guint   *Order;
+    guint   *BestPosition;
+    double   Cost, BestCost;
+    double   Sum, Total, Delta;
+    gboolean Improved;
+    guint    Sweep, Pass;
+    guint    a, b, i, u, v;
+
+    Barycenter   = g_new(double, ActorCnt);
+    Order        = g_new(guint, ActorCnt);
+    BestPosition = g_new(guint, ActorCnt);
+
+    // Start from the document order.
+    for( a = 0; a < ActorCnt; a++ )
+        Position[a] = BestPosition[a] = a;
+
+    BestCost = sqd_layout_order_cost(Weight, EdgeWeight, Position, ActorCnt);
+
+    for( Sweep = 0; Sweep < SQD_REORDER_SWEEPS; Sweep++ )
+    {
+        for( a = 0; a < ActorCnt; a++ )
+        {
+            // A little inertia keeps actors without events where they were.
+            Sum   = Position[a] * SQD_REORDER_INERTIA;
+            Total = SQD_REORDER_INERTIA;
+
+            // The left edge sits one column before the first actor.
+            Sum   -= EdgeWeight[a];
+            Total += EdgeWeight[a];
+
+            for( b = 0; b < ActorCnt; b++ )
+            {
+                if( Weight[(a * ActorCnt) + b] )
+                {
+                    Sum   += Weight[(a * ActorCnt) + b] * Position[b];
+                    Total += Weight[(a * ActorCnt) + b];
+                }
+            }
+
+            Barycenter[a] = Sum / Total;
+            Order[a]      = a;
+        }
+
+        g_qsort_with_data(Order, ActorCnt, sizeof(guint), sqd_layout_compare_barycenters, Barycenter);
+
+        for( i = 0; i < ActorCnt; i++ )
+            Position[ Order[i] ] = i;
+
+        Cost = sqd_layout_order_cost(Weight, EdgeWeight, Position, ActorCnt);
+        if( Cost < BestCost )
+        {
+            BestCost = Cost;
+            memcpy(BestPosition, Position, ActorCnt * sizeof(guint));
+        }
+    }
+
+    memcpy(Position, BestPosition, ActorCnt * sizeof(guint));
+
+    for( a = 0; a < ActorCnt; a++ )
+        Order[ Position[a] ] = a;
+
+    // Swap neighbours while that shortens the arrows.  Moving u right past v only
+    // changes its distance to the actors on either side by one column.
+    for( Pass = 0, Improved = TRUE; Improved && (Pass < SQD_REORDER_SWAP_PASSES); Pass++ )
+    {
+        Improved = FALSE;
+
+        for( i = 0; (i + 1) < ActorCnt; i++ )
+        {
+            u = Order[i];
+            v = Order[i + 1];
+
+            Delta = EdgeWeight[u] - EdgeWeight[v];
+
+            for( b = 0; b < ActorCnt; b++ )
+            {
+                if( (b == u) || (b == v) )
+                    continue;
+
+                if( Position[b] < i )
+                    Delta += Weight[(u * ActorCnt) + b] - Weight[(v * ActorCnt) + b];
+                else
+                    Delta += Weight[(v * ActorCnt) + b] - Weight[(u * ActorCnt) + b];
+            }
+
+            if( Delta < 0 )
+            {
+                Order[i]     = v;
+                Order[i + 1] = u;
+                Position[v]  = i;
+                Position[u]  = i + 1;
+
+                BestCost += Delta;
+                Improved  = TRUE;
+            }
+        }
+    }
+
+    g_free(BestPosition);
+    g_free(Order);
+    g_free(Barycenter);
+}
+
+// Check whether an event's columns are clear of the events already in a layer.
+static gboolean
+sqd_layout_layer_has_room( GList *Events, SQD_EVENT *Event )
+{
+    GList     *Element;
+    SQD_EVENT *Other;
+    guint FirstColumn, LastColumn;
+    guint OtherFirst, OtherLast;
+
+    sqd_layout_get_event_columns( Event, &FirstColumn, &LastColumn );
+
+    Element = g_list_first(Events);
+    while( Element )
+    {
+        Other = Element->data;
+
+        sqd_layout_get_event_columns( Other, &OtherFirst, &OtherLast );
+
+        if( (FirstColumn <= OtherLast) && (OtherFirst <= LastColumn) )
+            return FALSE;
+
+        Element = g_list_next(Element);
+    }
+
+    return TRUE;
+}
+
+// Recompute the occupancy mask of a layer from its events.
+static void
+sqd_layout_update_layer_mask( SQD_EVENT_LAYER *Layer )
+{
+    GList     *Element;
+    SQD_EVENT *Event;
+    guint FirstColumn, LastColumn;
+
+    memset(Layer->UsedMask, 0, sizeof Layer->UsedMask);
+
+    Element = g_list_first(Layer->Events);
+    while( Element )
+    {
+        Event = Element->data;
+
+        if( (Event->ArrowDir != ARROWDIR_EXTERNAL_TO) && (Event->ArrowDir != ARROWDIR_EXTERNAL_FROM) )
+        {
+            sqd_layout_get_event_columns( Event, &FirstColumn, &LastColumn );
+            sqd_layout_mask_set( Layer->UsedMask, FirstColumn, LastColumn );
+        }
+
+        Element = g_list_next(Element);
+    }
+}
+
+// Renumber the actors so that events span as few columns as possible.  Events
+// that shared a slot may cross once their actors move; those are split into
+// extra layers right after the original one so their order is kept.
+static void
+sqd_layout_reorder_actors( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT_LAYER   NewLayer;
+    SQD_EVENT        *Event;
+    SQD_ACTOR        *Actor;
+    SQD_BOX_REGION   *BReg;
+    GPtrArray        *Actors;
+    GArray           *Layers;
+    GList            *Element;
+    GList            *Pending;
+    GList            *Deferred;
+    double *Weight;
+    double *EdgeWeight;
+    guint  *Position;
+    guint   ActorCnt;
+    guint   Start, End;
+    guint   i, j;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    ActorCnt = priv->MaxActorIndex + 1;
+
+    if( ActorCnt < 3 )
+        return;
+
+    Weight     = g_new0(double, ActorCnt * ActorCnt);
+    EdgeWeight = g_new0(double, ActorCnt);
+    Position   = g_new0(guint, ActorCnt);
+
+    // Count the events between each pair of actors.
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        Element = g_list_first(Layer->Events);
+        while( Element )
+        {
+            Event = Element->data;
+
+            switch ( Event->ArrowDir )
+            {
+                case ARROWDIR_LEFT_TO_RIGHT:
+                case ARROWDIR_RIGHT_TO_LEFT:
+                    Start = Event->StartActorIndx;
+                    End   = Event->EndActorIndx;
+
+                    Weight[(Start * ActorCnt) + End] += 1;
+                    Weight[(End * ActorCnt) + Start] += 1;
+                break;
+
+                case ARROWDIR_EXTERNAL_TO:
+                case ARROWDIR_EXTERNAL_FROM:
+                    EdgeWeight[Event->StartActorIndx] += 1;
+                break;
+
+                case ARROWDIR_STEP:
+                break;
+            }
+
+            Element = g_list_next(Element);
+        }
+    }
+
+    sqd_layout_optimise_actor_order(Weight, EdgeWeight, ActorCnt, Position);
+
+    // Move the actors to their new columns.
+    Actors = g_ptr_array_sized_new(ActorCnt);
+    g_ptr_array_set_size(Actors, ActorCnt);
+
+    for( i = 0; i < ActorCnt; i++ )
+    {
+        Actor = g_ptr_array_index(priv->Actors, i);
+
+        Actor->hdr.Index = Position[i];
+        g_ptr_array_index(Actors, Position[i]) = Actor;
+    }
+
+    g_ptr_array_free(priv->Actors, TRUE);
+    priv->Actors = Actors;
+
+    // Box regions run from their start actor to their end actor.
+    for( i = 0; i < priv->BoxRegions->len; i++ )
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+
+        if( BReg->SActorRef->hdr.Index > BReg->EActorRef->hdr.Index )
+        {
+            Actor           = BReg->SActorRef;
+            BReg->SActorRef = BReg->EActorRef;
+            BReg->EActorRef = Actor;
+        }
+    }
+
+    // Renumber the events and rebuild the layers, splitting any that now collide.
+    Layers = g_array_new(FALSE, TRUE, sizeof (SQD_EVENT_LAYER));
+
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer   = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        Pending = Layer->Events;
+
+        Element = g_list_first(Pending);
+        while( Element )
+        {
+            Event = Element->data;
+
+            Event->StartActorIndx = Position[Event->StartActorIndx];
+
+            if( (Event->ArrowDir == ARROWDIR_LEFT_TO_RIGHT) || (Event->ArrowDir == ARROWDIR_RIGHT_TO_LEFT) )
+            {
+                Event->EndActorIndx = Position[Event->EndActorIndx];
+
+                if( Event->StartActorIndx < Event->EndActorIndx )
+                    Event->ArrowDir = ARROWDIR_LEFT_TO_RIGHT;
+                else
+                    Event->ArrowDir = ARROWDIR_RIGHT_TO_LEFT;
+            }
+
+            Element = g_list_next(Element);
+        }
+
+        // Keep one layer, even if empty, for every original slot.
+        do
+        {
+            NewLayer           = *Layer;
+            NewLayer.Events    = NULL;
+            NewLayer.EventCnt  = 0;
+            NewLayer.Summaries = NULL;
+            NewLayer.Dirty     = TRUE;
+
+            Deferred = NULL;
+
+            Element = g_list_first(Pending);
+            while( Element )
+            {
+                Event = Element->data;
+
+                if( sqd_layout_layer_has_room(NewLayer.Events, Event) )
+                {
+                    Event->hdr.Index   = Layers->len;
+                    NewLayer.Events    = g_list_append(NewLayer.Events, Event);
+                    NewLayer.EventCnt += 1;
+                }
+                else
+                    Deferred = g_list_append(Deferred, Event);
+
+                Element = g_list_next(Element);
+            }
+
+            if( Pending != Layer->Events )
+                g_list_free(Pending);
+
+            sqd_layout_update_layer_mask(&NewLayer);
+            g_array_append_val(Layers, NewLayer);
+
+            Pending = Deferred;
+        }
+        while( Pending );
+
+        // The summary bands are listed again once the slots settle.
+        g_list_free(Layer->Events);
+        g_list_free(Layer->Summaries);
+    }
+
+    g_array_free(priv->EventLayers, TRUE);
+    priv->EventLayers   = Layers;
+    priv->MaxEventIndex = Layers->len;
+
+    // Start the slot packer over with the new columns.
+    sqd_layout_repack_events(sb);
+
+    g_free(Position);
+    g_free(EdgeWeight);
+    g_free(Weight);
+}
+
+// Start the slot packer over from the events already in the layers.
+static void
+sqd_layout_repack_events( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    GList            *Element;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    for( i = 0; i < (2 * SQD_PACK_COLUMNS); i++ )
+    {
+        priv->Packer.TopLayer[i] = -1;
+        priv->Packer.Pending[i]  = -1;
+    }
+
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        Layer->SkipTo = 0;
+
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+            sqd_layout_pack_record_event(sb, Element->data);
+    }
+}
+
+static guint64
+sqd_layout_hash_step( guint64 Hash, guint Value )
+{
+    return (Hash ^ Value) * SQD_FOLD_FNV_PRIME;
+}
+
+// Hash what a slot looks like: the actors, direction, labels and class of 
+// each event in it.  Slots that draw the same hash the same, but a match 
+// still has to be confirmed with sqd_layout_layers_match.
+static guint64
+sqd_layout_hash_layer( SQD_EVENT_LAYER *Layer )
+{
+    SQD_EVENT *Event;
+    GList     *Element;
+    guint64    Hash;
+
+    Hash = SQD_FOLD_FNV_OFFSET;
+
+    for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+    {
+        Event = Element->data;
+
+        Hash = sqd_layout_hash_step(Hash, Event->StartActorIndx);
+        Hash = sqd_layout_hash_step(Hash, Event->EndActorIndx);
+        Hash = sqd_layout_hash_step(Hash, Event->ArrowDir);
+        Hash = sqd_layout_hash_step(Hash, Event->UpperText.Str ? g_str_hash(Event->UpperText.Str) : 0);
+        Hash = sqd_layout_hash_step(Hash, Event->LowerText.Str ? g_str_hash(Event->LowerText.Str) : 0);
+        Hash = sqd_layout_hash_step(Hash, Event->hdr.ClassStr ? g_str_hash(Event->hdr.ClassStr) : 0);
+    }
+
+    return Hash;
+}
+
+// Compare two slots event by event on everything that is drawn.
+static gboolean
+sqd_layout_layers_match( SQD_EVENT_LAYER *LayerA, SQD_EVENT_LAYER *LayerB )
+{
+    SQD_EVENT *EventA;
+    SQD_EVENT *EventB;
+    GList     *ElementA;
+    GList     *ElementB;
+
+    ElementA = g_list_first(LayerA->Events);
+    ElementB = g_list_first(LayerB->Events);
+
+    while( ElementA && ElementB )
+    {
+        EventA = ElementA->data;
+        EventB = ElementB->data;
+
+        if( (EventA->StartActorIndx != EventB->StartActorIndx)
+            || (EventA->EndActorIndx != EventB->EndActorIndx)
+            || (EventA->ArrowDir != EventB->ArrowDir)
+            || (sqd_layout_str_match(EventA->UpperText.Str, EventB->UpperText.Str) == FALSE)
+            || (sqd_layout_str_match(EventA->LowerText.Str, EventB->LowerText.Str) == FALSE)
+            || (sqd_layout_str_match(EventA->hdr.ClassStr, EventB->hdr.ClassStr) == FALSE) )
+            return FALSE;
+
+        ElementA = g_list_next(ElementA);
+        ElementB = g_list_next(ElementB);
+    }
+
+    return ( (ElementA == NULL) && (ElementB == NULL) );
+}
+
+// Collect the events that notes and regions point at.  They have to stay 
+// drawn whatever the layout does to the rest of the slots.
+static GHashTable *
+sqd_layout_collect_pinned_events( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE         *Note;
+    SQD_ACTOR_REGION *AReg;
+    SQD_BOX_REGION   *BReg;
+    GHashTable       *Pinned;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Pinned = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    for( i = 0; i < priv->MaxNoteIndex; i++ )
+    {
+        Note = g_ptr_array_index(priv->Notes, i);
+        if( Note->RefObj && (Note->RefObj->Type == SDOBJ_EVENT) )
+            g_hash_table_insert(Pinned, Note->RefObj, Note->RefObj);
+    }
+
+    for( i = 0; i < priv->ActorRegions->len; i++ )
+    {
+        AReg = g_ptr_array_index(priv->ActorRegions, i);
+        g_hash_table_insert(Pinned, AReg->SEventRef, AReg->SEventRef);
+        g_hash_table_insert(Pinned, AReg->EEventRef, AReg->EEventRef);
+    }
+
+    for( i = 0; i < priv->BoxRegions->len; i++ )
+    {
+        BReg = g_ptr_array_index(priv->BoxRegions, i);
+        g_hash_table_insert(Pinned, BReg->SEventRef, BReg->SEventRef);
+        g_hash_table_insert(Pinned, BReg->EEventRef, BReg->EEventRef);
+    }
+
+    return Pinned;
+}
+
+// Restore the heap order of the sample reservoir from the root down, the 
+// largest key stays on top so it is the first to be replaced.
+static void
+sqd_layout_sift_sample_down( SQD_SAMPLE *Samples, guint Count, guint i )
+{
+    SQD_SAMPLE Tmp;
+    guint Child;
+
+    while( (Child = (2 * i) + 1) < Count )
+    {
+        if( ((Child + 1) < Count) && (Samples[Child + 1].Key > Samples[Child].Key) )
+            Child += 1;
+
+        if( Samples[i].Key >= Samples[Child].Key )
+            break;
+
+        Tmp            = Samples[Child];
+        Samples[Child] = Samples[i];
+        Samples[i]     = Tmp;
+
+        i = Child;
+    }
+}
+
+static void
+sqd_layout_sift_sample_up( SQD_SAMPLE *Samples, guint i )
+{
+    SQD_SAMPLE Tmp;
+    guint Parent;
+
+    while( i > 0 )
+    {
+        Parent = (i - 1) / 2;
+
+        if( Samples[Parent].Key >= Samples[i].Key )
+            break;
+
+        Tmp             = Samples[Parent];
+        Samples[Parent] = Samples[i];
+        Samples[i]      = Tmp;
+
+        i = Parent;
+    }
+}
+
+// Cut the events down to MaxEvents.  Events that notes and regions point at 
+// are always kept.  The rest are sampled in one pass with a bounded 
+// reservoir: each event is keyed by a random number scaled by how many 
+// events of its stratum (actor pair, direction and stretch of the trace) 
+// came before it, and the smallest keys are kept.  Every stratum gets its 
+// first events in before any stratum gets many, so rare exchanges survive 
+// next to the chatty ones.  Slots left empty are removed and the next kept 
+// slot records how many events were dropped before it.
+static void
+sqd_layout_sample_events( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT_LAYER   NewLayer;
+    SQD_EVENT        *Event;
+    SQD_SAMPLE       *Samples;
+    SQD_SAMPLE        Sample;
+    GHashTable       *Pinned;
+    GHashTable       *Kept;
+    GHashTable       *Strata;
+    GArray           *Layers;
+    GList            *Element;
+    GRand            *Rand;
+    guint  EventCnt;
+    guint  Budget;
+    guint  SampleCnt;
+    guint  Stratum;
+    guint  Seen;
+    guint  Dropped;
+    guint  i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    EventCnt = 0;
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+        EventCnt += g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i).EventCnt;
+
+    if( EventCnt <= priv->MaxEvents )
+        return;
+
+    Pinned = sqd_layout_collect_pinned_events(sb);
+
+    Budget = 0;
+    if( priv->MaxEvents > g_hash_table_size(Pinned) )
+        Budget = priv->MaxEvents - g_hash_table_size(Pinned);
+
+    Samples   = g_new(SQD_SAMPLE, Budget + 1);
+    SampleCnt = 0;
+    Strata    = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    // The same seed every time, so the same trace draws the same way.
+    Rand = g_rand_new_with_seed(SQD_SAMPLE_SEED);
+
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            Event = Element->data;
+
+            if( g_hash_table_lookup(Pinned, Event) )
+                continue;
+
+            Stratum  = (Event->ArrowDir << 16) | (Event->StartActorIndx << 8) | Event->EndActorIndx;
+            Stratum  = (Stratum * SQD_SAMPLE_TIME_BUCKETS) + ((i * SQD_SAMPLE_TIME_BUCKETS) / priv->MaxEventIndex);
+            Stratum += 1;
+
+            Seen = GPOINTER_TO_UINT( g_hash_table_lookup(Strata, GUINT_TO_POINTER(Stratum)) ) + 1;
+            g_hash_table_insert(Strata, GUINT_TO_POINTER(Stratum), GUINT_TO_POINTER(Seen));
+
+            Sample.Key   = g_rand_double(Rand) * Seen;
+            Sample.Event = Event;
+
+            if( SampleCnt < Budget )
+            {
+                Samples[SampleCnt] = Sample;
+                sqd_layout_sift_sample_up(Samples, SampleCnt);
+                SampleCnt += 1;
+            }
+            else if( SampleCnt && (Sample.Key < Samples[0].Key) )
+            {
+                Samples[0] = Sample;
+                sqd_layout_sift_sample_down(Samples, SampleCnt, 0);
+            }
+        }
+    }
+
+    Kept = Pinned;
+    for( i = 0; i < SampleCnt; i++ )
+        g_hash_table_insert(Kept, Samples[i].Event, Samples[i].Event);
+
+    // Rebuild the slots from the kept events.
+    Layers  = g_array_new(FALSE, TRUE, sizeof (SQD_EVENT_LAYER));
+    Dropped = 0;
+
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        NewLayer            = *Layer;
+        NewLayer.Events     = NULL;
+        NewLayer.EventCnt   = 0;
+        NewLayer.Summaries  = NULL;
+        NewLayer.Dirty      = TRUE;
+
+        // A marker from an earlier sampling has the old count in it, it is 
+        // built again from the new count when the slot is measured.  The 
+        // events it counted are still gone, so they carry over.
+        Dropped += Layer->DroppedCnt;
+
+        g_free(NewLayer.DroppedText.Str);
+        NewLayer.DroppedText.Str    = NULL;
+        NewLayer.DroppedText.Width  = 0;
+        NewLayer.DroppedText.Height = 0;
+
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            Event = Element->data;
+
+            // Dropped events point at the next slot that is drawn.
+            Event->hdr.Index = Layers->len;
+
+            if( g_hash_table_lookup(Kept, Event) )
+            {
+                NewLayer.Events    = g_list_append(NewLayer.Events, Event);
+                NewLayer.EventCnt += 1;
+            }
+            else
+                Dropped += 1;
+        }
+
+        // Slots that were empty to start with are gaps the document asked for.
+        if( (NewLayer.Events == NULL) && (Layer->Events != NULL) )
+            continue;
+
+        sqd_layout_update_layer_mask(&NewLayer);
+
+        NewLayer.DroppedCnt = Dropped;
+        Dropped = 0;
+
+        g_array_append_val(Layers, NewLayer);
+    }
+
+    // Mark anything dropped off the end with an empty slot.
+    if( Dropped )
+    {
+        memset(&NewLayer, 0, sizeof (SQD_EVENT_LAYER));
+        NewLayer.Dirty      = TRUE;
+        NewLayer.DroppedCnt = Dropped;
+
+        g_array_append_val(Layers, NewLayer);
+    }
+
+    for( i = 0; i < priv->MaxEventIndex; i++ )
+    {
+        g_list_free(g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i).Events);
+        g_list_free(g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i).Summaries);
+    }
+
+    g_array_free(priv->EventLayers, TRUE);
+    priv->EventLayers   = Layers;
+    priv->MaxEventIndex = Layers->len;
+
+    sqd_layout_repack_events(sb);
+
+    g_rand_free(Rand);
+    g_hash_table_destroy(Strata);
+    g_hash_table_destroy(Kept);
+    g_free(Samples);
+}
+
+// Put a repeat count box region around the slots of a folded block.
+static void
+sqd_layout_add_repeat_region( SQDLayout *sb, guint FirstLayer, guint LastLayer, guint RepeatCnt )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    SQD_BOX_REGION   *Region;
+    GList            *Element;
+    gchar            *IdStr;
+    guint StartActor, EndActor;
+    guint i, Suffix;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Region = malloc( sizeof(SQD_BOX_REGION) );
+
+    Region->SEventRef = NULL;
+    Region->EEventRef = NULL;
+
+    StartActor = priv->MaxActorIndex;
+    EndActor   = 0;
+
+    for( i = FirstLayer; i <= LastLayer; i++ )
+    {
+        Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            Event = Element->data;
+
+            if( Region->SEventRef == NULL )
+                Region->SEventRef = Event;
+            Region->EEventRef = Event;
+
+            StartActor = MIN(StartActor, Event->StartActorIndx);
+            EndActor   = MAX(EndActor, Event->StartActorIndx);
+
+            if( (Event->ArrowDir == ARROWDIR_LEFT_TO_RIGHT) || (Event->ArrowDir == ARROWDIR_RIGHT_TO_LEFT) )
+            {
+                StartActor = MIN(StartActor, Event->EndActorIndx);
+                EndActor   = MAX(EndActor, Event->EndActorIndx);
+            }
+        }
+    }
+
+    // Pick an id that doesn't clash with the document's own.
+    Suffix = priv->BoxRegions->len;
+    IdStr  = g_strdup_printf("repeat-%u", Suffix);
+    while( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_free(IdStr);
+        Suffix += 1;
+        IdStr   = g_strdup_printf("repeat-%u", Suffix);
+    }
+
+    Region->hdr.Index    = 0;
+    Region->hdr.Type     = SDOBJ_BREGION;
+    Region->hdr.Dirty    = TRUE;
+    Region->hdr.IdStr    = IdStr;
+    Region->hdr.ClassStr = g_strdup("repeat");
+
+    Region->SActorRef = g_ptr_array_index(priv->Actors, StartActor);
+    Region->EActorRef = g_ptr_array_index(priv->Actors, EndActor);
+
+    Region->BoundsBox.Top     = 0;
+    Region->BoundsBox.Bottom  = 0;
+    Region->BoundsBox.Start   = 0;
+    Region->BoundsBox.End     = 0;
+
+    Region->Label.Str    = g_strdup_printf("\xc3\x97%u", RepeatCnt);
+    Region->Label.Width  = 0;
+    Region->Label.Height = 0;
+
+    Region->Collapsed          = FALSE;
+    Region->SummaryText.Str    = NULL;
+    Region->SummaryText.Width  = 0;
+    Region->SummaryText.Height = 0;
+    Region->SummaryOffset      = 0;
+
+    g_ptr_array_add(priv->BoxRegions, Region);
+    g_hash_table_insert( priv->IdTable, Region->hdr.IdStr, Region );
+}
+
+// Fold back to back repeats of the same run of slots into one drawn copy 
+// inside a "xN" box region.  Slots are compared by a hash of their events, 
+// and runs of up to SQD_FOLD_MAX_PERIOD slots are compared with a rolling 
+// hash over those, so checking a run costs the same at any length; the 
+// slots of a hash match are then compared for real.  Slots holding events 
+// that notes or regions refer to are never folded away.  The folded away 
+// events stay in the IdTable and are kept in FoldedEvents.
+static void
+sqd_layout_fold_repeats( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    SQD_EVENT        *Event;
+    GHashTable       *Pinned;
+    GArray           *Layers;
+    GArray           *Folds;
+    GList            *Element;
+    SQD_FOLD          Fold;
+    SQD_FOLD         *FoldPtr;
+    guint64 *Sig;
+    guint64 *Prefix;
+    guint64 *Power;
+    guint   *PinCnt;
+    guint64  BlockHash;
+    guint    LayerCnt;
+    guint    Period, Repeats;
+    guint    BestPeriod, BestRepeats, BestSaved;
+    guint    BlockStart;
+    guint    i, j, k;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    LayerCnt = priv->MaxEventIndex;
+
+    if( LayerCnt < SQD_FOLD_MIN_REPEATS )
+        return;
+
+    // Events that something else points at have to stay drawn.
+    Pinned = sqd_layout_collect_pinned_events(sb);
+
+    Sig    = g_new(guint64, LayerCnt);
+    Prefix = g_new(guint64, LayerCnt + 1);
+    Power  = g_new(guint64, SQD_FOLD_MAX_PERIOD + 1);
+    PinCnt = g_new(guint, LayerCnt + 1);
+
+    Prefix[0] = 0;
+    PinCnt[0] = 0;
+
+    for( i = 0; i < LayerCnt; i++ )
+    {
+        Layer  = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+        Sig[i] = sqd_layout_hash_layer(Layer);
+
+        Prefix[i + 1] = (Prefix[i] * SQD_FOLD_HASH_BASE) + Sig[i];
+
+        // Empty slots are gaps the document asked for, leave them be.
+        PinCnt[i + 1] = PinCnt[i] + ((Layer->Events == NULL) ? 1 : 0);
+
+        for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+        {
+            if( g_hash_table_lookup(Pinned, Element->data) )
+            {
+                PinCnt[i + 1] = PinCnt[i] + 1;
+                break;
+            }
+        }
+    }
+
+    Power[0] = 1;
+    for( i = 1; i <= SQD_FOLD_MAX_PERIOD; i++ )
+        Power[i] = Power[i - 1] * SQD_FOLD_HASH_BASE;
+
+    Layers = g_array_new(FALSE, TRUE, sizeof (SQD_EVENT_LAYER));
+    Folds  = g_array_new(FALSE, FALSE, sizeof (SQD_FOLD));
+
+    i = 0;
+    while( i < LayerCnt )
+    {
+        // Find the period that folds away the most slots from here.
+        BestPeriod  = 0;
+        BestRepeats = 0;
+        BestSaved   = 0;
+
+        for( Period = 1; (Period <= SQD_FOLD_MAX_PERIOD) && ((i + (SQD_FOLD_MIN_REPEATS * Period)) <= LayerCnt); Period++ )
+        {
+            BlockHash = Prefix[i + Period] - (Prefix[i] * Power[Period]);
+
+            for( Repeats = 1; (i + ((Repeats + 1) * Period)) <= LayerCnt; Repeats++ )
+            {
+                j = i + (Repeats * Period);
+
+                if( (Prefix[j + Period] - (Prefix[j] * Power[Period])) != BlockHash )
+                    break;
+
+                if( PinCnt[j + Period] != PinCnt[j] )
+                    break;
+            }
+
+            if( (Repeats >= SQD_FOLD_MIN_REPEATS) && (((Repeats - 1) * Period) > BestSaved) )
+            {
+                BestPeriod  = Period;
+                BestRepeats = Repeats;
+                BestSaved   = (Repeats - 1) * Period;
+            }
+        }
+
+        // Compare the slots themselves so a hash collision can't fold 
+        // slots that differ.
+        if( BestPeriod )
+        {
+            for( j = i + BestPeriod; j < (i + (BestRepeats * BestPeriod)); j++ )
+            {
+                if( sqd_layout_layers_match(&g_array_index(priv->EventLayers, SQD_EVENT_LAYER, j), 
+                                            &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i + ((j - i) % BestPeriod))) == FALSE )
+                    break;
+            }
+
+            BestRepeats = (j - i) / BestPeriod;
+        }
+
+        if( (BestPeriod == 0) || (BestRepeats < SQD_FOLD_MIN_REPEATS) )
+        {
+            Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i);
+
+            for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+            {
+                Event = Element->data;
+                Event->hdr.Index = Layers->len;
+            }
+
+            Layer->Dirty = TRUE;
+            g_array_append_val(Layers, *Layer);
+
+            i += 1;
+            continue;
+        }
+
+        // Keep the first copy of the block.
+        BlockStart = Layers->len;
+        for( k = 0; k < BestPeriod; k++ )
+        {
+            Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i + k);
+
+            for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+            {
+                Event = Element->data;
+                Event->hdr.Index = Layers->len;
+            }
+
+            Layer->Dirty = TRUE;
+            g_array_append_val(Layers, *Layer);
+        }
+
+        // The repeats are no longer drawn; their events point at the copy 
+        // that stands in for them so edits still land somewhere sensible.
+        for( k = BestPeriod; k < (BestRepeats * BestPeriod); k++ )
+        {
+            Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, i + k);
+
+            for( Element = g_list_first(Layer->Events); Element; Element = g_list_next(Element) )
+            {
+                Event = Element->data;
+                Event->hdr.Index = BlockStart + (k % BestPeriod);
+
+                g_ptr_array_add(priv->FoldedEvents, Event);
+            }
+
+            g_list_free(Layer->Events);
+            g_list_free(Layer->Summaries);
+        }
+
+        i += BestRepeats * BestPeriod;
+
+        Fold.FirstLayer = BlockStart;
+        Fold.LastLayer  = Layers->len - 1;
+        Fold.RepeatCnt  = BestRepeats;
+        g_array_append_val(Folds, Fold);
+    }
+
+    g_array_free(priv->EventLayers, TRUE);
+    priv->EventLayers   = Layers;
+    priv->MaxEventIndex = Layers->len;
+
+    // The regions go around the kept copies once they are in place.
+    for( i = 0; i < Folds->len; i++ )
+    {
+        FoldPtr = &g_array_index(Folds, SQD_FOLD, i);
+        sqd_layout_add_repeat_region(sb, FoldPtr->FirstLayer, FoldPtr->LastLayer, FoldPtr->RepeatCnt);
+    }
+
+    sqd_layout_repack_events(sb);
+
+    g_array_free(Folds, TRUE);
+    g_free(PinCnt);
+    g_free(Power);
+    g_free(Prefix);
+    g_free(Sig);
+    g_hash_table_destroy(Pinned);
+}
+
+// Flag a layer to be arranged again on the next layout pass.
+static void
+sqd_layout_mark_layer_dirty( SQDLayout *sb, guint LayerIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, LayerIndex);
+    Layer->Dirty = TRUE;
+
+    if( (priv->DirtyFirstLayer == G_MAXUINT) || (LayerIndex < priv->DirtyFirstLayer) )
+        priv->DirtyFirstLayer = LayerIndex;
+
+    if( LayerIndex > priv->DirtyLastLayer )
+        priv->DirtyLastLayer = LayerIndex;
+}
+
+static gboolean
+sqd_layout_add_event_common( SQDLayout *sb, SQD_EVENT *Event, int SlotIndex )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT_LAYER  *Layer;
+    guint            FirstColumn, LastColumn, i;
+    guint            OldLayerCnt;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Events without an explicit slot get packed into the earliest free one.
+    if( SlotIndex == SQD_LAYOUT_AUTO_SLOT )
+        Event->hdr.Index = sqd_layout_pack_event_slot(sb, Event);
+    else
+        Event->hdr.Index = SlotIndex;
+
+    if( Event->hdr.Index >= priv->MaxEventIndex )
+        priv->MaxEventIndex = Event->hdr.Index+1;
+
+    printf("Event Common: %d, %s\n", Event->hdr.Index, Event->hdr.IdStr);
+
+    // Add this object to the ID hash table.
+    g_hash_table_insert( priv->IdTable, Event->hdr.IdStr, Event );
+
+    if( priv->EventLayers->len < (Event->hdr.Index + 1) )
+    {
+        OldLayerCnt = priv->EventLayers->len;
+        g_array_set_size(priv->EventLayers, (Event->hdr.Index + 1));
+
+        // Any skipped slots still need a position.
+        for( i = OldLayerCnt; i < priv->EventLayers->len; i++ )
+            sqd_layout_mark_layer_dirty(sb, i);
+    }
+    Layer = &g_array_index(priv->EventLayers, SQD_EVENT_LAYER, Event->hdr.Index);
+
+    Event->hdr.Dirty = TRUE;
+    sqd_layout_mark_layer_dirty(sb, Event->hdr.Index);
+
+    // New events may start or extend a repeat on the next full arrange.
+    priv->RepeatsFolded   = FALSE;
+    priv->EventsSampled   = FALSE;
+    priv->ActorsReordered = FALSE;
+
+    // Labels feed into the column widths.
+    if( priv->VariableColumns )
+        priv->LayoutDirty = TRUE;
+
+    Layer->EventCnt += 1;
+
+    switch ( Event->ArrowDir )
+    {
+        // External events need to be in a layer by themselves.
+        case ARROWDIR_EXTERNAL_TO:
+            if( Layer->EventCnt > 1 )
+            {
+                g_error("External events must be in there own slot.");
+                return TRUE;
+            }
+            Layer->ExternalLayer = TRUE;
+        break;
+
+        // External events need to be in a layer by themselves.
+        case ARROWDIR_EXTERNAL_FROM:
+            if( Layer->EventCnt > 1 )
+            {
+                g_error("External events must be in there own slot.");
+                return TRUE;
+            }
+            Layer->ExternalLayer = TRUE;
+        break;
+
+        case ARROWDIR_STEP:
+            if( (Layer->EventCnt > 1) && (Layer->StepLayer == FALSE) )
+            {
+                g_error("Step events can only share a slot with other step events.");
+                return TRUE;
+            }
+            Layer->StepLayer = TRUE;
+        break;
+
+        case ARROWDIR_LEFT_TO_RIGHT:
+            if( (Layer->EventCnt > 1) && (Layer->RegularLayer == FALSE) )
+            {
+                g_error("Regular events can only share a slot with other regular events.");
+                return TRUE;
+            }
+            Layer->RegularLayer = TRUE;
+        break;
+
+        case ARROWDIR_RIGHT_TO_LEFT:
+            if( (Layer->EventCnt > 1) && (Layer->RegularLayer == FALSE) )
+            {
+                g_error("Regular events can only share a slot with other regular events.");
+                return TRUE;
+            }
+            Layer->RegularLayer = TRUE;
+        break;
+    }
+
+    // External events have the layer to themselves, the rest claim their columns.
+    if( Layer->ExternalLayer == FALSE )
+    {
+        sqd_layout_get_event_columns( Event, &FirstColumn, &LastColumn );
+
+        if( sqd_layout_mask_test( Layer->UsedMask, FirstColumn, LastColumn ) )
+        {
+            printf("ERROR: Event Collision\n");
+            exit(-1);
+        }
+
+        sqd_layout_mask_set( Layer->UsedMask, FirstColumn, LastColumn );
+    }
+
+    printf("0x%x\n", Layer->Events);
+
+    Layer->Events = g_list_append(Layer->Events, Event);
+
+    // Keep the packer aware of explicitly slotted events too.
+    sqd_layout_pack_record_event(sb, Event);
+
+}
+
+gboolean
+sqd_layout_add_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *StartActorId, gchar *EndActorId, char *TopLabel, char *BottomLabel)
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT        *TmpEvent;
+    SQD_EVENT_LAYER  *Layer;
+    guint32          TmpMask, i;
+    SQD_ACTOR        *SAPtr;
+    SQD_ACTOR        *EAPtr;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    // Lookup the start actor
+    SAPtr = g_hash_table_lookup(priv->IdTable, StartActorId);
+    g_print("Start Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
+    if( SAPtr == NULL )
+    {
+        g_error("Couldn't find start actor with id \"%s\".\n", StartActorId);
+        return TRUE;
+    }
+    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+    {
+        g_error("Object with id \"%s\" is not of the required actor type.\n", StartActorId);
+        return TRUE;
+    }
+
+    // Lookup the end actor
+    EAPtr = g_hash_table_lookup(priv->IdTable, EndActorId);
+    g_print("End Actor Lookup: 0x%x, %d, %d, %s\n", EAPtr, EAPtr->hdr.Index, EAPtr->hdr.Type, EAPtr->hdr.IdStr); 
+    if( EAPtr == NULL )
+    {
+        g_error("Couldn't find end actor with id \"%s\".\n", EndActorId);
+        return TRUE;
+    }
+    if( EAPtr->hdr.Type != SDOBJ_ACTOR )
+    {
+        g_error("Object with id \"%s\" is not of the required actor type.\n", EndActorId);
+        return TRUE;
+    }
+
+    TmpEvent = malloc( sizeof(SQD_EVENT) );
+
+    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+
+    TmpEvent->hdr.Type          = SDOBJ_EVENT;
+    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
+    TmpEvent->hdr.ClassStr      = ClassStr ? (gchar *)g_intern_string(ClassStr):NULL;
+
+    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
+    TmpEvent->EndActorIndx      = EAPtr->hdr.Index;
+
+    if( TmpEvent->StartActorIndx < TmpEvent->EndActorIndx )
+        TmpEvent->ArrowDir = ARROWDIR_LEFT_TO_RIGHT;
+    else 
+        TmpEvent->ArrowDir = ARROWDIR_RIGHT_TO_LEFT;
+
+    if( TopLabel )
+        TmpEvent->UpperText.Str  = strdup(TopLabel);
+
+    if( BottomLabel )
+        TmpEvent->LowerText.Str  = strdup(BottomLabel);
+
+    sqd_layout_add_event_common( sb, TmpEvent, SlotIndex );
+
+}
+
+gboolean
+sqd_layout_add_step_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *ActorId, gchar *Label)
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT        *TmpEvent;
+    SQD_EVENT_LAYER  *Layer;
+    guint32          TmpMask, i;
+    SQD_ACTOR        *SAPtr;
+    SQD_ACTOR        *EAPtr;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    // Lookup the actor
+    SAPtr = g_hash_table_lookup(priv->IdTable, ActorId);
+    g_print("Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
+    if( SAPtr == NULL )
+    {
+        g_error("Couldn't find start actor with id \"%s\".\n", ActorId);
+        return TRUE;
+    }
+    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+    {
+        g_error("Object with id \"%s\" is not of the required actor type.\n", ActorId);
+        return TRUE;
+    }
+
+    TmpEvent = malloc( sizeof(SQD_EVENT) );
+
+    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+
+    TmpEvent->hdr.Type          = SDOBJ_EVENT;
+    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
+    TmpEvent->hdr.ClassStr      = ClassStr ? (gchar *)g_intern_string(ClassStr):NULL;
+
+    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
+    TmpEvent->EndActorIndx      = 0;
+    
+    TmpEvent->ArrowDir          = ARROWDIR_STEP;
+
+    if( Label )
+        TmpEvent->UpperText.Str  = strdup(Label);
+
+    sqd_layout_add_event_common( sb, TmpEvent, SlotIndex );
+
+}
+
+gboolean
+sqd_layout_add_external_event( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int SlotIndex, gchar *ActorId, gchar *Label, gboolean FromFlag )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT        *TmpEvent;
+    SQD_EVENT_LAYER  *Layer;
+    guint32          TmpMask, i;
+    SQD_ACTOR        *SAPtr;
+    SQD_ACTOR        *EAPtr;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    // Lookup the actor
+    SAPtr = g_hash_table_lookup(priv->IdTable, ActorId);
+    g_print("Actor Lookup: 0x%x, %d, %d, %s\n", SAPtr, SAPtr->hdr.Index, SAPtr->hdr.Type, SAPtr->hdr.IdStr); 
+    if( SAPtr == NULL )
+    {
+        g_error("Couldn't find start actor with id \"%s\".\n", ActorId);
+        return TRUE;
+    }
+    if( SAPtr->hdr.Type != SDOBJ_ACTOR )
+    {
+        g_error("Object with id \"%s\" is not of the required actor type.\n", ActorId);
+        return TRUE;
+    }
+
+    TmpEvent = malloc( sizeof(SQD_EVENT) );
+
+    memset(TmpEvent, 0, sizeof(SQD_EVENT));
+
+    TmpEvent->hdr.Type          = SDOBJ_EVENT;
+    TmpEvent->hdr.IdStr         = g_strdup(IdStr);
+    TmpEvent->hdr.ClassStr      = ClassStr ? (gchar *)g_intern_string(ClassStr):NULL;
+
+    TmpEvent->StartActorIndx    = SAPtr->hdr.Index;
+    TmpEvent->EndActorIndx      = 0;
+    
+    if( FromFlag )
+        TmpEvent->ArrowDir = ARROWDIR_EXTERNAL_FROM;
+    else
+        TmpEvent->ArrowDir = ARROWDIR_EXTERNAL_TO;
+
+    if( Label )
+        TmpEvent->UpperText.Str  = strdup(Label);
+
+    sqd_layout_add_event_common( sb, TmpEvent, SlotIndex );
+
+}
+
+gboolean
+sqd_layout_add_actor( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int ActorIndex, gchar *ActorTitle )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR *TmpActor;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Event layers keep one bit per actor column.
+    if( (ActorIndex < 0) || (ActorIndex >= SQD_PACK_COLUMNS) )
+    {
+        g_error("Actor index %d is out of range, at most %d actors are supported.\n", ActorIndex, SQD_PACK_COLUMNS);
+        return TRUE;
+    }
+
+    TmpActor = malloc( sizeof(SQD_ACTOR) );
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    TmpActor->hdr.Index           = ActorIndex;
+    TmpActor->hdr.Type            = SDOBJ_ACTOR;
+    TmpActor->hdr.Dirty           = TRUE;
+    TmpActor->hdr.IdStr           = g_strdup(IdStr);
+    TmpActor->hdr.ClassStr        = ClassStr ? g_strdup(ClassStr):NULL;
+
+    if( TmpActor->hdr.Index > priv->MaxActorIndex )
+        priv->MaxActorIndex = TmpActor->hdr.Index;
+
+    // A new actor needs a place in the reordered columns.
+    priv->ActorsReordered = FALSE;
+
+    TmpActor->Name.Str            = NULL;
+    TmpActor->Name.Width          = 0;
+    TmpActor->Name.Height         = 0;
+
+    if( ActorTitle )
+        TmpActor->Name.Str        = strdup(ActorTitle);
+
+    TmpActor->BoundsBox.Top     = 0;
+    TmpActor->BoundsBox.Bottom  = 0;
+    TmpActor->BoundsBox.Start   = 0;
+    TmpActor->BoundsBox.End     = 0;
+
+    TmpActor->NameBox.Top     = 0;
+    TmpActor->NameBox.Bottom  = 0;
+    TmpActor->NameBox.Start   = 0;
+    TmpActor->NameBox.End     = 0;
+
+    TmpActor->BaselineBox.Top     = 0;
+    TmpActor->BaselineBox.Bottom  = 0;
+    TmpActor->BaselineBox.Start   = 0;
+    TmpActor->BaselineBox.End     = 0;
+
+    TmpActor->StemBox.Top         = 0;
+    TmpActor->StemBox.Bottom      = 0;
+    TmpActor->StemBox.Start       = 0;
+    TmpActor->StemBox.End         = 0;
+
+    g_ptr_array_add(priv->Actors, TmpActor); 
+
+    // Actor columns set the geometry for everything else.
+    priv->LayoutDirty = TRUE;
+
+    // Add this object to the ID hash table.
+    g_hash_table_insert( priv->IdTable, TmpActor->hdr.IdStr, TmpActor );
+    g_print("Actor Insert: 0x%x, %d, %d, %s\n", TmpActor, TmpActor->hdr.Index, TmpActor->hdr.Type, TmpActor->hdr.IdStr); 
+}
+
+gboolean
+sqd_layout_add_actor_region(  SQDLayout *sb, gchar *IdStr, gchar *ClassStr, gchar *ActorId, gchar *StartEvent, gchar *EndEvent )
+{
+	SQDLayoutPrivate *priv;
+    SQD_ACTOR_REGION *TmpRegion;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    TmpRegion = malloc( sizeof(SQD_ACTOR_REGION) );
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    TmpRegion->hdr.Index    = 0;
+    TmpRegion->hdr.Type     = SDOBJ_AREGION;
+    TmpRegion->hdr.Dirty    = TRUE;
+    TmpRegion->hdr.IdStr    = g_strdup(IdStr);
+    TmpRegion->hdr.ClassStr = ClassStr ? g_strdup(ClassStr):NULL;;
+
+    TmpRegion->ActorRef = g_hash_table_lookup(priv->IdTable, ActorId);
+    if( (TmpRegion->ActorRef == NULL) || (TmpRegion->ActorRef->hdr.Type != SDOBJ_ACTOR) )
+    {
+        g_error("Reference to actor with id \"%s\" was not found.\n", ActorId);
+        return TRUE;
+    }
+
+    TmpRegion->SEventRef = g_hash_table_lookup(priv->IdTable, StartEvent);
+    if( (TmpRegion->SEventRef == NULL) || (TmpRegion->SEventRef->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Reference to start event with id \"%s\" was not found.\n", StartEvent);
+        return TRUE;
+    }
+
+    TmpRegion->EEventRef = g_hash_table_lookup(priv->IdTable, EndEvent);
+    if( (TmpRegion->EEventRef == NULL) || (TmpRegion->EEventRef->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Reference to end event with id \"%s\" was not found.\n", EndEvent);
+        return TRUE;
+    }
+
+    TmpRegion->BoundsBox.Top     = 0;
+    TmpRegion->BoundsBox.Bottom  = 0;
+    TmpRegion->BoundsBox.Start   = 0;
+    TmpRegion->BoundsBox.End     = 0;
+
+    g_ptr_array_add(priv->ActorRegions, TmpRegion); 
+
+    priv->RegionsDirty = TRUE;
+
+    // Add this object to the ID hash table.
+    g_hash_table_insert( priv->IdTable, TmpRegion->hdr.IdStr, TmpRegion );
+    g_print("Actor-Region Insert: 0x%x, %d, %d, %s\n", TmpRegion, TmpRegion->hdr.Index, TmpRegion->hdr.Type, TmpRegion->hdr.IdStr); 
+}
+
+gboolean
+sqd_layout_add_box_region( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, gchar *StartActor, gchar *EndActor, gchar *StartEvent, gchar *EndEvent)
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX_REGION *TmpRegion;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    TmpRegion = malloc( sizeof(SQD_BOX_REGION) );
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    TmpRegion->hdr.Index    = 0;
+    TmpRegion->hdr.Type     = SDOBJ_BREGION;
+    TmpRegion->hdr.Dirty    = TRUE;
+    TmpRegion->hdr.IdStr    = g_strdup(IdStr);
+    TmpRegion->hdr.ClassStr = ClassStr ? g_strdup(ClassStr):NULL;;
+
+    TmpRegion->SActorRef = g_hash_table_lookup(priv->IdTable, StartActor);
+    if( (TmpRegion->SActorRef == NULL) || (TmpRegion->SActorRef->hdr.Type != SDOBJ_ACTOR) )
+    {
+        g_error("Reference to start actor with id \"%s\" was not found.\n", StartActor);
+        return TRUE;
+    }
+
+    TmpRegion->EActorRef = g_hash_table_lookup(priv->IdTable, EndActor);
+    if( (TmpRegion->EActorRef == NULL) || (TmpRegion->EActorRef->hdr.Type != SDOBJ_ACTOR) )
+    {
+        g_error("Reference to end actor with id \"%s\" was not found.\n", EndActor);
+        return TRUE;
+    }
+
+    TmpRegion->SEventRef = g_hash_table_lookup(priv->IdTable, StartEvent);
+    if( (TmpRegion->SEventRef == NULL) || (TmpRegion->SEventRef->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Reference to start event with id \"%s\" was not found.\n", StartEvent);
+        return TRUE;
+    }
+
+    TmpRegion->EEventRef = g_hash_table_lookup(priv->IdTable, EndEvent);
+    if( (TmpRegion->EEventRef == NULL) || (TmpRegion->EEventRef->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Reference to end event with id \"%s\" was not found.\n", EndEvent);
+        return TRUE;
+    }
+
+    TmpRegion->BoundsBox.Top     = 0;
+    TmpRegion->BoundsBox.Bottom  = 0;
+    TmpRegion->BoundsBox.Start   = 0;
+    TmpRegion->BoundsBox.End     = 0;
+
+    TmpRegion->Label.Str         = NULL;
+    TmpRegion->Label.Width       = 0;
+    TmpRegion->Label.Height      = 0;
+
+    TmpRegion->Collapsed         = FALSE;
+    TmpRegion->SummaryText.Str   = NULL;
+    TmpRegion->SummaryText.Width = 0;
+    TmpRegion->SummaryText.Height = 0;
+    TmpRegion->SummaryOffset      = 0;
+
+    g_ptr_array_add(priv->BoxRegions, TmpRegion); 
+
+    priv->RegionsDirty = TRUE;
+
+    // Add this object to the ID hash table.
+    g_hash_table_insert( priv->IdTable, TmpRegion->hdr.IdStr, TmpRegion );
+    g_print("Box-Region Insert: 0x%x, %d, %d, %s\n", TmpRegion, TmpRegion->hdr.Index, TmpRegion->hdr.Type, TmpRegion->hdr.IdStr); 
+}
+
+gboolean
+sqd_layout_add_note( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int NoteIndex, int NoteType, gchar *RefId, char *NoteText)
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE *TmpNote;
+    SQD_OBJ  *RefObj;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Make sure the ID isn't already in use
+    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    {
+        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
+        return TRUE;
+    }
+
+    // Make sure the reference is to something valid
+    switch(NoteType)
+    {
+        case NOTE_REFTYPE_NONE:   
+            RefObj = NULL;   
+        break;
+
+        case NOTE_REFTYPE_ACTOR:
+            // Lookup the referenced object
+            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
+            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_ACTOR) )
+            {
+                g_error("Couldn't find the note, actor object with id \"%s\".\n", RefId);
+                return TRUE;
+            }
+            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);               
+        break;
+       
+        case NOTE_REFTYPE_EVENT_START:   
+        case NOTE_REFTYPE_EVENT_MIDDLE:  
+        case NOTE_REFTYPE_EVENT_END: 
+            // Lookup the referenced object
+            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
+            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_EVENT) )
+            {
+                g_error("Couldn't find the note, event object with id \"%s\".\n", RefId);
+                return TRUE;
+            }
+            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
+        break;
+
+        case NOTE_REFTYPE_VSPAN:  
+            // Lookup the referenced object
+            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
+            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_AREGION) )
+            {
+                g_error("Couldn't find the note, actor-region object with id \"%s\".\n", RefId);
+                return TRUE;
+            }
+            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
+        break;
+
+        case NOTE_REFTYPE_BOXSPAN:       
+            // Lookup the referenced object
+            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
+            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_BREGION) )
+            {
+                g_error("Couldn't find the note, box-region object with id \"%s\".\n", RefId);
+                return TRUE;
+            }
+            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
+        break;
+    }
+
+    TmpNote = malloc( sizeof(SQD_NOTE) );
+
+    TmpNote->hdr.Index      = NoteIndex;
+    TmpNote->hdr.Type       = SDOBJ_NOTE;
+    TmpNote->hdr.Dirty      = TRUE;
+    TmpNote->hdr.IdStr      = g_strdup(IdStr);
+    TmpNote->hdr.ClassStr   = ClassStr ? g_strdup(ClassStr):NULL;;
+
+    if( TmpNote->hdr.Index >= priv->MaxNoteIndex )
+        priv->MaxNoteIndex = TmpNote->hdr.Index+1;
+
+    TmpNote->Text.Str            = NULL;
+    TmpNote->Text.Width          = 0;
+    TmpNote->Text.Height         = 0;
+
+    TmpNote->Text.Str            = NULL;
+    if( NoteText )
+    {
+        TmpNote->Text.Str        = strdup(NoteText);
+    }
+
+    TmpNote->BoundsBox.Top       = 0;
+    TmpNote->BoundsBox.Bottom    = 0;
+    TmpNote->BoundsBox.Start     = 0;
+    TmpNote->BoundsBox.End       = 0;
+
+    TmpNote->ReferenceType       = NoteType;
+
+    TmpNote->Height              = 0;
+
+    TmpNote->RefObj              = RefObj;
+    TmpNote->RefFirstTop         = 0;
+    TmpNote->RefFirstStart       = 0;
+    TmpNote->RefLastTop          = 0;
+    TmpNote->RefLastStart        = 0;
+
+    TmpNote->Page                = G_MAXUINT;
+    TmpNote->Column              = 0;
+
+    // The first note opens up the notes column and narrows the actors.
+    if( priv->Notes->len == 0 )
+        priv->LayoutDirty = TRUE;
+
+    priv->NotesDirty = TRUE;
+
+    g_ptr_array_add(priv->Notes, TmpNote); 
+
+    // Add this object to the ID hash table.
+    g_hash_table_insert( priv->IdTable, TmpNote->hdr.IdStr, TmpNote );
+
+}
+
+// Replace the labels on an existing event.  Only the event's layer is 
+// measured again on the next layout, later layers just move.
+gboolean
+sqd_layout_set_event_label( SQDLayout *sb, gchar *IdStr, gchar *TopLabel, gchar *BottomLabel )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT        *Event;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Event = g_hash_table_lookup(priv->IdTable, IdStr);
+    if( (Event == NULL) || (Event->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Couldn't find event with id \"%s\".\n", IdStr);
+        return TRUE;
+    }
+
+    if( Event->UpperText.Str )
+        free(Event->UpperText.Str);
+
+    Event->UpperText.Str    = TopLabel ? strdup(TopLabel) : NULL;
+    Event->UpperText.Width  = 0;
+    Event->UpperText.Height = 0;
+
+    if( Event->LowerText.Str )
+        free(Event->LowerText.Str);
+
+    Event->LowerText.Str    = BottomLabel ? strdup(BottomLabel) : NULL;
+    Event->LowerText.Width  = 0;
+    Event->LowerText.Height = 0;
+
+    Event->hdr.Dirty = TRUE;
+    sqd_layout_mark_layer_dirty(sb, Event->hdr.Index);
+
+    // Labels feed into the column widths.
+    if( priv->VariableColumns )
+        priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+// Give an event a trace timestamp for the time axis.
+gboolean
+sqd_layout_set_event_time( SQDLayout *sb, gchar *IdStr, gdouble Time )
+{
+	SQDLayoutPrivate *priv;
+    SQD_EVENT        *Event;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Event = g_hash_table_lookup(priv->IdTable, IdStr);
+    if( (Event == NULL) || (Event->hdr.Type != SDOBJ_EVENT) )
+    {
+        g_error("Couldn't find event with id \"%s\".\n", IdStr);
+        return TRUE;
+    }
+
+    Event->Time    = Time;
+    Event->HasTime = TRUE;
+
+    sqd_layout_mark_layer_dirty(sb, Event->hdr.Index);
+
+    return FALSE;
+}
+
+// Replace the text of an existing note.
+gboolean
+sqd_layout_set_note_text( SQDLayout *sb, gchar *IdStr, gchar *NoteText )
+{
+	SQDLayoutPrivate *priv;
+    SQD_NOTE         *Note;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Note = g_hash_table_lookup(priv->IdTable, IdStr);
+    if( (Note == NULL) || (Note->hdr.Type != SDOBJ_NOTE) )
+    {
+        g_error("Couldn't find note with id \"%s\".\n", IdStr);
+        return TRUE;
+    }
+
+    if( Note->Text.Str )
+        free(Note->Text.Str);
+
+    Note->Text.Str    = NoteText ? strdup(NoteText) : NULL;
+    Note->Text.Width  = 0;
+    Note->Text.Height = 0;
+
+    Note->hdr.Dirty  = TRUE;
+    priv->NotesDirty = TRUE;
+
+    return FALSE;
+}
+
+// Set the label drawn in the corner of a box region, or in its summary band 
+// when it is collapsed.
+gboolean
+sqd_layout_set_box_region_label( SQDLayout *sb, gchar *IdStr, gchar *Label )
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX_REGION   *BReg;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    BReg = g_hash_table_lookup(priv->IdTable, IdStr);
+    if( (BReg == NULL) || (BReg->hdr.Type != SDOBJ_BREGION) )
+    {
+        g_error("Couldn't find box region with id \"%s\".\n", IdStr);
+        return TRUE;
+    }
+
+    if( BReg->Label.Str )
+        g_free(BReg->Label.Str);
+
+    BReg->Label.Str = Label ? g_strdup(Label) : NULL;
+
+    BReg->hdr.Dirty    = TRUE;
+    priv->RegionsDirty = TRUE;
+
+    // A collapsed region's summary band changes size with its label.
+    if( BReg->Collapsed )
+        priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean 
+sqd_layout_set_presentation_parameter( SQDLayout *sb, gchar *ParamStr, gchar *ValueStr, gchar *ClassStr )
+{
+	SQDLayoutPrivate *priv;
+    gchar            *PStr;
+    SQD_P_PARAM      *PParam;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Build the Parameter ID String
+    if(ClassStr)
+        PStr = g_strdup_printf("%s.%s", ClassStr, ParamStr);
+    else
+        PStr = g_strdup(ParamStr);
+
+    // Fonts and spacing can change anywhere in the layout.
+    priv->LayoutDirty = TRUE;
+
+    // Check if the Parameter already has a value
+    PParam = g_hash_table_lookup(priv->PTable, PStr);
+    if( PParam != NULL )
+    {
+        // Parameter already exists, just modify the value.
+        if( PParam->ValueStr )
+            g_free( PParam->ValueStr );
+
+        PParam->ValueStr = g_strdup(ValueStr);
+
+        g_free(PStr);
+
+        return FALSE;
+    }
+
+    // Parameter does not yet exist, create and init the parameter.
+    PParam = g_malloc(sizeof(SQD_P_PARAM));
+
+    if(PParam == NULL)
+    {
+        g_error("Out of memory!\n");
+        return TRUE;
+    }
+
+    // Init the new parameter.
+    PParam->ParamStr = PStr;
+    PParam->ClassStr = g_strdup(ClassStr);
+    PParam->ValueStr = g_strdup(ValueStr);
+
+    // Install the parameter in the table
+    g_hash_table_insert( priv->PTable, PParam->ParamStr, PParam );
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_thread_count( SQDLayout *sb, gint ThreadCnt )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( ThreadCnt < 0 )
+    {
+        g_error("The thread count must not be negative.\n");
+        return TRUE;
+    }
+
+    priv->ThreadCnt = ThreadCnt;
+
+    return FALSE;
+}
+
+// Build the output path for a page. Single page diagrams use the path as is,
+// otherwise the page number is added ahead of the extension.
+static gchar *
+sqd_layout_get_page_path( SQDLayout *sb, gchar *FilePath, guint PageIndex )
+{
+	SQDLayoutPrivate *priv;
+    gchar *ExtStr;
+    gchar *BaseStr;
+    gchar *PathStr;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( priv->Pages->len <= 1 )
+        return g_strdup(FilePath);
+
+    // Only treat a dot in the file name itself as the extension.
+    ExtStr = strrchr(FilePath, '.');
+    if( (ExtStr == NULL) || (strchr(ExtStr, '/') != NULL) )
+        return g_strdup_printf("%s-%d", FilePath, PageIndex + 1);
+
+    BaseStr = g_strndup(FilePath, ExtStr - FilePath);
+    PathStr = g_strdup_printf("%s-%d%s", BaseStr, PageIndex + 1, ExtStr);
+    g_free(BaseStr);
+
+    return PathStr;
+}
+
+// Swallow the output of a surface that is only used for measuring text.
+static cairo_status_t
+sqd_layout_discard_output( void *closure, const unsigned char *data, unsigned int length )
+{
+    return CAIRO_STATUS_SUCCESS;
+}
+
+guint
+sqd_layout_get_page_count( SQDLayout *sb )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    return priv->Pages->len;
+}
+
+// Find the objects whose bounds overlap a rectangle on a page of the last
+// generated output.  Returns an array of object id strings owned by the
+// layout; free the array with g_ptr_array_free(Results, TRUE).
+GPtrArray *
+sqd_layout_query_rect( SQDLayout *sb, guint PageIndex, gdouble Start, gdouble Top, gdouble End, gdouble Bottom )
+{
+	SQDLayoutPrivate  *priv;
+    SQD_SPATIAL_INDEX *Index;
+    GPtrArray         *Results;
+    SQD_BOX            QueryBox;
+    guint              i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    Results = g_ptr_array_new();
+
+    if( PageIndex >= priv->Pages->len )
+        return Results;
+
+    if( priv->SpatialIndexValid == FALSE )
+        sqd_layout_build_spatial_index(sb);
+
+    QueryBox.Start  = Start;
+    QueryBox.Top    = Top;
+    QueryBox.End    = End;
+    QueryBox.Bottom = Bottom;
+
+    Index = &g_array_index(priv->SpatialIndex, SQD_SPATIAL_INDEX, PageIndex);
+    sqd_layout_search_spatial_index(Index, &QueryBox, Results);
+
+    // Hand back the ids rather than the entries.
+    for( i = 0; i < Results->len; i++ )
+        g_ptr_array_index(Results, i) = ((SQD_INDEX_ENTRY *)g_ptr_array_index(Results, i))->Obj->IdStr;
+
+    return Results;
+}
+
+// Find the objects under a point on a page of the last generated output.
+GPtrArray *
+sqd_layout_query_point( SQDLayout *sb, guint PageIndex, gdouble X, gdouble Y )
+{
+    return sqd_layout_query_rect(sb, PageIndex, X, Y, X, Y);
+}
+
+gboolean
+sqd_layout_set_note_placement( SQDLayout *sb, gint NotePlacement )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->NotePlacement = NotePlacement;
+    priv->NotesDirty    = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_note_columns( SQDLayout *sb, gint LeftColumns, gint RightColumns )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // There has to be somewhere to put the notes.
+    if( (LeftColumns < 0) || (RightColumns < 0) || ((LeftColumns + RightColumns) == 0) )
+    {
+        LeftColumns  = 0;
+        RightColumns = 1;
+    }
+
+    // A content sized page widens to fit the columns, a fixed one has to 
+    // leave the actors some room.
+    if( (priv->FitContent == FALSE) && (sqd_layout_get_note_columns_width(sb, LeftColumns + RightColumns) >= (priv->Width - (2 * priv->Margin))) )
+    {
+        g_error("%d note columns don't leave the actors any room on the page.\n", LeftColumns + RightColumns);
+        return TRUE;
+    }
+
+    priv->NoteColumnsLeft  = LeftColumns;
+    priv->NoteColumnsRight = RightColumns;
+
+    // The columns change how much room the actors get.
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_note_routing( SQDLayout *sb, gint NoteRouting )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->NoteRouting = NoteRouting;
+
+    // The routing gutter changes the width of the notes columns.
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_max_events( SQDLayout *sb, gint MaxEvents )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->MaxEvents   = (MaxEvents > 0) ? MaxEvents : 0;
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+// Place the events by their time, Scale points per unit of time.  Idle gaps 
+// longer than MaxGap points are cut short and marked.  A Scale of zero turns 
+// it off.
+gboolean
+sqd_layout_set_time_axis( SQDLayout *sb, gdouble Scale, gdouble MaxGap )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->TimeScale   = (Scale > 0) ? Scale : 0;
+    priv->MaxTimeGap  = (MaxGap > 0) ? MaxGap : 0;
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_fold_repeats( SQDLayout *sb, gboolean FoldRepeats )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->FoldRepeats = FoldRepeats;
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_reorder_actors( SQDLayout *sb, gboolean ReorderActors )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->ReorderActors   = ReorderActors;
+    priv->ActorsReordered = FALSE;
+    priv->LayoutDirty     = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_variable_columns( SQDLayout *sb, gboolean VariableColumns )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->VariableColumns = VariableColumns;
+    priv->LayoutDirty     = TRUE;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_set_fit_content( SQDLayout *sb, gboolean FitContent )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->FitContent  = FitContent;
+    priv->LayoutDirty = TRUE;
+
+    return FALSE;
+}
+
+// Write svg output with the native streaming writer rather than cairo.
+gboolean
+sqd_layout_set_native_svg( SQDLayout *sb, gboolean NativeSvg )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->NativeSvg = NativeSvg;
+
+    return FALSE;
+}
+
+// Only draw a Width by Height rectangle of each page starting at X, Y, and
+// size the output to it.  A Width or Height of zero draws whole pages again.
+gboolean
+sqd_layout_set_viewport( SQDLayout *sb, gdouble X, gdouble Y, gdouble Width, gdouble Height )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( (Width < 0) || (Height < 0) )
+    {
+        g_error("The viewport size can't be negative.\n");
+        return TRUE;
+    }
+
+    priv->HasViewport = (Width > 0) && (Height > 0);
+
+    priv->Viewport.Start  = X;
+    priv->Viewport.Top    = Y;
+    priv->Viewport.End    = X + Width;
+    priv->Viewport.Bottom = Y + Height;
+
+    return FALSE;
+}
+
+// Set the zlib level (-1 for zlib's default) and row filter for png
+// output, and whether the render threads deflate their own bands.
+gboolean
+sqd_layout_set_png_encoding( SQDLayout *sb, gint Level, gint Filter, gboolean ParallelDeflate )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( (Level < -1) || (Level > 9) )
+    {
+        g_error("The png compression level must be from -1 to 9.\n");
+        return TRUE;
+    }
+
+    if( (Filter < RASTER_FILTER_NONE) || (Filter > RASTER_FILTER_ADAPTIVE) )
+    {
+        g_error("Unknown png filter %d.\n", Filter);
+        return TRUE;
+    }
+
+    priv->PngLevel        = Level;
+    priv->PngFilter       = Filter;
+    priv->ParallelDeflate = ParallelDeflate;
+
+    return FALSE;
+}
+
+// Pixels per point for png, ppm and qoi output: 0.25 for thumbnails, 
+// 2.0 or more for high dpi images.  The layout itself is unchanged.
+gboolean
+sqd_layout_set_raster_scale( SQDLayout *sb, gdouble Scale )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    if( Scale <= 0 )
+    {
+        g_error("The raster scale must be greater than zero.\n");
+        return TRUE;
+    }
+
+    // Scaled output measures text without metric hinting.
+    if( (Scale != 1.0) != (priv->RasterScale != 1.0) )
+        priv->LayoutDirty = TRUE;
+
+    priv->RasterScale = Scale;
+
+    return FALSE;
+}
+
+// Write pdf output with the native streaming writer rather than cairo.
+gboolean
+sqd_layout_set_native_pdf( SQDLayout *sb, gboolean NativePdf )
+{
+	SQDLayoutPrivate *priv;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    priv->NativePdf = NativePdf;
+
+    return FALSE;
+}
+
+gboolean
+sqd_layout_generate_pdf( SQDLayout *sb, gchar *FilePath )
+{
+	SQDLayoutPrivate *priv;
+    SQD_BOX      Out;
+    PangoLayout *Layout;
+    gboolean Result;
+    guint i;
+
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+
+    // Arrange against a scratch pdf surface so the text metrics match, 
+    // the page size isn't known yet for content sized output.
+    priv->surface = cairo_pdf_surface_create_for_stream(sqd_layout_discard_output, NULL, priv->Width, priv->Height);
+    priv->cr = cairo_create (priv->surface);
+
+    sqd_layout_arrange_diagram(sb);
+
+    // The native writer streams the document itself and lays wrapped 
+    // text out again against the scratch surface to find the lines.
+    if( priv->NativePdf )
+    {
+        Layout = pango_cairo_create_layout(priv->cr);
+        Result = sqd_layout_pdf_write_document(sb, FilePath, Layout);
+        g_object_unref(Layout);
+
+        cairo_destroy(priv->cr);
+        cairo_surface_destroy(priv->surface);
+
+        priv->cr      = NULL;
+        priv->surface = NULL;
+
+        return Result;
+    }
+
+    cairo_destroy(priv->cr);
+    cairo_surface_destroy(priv->surface);
+
+    sqd_layout_get_output_box(sb, &Out);
 
-    if( Label )
-        TmpEvent->UpperText.Str  = strdup(Label);
+    priv->surface = cairo_pdf_surface_create(FilePath, Out.End - Out.Start, Out.Bottom - Out.Top);
+    priv->cr = cairo_create (priv->surface);
+
+    cairo_set_source_rgb(priv->cr, 0, 0, 0);
+    cairo_translate(priv->cr, -Out.Start, -Out.Top);
+
+    // One pdf page per diagram page, each drawn just before it is replayed.
+    for (i = 0; i < priv->Pages->len; i++)
+    {
+        sqd_layout_build_page_display_list(sb, i);
+        sqd_layout_replay_cairo(sb, priv->cr, NULL, i, &Out);
+        cairo_show_page(priv->cr);
+    }
 
-    sqd_layout_add_event_common( sb, TmpEvent);
+    sqd_layout_clear_display_list(sb);
 
+    cairo_destroy(priv->cr);
+    cairo_surface_destroy(priv->surface);
+
+    priv->cr      = NULL;
+    priv->surface = NULL;
+
+    return FALSE;
 }
 
-gboolean
-sqd_layout_add_actor( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int ActorIndex, gchar *ActorTitle )
+// Font options for raster output.  At scales other than one pixel per 
+// point the glyph advances must scale with the rest of the page, so metric
+// hinting is off, both when the text is measured and when the bands draw 
+// it; outlines are hinted lightly when enlarged and not at all in 
+// thumbnails, where hinting would distort the tiny glyphs.  Grey pages, 
+// and others that drop channels, get grey antialiasing at any scale; 
+// subpixel fringes would come out as the wrong greys once only one byte 
+// is kept.
+static void
+sqd_layout_set_raster_font_options( SQDLayout *sb, cairo_t *cr, gboolean Grey )
 {
 	SQDLayoutPrivate *priv;
-    SQD_ACTOR *TmpActor;
+    cairo_font_options_t *Options;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    TmpActor = malloc( sizeof(SQD_ACTOR) );
+    if( (priv->RasterScale == 1.0) && (Grey == FALSE) )
+        return;
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    Options = cairo_font_options_create();
+    cairo_font_options_set_antialias(Options, CAIRO_ANTIALIAS_GRAY);
+
+    if( priv->RasterScale != 1.0 )
     {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
+        cairo_font_options_set_hint_metrics(Options, CAIRO_HINT_METRICS_OFF);
+        cairo_font_options_set_hint_style(Options, (priv->RasterScale > 1.0) ? CAIRO_HINT_STYLE_SLIGHT : CAIRO_HINT_STYLE_NONE);
     }
 
-    TmpActor->hdr.Index           = ActorIndex;
-    TmpActor->hdr.Type            = SDOBJ_ACTOR;
-    TmpActor->hdr.IdStr           = g_strdup(IdStr);
-    TmpActor->hdr.ClassStr        = ClassStr ? g_strdup(ClassStr):NULL;
+    cairo_set_font_options(cr, Options);
+    cairo_font_options_destroy(Options);
+}
 
-    if( TmpActor->hdr.Index > priv->MaxActorIndex )
-        priv->MaxActorIndex = TmpActor->hdr.Index;
+// Worker for png output: replay the ops that reach one band of a page.
+// Each band lays its text out with a font map of its own, like the arrange 
+// workers; pango's shared default one isn't safe across threads before 1.32.
+// So bands don't share any cairo or pango state.
+static void
+sqd_layout_render_band( gpointer data, gpointer user_data )
+{
+    SQD_RASTER_BAND *Band = data;
+    SQDLayout       *sb   = user_data;
+	SQDLayoutPrivate *priv;
+    PangoContext *Context;
+    cairo_t *cr;
 
-    TmpActor->Name.Str            = NULL;
-    TmpActor->Name.Width          = 0;
-    TmpActor->Name.Height         = 0;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    if( ActorTitle )
-        TmpActor->Name.Str        = strdup(ActorTitle);
+    cr = cairo_create(Band->Surface);
 
-    TmpActor->BoundsBox.Top     = 0;
-    TmpActor->BoundsBox.Bottom  = 0;
-    TmpActor->BoundsBox.Start   = 0;
-    TmpActor->BoundsBox.End     = 0;
+    // The strip buffer still holds the last strip.
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
-    TmpActor->NameBox.Top     = 0;
-    TmpActor->NameBox.Bottom  = 0;
-    TmpActor->NameBox.Start   = 0;
-    TmpActor->NameBox.End     = 0;
+    sqd_layout_set_raster_font_options(sb, cr, (Band->Channels < 4));
 
-    TmpActor->BaselineBox.Top     = 0;
-    TmpActor->BaselineBox.Bottom  = 0;
-    TmpActor->BaselineBox.Start   = 0;
-    TmpActor->BaselineBox.End     = 0;
+    cairo_scale(cr, priv->RasterScale, priv->RasterScale);
+    cairo_translate(cr, -Band->Origin.X, -Band->Origin.Y);
+    cairo_set_source_rgb(cr, 0, 0, 0);
 
-    TmpActor->StemBox.Top         = 0;
-    TmpActor->StemBox.Bottom      = 0;
-    TmpActor->StemBox.Start       = 0;
-    TmpActor->StemBox.End         = 0;
+    Context = sqd_layout_create_pango_context(cr);
 
-    g_ptr_array_add(priv->Actors, TmpActor); 
+    sqd_layout_replay_cairo(sb, cr, Context, Band->PageIndex, &Band->View);
 
-    // Add this object to the ID hash table.
-    g_hash_table_insert( priv->IdTable, TmpActor->hdr.IdStr, TmpActor );
-    g_print("Actor Insert: 0x%x, %d, %d, %s\n", TmpActor, TmpActor->hdr.Index, TmpActor->hdr.Type, TmpActor->hdr.IdStr); 
+    g_object_unref(Context);
+    cairo_destroy(cr);
+
+    cairo_surface_flush(Band->Surface);
 }
 
-gboolean
-sqd_layout_add_actor_region(  SQDLayout *sb, gchar *IdStr, gchar *ClassStr, gchar *ActorId, gchar *StartEvent, gchar *EndEvent )
+// Turn a row of cairo pixels into Channels bytes per pixel: straight RGBA
+// from premultiplied ARGB, the colour bytes as they are for RGB, or the
+// green byte of a grey page for a single channel.
+static void
+sqd_layout_convert_row( guchar *Src, guchar *Dst, guint Width, guint Channels )
+{
+    guint32 Pixel;
+    guint   Alpha;
+    guint   i;
+
+    for( i = 0; i < Width; i++ )
+    {
+        Pixel = ((guint32 *)Src)[i];
+
+        switch( Channels )
+        {
+            case 1:
+                Dst[0] = (Pixel >> 8) & 0xff;
+            break;
+
+            case 3:
+                Dst[0] = (Pixel >> 16) & 0xff;
+                Dst[1] = (Pixel >> 8) & 0xff;
+                Dst[2] = Pixel & 0xff;
+            break;
+
+            default:
+                Alpha = Pixel >> 24;
+
+                if( Alpha == 0 )
+                {
+                    Dst[0] = Dst[1] = Dst[2] = Dst[3] = 0;
+                }
+                else
+                {
+                    Dst[0] = ((((Pixel >> 16) & 0xff) * 255) + (Alpha / 2)) / Alpha;
+                    Dst[1] = ((((Pixel >> 8) & 0xff) * 255) + (Alpha / 2)) / Alpha;
+                    Dst[2] = (((Pixel & 0xff) * 255) + (Alpha / 2)) / Alpha;
+                    Dst[3] = Alpha;
+                }
+            break;
+        }
+
+        Dst += Channels;
+    }
+}
+
+// Channels a page needs: 1 when every style is an opaque grey, 3 when
+// they are all opaque, otherwise 4.  The background is one of the styles.
+static guint
+sqd_layout_get_raster_channels( SQDLayout *sb )
 {
 	SQDLayoutPrivate *priv;
-    SQD_ACTOR_REGION *TmpRegion;
+    SQD_DL_STYLE     *Style;
+    gboolean Grey;
+    guint i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    TmpRegion = malloc( sizeof(SQD_ACTOR_REGION) );
+    Grey = TRUE;
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
+    for( i = 0; i < priv->DisplayList.Styles->len; i++ )
     {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
-    }
+        Style = &g_array_index(priv->DisplayList.Styles, SQD_DL_STYLE, i);
 
-    TmpRegion->hdr.Index    = 0;
-    TmpRegion->hdr.Type     = SDOBJ_AREGION;
-    TmpRegion->hdr.IdStr    = g_strdup(IdStr);
-    TmpRegion->hdr.ClassStr = ClassStr ? g_strdup(ClassStr):NULL;;
+        if( Style->Color.Alpha < 1.0 )
+            return 4;
 
-    TmpRegion->ActorRef = g_hash_table_lookup(priv->IdTable, ActorId);
-    if( (TmpRegion->ActorRef == NULL) || (TmpRegion->ActorRef->hdr.Type != SDOBJ_ACTOR) )
-    {
-        g_error("Reference to actor with id \"%s\" was not found.\n", ActorId);
-        return TRUE;
+        if( (Style->Color.Red != Style->Color.Green) || (Style->Color.Green != Style->Color.Blue) )
+            Grey = FALSE;
     }
 
-    TmpRegion->SEventRef = g_hash_table_lookup(priv->IdTable, StartEvent);
-    if( (TmpRegion->SEventRef == NULL) || (TmpRegion->SEventRef->hdr.Type != SDOBJ_EVENT) )
-    {
-        g_error("Reference to start event with id \"%s\" was not found.\n", StartEvent);
-        return TRUE;
-    }
+    return Grey ? 1 : 3;
+}
 
-    TmpRegion->EEventRef = g_hash_table_lookup(priv->IdTable, EndEvent);
-    if( (TmpRegion->EEventRef == NULL) || (TmpRegion->EEventRef->hdr.Type != SDOBJ_EVENT) )
+static guchar
+sqd_layout_paeth( guchar Left, guchar Up, guchar UpLeft )
+{
+    gint P, PA, PB, PC;
+
+    P  = (gint)Left + Up - UpLeft;
+    PA = abs(P - Left);
+    PB = abs(P - Up);
+    PC = abs(P - UpLeft);
+
+    if( (PA <= PB) && (PA <= PC) )
+        return Left;
+
+    return (PB <= PC) ? Up : UpLeft;
+}
+
+// Apply one png filter to a row.  Dst gets the filter type byte and then
+// RowLen filtered bytes; Prev is the unfiltered row above, or zeros.
+static guint
+sqd_layout_png_filter_row( guint8 Filter, guchar *Cur, guchar *Prev, guchar *Dst, guint RowLen, guint Bpp )
+{
+    guchar Left, UpLeft;
+    guint  Sum;
+    guint  i;
+
+    Dst[0] = Filter;
+    Sum    = 0;
+
+    for( i = 0; i < RowLen; i++ )
     {
-        g_error("Reference to end event with id \"%s\" was not found.\n", EndEvent);
-        return TRUE;
+        Left   = (i >= Bpp) ? Cur[i - Bpp] : 0;
+        UpLeft = (i >= Bpp) ? Prev[i - Bpp] : 0;
+
+        switch( Filter )
+        {
+            case RASTER_FILTER_SUB:
+                Dst[i + 1] = Cur[i] - Left;
+            break;
+
+            case RASTER_FILTER_UP:
+                Dst[i + 1] = Cur[i] - Prev[i];
+            break;
+
+            case RASTER_FILTER_AVERAGE:
+                Dst[i + 1] = Cur[i] - (guchar)(((guint)Left + Prev[i]) / 2);
+            break;
+
+            case RASTER_FILTER_PAETH:
+                Dst[i + 1] = Cur[i] - sqd_layout_paeth(Left, Prev[i], UpLeft);
+            break;
+
+            default:
+                Dst[i + 1] = Cur[i];
+            break;
+        }
+
+        // The usual heuristic: smallest sum of the bytes taken as signed.
+        Sum += (Dst[i + 1] < 128) ? Dst[i + 1] : (256 - Dst[i + 1]);
     }
 
-    TmpRegion->BoundsBox.Top     = 0;
-    TmpRegion->BoundsBox.Bottom  = 0;
-    TmpRegion->BoundsBox.Start   = 0;
-    TmpRegion->BoundsBox.End     = 0;
+    return Sum;
+}
 
-    g_ptr_array_add(priv->ActorRegions, TmpRegion); 
+// Append a big endian 32 bit value.
+static void
+sqd_layout_png_append_u32( GByteArray *Bytes, guint32 Value )
+{
+    guint8 Be[4];
 
-    // Add this object to the ID hash table.
-    g_hash_table_insert( priv->IdTable, TmpRegion->hdr.IdStr, TmpRegion );
-    g_print("Actor-Region Insert: 0x%x, %d, %d, %s\n", TmpRegion, TmpRegion->hdr.Index, TmpRegion->hdr.Type, TmpRegion->hdr.IdStr); 
+    Be[0] = Value >> 24;
+    Be[1] = Value >> 16;
+    Be[2] = Value >> 8;
+    Be[3] = Value;
+
+    g_byte_array_append(Bytes, Be, 4);
 }
 
-gboolean
-sqd_layout_add_box_region( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, gchar *StartActor, gchar *EndActor, gchar *StartEvent, gchar *EndEvent)
+// Write a whole png chunk with its length and crc.  Returns TRUE when the
+// chunk couldn't all be written.
+static gboolean
+sqd_layout_png_write_chunk( FILE *File, const gchar *Type, guint8 *Data, guint Len )
+{
+    GByteArray *Chunk;
+    gboolean    Failed;
+
+    Chunk = g_byte_array_sized_new(Len + 12);
+
+    sqd_layout_png_append_u32(Chunk, Len);
+    g_byte_array_append(Chunk, (guint8 *)Type, 4);
+    g_byte_array_append(Chunk, Data, Len);
+    sqd_layout_png_append_u32(Chunk, crc32(0, Chunk->data + 4, Len + 4));
+
+    Failed = (fwrite(Chunk->data, 1, Chunk->len, File) != Chunk->len);
+
+    g_byte_array_free(Chunk, TRUE);
+
+    return Failed;
+}
+
+// Worker for parallel deflate: filter and compress one band's rows into
+// a finished IDAT chunk.  Each band ends on a sync flush so the chunks can
+// simply be written one after another.
+static void
+sqd_layout_deflate_band( gpointer data, gpointer user_data )
 {
 	SQDLayoutPrivate *priv;
-    SQD_BOX_REGION *TmpRegion;
+    SQD_RASTER_BAND  *Band = data;
+    SQDLayout        *sb   = user_data;
+    z_stream Stream;
+    guchar  *Pixels;
+    guchar  *Cur, *Prev, *Best, *Try, *Swap;
+    guchar   Out[16384];
+    guint    Width, Stride, RowLen;
+    guint    BestSum, Sum;
+    guint8   Filter;
+    guint32  Crc;
+    gint     Flush;
+    guint    i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    TmpRegion = malloc( sizeof(SQD_BOX_REGION) );
+    Band->Adler  = adler32(0, NULL, 0);
+    Band->RawLen = 0;
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
-    {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
-    }
+    g_byte_array_set_size(Band->Chunk, 0);
 
-    TmpRegion->hdr.Index    = 0;
-    TmpRegion->hdr.Type     = SDOBJ_BREGION;
-    TmpRegion->hdr.IdStr    = g_strdup(IdStr);
-    TmpRegion->hdr.ClassStr = ClassStr ? g_strdup(ClassStr):NULL;;
+    if( Band->Rows == 0 )
+        return;
 
-    TmpRegion->SActorRef = g_hash_table_lookup(priv->IdTable, StartActor);
-    if( (TmpRegion->SActorRef == NULL) || (TmpRegion->SActorRef->hdr.Type != SDOBJ_ACTOR) )
-    {
-        g_error("Reference to start actor with id \"%s\" was not found.\n", StartActor);
-        return TRUE;
-    }
+    Width  = cairo_image_surface_get_width(Band->Surface);
+    Stride = cairo_image_surface_get_stride(Band->Surface);
+    Pixels = cairo_image_surface_get_data(Band->Surface);
+    RowLen = Width * Band->Channels;
 
-    TmpRegion->EActorRef = g_hash_table_lookup(priv->IdTable, EndActor);
-    if( (TmpRegion->EActorRef == NULL) || (TmpRegion->EActorRef->hdr.Type != SDOBJ_ACTOR) )
-    {
-        g_error("Reference to end actor with id \"%s\" was not found.\n", EndActor);
-        return TRUE;
-    }
+    Cur  = g_malloc(RowLen);
+    Prev = g_malloc0(RowLen);
+    Best = g_malloc(RowLen + 1);
+    Try  = g_malloc(RowLen + 1);
 
-    TmpRegion->SEventRef = g_hash_table_lookup(priv->IdTable, StartEvent);
-    if( (TmpRegion->SEventRef == NULL) || (TmpRegion->SEventRef->hdr.Type != SDOBJ_EVENT) )
+    if( Band->Above )
+        sqd_layout_convert_row(Band->Above, Prev, Width, Band->Channels);
+
+    memset(&Stream, 0, sizeof Stream);
+
+    // Raw deflate, the zlib header and checksum are written around the bands.
+    if( deflateInit2(&Stream, priv->PngLevel, Z_DEFLATED, -15, 8,
+                     (priv->PngFilter == RASTER_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK )
+        g_error("Couldn't start the deflate stream for a png band.\n");
+
+    // Chunk length and type, the length is filled in at the end.
+    g_byte_array_append(Band->Chunk, (guint8 *)"\0\0\0\0IDAT", 8);
+
+    for( i = 0; i < Band->Rows; i++ )
     {
-        g_error("Reference to start event with id \"%s\" was not found.\n", StartEvent);
-        return TRUE;
+        sqd_layout_convert_row(Pixels + ((gsize)i * Stride), Cur, Width, Band->Channels);
+
+        if( priv->PngFilter == RASTER_FILTER_ADAPTIVE )
+        {
+            BestSum = G_MAXUINT;
+
+            for( Filter = RASTER_FILTER_NONE; Filter <= RASTER_FILTER_PAETH; Filter++ )
+            {
+                Sum = sqd_layout_png_filter_row(Filter, Cur, Prev, Try, RowLen, Band->Channels);
+
+                if( Sum < BestSum )
+                {
+                    BestSum = Sum;
+                    Swap = Best; Best = Try; Try = Swap;
+                }
+            }
+        }
+        else
+            sqd_layout_png_filter_row(priv->PngFilter, Cur, Prev, Best, RowLen, Band->Channels);
+
+        Band->Adler   = adler32(Band->Adler, Best, RowLen + 1);
+        Band->RawLen += RowLen + 1;
+
+        Stream.next_in  = Best;
+        Stream.avail_in = RowLen + 1;
+
+        Flush = ((i + 1) == Band->Rows) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        do
+        {
+            Stream.next_out  = Out;
+            Stream.avail_out = sizeof Out;
+
+            deflate(&Stream, Flush);
+
+            g_byte_array_append(Band->Chunk, Out, sizeof Out - Stream.avail_out);
+        }
+        while( Stream.avail_out == 0 );
+
+        Swap = Prev; Prev = Cur; Cur = Swap;
     }
 
-    TmpRegion->EEventRef = g_hash_table_lookup(priv->IdTable, EndEvent);
-    if( (TmpRegion->EEventRef == NULL) || (TmpRegion->EEventRef->hdr.Type != SDOBJ_EVENT) )
+    deflateEnd(&Stream);
+
+    // Big endian data length, then the crc over the type and data.
+    i = Band->Chunk->len - 8;
+    Band->Chunk->data[0] = i >> 24;
+    Band->Chunk->data[1] = i >> 16;
+    Band->Chunk->data[2] = i >> 8;
+    Band->Chunk->data[3] = i;
+
+    Crc = crc32(0, Band->Chunk->data + 4, Band->Chunk->len - 4);
+    sqd_layout_png_append_u32(Band->Chunk, Crc);
+
+    g_free(Cur);
+    g_free(Prev);
+    g_free(Best);
+    g_free(Try);
+}
+
+// Add a row to a qoi stream.  State carries the previous pixel, the open
+// run and the colour index across rows.
+static void
+sqd_layout_qoi_encode_row( SQD_QOI_STATE *State, guchar *Row, guint Width, guint Channels, GByteArray *Out )
+{
+    guchar Px[4];
+    guint8 Op[5];
+    gint   Vr, Vg, Vb, VgR, VgB;
+    guint  Hash;
+    guint  i;
+
+    for( i = 0; i < Width; i++ )
     {
-        g_error("Reference to end event with id \"%s\" was not found.\n", EndEvent);
-        return TRUE;
-    }
+        Px[0] = Row[0];
+        Px[1] = Row[1];
+        Px[2] = Row[2];
+        Px[3] = (Channels == 4) ? Row[3] : 255;
+        Row  += Channels;
 
-    TmpRegion->BoundsBox.Top     = 0;
-    TmpRegion->BoundsBox.Bottom  = 0;
-    TmpRegion->BoundsBox.Start   = 0;
-    TmpRegion->BoundsBox.End     = 0;
+        if( memcmp(Px, State->Prev, 4) == 0 )
+        {
+            State->Run++;
 
-    g_ptr_array_add(priv->BoxRegions, TmpRegion); 
+            if( State->Run == 62 )
+            {
+                Op[0] = 0xc0 | (State->Run - 1);
+                g_byte_array_append(Out, Op, 1);
+                State->Run = 0;
+            }
+            continue;
+        }
 
-    // Add this object to the ID hash table.
-    g_hash_table_insert( priv->IdTable, TmpRegion->hdr.IdStr, TmpRegion );
-    g_print("Box-Region Insert: 0x%x, %d, %d, %s\n", TmpRegion, TmpRegion->hdr.Index, TmpRegion->hdr.Type, TmpRegion->hdr.IdStr); 
+        if( State->Run )
+        {
+            Op[0] = 0xc0 | (State->Run - 1);
+            g_byte_array_append(Out, Op, 1);
+            State->Run = 0;
+        }
+
+        Hash = ((Px[0] * 3) + (Px[1] * 5) + (Px[2] * 7) + (Px[3] * 11)) % 64;
+
+        if( memcmp(Px, State->Index[Hash], 4) == 0 )
+        {
+            Op[0] = Hash;
+            g_byte_array_append(Out, Op, 1);
+        }
+        else if( Px[3] == State->Prev[3] )
+        {
+            Vr  = (gint8)(Px[0] - State->Prev[0]);
+            Vg  = (gint8)(Px[1] - State->Prev[1]);
+            Vb  = (gint8)(Px[2] - State->Prev[2]);
+            VgR = Vr - Vg;
+            VgB = Vb - Vg;
+
+            if( (Vr >= -2) && (Vr <= 1) && (Vg >= -2) && (Vg <= 1) && (Vb >= -2) && (Vb <= 1) )
+            {
+                Op[0] = 0x40 | ((Vr + 2) << 4) | ((Vg + 2) << 2) | (Vb + 2);
+                g_byte_array_append(Out, Op, 1);
+            }
+            else if( (Vg >= -32) && (Vg <= 31) && (VgR >= -8) && (VgR <= 7) && (VgB >= -8) && (VgB <= 7) )
+            {
+                Op[0] = 0x80 | (Vg + 32);
+                Op[1] = ((VgR + 8) << 4) | (VgB + 8);
+                g_byte_array_append(Out, Op, 2);
+            }
+            else
+            {
+                Op[0] = 0xfe;
+                memcpy(Op + 1, Px, 3);
+                g_byte_array_append(Out, Op, 4);
+            }
+        }
+        else
+        {
+            Op[0] = 0xff;
+            memcpy(Op + 1, Px, 4);
+            g_byte_array_append(Out, Op, 5);
+        }
+
+        memcpy(State->Index[Hash], Px, 4);
+        memcpy(State->Prev, Px, 4);
+    }
 }
 
-gboolean
-sqd_layout_add_note( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int NoteIndex, int NoteType, gchar *RefId, char *NoteText)
+// Write a page's header in the chosen format.  Only png needs libpng
+// state, the others are a few bytes.  Returns TRUE on failure.
+static gboolean
+sqd_layout_raster_begin_page( SQDLayout *sb, SQD_RASTER_PAGE *Page )
 {
 	SQDLayoutPrivate *priv;
-    SQD_NOTE *TmpNote;
-    SQD_OBJ  *RefObj;
+    guint8 Header[14];
+    guint8 ColorType;
+    guint32 PixelsPerMetre;
+    gboolean Failed;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Make sure the ID isn't already in use
-    if( g_hash_table_lookup(priv->IdTable, IdStr) != NULL )
-    {
-        g_error("Sequence object id \"%s\" already exists. Ids must be unique.\n", IdStr);
-        return TRUE;
-    }
+    Failed = FALSE;
 
-    // Make sure the reference is to something valid
-    switch(NoteType)
+    switch( Page->Format )
     {
-        case NOTE_REFTYPE_NONE:   
-            RefObj = NULL;   
+        case RASTER_FORMAT_PPM:
+            // No alpha here, translucent pages come out over black.
+            Failed = (fprintf(Page->File, "%s\n%u %u\n255\n", (Page->Channels == 1) ? "P5" : "P6", Page->Width, Page->Height) < 0);
         break;
 
-        case NOTE_REFTYPE_ACTOR:
-            // Lookup the referenced object
-            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
-            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_ACTOR) )
+        case RASTER_FORMAT_QOI:
+            memcpy(Header, "qoif", 4);
+            Header[4]  = Page->Width >> 24;  Header[5]  = Page->Width >> 16;
+            Header[6]  = Page->Width >> 8;   Header[7]  = Page->Width;
+            Header[8]  = Page->Height >> 24; Header[9]  = Page->Height >> 16;
+            Header[10] = Page->Height >> 8;  Header[11] = Page->Height;
+            Header[12] = Page->Channels;
+            Header[13] = 0;
+            Failed = (fwrite(Header, 1, 14, Page->File) != 14);
+
+            memset(&Page->Qoi, 0, sizeof Page->Qoi);
+            Page->Qoi.Prev[3] = 255;
+        break;
+
+        default:
+            ColorType = (Page->Channels == 1) ? 0 : ((Page->Channels == 3) ? 2 : 6);
+
+            // Record the resolution when it isn't the usual 72 dpi.
+            PixelsPerMetre = (guint32) floor((Page->Scale * 72.0 / 0.0254) + 0.5);
+
+            if( priv->ParallelDeflate )
             {
-                g_error("Couldn't find the note, actor object with id \"%s\".\n", RefId);
-                return TRUE;
+                Failed = (fwrite("\x89PNG\r\n\x1a\n", 1, 8, Page->File) != 8);
+
+                Header[0]  = Page->Width >> 24;  Header[1] = Page->Width >> 16;
+                Header[2]  = Page->Width >> 8;   Header[3] = Page->Width;
+                Header[4]  = Page->Height >> 24; Header[5] = Page->Height >> 16;
+                Header[6]  = Page->Height >> 8;  Header[7] = Page->Height;
+                Header[8]  = 8;
+                Header[9]  = ColorType;
+                Header[10] = Header[11] = Header[12] = 0;
+                Failed |= sqd_layout_png_write_chunk(Page->File, "IHDR", Header, 13);
+
+                if( Page->Scale != 1.0 )
+                {
+                    Header[0] = Header[4] = PixelsPerMetre >> 24;
+                    Header[1] = Header[5] = PixelsPerMetre >> 16;
+                    Header[2] = Header[6] = PixelsPerMetre >> 8;
+                    Header[3] = Header[7] = PixelsPerMetre;
+                    Header[8] = 1;
+                    Failed |= sqd_layout_png_write_chunk(Page->File, "pHYs", Header, 9);
+                }
+
+                // The zlib header goes out on its own, the bands follow it.
+                Header[0] = 0x78;
+                Header[1] = 0x9c;
+                Failed |= sqd_layout_png_write_chunk(Page->File, "IDAT", Header, 2);
+
+                Page->Adler = adler32(0, NULL, 0);
+                break;
             }
-            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);               
-        break;
-       
-        case NOTE_REFTYPE_EVENT_START:   
-        case NOTE_REFTYPE_EVENT_MIDDLE:  
-        case NOTE_REFTYPE_EVENT_END: 
-            // Lookup the referenced object
-            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
-            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_EVENT) )
+
+            Page->Png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+            if( Page->Png == NULL )
             {
-                g_error("Couldn't find the note, event object with id \"%s\".\n", RefId);
+                g_error("Couldn't set up libpng for page %u.\n", Page->Index);
                 return TRUE;
             }
-            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
-        break;
 
-        case NOTE_REFTYPE_VSPAN:  
-            // Lookup the referenced object
-            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
-            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_AREGION) )
+            Page->Info = png_create_info_struct(Page->Png);
+            if( Page->Info == NULL )
             {
-                g_error("Couldn't find the note, actor-region object with id \"%s\".\n", RefId);
+                g_error("Couldn't set up libpng for page %u.\n", Page->Index);
+                png_destroy_write_struct(&Page->Png, NULL);
+                Page->Png = NULL;
                 return TRUE;
             }
-            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
-        break;
 
-        case NOTE_REFTYPE_BOXSPAN:       
-            // Lookup the referenced object
-            RefObj = g_hash_table_lookup(priv->IdTable, RefId);
-            if( (RefObj == NULL) || (RefObj->Type != SDOBJ_BREGION) )
+            // libpng reports errors by jumping back here.
+            if( setjmp(png_jmpbuf(Page->Png)) )
+                g_error("Couldn't write the png page %u.\n", Page->Index);
+
+            png_init_io(Page->Png, Page->File);
+            png_set_compression_level(Page->Png, priv->PngLevel);
+
+            switch( priv->PngFilter )
             {
-                g_error("Couldn't find the note, box-region object with id \"%s\".\n", RefId);
-                return TRUE;
+                case RASTER_FILTER_NONE:    png_set_filter(Page->Png, 0, PNG_FILTER_NONE);  break;
+                case RASTER_FILTER_SUB:     png_set_filter(Page->Png, 0, PNG_FILTER_SUB);   break;
+                case RASTER_FILTER_UP:      png_set_filter(Page->Png, 0, PNG_FILTER_UP);    break;
+                case RASTER_FILTER_AVERAGE: png_set_filter(Page->Png, 0, PNG_FILTER_AVG);   break;
+                case RASTER_FILTER_PAETH:   png_set_filter(Page->Png, 0, PNG_FILTER_PAETH); break;
+                default:                    png_set_filter(Page->Png, 0, PNG_ALL_FILTERS);  break;
             }
-            g_print("RefObj ID Lookup: 0x%x, %d, %d, %s\n", RefObj, RefObj->Index, RefObj->Type, RefObj->IdStr);                   
+
+            png_set_IHDR(Page->Png, Page->Info, Page->Width, Page->Height, 8, ColorType, PNG_INTERLACE_NONE,
+                         PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+            if( Page->Scale != 1.0 )
+                png_set_pHYs(Page->Png, Page->Info, PixelsPerMetre, PixelsPerMetre, PNG_RESOLUTION_METER);
+
+            png_write_info(Page->Png, Page->Info);
         break;
     }
 
-    TmpNote = malloc( sizeof(SQD_NOTE) );
-
-    TmpNote->hdr.Index      = NoteIndex;
-    TmpNote->hdr.Type       = SDOBJ_NOTE;
-    TmpNote->hdr.IdStr      = g_strdup(IdStr);
-    TmpNote->hdr.ClassStr   = ClassStr ? g_strdup(ClassStr):NULL;;
+    return Failed;
+}
 
-    if( TmpNote->hdr.Index >= priv->MaxNoteIndex )
-        priv->MaxNoteIndex = TmpNote->hdr.Index+1;
+// Write the rendered rows of a strip.  Parallel png deflate hands the
+// bands back to the workers; everything else is encoded row by row here.
+// Returns TRUE when the rows couldn't all be written; libpng reports its 
+// own write errors through its jump buffer.
+static gboolean
+sqd_layout_raster_write_strip( SQDLayout *sb, SQD_RASTER_PAGE *Page, guint Rows )
+{
+	SQDLayoutPrivate *priv;
+    SQD_RASTER_BAND  *Band;
+    guint i;
 
-    TmpNote->Text.Str            = NULL;
-    TmpNote->Text.Width          = 0;
-    TmpNote->Text.Height         = 0;
+	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    TmpNote->Text.Str            = NULL;
-    if( NoteText )
+    if( (Page->Format == RASTER_FORMAT_PNG) && priv->ParallelDeflate )
     {
-        TmpNote->Text.Str        = strdup(NoteText);
-    }
+        sqd_layout_run_workers(sb, sqd_layout_deflate_band, Page->Bands, sizeof(SQD_RASTER_BAND), Page->BandCnt);
 
-    TmpNote->BoundsBox.Top       = 0;
-    TmpNote->BoundsBox.Bottom    = 0;
-    TmpNote->BoundsBox.Start     = 0;
-    TmpNote->BoundsBox.End       = 0;
+        for( i = 0; i < Page->BandCnt; i++ )
+        {
+            Band = &Page->Bands[i];
 
-    TmpNote->ReferenceType       = NoteType;
+            if( Band->Rows == 0 )
+                continue;
 
-    TmpNote->Height              = 0;
+            if( fwrite(Band->Chunk->data, 1, Band->Chunk->len, Page->File) != Band->Chunk->len )
+                return TRUE;
 
-    TmpNote->RefObj              = RefObj;
-    TmpNote->RefFirstTop         = 0;
-    TmpNote->RefFirstStart       = 0;
-    TmpNote->RefLastTop          = 0;
-    TmpNote->RefLastStart        = 0;
+            Page->Adler = adler32_combine(Page->Adler, Band->Adler, Band->RawLen);
+        }
+        return FALSE;
+    }
 
-    g_ptr_array_add(priv->Notes, TmpNote); 
+    for( i = 0; i < Rows; i++ )
+    {
+        sqd_layout_convert_row(Page->Pixels + ((gsize)i * Page->Stride), Page->Row, Page->Width, Page->Channels);
 
-    // Add this object to the ID hash table.
-    g_hash_table_insert( priv->IdTable, TmpNote->hdr.IdStr, TmpNote );
+        switch( Page->Format )
+        {
+            case RASTER_FORMAT_PPM:
+                if( fwrite(Page->Row, Page->Channels, Page->Width, Page->File) != Page->Width )
+                    return TRUE;
+            break;
 
-}
+            case RASTER_FORMAT_QOI:
+                g_byte_array_set_size(Page->Encoded, 0);
+                sqd_layout_qoi_encode_row(&Page->Qoi, Page->Row, Page->Width, Page->Channels, Page->Encoded);
+                if( fwrite(Page->Encoded->data, 1, Page->Encoded->len, Page->File) != Page->Encoded->len )
+                    return TRUE;
+            break;
 
+            default:
+                png_write_row(Page->Png, Page->Row);
+            break;
+        }
+    }
 
-gboolean 
-sqd_layout_set_presentation_parameter( SQDLayout *sb, gchar *ParamStr, gchar *ValueStr, gchar *ClassStr )
+    return FALSE;
+}
+
+// Close off a page's stream.  Returns TRUE when the tail couldn't be written.
+static gboolean
+sqd_layout_raster_end_page( SQDLayout *sb, SQD_RASTER_PAGE *Page )
 {
 	SQDLayoutPrivate *priv;
-    gchar            *PStr;
-    SQD_P_PARAM      *PParam;
+    guint8 Tail[8];
+    gboolean Failed;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    // Build the Parameter ID String
-    if(ClassStr)
-        PStr = g_strdup_printf("%s.%s", ClassStr, ParamStr);
-    else
-        PStr = g_strdup(ParamStr);
+    Failed = FALSE;
 
-    // Check if the Parameter already has a value
-    PParam = g_hash_table_lookup(priv->PTable, PStr);
-    if( PParam != NULL )
+    switch( Page->Format )
     {
-        // Parameter already exists, just modify the value.
-        if( PParam->ValueStr )
-            g_free( PParam->ValueStr );
+        case RASTER_FORMAT_PPM:
+        break;
 
-        PParam->ValueStr = g_strdup(ValueStr);
+        case RASTER_FORMAT_QOI:
+            if( Page->Qoi.Run )
+            {
+                Tail[0] = 0xc0 | (Page->Qoi.Run - 1);
+                Failed = (fwrite(Tail, 1, 1, Page->File) != 1);
+            }
 
-        g_free(PStr);
+            Failed |= (fwrite("\0\0\0\0\0\0\0\1", 1, 8, Page->File) != 8);
+        break;
 
-        return FALSE;
+        default:
+            if( priv->ParallelDeflate )
+            {
+                // An empty final block after the last sync flush, then the checksum.
+                Tail[0] = 0x03;
+                Tail[1] = 0x00;
+                Tail[2] = Page->Adler >> 24;
+                Tail[3] = Page->Adler >> 16;
+                Tail[4] = Page->Adler >> 8;
+                Tail[5] = Page->Adler;
+                Failed  = sqd_layout_png_write_chunk(Page->File, "IDAT", Tail, 6);
+                Failed |= sqd_layout_png_write_chunk(Page->File, "IEND", NULL, 0);
+                break;
+            }
+
+            png_write_end(Page->Png, NULL);
+            png_destroy_write_struct(&Page->Png, &Page->Info);
+
+            Page->Png  = NULL;
+            Page->Info = NULL;
+        break;
     }
 
-    // Parameter does not yet exist, create and init the parameter.
-    PParam = g_malloc(sizeof(SQD_P_PARAM));
+    return Failed;
+}
 
-    if(PParam == NULL)
+// Render a page one strip at a time and stream the rows straight into
+// the output file.  The pixels stay at one strip whatever the page height,
+// so pages taller than a cairo image surface can hold still come out.
+static gboolean
+sqd_layout_raster_write_page( SQDLayout *sb, gchar *PagePath, SQD_RASTER_PAGE *Page, SQD_BOX *Out )
+{
+    SQD_RASTER_BAND *Band;
+    gboolean Failed;
+    guint StripRows, StripTop;
+    guint i;
+
+    StripRows = cairo_image_surface_get_height(Page->Strip);
+
+    Page->File = fopen(PagePath, "wb");
+
+    if( Page->File == NULL )
     {
-        g_error("Out of memory!\n");
+        g_error("Couldn't open \"%s\" for writing.\n", PagePath);
         return TRUE;
     }
 
-    // Init the new parameter.
-    PParam->ParamStr = PStr;
-    PParam->ClassStr = g_strdup(ClassStr);
-    PParam->ValueStr = g_strdup(ValueStr);
+    if( sqd_layout_raster_begin_page(sb, Page) )
+    {
+        fclose(Page->File);
+        return TRUE;
+    }
 
-    // Install the parameter in the table
-    g_hash_table_insert( priv->PTable, PParam->ParamStr, PParam );
+    // libpng jumps back here on a write error, this frame lasts the whole page.
+    if( Page->Png && setjmp(png_jmpbuf(Page->Png)) )
+        g_error("Couldn't write the png \"%s\".\n", PagePath);
+
+    Failed = FALSE;
+
+    for( StripTop = 0; (Failed == FALSE) && (StripTop < Page->Height); StripTop += StripRows )
+    {
+        for( i = 0; i < Page->BandCnt; i++ )
+        {
+            Band = &Page->Bands[i];
+
+            Band->PageIndex = Page->Index;
+            Band->Top       = StripTop + (i * SQD_RASTER_BAND_ROWS);
+            Band->Rows      = (Band->Top < Page->Height) ? MIN(SQD_RASTER_BAND_ROWS, Page->Height - Band->Top) : 0;
+
+            // Origin and View are in points, the rows are pixels.
+            Band->Origin.X = Out->Start;
+            Band->Origin.Y = Out->Top + (Band->Top / Page->Scale);
+
+            Band->View.Start  = Out->Start - SQD_RASTER_BAND_PAD;
+            Band->View.End    = Out->Start + (Page->Width / Page->Scale) + SQD_RASTER_BAND_PAD;
+            Band->View.Top    = Band->Origin.Y - SQD_RASTER_BAND_PAD;
+            Band->View.Bottom = Band->Origin.Y + (SQD_RASTER_BAND_ROWS / Page->Scale) + SQD_RASTER_BAND_PAD;
+
+            // The row above the band, for the png filters.  The first band
+            // of a strip gets the copy kept from the strip before.
+            if( i > 0 )
+                Band->Above = Page->Pixels + ((gsize)((i * SQD_RASTER_BAND_ROWS) - 1) * Page->Stride);
+            else
+                Band->Above = (StripTop > 0) ? Page->LastRow : NULL;
+        }
+
+        sqd_layout_run_workers(sb, sqd_layout_render_band, Page->Bands, sizeof(SQD_RASTER_BAND), Page->BandCnt);
+
+        Failed = sqd_layout_raster_write_strip(sb, Page, MIN(StripRows, Page->Height - StripTop));
+
+        memcpy(Page->LastRow, Page->Pixels + ((gsize)(StripRows - 1) * Page->Stride), Page->Stride);
+    }
+
+    // A short write anywhere leaves a truncated file, so report it.
+    if( Failed == FALSE )
+        Failed = sqd_layout_raster_end_page(sb, Page);
+
+    if( ferror(Page->File) )
+        Failed = TRUE;
+
+    if( fclose(Page->File) != 0 )
+        Failed = TRUE;
+
+    if( Failed )
+    {
+        // Don't leave a half written png's state for the next page.
+        if( Page->Png )
+        {
+            png_destroy_write_struct(&Page->Png, &Page->Info);
+            Page->Png  = NULL;
+            Page->Info = NULL;
+        }
+
+        g_error("Couldn't write \"%s\".\n", PagePath);
+        return TRUE;
+    }
 
     return FALSE;
 }
 
-gboolean
-sqd_layout_generate_pdf( SQDLayout *sb, gchar *FilePath )
+// Shared by the raster outputs: arrange, then stream each page out in the
+// given format through a reused strip buffer.  Only the pixels are held a 
+// strip at a time; the display list is built for the whole document first,
+// since the channel count and strip format have to suit every page.
+static gboolean
+sqd_layout_generate_raster( SQDLayout *sb, gchar *FilePath, guint8 Format )
 {
 	SQDLayoutPrivate *priv;
+    SQD_RASTER_PAGE Page;
+    SQD_BOX Out;
+    gchar  *PagePath;
+    gboolean Result;
+    guint   i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    priv->surface = cairo_pdf_surface_create(FilePath, priv->Width, priv->Height);
+    // Arrange against a scratch surface, the page count and size aren't known
+    // yet.  The text is measured with the metrics the bands draw it with.
+    priv->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
     priv->cr = cairo_create (priv->surface);
 
-    cairo_set_source_rgb(priv->cr, 0, 0, 0);
+    sqd_layout_set_raster_font_options(sb, priv->cr, FALSE);
 
     sqd_layout_arrange_diagram(sb);
-    sqd_layout_draw_diagram(sb);
 
-    cairo_show_page(priv->cr);
     cairo_destroy(priv->cr);
     cairo_surface_destroy(priv->surface);
 
     priv->cr      = NULL;
     priv->surface = NULL;
-}
 
-gboolean
-sqd_layout_generate_png( SQDLayout *sb, gchar *FilePath )
-{
-	SQDLayoutPrivate *priv;
+    sqd_layout_build_display_list(sb);
 
-	priv = SQD_LAYOUT_GET_PRIVATE (sb);
+    sqd_layout_get_output_box(sb, &Out);
 
-    priv->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, priv->Width, priv->Height);
-    priv->cr = cairo_create (priv->surface);
+    memset(&Page, 0, sizeof Page);
 
-    cairo_set_source_rgb(priv->cr, 0, 0, 0);
+    Page.Format = Format;
+    Page.Scale  = priv->RasterScale;
+    Page.Width  = MAX(ceil((Out.End - Out.Start) * Page.Scale), 1);
+    Page.Height = MAX(ceil((Out.Bottom - Out.Top) * Page.Scale), 1);
 
-    sqd_layout_arrange_diagram(sb);
-    sqd_layout_draw_diagram(sb);
+    // Strips are as wide as the page, tall pages are fine but cairo can't
+    // make an image surface wider than this.
+    if( Page.Width > SQD_RASTER_MAX_WIDTH )
+    {
+        g_error("The page is %u pixels wide, over the %u pixel limit; use a smaller scale.\n", Page.Width, SQD_RASTER_MAX_WIDTH);
+        return TRUE;
+    }
 
-    cairo_show_page(priv->cr);
+    // Opaque pages render without alpha and are written with fewer channels.
+    Page.Channels = sqd_layout_get_raster_channels(sb);
 
-    cairo_surface_write_to_png(priv->surface, FilePath);
-    cairo_destroy(priv->cr);
-    cairo_surface_destroy(priv->surface);
+    if( (Format == RASTER_FORMAT_PPM) && (Page.Channels == 4) )
+        Page.Channels = 3;
+    if( (Format == RASTER_FORMAT_QOI) && (Page.Channels == 1) )
+        Page.Channels = 3;
 
-    priv->cr      = NULL;
-    priv->surface = NULL;
+    Page.SurfaceFormat = (Page.Channels == 4) ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+
+    // One band per worker makes up a strip, the strip buffer is reused
+    // for every strip of every page.
+    Page.BandCnt = sqd_layout_get_worker_count(sb, Page.Height, SQD_RASTER_MIN_ROWS_PER_WORKER);
+    Page.Bands   = g_new0(SQD_RASTER_BAND, Page.BandCnt);
+
+    Page.Strip  = cairo_image_surface_create (Page.SurfaceFormat, Page.Width, Page.BandCnt * SQD_RASTER_BAND_ROWS);
+    Page.Pixels = cairo_image_surface_get_data(Page.Strip);
+    Page.Stride = cairo_image_surface_get_stride(Page.Strip);
+
+    for( i = 0; i < Page.BandCnt; i++ )
+    {
+        Page.Bands[i].Surface  = cairo_image_surface_create_for_data(Page.Pixels + ((gsize)i * SQD_RASTER_BAND_ROWS * Page.Stride),
+                                                                     Page.SurfaceFormat, Page.Width, SQD_RASTER_BAND_ROWS, Page.Stride);
+        Page.Bands[i].Channels = Page.Channels;
+        Page.Bands[i].Chunk    = g_byte_array_new();
+    }
+
+    Page.Row     = g_malloc(Page.Width * 4);
+    Page.LastRow = g_malloc(Page.Stride);
+    Page.Encoded = g_byte_array_new();
+
+    Result = FALSE;
+
+    for (i = 0; (Result == FALSE) && (i < priv->Pages->len); i++)
+    {
+        Page.Index = i;
+
+        PagePath = sqd_layout_get_page_path(sb, FilePath, i);
+        Result   = sqd_layout_raster_write_page(sb, PagePath, &Page, &Out);
+        g_free(PagePath);
+    }
+
+    g_byte_array_free(Page.Encoded, TRUE);
+    g_free(Page.LastRow);
+    g_free(Page.Row);
+
+    for( i = 0; i < Page.BandCnt; i++ )
+    {
+        cairo_surface_destroy(Page.Bands[i].Surface);
+        g_byte_array_free(Page.Bands[i].Chunk, TRUE);
+    }
+
+    cairo_surface_destroy(Page.Strip);
+    g_free(Page.Bands);
+
+    return Result;
+}
+
+gboolean
+sqd_layout_generate_png( SQDLayout *sb, gchar *FilePath )
+{
+    return sqd_layout_generate_raster(sb, FilePath, RASTER_FORMAT_PNG);
+}
+
+// Binary ppm, or pgm for grey pages, for pipelines that encode the pixels again.
+gboolean
+sqd_layout_generate_ppm( SQDLayout *sb, gchar *FilePath )
+{
+    return sqd_layout_generate_raster(sb, FilePath, RASTER_FORMAT_PPM);
+}
+
+gboolean
+sqd_layout_generate_qoi( SQDLayout *sb, gchar *FilePath )
+{
+    return sqd_layout_generate_raster(sb, FilePath, RASTER_FORMAT_QOI);
 }
 
 gboolean
 sqd_layout_generate_svg( SQDLayout *sb, gchar *FilePath )
 {
 	SQDLayoutPrivate *priv;
+    SQD_BOX Out;
+    gchar *PagePath;
+    PangoLayout *Layout;
+    FILE  *File;
+    guint i;
 
 	priv = SQD_LAYOUT_GET_PRIVATE (sb);
 
-    priv->surface = cairo_svg_surface_create(FilePath, priv->Width, priv->Height);
+    // Arrange against a scratch svg surface so the text metrics match, 
+    // the page count and size aren't known yet.
+    priv->surface = cairo_svg_surface_create_for_stream(sqd_layout_discard_output, NULL, priv->Width, priv->Height);
     priv->cr = cairo_create (priv->surface);
 
-    cairo_set_source_rgb(priv->cr, 0, 0, 0);
-
     sqd_layout_arrange_diagram(sb);
-    sqd_layout_draw_diagram(sb);
 
-    cairo_show_page(priv->cr);
+    // The native writer streams each page out as plain elements.  It lays 
+    // wrapped text out again against the scratch surface to find the lines.
+    // Only the page being written is in the display list.
+    if( priv->NativeSvg )
+    {
+        Layout = pango_cairo_create_layout(priv->cr);
+
+        for (i = 0; i < priv->Pages->len; i++)
+        {
+            PagePath = sqd_layout_get_page_path(sb, FilePath, i);
+            File = fopen(PagePath, "w");
+
+            if( File == NULL )
+            {
+                g_error("Couldn't open \"%s\" for writing.\n", PagePath);
+                g_free(PagePath);
+                g_object_unref(Layout);
+                return TRUE;
+            }
+
+            sqd_layout_build_page_display_list(sb, i);
+            sqd_layout_svg_write_page(sb, File, Layout, i);
+
+            fclose(File);
+            g_free(PagePath);
+        }
+
+        g_object_unref(Layout);
+    }
+
     cairo_destroy(priv->cr);
     cairo_surface_destroy(priv->surface);
 
+    sqd_layout_get_output_box(sb, &Out);
+
+    // Each page is written to its own file, built just before it is replayed.
+    for (i = 0; (priv->NativeSvg == FALSE) && (i < priv->Pages->len); i++)
+    {
+        sqd_layout_build_page_display_list(sb, i);
+
+        PagePath = sqd_layout_get_page_path(sb, FilePath, i);
+        priv->surface = cairo_svg_surface_create(PagePath, Out.End - Out.Start, Out.Bottom - Out.Top);
+        g_free(PagePath);
+
+        priv->cr = cairo_create (priv->surface);
+
+        cairo_set_source_rgb(priv->cr, 0, 0, 0);
+        cairo_translate(priv->cr, -Out.Start, -Out.Top);
+
+        sqd_layout_replay_cairo(sb, priv->cr, NULL, i, &Out);
+
+        cairo_show_page(priv->cr);
+        cairo_destroy(priv->cr);
+        cairo_surface_destroy(priv->surface);
+    }
+
+    sqd_layout_clear_display_list(sb);
+
     priv->cr      = NULL;
     priv->surface = NULL;
+
+    return FALSE;
 }
 
 
@@ -43,6 +43,32 @@ enum NoteReferenceTypes
     NOTE_REFTYPE_BOXSPAN,       // Group events into a box. Reference to the box.
 };
 
+enum NotePlacementTypes
+{
+    NOTE_PLACEMENT_STACKED,     // Stack the notes in document order from the top of the page.
+    NOTE_PLACEMENT_ALIGNED,     // Place each note next to the feature it references.
+};
+
+enum NoteRoutingTypes
+{
+    NOTE_ROUTING_DIRECT,        // Draw a straight line from the note to its reference.
+    NOTE_ROUTING_ORTHOGONAL,    // Route the line around events with horizontal and vertical runs.
+};
+
+// Row filter for png output, the first five are png's own filter types.
+enum RasterFilterTypes
+{
+    RASTER_FILTER_NONE,
+    RASTER_FILTER_SUB,
+    RASTER_FILTER_UP,
+    RASTER_FILTER_AVERAGE,
+    RASTER_FILTER_PAETH,
+    RASTER_FILTER_ADAPTIVE,     // Pick the best of the five for each row.
+};
+
+// Slot index requesting that the layout pick the earliest free slot for an event.
+#define SQD_LAYOUT_AUTO_SLOT  (-1)
+
 #define G_TYPE_SQD_LAYOUT			(sqd_layout_get_type ())
 #define G_SQD_LAYOUT(obj)			(G_TYPE_CHECK_INSTANCE_CAST ((obj), G_TYPE_SQD_LAYOUT, SQDLayout))
 #define G_SQD_LAYOUT_GET_CLASS(obj)	(G_TYPE_INSTANCE_GET_CLASS ((obj), G_TYPE_TDA_HUDSON, SQDLayoutClass))
@@ -78,12 +104,39 @@ gboolean sqd_layout_add_actor_region( SQDLayout *sb, gchar *IdStr, gchar *ClassS
 gboolean sqd_layout_add_box_region( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, gchar *StartActor, gchar *EndActor, gchar *StartEvent, gchar *EndEvent);
 gboolean sqd_layout_add_note( SQDLayout *sb, gchar *IdStr, gchar *ClassStr, int NoteIndex, int NoteType, gchar *RefId, gchar *NoteText);
 
+gboolean sqd_layout_set_event_label( SQDLayout *sb, gchar *IdStr, gchar *TopLabel, gchar *BottomLabel );
+gboolean sqd_layout_set_event_time( SQDLayout *sb, gchar *IdStr, gdouble Time );
+gboolean sqd_layout_set_note_text( SQDLayout *sb, gchar *IdStr, gchar *NoteText );
+gboolean sqd_layout_set_box_region_label( SQDLayout *sb, gchar *IdStr, gchar *Label );
+
 gboolean sqd_layout_set_presentation_parameter( SQDLayout *sb, gchar *IdStr, gchar *ValueStr, gchar *ClassStr );
 
+gboolean sqd_layout_set_thread_count( SQDLayout *sb, gint ThreadCnt );
+gboolean sqd_layout_set_fit_content( SQDLayout *sb, gboolean FitContent );
+gboolean sqd_layout_set_variable_columns( SQDLayout *sb, gboolean VariableColumns );
+gboolean sqd_layout_set_reorder_actors( SQDLayout *sb, gboolean ReorderActors );
+gboolean sqd_layout_set_fold_repeats( SQDLayout *sb, gboolean FoldRepeats );
+gboolean sqd_layout_set_max_events( SQDLayout *sb, gint MaxEvents );
+gboolean sqd_layout_set_time_axis( SQDLayout *sb, gdouble Scale, gdouble MaxGap );
+gboolean sqd_layout_set_note_placement( SQDLayout *sb, gint NotePlacement );
+gboolean sqd_layout_set_note_columns( SQDLayout *sb, gint LeftColumns, gint RightColumns );
+gboolean sqd_layout_set_note_routing( SQDLayout *sb, gint NoteRouting );
+gboolean sqd_layout_set_native_svg( SQDLayout *sb, gboolean NativeSvg );
+gboolean sqd_layout_set_native_pdf( SQDLayout *sb, gboolean NativePdf );
+gboolean sqd_layout_set_viewport( SQDLayout *sb, gdouble X, gdouble Y, gdouble Width, gdouble Height );
+gboolean sqd_layout_set_png_encoding( SQDLayout *sb, gint Level, gint Filter, gboolean ParallelDeflate );
+gboolean sqd_layout_set_raster_scale( SQDLayout *sb, gdouble Scale );
+
 gboolean sqd_layout_generate_pdf( SQDLayout *sb, gchar *FilePath );
 gboolean sqd_layout_generate_png( SQDLayout *sb, gchar *FilePath );
+gboolean sqd_layout_generate_ppm( SQDLayout *sb, gchar *FilePath );
+gboolean sqd_layout_generate_qoi( SQDLayout *sb, gchar *FilePath );
 gboolean sqd_layout_generate_svg( SQDLayout *sb, gchar *FilePath );
 
+guint sqd_layout_get_page_count( SQDLayout *sb );
+GPtrArray *sqd_layout_query_rect( SQDLayout *sb, guint PageIndex, gdouble Start, gdouble Top, gdouble End, gdouble Bottom );
+GPtrArray *sqd_layout_query_point( SQDLayout *sb, guint PageIndex, gdouble X, gdouble Y );
+
 G_END_DECLS
 
 #endif